@@ -0,0 +1,518 @@
+// Offline rule evaluation: runs the replace rules of a config against inventories of device
+// caps instead of real devices, so a config can be checked before deployment, on machines
+// without the devices. Uses the DLL's own rule and profile code (ReplaceRules.h).
+//
+//   RuleEval [config] [--exe <path>] [--inventory <file>]... [--file <report>] [--iterations <n>]
+//   RuleEval --sweep [--file <report>] [--iterations <n>]
+//
+// The config defaults to MIDI_REPLACE_CONFIGFILE, then midi_rename_config.json, like the DLL.
+// Its "evaluate" section gives the defaults for the other options. With --exe, the rules of
+// the profile the DLL would select for that executable are evaluated too.
+// --sweep needs no config: it times the overridden entry points (GetDevCaps, the device
+// interface queries, midiOutShortMsg and midiOutLongMsg) with 0, 1, 10 and 1000 synthetic
+// rules, with query logging off and on, against native functions that do no work.
+
+#include <Windows.h>
+
+#include <cstdio>
+#include <type_traits>
+#include <optional>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <regex>
+#include <mmddk.h>
+#include <cwchar>
+#include <algorithm>
+#include <unordered_map>
+#include <memory>
+#include <limits>
+#include <atomic>
+#include <bit>
+#include <functional>
+
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+#include "StringConvert.h"
+
+extern "C" {
+#include "WinMM.h"
+}
+
+#include "WrapperStats.h"
+#include "TimerPeriod.h"
+#include "OutputScheduler.h"
+#include "OutputFilter.h"
+#include "NoteTracker.h"
+#include "AppCallback.h"
+#include "SysexRewrite.h"
+#include "InputBufferPool.h"
+#include "InputDispatch.h"
+#include "ClockEngine.h"
+#include "MidiHandles.h"
+#include "IdentityResponder.h"
+#include "SharedOutputs.h"
+#include "MidiOutPath.h"
+#include "LogDedup.h"
+
+FILE* g_maybe_sweep_log = NULL;		// While the sweep times a run with logging
+
+// The rule code logs through this; here, to stderr, or to the sweep's log
+template<typename ...Args>
+inline void wrapper_log(std::wostringstream* maybe_os, Args... args) {
+	fwprintf(g_maybe_sweep_log ? g_maybe_sweep_log : stderr, args...);
+}
+
+// The interface queries log whenever the sweep logs, like the DLL without log deduplication
+bool should_log_query(StatsEntry api, log_dedup::key_builder key) {
+	return g_maybe_sweep_log != NULL;
+}
+
+#include "ReplaceRules.h"
+#include "InterfaceQuery.h"
+
+struct evaluate_config {
+	std::vector<std::string> inventories;
+	std::optional<std::string> maybe_output_file;
+	size_t iterations = 1000;
+};
+
+evaluate_config g_evaluate_config;
+
+std::string read_whole_file(std::string const& filename) {
+	std::ifstream in(filename, std::ios::binary);
+	if (!in) { throw std::runtime_error("Unable to open for reading: " + filename); }
+	std::ostringstream os;
+	os << in.rdbuf();
+	return os.str();
+}
+
+// Device caps as listed in an inventory file, in the same terms the log uses.
+MIDIOUTCAPSW inventory_out_caps(json const& d) {
+	MIDIOUTCAPSW caps = {};
+	caps.wMid = d.value("man_id", 0);
+	caps.wPid = d.value("prod_id", 0);
+	caps.vDriverVersion = d.value("driver_version", 0);
+	wcsncpy(caps.szPname, stringToWstring(d.value("name", std::string())).c_str(), MAXPNAMELEN - 1);
+	caps.wTechnology = d.value("technology", 0);
+	caps.wVoices = d.value("voices", 0);
+	caps.wNotes = d.value("notes", 0);
+	caps.wChannelMask = d.value("channel_mask", 0);
+	caps.dwSupport = d.value("support", 0);
+	return caps;
+}
+
+MIDIINCAPSW inventory_in_caps(json const& d) {
+	MIDIINCAPSW caps = {};
+	caps.wMid = d.value("man_id", 0);
+	caps.wPid = d.value("prod_id", 0);
+	caps.vDriverVersion = d.value("driver_version", 0);
+	wcsncpy(caps.szPname, stringToWstring(d.value("name", std::string())).c_str(), MAXPNAMELEN - 1);
+	return caps;
+}
+
+json caps_to_json(midi_dev_caps const& m) {
+	json rval = {
+		{ "direction", m.direction == Direction::Input ? "in" : "out" },
+		{ "name", wstringToString(m.name) },
+		{ "man_id", m.man_id },
+		{ "prod_id", m.prod_id },
+		{ "driver_version", m.driver_version }
+	};
+	if (m.direction == Direction::Output) {
+		rval["technology"] = m.technology.value();
+		rval["voices"] = m.voices.value();
+		rval["notes"] = m.notes.value();
+		rval["channel_mask"] = m.channel_mask.value();
+		rval["support"] = m.support.value();
+	}
+	return rval;
+}
+
+struct rule_evaluation {
+	uint64_t matches = 0;
+	uint64_t effective = 0;		// Matches where at least one replaced value survived later rules
+	uint64_t match_ticks = 0;
+	uint64_t match_calls = 0;
+};
+
+// Runs one device through the rules the way the GetDevCaps / interface query overrides do,
+// recording which rules matched and which of them determined part of the result.
+template<typename dev_caps_struct>
+json evaluate_device(dev_caps_struct caps, std::vector<rule_evaluation>& rules) {
+	constexpr RuleField replace_fields[] = { ReplaceName, ReplaceManId, ReplaceProdId, ReplaceDriverVersion,
+		ReplaceTechnology, ReplaceVoices, ReplaceNotes, ReplaceChannelMask, ReplaceSupport };
+	size_t const iterations = g_evaluate_config.iterations;
+	auto original = to_our_dev_caps(caps);
+	auto ours = original;
+	std::vector<size_t> matched;
+	std::optional<size_t> last_writer[std::size(replace_fields)];
+
+	for (size_t i = 0; i < g_replace_rules.size(); i++) {
+		bool match = false;
+		uint64_t start = qpc_now();
+		for (size_t n = 0; n < iterations; n++) { match = g_replace_rules.is_match(i, ours); }
+		rules[i].match_ticks += qpc_now() - start;
+		rules[i].match_calls += iterations;
+		if (!match) { continue; }
+		matched.push_back(i);
+		rules[i].matches++;
+		g_replace_rules.apply(i, ours);
+		for (size_t f = 0; f < std::size(replace_fields); f++) {
+			if (g_replace_rules.fields(i) & replace_fields[f]) { last_writer[f] = i; }
+		}
+	}
+
+	// The interface name comes from the first rule matching the unmodified caps
+	auto interface_rule = g_replace_rules.first_match(original);
+	std::vector<size_t> effective;
+	for (auto i : matched) {
+		bool wins = interface_rule == i && (g_replace_rules.fields(i) & ReplaceInterfaceName);
+		for (size_t f = 0; f < std::size(replace_fields); f++) { wins = wins || last_writer[f] == i; }
+		if (wins) { rules[i].effective++; effective.push_back(i); }
+	}
+
+	uint64_t start = qpc_now();
+	for (size_t n = 0; n < iterations; n++) {
+		auto copy = caps;
+		g_replace_rules.apply_in_place_c(copy, [] {});
+	}
+	double query_ns = ticks_to_ns(qpc_now() - start) / iterations;
+
+	json rval = {
+		{ "device", caps_to_json(original) },
+		{ "matched_rules", matched },
+		{ "effective_rules", effective },
+		{ "result", caps_to_json(ours) },
+		{ "query_ns", query_ns }
+	};
+	if (interface_rule.has_value()) {
+		auto name = g_replace_rules.interface_name(interface_rule.value());
+		rval["interface_name"] = name.has_value() ? json(wstringToString(name.value())) : json(nullptr);
+	}
+	return rval;
+}
+
+// The report goes to the "file" option, or to the standard output
+void write_report(json const& report) {
+	if (g_evaluate_config.maybe_output_file.has_value()) {
+		FILE* f = fopen(g_evaluate_config.maybe_output_file.value().c_str(), "w");
+		if (f) {
+			fputs(report.dump(2).c_str(), f);
+			fclose(f);
+		}
+		else {
+			wrapper_log(nullptr, L"Evaluate: unable to open %ls for writing\n", stringToWstring(g_evaluate_config.maybe_output_file.value()).c_str());
+		}
+	}
+	else {
+		puts(report.dump(2).c_str());
+	}
+}
+
+// Evaluates the loaded rules against the inventories: which rules match which devices, the
+// resulting caps, rules that never match or never have an effect (shadowed by later or
+// earlier rules), and what matching costs per rule and per query.
+void run_rule_evaluation() {
+	std::vector<rule_evaluation> rules(g_replace_rules.size());
+	json report = { { "rules_loaded", g_replace_rules.size() }, { "iterations", g_evaluate_config.iterations } };
+	json inventories = json::array();
+	size_t n_devices = 0;
+
+	for (auto const& filename : g_evaluate_config.inventories) {
+		json inventory_report = { { "file", filename } };
+		try {
+			json inventory = json::parse(read_whole_file(filename));
+			json& devices = inventory.is_array() ? inventory : inventory["devices"];
+			json results = json::array();
+			for (auto const& d : devices) {
+				bool input = d.value("direction", std::string("out")) == "in";
+				results.push_back(input ?
+					evaluate_device(inventory_in_caps(d), rules) :
+					evaluate_device(inventory_out_caps(d), rules));
+				n_devices++;
+			}
+			inventory_report["devices"] = results;
+		}
+		catch (std::exception& e) {
+			inventory_report["error"] = e.what();
+			wrapper_log(nullptr, L"Evaluate: unable to process inventory %ls: %ls\n", stringToWstring(filename).c_str(), stringToWstring(e.what()).c_str());
+		}
+		inventories.push_back(inventory_report);
+	}
+
+	json rule_reports = json::array();
+	for (size_t i = 0; i < rules.size(); i++) {
+		auto const& r = rules[i];
+		bool never_matches = r.matches == 0;
+		bool shadowed = r.matches > 0 && r.effective == 0;
+		rule_reports.push_back({
+			{ "index", i },
+			{ "rule", json::parse(g_replace_rule_sources[i]) },
+			{ "matches", r.matches },
+			{ "effective", r.effective },
+			{ "never_matches", never_matches },
+			{ "shadowed", shadowed },
+			{ "mean_match_ns", r.match_calls ? ticks_to_ns(r.match_ticks) / r.match_calls : 0.0 }
+		});
+		if (never_matches) {
+			wrapper_log(nullptr, L"Evaluate: rule #%zu matches none of the %zu devices: %ls\n", i, n_devices, stringToWstring(g_replace_rule_sources[i]).c_str());
+		}
+		else if (shadowed) {
+			wrapper_log(nullptr, L"Evaluate: rule #%zu matches but is always overridden by other rules: %ls\n", i, stringToWstring(g_replace_rule_sources[i]).c_str());
+		}
+	}
+	report["rules"] = rule_reports;
+	report["inventories"] = inventories;
+	wrapper_log(nullptr, L"Evaluate: %zu rules against %zu devices from %zu inventories\n", rules.size(), n_devices, g_evaluate_config.inventories.size());
+	write_report(report);
+}
+
+// Synthetic rules for the sweep, added to the loaded (empty) rules until there are n. Rule k
+// only matches the device "Sweep device k" with manufacturer ID 1000 + k; every other rule
+// is ruled out by its numeric fields, the others only by their name regex, which then runs
+// on every query. The sweep device of a table is that of its last rule, so every query
+// also applies a replacement, and the interface name is found after going through all the
+// rules.
+void add_sweep_rules(size_t n) {
+	for (size_t k = g_replace_rules.size(); k < n; k++) {
+		replace_rule r;
+		r.maybe_match_name = L"Sweep device " + std::to_wstring(k);
+		if (k % 2 == 0) { r.maybe_match_man_id = 1000 + k; }
+		r.maybe_replace_name = L"Renamed " + std::to_wstring(k);
+		r.maybe_replace_interface_name = L"\\\\?\\swd#sweep#" + std::to_wstring(k);
+		g_replace_rules.add(r);
+	}
+}
+
+// The device the natives report, and the interface name the driver gives it
+MIDIOUTCAPSW g_sweep_out_caps = {};
+MIDIINCAPSW g_sweep_in_caps = {};
+const wchar_t g_sweep_interface_name[] = L"\\\\?\\swd#native#sweep";
+
+void set_sweep_device(size_t rules) {
+	std::wstring name = L"Sweep device " + std::to_wstring(rules ? rules - 1 : 0);
+	g_sweep_out_caps = {};
+	wcsncpy(g_sweep_out_caps.szPname, name.c_str(), MAXPNAMELEN - 1);
+	g_sweep_out_caps.wMid = (WORD)(1000 + (rules ? rules - 1 : 0));
+	g_sweep_in_caps = {};
+	wcsncpy(g_sweep_in_caps.szPname, name.c_str(), MAXPNAMELEN - 1);
+	g_sweep_in_caps.wMid = g_sweep_out_caps.wMid;
+}
+
+// Native functions for the sweep, which return the sweep device at once. Unlike the fakes of
+// the tests they record nothing, so only the wrapper's own work is timed.
+MMRESULT WINAPI sweep_midiOutGetDevCapsW(UINT_PTR deviceId, LPMIDIOUTCAPSW pmoc, UINT cpmoc) {
+	*pmoc = g_sweep_out_caps;
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI sweep_midiInGetDevCapsW(UINT_PTR deviceId, LPMIDIINCAPSW pmic, UINT cpmic) {
+	*pmic = g_sweep_in_caps;
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT sweep_interface_query(UINT msg, DWORD_PTR dw1, DWORD_PTR dw2) {
+	if (msg == DRV_QUERYDEVICEINTERFACESIZE) {
+		*(ULONG*)dw1 = sizeof(g_sweep_interface_name);
+		return MMSYSERR_NOERROR;
+	}
+	if (msg == DRV_QUERYDEVICEINTERFACE) {
+		if (dw2 < sizeof(g_sweep_interface_name)) { return MMSYSERR_INVALPARAM; }
+		memcpy((void*)dw1, g_sweep_interface_name, sizeof(g_sweep_interface_name));
+		return MMSYSERR_NOERROR;
+	}
+	return MMSYSERR_NOTSUPPORTED;
+}
+
+MMRESULT WINAPI sweep_midiOutMessage(HMIDIOUT hmo, UINT msg, DWORD_PTR dw1, DWORD_PTR dw2) {
+	return sweep_interface_query(msg, dw1, dw2);
+}
+
+MMRESULT WINAPI sweep_midiInMessage(HMIDIIN hmi, UINT msg, DWORD_PTR dw1, DWORD_PTR dw2) {
+	return sweep_interface_query(msg, dw1, dw2);
+}
+
+MMRESULT WINAPI sweep_midiOutShortMsg(HMIDIOUT hmo, DWORD msg) {
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI sweep_midiOutLongMsg(HMIDIOUT hmo, LPMIDIHDR pmh, UINT cbmh) {
+	return MMSYSERR_NOERROR;
+}
+
+// Mean time of one call, over the iterations. The first call, untimed, compiles the
+// regexes, which the DLL does once per pattern.
+template<typename F>
+double sweep_call_ns(F&& call) {
+	size_t const iterations = g_evaluate_config.iterations;
+	call();
+	uint64_t start = qpc_now();
+	for (size_t n = 0; n < iterations; n++) { call(); }
+	return ticks_to_ns(qpc_now() - start) / iterations;
+}
+
+// The rule path of the GetDevCaps overrides, on a copy of the native result. The overrides
+// themselves live with the DLL's entry points.
+template<typename dev_caps_struct>
+void sweep_caps_query(dev_caps_struct const& caps) {
+	auto copy = caps;
+	bool log = g_maybe_sweep_log != NULL;
+	if (log) { wrapper_log(nullptr, L"\nRequest for device capabilities:\n  %ls\n", stringify_caps(copy).c_str()); }
+	g_replace_rules.apply_in_place_c(copy, [&] {
+		if (log) { wrapper_log(nullptr, L"--> Matched a replace rule. Returning: %ls\n", stringify_caps(copy).c_str()); }
+	});
+}
+
+// Every overridden entry point, for each combination of rule count and logging. The
+// interface queries go by device ID, which looks up the rule on every query (a handle only
+// looks it up once). midiOutShortMsg and midiOutLongMsg don't use the rules or the log;
+// they are timed with every combination anyway, with the other features off.
+void run_sweep() {
+	MMmidiOutGetDevCapsW = sweep_midiOutGetDevCapsW;
+	MMmidiInGetDevCapsW = sweep_midiInGetDevCapsW;
+	MMmidiOutMessage = sweep_midiOutMessage;
+	MMmidiInMessage = sweep_midiInMessage;
+	MMmidiOutShortMsg = sweep_midiOutShortMsg;
+	MMmidiOutLongMsg = sweep_midiOutLongMsg;
+
+	HMIDIOUT hmo = (HMIDIOUT)(UINT_PTR)0;
+	HMIDIIN hmi = (HMIDIIN)(UINT_PTR)0;
+	ULONG interface_size = 0;
+	wchar_t interface_name[256];
+	char sysex[] = { (char)0xF0, 0x7E, 0x7F, 0x09, 0x01, (char)0xF7 };	// GM System On
+	MIDIHDR hdr = {};
+	hdr.lpData = sysex;
+	hdr.dwBufferLength = hdr.dwBytesRecorded = sizeof(sysex);
+	hdr.dwFlags = MHDR_PREPARED;
+
+	// The log goes to a temporary file, so the cost of writing it is included
+	FILE* log = tmpfile();
+	if (!log) { wrapper_log(nullptr, L"Sweep: unable to create a temporary log file, timing without logging only\n"); }
+	json runs = json::array();
+	for (size_t n : { 0, 1, 10, 1000 }) {
+		add_sweep_rules(n);
+		set_sweep_device(n);
+		MIDIOUTCAPSW out_w = g_sweep_out_caps;
+		MIDIINCAPSW in_w = g_sweep_in_caps;
+		MIDIOUTCAPSA out_a = {};
+		strcpy(out_a.szPname, wstringToString(out_w.szPname).c_str());
+		out_a.wMid = out_w.wMid;
+		MIDIINCAPSA in_a = {};
+		strcpy(in_a.szPname, wstringToString(in_w.szPname).c_str());
+		in_a.wMid = in_w.wMid;
+
+		for (bool logging : { false, true }) {
+			if (logging && !log) { continue; }
+			g_maybe_sweep_log = logging ? log : NULL;
+			json mean_ns = {
+				{ g_stats_entry_names[(size_t)StatsEntry::midiOutGetDevCapsA], sweep_call_ns([&] { sweep_caps_query(out_a); }) },
+				{ g_stats_entry_names[(size_t)StatsEntry::midiOutGetDevCapsW], sweep_call_ns([&] { sweep_caps_query(out_w); }) },
+				{ g_stats_entry_names[(size_t)StatsEntry::midiInGetDevCapsA], sweep_call_ns([&] { sweep_caps_query(in_a); }) },
+				{ g_stats_entry_names[(size_t)StatsEntry::midiInGetDevCapsW], sweep_call_ns([&] { sweep_caps_query(in_w); }) },
+				{ g_stats_entry_names[(size_t)StatsEntry::midiOutMessage_QUERYDEVICEINTERFACESIZE], sweep_call_ns([&] {
+					OVERRIDE_WINMM_midiOutMessage(hmo, DRV_QUERYDEVICEINTERFACESIZE, (DWORD_PTR)&interface_size, 0);
+				}) },
+				{ g_stats_entry_names[(size_t)StatsEntry::midiOutMessage_QUERYDEVICEINTERFACE], sweep_call_ns([&] {
+					OVERRIDE_WINMM_midiOutMessage(hmo, DRV_QUERYDEVICEINTERFACE, (DWORD_PTR)interface_name, sizeof(interface_name));
+				}) },
+				{ g_stats_entry_names[(size_t)StatsEntry::midiInMessage_QUERYDEVICEINTERFACESIZE], sweep_call_ns([&] {
+					OVERRIDE_WINMM_midiInMessage(hmi, DRV_QUERYDEVICEINTERFACESIZE, (DWORD_PTR)&interface_size, 0);
+				}) },
+				{ g_stats_entry_names[(size_t)StatsEntry::midiInMessage_QUERYDEVICEINTERFACE], sweep_call_ns([&] {
+					OVERRIDE_WINMM_midiInMessage(hmi, DRV_QUERYDEVICEINTERFACE, (DWORD_PTR)interface_name, sizeof(interface_name));
+				}) },
+				{ g_stats_entry_names[(size_t)StatsEntry::midiOutShortMsg], sweep_call_ns([&] { OVERRIDE_WINMM_midiOutShortMsg(hmo, 0x007F3C90); }) },
+				{ g_stats_entry_names[(size_t)StatsEntry::midiOutLongMsg], sweep_call_ns([&] { OVERRIDE_WINMM_midiOutLongMsg(hmo, &hdr, sizeof(hdr)); }) }
+			};
+			runs.push_back({
+				{ "rules", n },
+				{ "logging", logging },
+				{ "interface_name", wstringToString(interface_name) },
+				{ "mean_call_ns", mean_ns }
+			});
+		}
+	}
+	g_maybe_sweep_log = NULL;
+	if (log) { fclose(log); }
+	write_report({ { "iterations", g_evaluate_config.iterations }, { "runs", runs } });
+}
+
+// Loads the rules and the "evaluate" section; the command line overrides the latter
+void load_config(std::string const& filename, std::optional<std::wstring> const& maybe_exe) {
+	json data = json::parse(read_whole_file(filename));
+	if (maybe_exe.has_value() && data.contains("profiles")) {
+		apply_profile(data, maybe_exe.value(), std::wcerr);
+	}
+	if (data.contains("evaluate")) {
+		auto& evaluate = data["evaluate"];
+		if (evaluate.contains("inventory")) { g_evaluate_config.inventories.push_back(evaluate["inventory"].template get<std::string>()); }
+		if (evaluate.contains("inventories")) {
+			for (auto& f : evaluate["inventories"]) { g_evaluate_config.inventories.push_back(f.template get<std::string>()); }
+		}
+		if (evaluate.contains("file")) { g_evaluate_config.maybe_output_file = evaluate["file"].template get<std::string>(); }
+		if (evaluate.contains("iterations")) { g_evaluate_config.iterations = evaluate["iterations"].template get<size_t>(); }
+	}
+	if (data.contains("rules")) { parse_rules(data["rules"], std::wcerr); }
+}
+
+int usage() {
+	fwprintf(stderr, L"Usage: RuleEval [config] [--exe <path>] [--inventory <file>]... [--file <report>] [--iterations <n>]\n"
+		L"       RuleEval --sweep [--file <report>] [--iterations <n>]\n");
+	return 2;
+}
+
+int wmain(int argc, wchar_t** argv) {
+	init_stats();
+	std::string config_file = "midi_rename_config.json";
+	if (char* maybe_env = getenv("MIDI_REPLACE_CONFIGFILE")) { config_file = maybe_env; }
+	std::optional<std::wstring> maybe_exe;
+	std::vector<std::string> inventories;
+	std::optional<std::string> maybe_output_file;
+	std::optional<size_t> maybe_iterations;
+	bool sweep = false;
+
+	for (int i = 1; i < argc; i++) {
+		std::wstring arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == L"--exe" && has_value) { maybe_exe = argv[++i]; }
+		else if (arg == L"--inventory" && has_value) { inventories.push_back(wstringToString(argv[++i])); }
+		else if (arg == L"--file" && has_value) { maybe_output_file = wstringToString(argv[++i]); }
+		else if (arg == L"--iterations" && has_value) { maybe_iterations = wcstoull(argv[++i], nullptr, 10); }
+		else if (arg == L"--sweep") { sweep = true; }
+		else if (arg.starts_with(L"--")) { return usage(); }
+		else { config_file = wstringToString(arg); }
+	}
+
+	if (sweep) {
+		if (maybe_output_file.has_value()) { g_evaluate_config.maybe_output_file = maybe_output_file; }
+		g_evaluate_config.iterations = maybe_iterations.value_or(100000);
+		if (g_evaluate_config.iterations == 0) { g_evaluate_config.iterations = 1; }
+		run_sweep();
+		return 0;
+	}
+
+	try {
+		load_config(config_file, maybe_exe);
+	}
+	catch (std::exception& e) {
+		fwprintf(stderr, L"Unable to load config from %hs: %hs\n", config_file.c_str(), e.what());
+		return 1;
+	}
+	if (!inventories.empty()) { g_evaluate_config.inventories = inventories; }
+	if (maybe_output_file.has_value()) { g_evaluate_config.maybe_output_file = maybe_output_file; }
+	if (maybe_iterations.has_value()) { g_evaluate_config.iterations = maybe_iterations.value(); }
+	if (g_evaluate_config.iterations == 0) { g_evaluate_config.iterations = 1; }
+	if (g_evaluate_config.inventories.empty()) {
+		fwprintf(stderr, L"No inventory given, in the \"evaluate\" section or with --inventory\n");
+		return usage();
+	}
+
+	run_rule_evaluation();
+	return 0;
+}
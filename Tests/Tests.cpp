@@ -0,0 +1,3904 @@
+// Unit tests for the parts of the wrapper that are plain logic. They use the DLL's own headers,
+// with the native WinMM functions replaced by fakes that record what the wrapper hands to the
+// driver, so no devices are needed.
+//
+//   Tests [name]...
+//   Tests --bench [--iterations <n>] [name]...
+//
+// Runs every test, or those whose name starts with one of the arguments. Prints a line per
+// failed check and exits with 1 if there was any. --bench runs the benchmarks instead and
+// prints their results as JSON.
+
+#include <Windows.h>
+
+#include <cstdio>
+#include <type_traits>
+#include <optional>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <io.h>
+#include <regex>
+#include <mmddk.h>
+#include <cwchar>
+#include <wchar.h>
+#include <algorithm>
+#include <unordered_map>
+#include <memory>
+#include <limits>
+#include <bit>
+#include <functional>
+
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+#include "StringConvert.h"
+
+extern "C" {
+#include "WinMM.h"
+}
+
+#include "WrapperStats.h"
+#include "TimerPeriod.h"
+#include "OutputScheduler.h"
+#include "OutputFilter.h"
+#include "NoteTracker.h"
+#include "AppCallback.h"
+#include "SysexRewrite.h"
+#include "InputBufferPool.h"
+#include "InputDispatch.h"
+#include "ClockEngine.h"
+#include "MidiHandles.h"
+#include "IdentityResponder.h"
+#include "SharedOutputs.h"
+#include "LogRotation.h"
+#include "LatencyProbe.h"
+#include "StreamEngine.h"
+#include "WaveRechunk.h"
+#include "WaveOutStats.h"
+#include "TimerWheel.h"
+
+// The rule code logs through this; here, to stderr
+template<typename ...Args>
+inline void wrapper_log(std::wostringstream* maybe_os, Args... args) {
+	fwprintf(stderr, args...);
+}
+
+#include "ReplaceRules.h"
+
+size_t g_checks = 0;
+size_t g_failures = 0;
+const char* g_current_test = "";
+
+void check(bool ok, const char* what, int line) {
+	g_checks++;
+	if (ok) { return; }
+	g_failures++;
+	fprintf(stderr, "%s: line %d: %s\n", g_current_test, line, what);
+}
+
+#define CHECK(x) check((x), #x, __LINE__)
+
+// Polls until done() or the timeout, for what other threads do
+bool wait_for(std::function<bool()> done, DWORD timeout_ms = 2000) {
+	for (DWORD waited = 0; !done(); waited++) {
+		if (waited >= timeout_ms) { return false; }
+		Sleep(1);
+	}
+	return true;
+}
+
+template<typename Handle>
+Handle fake_handle(uintptr_t n) {
+	return (Handle)(n << 4);
+}
+
+// The native functions the tested code calls. Each records its arguments; calls may come
+// from the wrapper's threads.
+struct fake_winmm {
+	SRWLOCK lock = SRWLOCK_INIT;
+	std::vector<std::pair<HMIDIOUT, DWORD>> short_msgs;
+	std::vector<uint64_t> short_msg_times;		// QPC
+	std::vector<std::pair<HMIDIOUT, LPMIDIHDR>> long_msgs;
+	MMRESULT long_msg_result = MMSYSERR_NOERROR;
+	bool long_msg_done = false;				// Completes long messages before returning, like some drivers
+	std::vector<LPMIDIHDR> in_queue;		// Input buffers queued with the driver, oldest first
+	size_t in_prepared = 0;
+	std::vector<std::pair<DWORD_PTR, DWORD_PTR>> out_opens;		// Callback and instance of each midiOutOpen
+	std::vector<HMIDIOUT> out_closes;
+	MMRESULT open_result = MMSYSERR_NOERROR;
+	DWORD open_delay_ms = 0;				// What an open costs, e.g. under Wine
+
+	void clear() {
+		AcquireSRWLockExclusive(&lock);
+		short_msgs.clear();
+		short_msg_times.clear();
+		long_msgs.clear();
+		long_msg_result = MMSYSERR_NOERROR;
+		long_msg_done = false;
+		in_queue.clear();
+		in_prepared = 0;
+		out_opens.clear();
+		out_closes.clear();
+		open_result = MMSYSERR_NOERROR;
+		open_delay_ms = 0;
+		ReleaseSRWLockExclusive(&lock);
+	}
+
+	size_t short_count() {
+		AcquireSRWLockShared(&lock);
+		size_t rval = short_msgs.size();
+		ReleaseSRWLockShared(&lock);
+		return rval;
+	}
+
+	size_t open_count() {
+		AcquireSRWLockShared(&lock);
+		size_t rval = out_opens.size();
+		ReleaseSRWLockShared(&lock);
+		return rval;
+	}
+
+	size_t close_count() {
+		AcquireSRWLockShared(&lock);
+		size_t rval = out_closes.size();
+		ReleaseSRWLockShared(&lock);
+		return rval;
+	}
+};
+
+fake_winmm g_fake;
+
+MMRESULT WINAPI fake_midiOutShortMsg(HMIDIOUT hmo, DWORD msg) {
+	AcquireSRWLockExclusive(&g_fake.lock);
+	g_fake.short_msgs.push_back({ hmo, msg });
+	g_fake.short_msg_times.push_back(qpc_now());
+	ReleaseSRWLockExclusive(&g_fake.lock);
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_midiOutLongMsg(HMIDIOUT hmo, LPMIDIHDR pmh, UINT cbmh) {
+	AcquireSRWLockExclusive(&g_fake.lock);
+	g_fake.long_msgs.push_back({ hmo, pmh });
+	MMRESULT rval = g_fake.long_msg_result;
+	if (g_fake.long_msg_done && rval == MMSYSERR_NOERROR) { pmh->dwFlags |= MHDR_DONE; }
+	ReleaseSRWLockExclusive(&g_fake.lock);
+	return rval;
+}
+
+// Native handles are numbered from 1000 in the order of the opens
+MMRESULT WINAPI fake_midiOutOpen(LPHMIDIOUT phmo, UINT uDeviceID, DWORD_PTR dwCallback, DWORD_PTR dwInstance, DWORD fdwOpen) {
+	if (g_fake.open_delay_ms) { Sleep(g_fake.open_delay_ms); }
+	AcquireSRWLockExclusive(&g_fake.lock);
+	MMRESULT rval = g_fake.open_result;
+	if (rval == MMSYSERR_NOERROR) {
+		g_fake.out_opens.push_back({ dwCallback, dwInstance });
+		*phmo = fake_handle<HMIDIOUT>(1000 + g_fake.out_opens.size());
+	}
+	ReleaseSRWLockExclusive(&g_fake.lock);
+	return rval;
+}
+
+MMRESULT WINAPI fake_midiOutClose(HMIDIOUT hmo) {
+	AcquireSRWLockExclusive(&g_fake.lock);
+	g_fake.out_closes.push_back(hmo);
+	ReleaseSRWLockExclusive(&g_fake.lock);
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_midiOutPrepareHeader(HMIDIOUT hmo, LPMIDIHDR pmh, UINT cbmh) {
+	pmh->dwFlags |= MHDR_PREPARED;
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_midiOutUnprepareHeader(HMIDIOUT hmo, LPMIDIHDR pmh, UINT cbmh) {
+	pmh->dwFlags &= ~MHDR_PREPARED;
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_midiInPrepareHeader(HMIDIIN hmi, LPMIDIHDR pmh, UINT cbmh) {
+	AcquireSRWLockExclusive(&g_fake.lock);
+	pmh->dwFlags |= MHDR_PREPARED;
+	g_fake.in_prepared++;
+	ReleaseSRWLockExclusive(&g_fake.lock);
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_midiInUnprepareHeader(HMIDIIN hmi, LPMIDIHDR pmh, UINT cbmh) {
+	AcquireSRWLockExclusive(&g_fake.lock);
+	pmh->dwFlags &= ~MHDR_PREPARED;
+	g_fake.in_prepared--;
+	ReleaseSRWLockExclusive(&g_fake.lock);
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_midiInAddBuffer(HMIDIIN hmi, LPMIDIHDR pmh, UINT cbmh) {
+	AcquireSRWLockExclusive(&g_fake.lock);
+	pmh->dwFlags |= MHDR_INQUEUE;
+	g_fake.in_queue.push_back(pmh);
+	ReleaseSRWLockExclusive(&g_fake.lock);
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_timeGetDevCaps(LPTIMECAPS ptc, UINT cbtc) {
+	ptc->wPeriodMin = 1;
+	ptc->wPeriodMax = 1000000;
+	return TIMERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_timeBeginPeriod(UINT period) {
+	return TIMERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_timeEndPeriod(UINT period) {
+	return TIMERR_NOERROR;
+}
+
+// A wave device that plays in real time: its thread completes the written headers in order,
+// each once its duration at the device's byte rate has passed, through the driver callback.
+// It records what it played and counts its own underruns: the queue running dry after a
+// completion, with the application writing again afterwards.
+struct fake_wave_device {
+	SRWLOCK lock = SRWLOCK_INIT;
+	HWAVEOUT hwo = NULL;
+	void (CALLBACK* callback)(HWAVEOUT, UINT, DWORD_PTR, DWORD_PTR, DWORD_PTR) = nullptr;
+	DWORD_PTR instance = 0;
+	DWORD bytes_per_ms = 0;
+	std::deque<LPWAVEHDR> queue;
+	std::atomic<uint64_t> generation{ 0 };		// Bumped by a reset, which returns the whole queue
+	uint64_t play_end = 0;			// QPC at which the header playing now is done
+	bool starved = false;
+	size_t underruns = 0;
+	size_t writes = 0;
+	size_t prepared = 0;
+	DWORD max_queued_bytes = 0;		// Written and not yet played, at any write
+	std::vector<char> played;		// Headers played to the end
+	HANDLE thread = NULL;
+	std::atomic<bool> stop{ false };
+
+	void open(HWAVEOUT handle, void (CALLBACK* cb)(HWAVEOUT, UINT, DWORD_PTR, DWORD_PTR, DWORD_PTR), DWORD_PTR inst, DWORD rate) {
+		hwo = handle;
+		callback = cb;
+		instance = inst;
+		bytes_per_ms = rate;
+		queue.clear();
+		play_end = 0;
+		starved = false;
+		underruns = writes = prepared = 0;
+		max_queued_bytes = 0;
+		played.clear();
+		stop = false;
+		thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+	}
+
+	void close() {
+		stop = true;
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+		thread = NULL;
+	}
+
+	size_t queued() {
+		AcquireSRWLockShared(&lock);
+		size_t rval = queue.size();
+		ReleaseSRWLockShared(&lock);
+		return rval;
+	}
+
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		((fake_wave_device*)param)->run();
+		return 0;
+	}
+
+	void run() {
+		while (!stop) {
+			AcquireSRWLockExclusive(&lock);
+			LPWAVEHDR hdr = queue.empty() ? NULL : queue.front();
+			uint64_t gen = generation;
+			uint64_t now = qpc_now();
+			if (hdr) {
+				// Continues where the previous header ended, unless the device ran dry
+				uint64_t start = play_end > now ? play_end : now;
+				play_end = start + hdr->dwBufferLength * g_qpc_frequency.QuadPart / (1000 * bytes_per_ms);
+			}
+			uint64_t end = play_end;
+			ReleaseSRWLockExclusive(&lock);
+			if (!hdr) {
+				Sleep(1);
+				continue;
+			}
+			while (qpc_now() < end && generation == gen && !stop) { Sleep(1); }
+			AcquireSRWLockExclusive(&lock);
+			bool done = generation == gen && !queue.empty() && queue.front() == hdr;
+			if (done) {
+				queue.pop_front();
+				played.insert(played.end(), hdr->lpData, hdr->lpData + hdr->dwBufferLength);
+				hdr->dwFlags = (hdr->dwFlags | WHDR_DONE) & ~WHDR_INQUEUE;
+				starved = queue.empty();
+			}
+			ReleaseSRWLockExclusive(&lock);
+			if (done) { callback(hwo, WOM_DONE, instance, (DWORD_PTR)hdr, 0); }
+		}
+	}
+};
+
+fake_wave_device g_wave_device;
+
+MMRESULT WINAPI fake_waveOutPrepareHeader(HWAVEOUT hwo, LPWAVEHDR pwh, UINT cbwh) {
+	AcquireSRWLockExclusive(&g_wave_device.lock);
+	pwh->dwFlags |= WHDR_PREPARED;
+	g_wave_device.prepared++;
+	ReleaseSRWLockExclusive(&g_wave_device.lock);
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_waveOutUnprepareHeader(HWAVEOUT hwo, LPWAVEHDR pwh, UINT cbwh) {
+	AcquireSRWLockExclusive(&g_wave_device.lock);
+	pwh->dwFlags &= ~WHDR_PREPARED;
+	g_wave_device.prepared--;
+	ReleaseSRWLockExclusive(&g_wave_device.lock);
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_waveOutWrite(HWAVEOUT hwo, LPWAVEHDR pwh, UINT cbwh) {
+	if (!(pwh->dwFlags & WHDR_PREPARED)) { return WAVERR_UNPREPARED; }
+	auto& device = g_wave_device;
+	AcquireSRWLockExclusive(&device.lock);
+	pwh->dwFlags = (pwh->dwFlags | WHDR_INQUEUE) & ~WHDR_DONE;
+	if (device.starved) {
+		device.underruns++;
+		device.starved = false;
+	}
+	device.queue.push_back(pwh);
+	device.writes++;
+	uint64_t now = qpc_now();
+	DWORD queued_bytes = device.play_end > now ? (DWORD)((device.play_end - now) * 1000 * device.bytes_per_ms / g_qpc_frequency.QuadPart) : 0;
+	for (size_t i = 1; i < device.queue.size(); i++) { queued_bytes += device.queue[i]->dwBufferLength; }
+	if (device.queue.size() == 1) { queued_bytes += pwh->dwBufferLength; }		// Not started yet
+	if (queued_bytes > device.max_queued_bytes) { device.max_queued_bytes = queued_bytes; }
+	ReleaseSRWLockExclusive(&device.lock);
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI fake_waveOutReset(HWAVEOUT hwo) {
+	auto& device = g_wave_device;
+	std::deque<LPWAVEHDR> returned;
+	AcquireSRWLockExclusive(&device.lock);
+	device.generation++;
+	returned.swap(device.queue);
+	device.play_end = 0;
+	device.starved = false;
+	ReleaseSRWLockExclusive(&device.lock);
+	for (auto hdr : returned) {
+		hdr->dwFlags = (hdr->dwFlags | WHDR_DONE) & ~WHDR_INQUEUE;
+		device.callback(hwo, WOM_DONE, device.instance, (DWORD_PTR)hdr, 0);
+	}
+	return MMSYSERR_NOERROR;
+}
+
+void install_fakes() {
+	MMmidiOutShortMsg = fake_midiOutShortMsg;
+	MMmidiOutLongMsg = fake_midiOutLongMsg;
+	MMmidiOutOpen = fake_midiOutOpen;
+	MMmidiOutClose = fake_midiOutClose;
+	MMmidiOutPrepareHeader = fake_midiOutPrepareHeader;
+	MMmidiOutUnprepareHeader = fake_midiOutUnprepareHeader;
+	MMmidiInPrepareHeader = fake_midiInPrepareHeader;
+	MMmidiInUnprepareHeader = fake_midiInUnprepareHeader;
+	MMmidiInAddBuffer = fake_midiInAddBuffer;
+	MMtimeGetDevCaps = fake_timeGetDevCaps;
+	MMtimeBeginPeriod = fake_timeBeginPeriod;
+	MMtimeEndPeriod = fake_timeEndPeriod;
+	MMwaveOutPrepareHeader = fake_waveOutPrepareHeader;
+	MMwaveOutUnprepareHeader = fake_waveOutUnprepareHeader;
+	MMwaveOutWrite = fake_waveOutWrite;
+	MMwaveOutReset = fake_waveOutReset;
+}
+
+// The application's callback, for the paths where the wrapper forwards messages itself.
+// Records the buffer contents, if any, as they were when the message arrived.
+struct fake_application {
+	struct message {
+		HANDLE handle;
+		UINT msg;
+		DWORD_PTR instance;
+		LPMIDIHDR hdr;
+		std::vector<uint8_t> data;
+		DWORD_PTR timestamp;
+		DWORD offset;
+	};
+
+	SRWLOCK lock = SRWLOCK_INIT;
+	std::vector<message> messages;
+
+	void clear() {
+		AcquireSRWLockExclusive(&lock);
+		messages.clear();
+		ReleaseSRWLockExclusive(&lock);
+	}
+
+	size_t count() {
+		AcquireSRWLockShared(&lock);
+		size_t rval = messages.size();
+		ReleaseSRWLockShared(&lock);
+		return rval;
+	}
+
+	std::vector<message> take() {
+		std::vector<message> rval;
+		AcquireSRWLockExclusive(&lock);
+		rval.swap(messages);
+		ReleaseSRWLockExclusive(&lock);
+		return rval;
+	}
+};
+
+fake_application g_app;
+
+void CALLBACK fake_app_callback(HDRVR hdrvr, UINT msg, DWORD_PTR instance, DWORD_PTR param1, DWORD_PTR param2) {
+	LPMIDIHDR hdr = (LPMIDIHDR)param1;
+	AcquireSRWLockExclusive(&g_app.lock);
+	std::vector<uint8_t> data;
+	bool midi_hdr = hdr && msg != WOM_DONE;		// WOM_DONE carries a WAVEHDR
+	if (midi_hdr) { data.assign(hdr->lpData, hdr->lpData + hdr->dwBytesRecorded); }
+	g_app.messages.push_back({ (HANDLE)hdrvr, msg, instance, hdr, data, param2, midi_hdr ? hdr->dwOffset : 0 });
+	ReleaseSRWLockExclusive(&g_app.lock);
+}
+
+const app_callback g_app_callback = { (DWORD_PTR)fake_app_callback, 0, CALLBACK_FUNCTION };
+
+// Defined with the overrides in the DLL; here they record what the scheduler reports
+std::vector<LPMIDIHDR> g_unsent_long_msgs;
+std::vector<DWORD> g_sending_short_msgs;
+
+void complete_unsent_long_msg(HMIDIOUT hmo, LPMIDIHDR pmh) {
+	pmh->dwFlags = (pmh->dwFlags | MHDR_DONE) & ~MHDR_INQUEUE;
+	g_unsent_long_msgs.push_back(pmh);
+}
+
+void scheduled_msg_sending(HMIDIOUT hmo, DWORD short_msg, LPMIDIHDR long_hdr) {
+	if (!long_hdr) { g_sending_short_msgs.push_back(short_msg); }
+}
+
+// Output scheduler
+
+void test_output_scheduler_order() {
+	g_sending_short_msgs.clear();
+	output_scheduler scheduler;
+	HMIDIOUT hmo = fake_handle<HMIDIOUT>(1);
+	HMIDIOUT native = fake_handle<HMIDIOUT>(2);
+	uint64_t ms = g_qpc_frequency.QuadPart / 1000;
+	uint64_t now = qpc_now();
+	auto skip_odd = [](HMIDIOUT, DWORD& msg) { return (msg & 0x0100) == 0; };
+	auto transpose = [](HMIDIOUT, DWORD& msg) { msg += 0x0C00; return true; };
+	scheduler.schedule({ now + 40 * ms, 0, hmo, NULL, 0x403C90 });
+	scheduler.schedule({ now + 10 * ms, 0, hmo, NULL, 0x403E90 });
+	scheduler.schedule({ now + 20 * ms, 0, hmo, NULL, 0x404090 });
+	scheduler.schedule({ now + 20 * ms, 0, hmo, native, 0x404290 });	// Same time: in submission order
+	scheduler.schedule({ now + 30 * ms, 0, hmo, NULL, 0x404390, NULL, 0, skip_odd });
+	scheduler.schedule({ now + 30 * ms, 0, hmo, NULL, 0x404490, NULL, 0, transpose });
+	scheduler.schedule({ 0, 0, hmo, NULL, 0xF8 });		// Already due
+	CHECK(wait_for([] { return g_fake.short_count() >= 6; }));
+	Sleep(20);
+	std::vector<std::pair<HMIDIOUT, DWORD>> expected = {
+		{ hmo, 0xF8 }, { hmo, 0x403E90 }, { hmo, 0x404090 }, { native, 0x404290 }, { hmo, 0x405090 }, { hmo, 0x403C90 }
+	};
+	CHECK(g_fake.short_msgs == expected);
+	CHECK(g_sending_short_msgs.size() == 6);
+	CHECK(scheduler.stats_json()["dispatched"] == 7);
+	scheduler.stop();
+}
+
+void test_output_scheduler_flush() {
+	static output_scheduler scheduler;
+	HMIDIOUT a = fake_handle<HMIDIOUT>(1);
+	HMIDIOUT b = fake_handle<HMIDIOUT>(2);
+	uint64_t later = qpc_now() + 10 * g_qpc_frequency.QuadPart;
+	MIDIHDR sent = {}, refused = {};
+	sent.dwFlags = refused.dwFlags = MHDR_PREPARED | MHDR_INQUEUE;
+	scheduler.schedule({ later, 0, a, NULL, 0x403C90 });
+	scheduler.schedule({ later, 0, a, NULL, 0, &sent, sizeof(sent) });
+	scheduler.schedule({ later, 0, b, NULL, 0x403C91 });
+	scheduler.flush_handle(a);
+	// The long message goes to the driver right away, unmarked, the short one is dropped
+	CHECK(g_fake.long_msgs.size() == 1 && g_fake.long_msgs[0].second == &sent);
+	CHECK(!(sent.dwFlags & MHDR_INQUEUE));
+	CHECK(g_fake.short_msgs.empty());
+	CHECK(scheduler.stats_json()["dropped_on_reset"] == 1);
+
+	// Refused by the driver: returned to the application as done
+	g_fake.long_msg_result = MIDIERR_NOTREADY;
+	scheduler.schedule({ later, 0, b, NULL, 0, &refused, sizeof(refused) });
+	scheduler.flush_handle(b);
+	CHECK(g_unsent_long_msgs.size() == 1 && g_unsent_long_msgs[0] == &refused);
+	CHECK((refused.dwFlags & (MHDR_DONE | MHDR_INQUEUE)) == MHDR_DONE);
+	CHECK(g_fake.short_msgs.empty());
+	CHECK(scheduler.stats_json()["dropped_on_reset"] == 2);
+	scheduler.stop();
+}
+
+// Output filter
+
+uint64_t g_no_flush_at = 0;
+DWORD g_no_flush_msg = 0;
+
+output_filter_state::Verdict filter_msg(output_filter_state& state, DWORD msg, output_filter_config const& cfg = {}) {
+	return state.filter(msg, cfg, 0, 0, g_no_flush_at, g_no_flush_msg);
+}
+
+void test_output_filter_redundant() {
+	using Verdict = output_filter_state::Verdict;
+	output_filter_state state;
+	CHECK(filter_msg(state, 0x6407B0) == Verdict::Send);
+	CHECK(filter_msg(state, 0x6407B0) == Verdict::DropRedundant);
+	CHECK(filter_msg(state, 0x6507B0) == Verdict::Send);
+	CHECK(filter_msg(state, 0x6507B1) == Verdict::Send);			// Other channel
+	CHECK(filter_msg(state, 0x200006B0) == Verdict::Send);			// Data entry
+	CHECK(filter_msg(state, 0x200006B0) == Verdict::Send);
+	CHECK(filter_msg(state, 0x00007BB0) == Verdict::Send);			// All notes off
+	CHECK(filter_msg(state, 0x00007BB0) == Verdict::Send);
+
+	CHECK(filter_msg(state, 0x2000E0) == Verdict::Send);
+	CHECK(filter_msg(state, 0x2000E0) == Verdict::DropRedundant);
+	CHECK(filter_msg(state, 0x2001E0) == Verdict::Send);			// LSB counts
+	CHECK(filter_msg(state, 0x30D0) == Verdict::Send);
+	CHECK(filter_msg(state, 0x30D0) == Verdict::DropRedundant);
+
+	// A bank select makes the next program change go out
+	CHECK(filter_msg(state, 0x05C0) == Verdict::Send);
+	CHECK(filter_msg(state, 0x05C0) == Verdict::DropRedundant);
+	CHECK(filter_msg(state, 0x0100B0) == Verdict::Send);
+	CHECK(filter_msg(state, 0x05C0) == Verdict::Send);
+
+	// Reset all controllers forgets the channel's values
+	CHECK(filter_msg(state, 0x0079B0) == Verdict::Send);
+	CHECK(filter_msg(state, 0x6507B0) == Verdict::Send);
+	CHECK(filter_msg(state, 0x2001E0) == Verdict::Send);
+
+	// As does a system reset for all channels
+	CHECK(filter_msg(state, 0x6507B1) == Verdict::DropRedundant);
+	CHECK(filter_msg(state, 0xFF) == Verdict::Send);
+	CHECK(filter_msg(state, 0x6507B1) == Verdict::Send);
+
+	output_filter_config off;
+	off.controllers = off.pitch_bend = off.channel_pressure = off.program = false;
+	CHECK(filter_msg(state, 0x6507B1, off) == Verdict::Send);
+	CHECK(filter_msg(state, 0x05C1, off) == Verdict::Send);
+	CHECK(filter_msg(state, 0x05C1, off) == Verdict::Send);
+}
+
+void test_output_filter_running_status() {
+	using Verdict = output_filter_state::Verdict;
+	output_filter_state state;
+	CHECK(filter_msg(state, 0x6407B0) == Verdict::Send);
+	CHECK(filter_msg(state, 0x6407B1) == Verdict::Send);
+	CHECK(filter_msg(state, 0x6407B0) == Verdict::DropRedundant);	// Device still has B1
+	DWORD msg = 0x200A;		// Data only, for B0 0A 20
+	CHECK(state.filter(msg, {}, 0, 0, g_no_flush_at, g_no_flush_msg) == Verdict::Send);
+	CHECK(msg == 0x200AB0);
+	msg = 0x210A;			// The device has B0 now
+	CHECK(state.filter(msg, {}, 0, 0, g_no_flush_at, g_no_flush_msg) == Verdict::Send);
+	CHECK(msg == 0x210A);
+	msg = 0x210A;
+	CHECK(state.filter(msg, {}, 0, 0, g_no_flush_at, g_no_flush_msg) == Verdict::DropRedundant);
+
+	// Program change: one data byte
+	CHECK(filter_msg(state, 0x05C2) == Verdict::Send);
+	CHECK(filter_msg(state, 0x6607B0) == Verdict::Send);
+	CHECK(filter_msg(state, 0x05C2) == Verdict::DropRedundant);
+	msg = 0x06;
+	CHECK(state.filter(msg, {}, 0, 0, g_no_flush_at, g_no_flush_msg) == Verdict::Send);
+	CHECK(msg == 0x06C2);
+
+	// System common messages cancel running status on the device; real-time ones don't
+	CHECK(filter_msg(state, 0xF8) == Verdict::Send);
+	CHECK(state.device_running_status == 0xC2);
+	CHECK(filter_msg(state, 0x01F3) == Verdict::Send);
+	CHECK(state.device_running_status == 0);
+}
+
+void test_output_filter_rate_limit() {
+	using Verdict = output_filter_state::Verdict;
+	output_filter_state state;
+	output_filter_config cfg;
+	cfg.rate_limited_controllers[1] = true;
+	uint64_t flush_at = 0;
+	DWORD flush_msg = 0;
+	DWORD msg = 0x0101B0;
+	CHECK(state.filter(msg, cfg, 1000, 100, flush_at, flush_msg) == Verdict::Send);
+	msg = 0x0201B0;
+	CHECK(state.filter(msg, cfg, 1050, 100, flush_at, flush_msg) == Verdict::HoldBack);
+	CHECK(flush_at == 1100 && flush_msg == 0x01B0);
+	flush_at = 0;
+	msg = 0x0301B0;
+	CHECK(state.filter(msg, cfg, 1060, 100, flush_at, flush_msg) == Verdict::HoldBack);
+	CHECK(flush_at == 0);		// Already scheduled
+	msg = 0x0307B0;				// Not rate limited
+	CHECK(state.filter(msg, cfg, 1060, 100, flush_at, flush_msg) == Verdict::Send);
+
+	// Only the latest value is sent
+	CHECK(state.take_pending(0, 1, 1100) == std::optional<DWORD>(0x0301B0));
+	CHECK(state.device_running_status == 0xB0);
+	CHECK(!state.take_pending(0, 1, 1100));
+	msg = 0x0301B0;
+	CHECK(state.filter(msg, cfg, 1250, 100, flush_at, flush_msg) == Verdict::DropRedundant);
+
+	// Back to the sent value within the interval: nothing to flush
+	msg = 0x0401B0;
+	CHECK(state.filter(msg, cfg, 1300, 100, flush_at, flush_msg) == Verdict::Send);
+	msg = 0x0501B0;
+	CHECK(state.filter(msg, cfg, 1310, 100, flush_at, flush_msg) == Verdict::HoldBack);
+	msg = 0x0401B0;
+	CHECK(state.filter(msg, cfg, 1320, 100, flush_at, flush_msg) == Verdict::HoldBack);
+	CHECK(!state.take_pending(0, 1, 1400));
+}
+
+// Note tracker
+
+std::vector<DWORD> silence_msgs(note_tracker& notes) {
+	HMIDIOUT hmo = fake_handle<HMIDIOUT>(1);
+	g_fake.clear();
+	uint64_t sent = notes.silence(hmo);
+	std::vector<DWORD> rval;
+	for (auto [h, msg] : g_fake.short_msgs) {
+		if (h == hmo) { rval.push_back(msg); }
+	}
+	CHECK(sent == rval.size());
+	std::sort(rval.begin(), rval.end());
+	return rval;
+}
+
+void test_note_tracker_short() {
+	note_tracker notes;
+	notes.on_short_msg(0x403C90);		// Channel 1, note 60
+	notes.on_short_msg(0x403E);			// Running status: note 62
+	notes.on_short_msg(0x7F7099);		// Channel 10, note 112, in the second word
+	notes.on_short_msg(0x004099);		// Velocity 0: off
+	notes.on_short_msg(0x404099);
+	notes.on_short_msg(0x404080);		// Off: note 64 was never on
+	notes.on_short_msg(0x7F40B3);		// Sustain on, channel 4
+	notes.on_short_msg(0x7F30B5);
+	notes.on_short_msg(0x00407BB5);		// All notes off, channel 6
+	std::vector<DWORD> expected = { 0x3C80, 0x3E80, 0x4089, 0x40B3, 0x7089 };
+	CHECK(silence_msgs(notes) == expected);
+	CHECK(silence_msgs(notes).empty());
+
+	notes.on_short_msg(0x7F40B0);
+	notes.on_short_msg(0x0040B0);		// Sustain off again
+	notes.on_short_msg(0x403C90);
+	notes.on_short_msg(0x407BB0);
+	CHECK(silence_msgs(notes).empty());
+
+	// After silence, running status must come from the next message
+	notes.on_short_msg(0x403C90);
+	silence_msgs(notes);
+	notes.on_short_msg(0x403C);
+	CHECK(silence_msgs(notes).empty());
+}
+
+void test_note_tracker_long() {
+	note_tracker notes;
+	const uint8_t msg[] = {
+		0xF0, 0x41, 0x10, 0x42, 0x12, 0x40, 0x00, 0x7F, 0x00, 0x41, 0xF7,	// SysEx, skipped
+		0x91, 0x3C, 0x40, 0x3E, 0x40,			// Two notes, the second with running status
+		0xFE, 0x40, 0x40,						// Real-time keeps running status
+		0xC1, 0x05, 0x41, 0x40,					// Program changes: one data byte each
+		0xF3, 0x01, 0x43, 0x40,					// System common cancels running status
+		0x82, 0x3C,								// Cut short
+	};
+	notes.on_long_msg(msg, sizeof(msg));
+	std::vector<DWORD> expected = { 0x3C81, 0x3E81, 0x4081 };
+	CHECK(silence_msgs(notes) == expected);
+
+	const uint8_t unterminated[] = { 0xF0, 0x7E, 0x7F, 0x06, 0x01, 0x90, 0x3C, 0x40 };
+	notes.on_long_msg(unterminated, sizeof(unterminated));
+	CHECK(silence_msgs(notes).empty());
+}
+
+// SysEx rewriter
+
+sysex_rewrite_rule sysex_rule(std::string const& match, std::string const& replace) {
+	sysex_rewrite_rule rule;
+	rule.match = parse_sysex_pattern(match);
+	rule.replace = parse_sysex_pattern(replace);
+	return rule;
+}
+
+std::vector<uint8_t> rewritten(sysex_rewriter const& rewriter, std::vector<uint8_t> data, bool output = true) {
+	rewriter.rewrite(data.data(), data.size(), output);
+	return data;
+}
+
+template<typename F>
+bool throws(F f) {
+	try { f(); }
+	catch (std::runtime_error&) { return true; }
+	return false;
+}
+
+void test_sysex_pattern() {
+	CHECK(parse_sysex_pattern("F0 41 ?? 42 12") == std::vector<int16_t>({ 0xF0, 0x41, -1, 0x42, 0x12 }));
+	CHECK(parse_sysex_pattern(" f0  7e ") == std::vector<int16_t>({ 0xF0, 0x7E }));
+	CHECK(parse_sysex_pattern("").empty());
+	CHECK(throws([] { parse_sysex_pattern("F0 4"); }));
+	CHECK(throws([] { parse_sysex_pattern("F0 G1"); }));
+	CHECK(throws([] { parse_sysex_pattern("F041"); }));
+
+	sysex_rewriter rewriter;
+	CHECK(throws([&] { rewriter.add(sysex_rule("?? ??", "00 00")); }));
+	CHECK(throws([&] { rewriter.add(sysex_rule("F0 41", "F0")); }));
+	CHECK(throws([&] { rewriter.add(sysex_rule("", "")); }));
+	CHECK(rewriter.size() == 0);
+}
+
+void test_sysex_rewrite() {
+	sysex_rewriter rewriter;
+	rewriter.add(sysex_rule("01 02 03 04", "0A ?? ?? 0D"));
+	rewriter.add(sysex_rule("03 04", "1C 1D"));					// Suffix of the first rule's anchor
+	rewriter.add(sysex_rule("?? 10 ?? 42", "?? 11 ?? ??"));		// Anchors on one byte
+	auto input_only = sysex_rule("7E 7F", "7E 10");
+	input_only.output = false;
+	rewriter.add(input_only);
+	rewriter.build();
+	CHECK(rewriter.has_input_rules() && rewriter.has_output_rules());
+
+	CHECK(rewritten(rewriter, { 0x01, 0x02, 0x03, 0x04 }) == std::vector<uint8_t>({ 0x0A, 0x02, 0x03, 0x0D }));
+	CHECK(rewritten(rewriter, { 0x09, 0x03, 0x04 }) == std::vector<uint8_t>({ 0x09, 0x1C, 0x1D }));
+	// Failing the first rule after 01 02 must still find the second
+	CHECK(rewritten(rewriter, { 0x01, 0x02, 0x01, 0x02, 0x03, 0x05, 0x03, 0x04 }) ==
+		std::vector<uint8_t>({ 0x01, 0x02, 0x01, 0x02, 0x03, 0x05, 0x1C, 0x1D }));
+	CHECK(rewritten(rewriter, { 0xF0, 0x41, 0x10, 0x16, 0x42, 0xF7 }) == std::vector<uint8_t>({ 0xF0, 0x41, 0x11, 0x16, 0x42, 0xF7 }));
+	// The wildcard before the anchor needs a byte
+	CHECK(rewritten(rewriter, { 0x10, 0x16, 0x42 }) == std::vector<uint8_t>({ 0x10, 0x16, 0x42 }));
+	CHECK(rewritten(rewriter, { 0xF0, 0x7E, 0x7F, 0xF7 }) == std::vector<uint8_t>({ 0xF0, 0x7E, 0x7F, 0xF7 }));
+	CHECK(rewritten(rewriter, { 0xF0, 0x7E, 0x7F, 0xF7 }, false) == std::vector<uint8_t>({ 0xF0, 0x7E, 0x10, 0xF7 }));
+
+	// Overlapping matches: the one starting first wins, at the same byte the earlier rule
+	uint64_t overlapping = g_sysex_rewrite_overlapping.load();
+	CHECK(rewritten(rewriter, { 0x01, 0x02, 0x03, 0x04, 0x03, 0x04 }) == std::vector<uint8_t>({ 0x0A, 0x02, 0x03, 0x0D, 0x1C, 0x1D }));
+	CHECK(g_sysex_rewrite_overlapping.load() == overlapping + 1);
+}
+
+// Compares the automaton with trying every rule at every position, on random buffers over a
+// small alphabet, so that matches are frequent and overlap
+void test_sysex_rewrite_random() {
+	uint32_t seed = 12345;
+	auto next = [&](uint32_t n) {
+		seed = seed * 1664525 + 1013904223;
+		return (seed >> 8) % n;
+	};
+	for (int round = 0; round < 50; round++) {
+		sysex_rewriter rewriter;
+		std::vector<sysex_rewrite_rule> rules;
+		size_t rule_count = 1 + next(12);
+		while (rules.size() < rule_count) {
+			sysex_rewrite_rule rule;
+			size_t length = 1 + next(5);
+			for (size_t i = 0; i < length; i++) {
+				rule.match.push_back(next(4) == 0 ? -1 : (int16_t)next(3));
+				rule.replace.push_back(next(2) == 0 ? -1 : (int16_t)(0x40 + rules.size()));
+			}
+			if (std::all_of(rule.match.begin(), rule.match.end(), [](int16_t b) { return b < 0; })) { continue; }
+			rule.output = next(4) != 0;
+			rule.input = !rule.output || next(2) == 0;
+			rewriter.add(rule);
+			rules.push_back(rule);
+		}
+		rewriter.build();
+		for (int buffer = 0; buffer < 20; buffer++) {
+			std::vector<uint8_t> data(next(64));
+			for (auto& b : data) { b = (uint8_t)next(3); }
+			for (bool output : { true, false }) {
+				std::vector<uint8_t> expected = data;
+				size_t free_from = 0;
+				for (size_t start = 0; start < data.size(); start++) {
+					for (auto const& rule : rules) {
+						if (!(output ? rule.output : rule.input) || start < free_from || start + rule.match.size() > data.size()) { continue; }
+						bool match = true;
+						for (size_t i = 0; i < rule.match.size(); i++) { match &= rule.match[i] < 0 || data[start + i] == rule.match[i]; }
+						if (!match) { continue; }
+						for (size_t i = 0; i < rule.replace.size(); i++) {
+							if (rule.replace[i] >= 0) { expected[start + i] = (uint8_t)rule.replace[i]; }
+						}
+						free_from = start + rule.match.size();
+					}
+				}
+				CHECK(rewritten(rewriter, data, output) == expected);
+			}
+		}
+	}
+}
+
+void test_sysex_roland_checksum() {
+	sysex_rewriter rewriter;
+	// GS master volume to 100
+	auto volume = sysex_rule("F0 41 ?? 42 12 40 00 04 ??", "?? ?? ?? ?? ?? ?? ?? ?? 64");
+	volume.checksum = sysex_checksum::Roland;
+	rewriter.add(volume);
+	// Device ID 10 to 11 in a DT1 with a 4-byte address header: the checksum starts later
+	auto device = sysex_rule("F0 41 10 00 00 12", "F0 41 11 00 00 12");
+	device.checksum = sysex_checksum::Roland;
+	device.checksum_start = 6;
+	rewriter.add(device);
+	rewriter.build();
+
+	// 40 + 00 + 04 + 64 = A8: checksum 80 - 28 = 58
+	std::vector<uint8_t> gs = { 0xF0, 0x41, 0x10, 0x42, 0x12, 0x40, 0x00, 0x04, 0x7F, 0x3D, 0xF7 };
+	CHECK(rewritten(rewriter, gs) == std::vector<uint8_t>({ 0xF0, 0x41, 0x10, 0x42, 0x12, 0x40, 0x00, 0x04, 0x64, 0x58, 0xF7 }));
+
+	// Several messages in one buffer: each gets its own checksum
+	std::vector<uint8_t> two = gs;
+	two.insert(two.end(), { 0xF0, 0x41, 0x10, 0x00, 0x00, 0x12, 0x01, 0x02, 0x7F, 0x00, 0xF7 });
+	two.insert(two.end(), gs.begin(), gs.end());
+	auto result = rewritten(rewriter, two);
+	CHECK(result[8] == 0x64 && result[9] == 0x58 && result[30] == 0x64 && result[31] == 0x58);
+	CHECK(result[13] == 0x11 && result[20] == (uint8_t)((128 - ((0x01 + 0x02 + 0x7F) & 0x7F)) & 0x7F));
+
+	// A sum that is a multiple of 128 has checksum 0
+	std::vector<uint8_t> zero = { 0xF0, 0x41, 0x10, 0x00, 0x00, 0x12, 0x7F, 0x01, 0x55, 0xF7 };
+	CHECK(rewritten(rewriter, zero)[8] == 0x00);
+
+	// Without the end of the message, the bytes are replaced but the checksum can't be
+	uint64_t incomplete = g_sysex_rewrite_checksums_incomplete.load();
+	std::vector<uint8_t> cut(gs.begin(), gs.begin() + 10);
+	auto cut_result = rewritten(rewriter, cut);
+	CHECK(cut_result[8] == 0x64 && cut_result[9] == 0x3D);
+	CHECK(g_sysex_rewrite_checksums_incomplete.load() == incomplete + 1);
+}
+
+// Input buffer pool
+
+// The driver filling the oldest buffer queued with it and returning it
+bool driver_returns(input_buffer_pool& pool, std::vector<uint8_t> const& data, DWORD_PTR timestamp, bool error = false) {
+	LPMIDIHDR hdr = nullptr;
+	bool queued = wait_for([&] {
+		AcquireSRWLockExclusive(&g_fake.lock);
+		if (!g_fake.in_queue.empty()) {
+			hdr = g_fake.in_queue.front();
+			g_fake.in_queue.erase(g_fake.in_queue.begin());
+		}
+		ReleaseSRWLockExclusive(&g_fake.lock);
+		return hdr != nullptr;
+	});
+	if (!queued || data.size() > hdr->dwBufferLength) { return false; }
+	memcpy(hdr->lpData, data.data(), data.size());
+	hdr->dwBytesRecorded = (DWORD)data.size();
+	hdr->dwFlags = (hdr->dwFlags | MHDR_DONE) & ~MHDR_INQUEUE;
+	pool.on_native_buffer(hdr, timestamp, error);
+	return true;
+}
+
+// A message in as many driver buffers as it takes
+bool driver_receives(input_buffer_pool& pool, std::vector<uint8_t> const& msg, size_t buffer_size, DWORD_PTR timestamp) {
+	for (size_t i = 0; i < msg.size(); i += buffer_size) {
+		size_t end = i + buffer_size < msg.size() ? i + buffer_size : msg.size();
+		std::vector<uint8_t> part(msg.begin() + i, msg.begin() + end);
+		if (!driver_returns(pool, part, timestamp + i)) { return false; }
+	}
+	return true;
+}
+
+size_t driver_queued() {
+	AcquireSRWLockShared(&g_fake.lock);
+	size_t rval = g_fake.in_queue.size();
+	ReleaseSRWLockShared(&g_fake.lock);
+	return rval;
+}
+
+// As midiInClose does it: the driver returns every buffer empty after the native midiInReset
+void close_pool(input_buffer_pool& pool) {
+	pool.stop();
+	while (driver_queued()) { driver_returns(pool, {}, 0); }
+	pool.release();
+	CHECK(g_fake.in_prepared == 0);
+}
+
+std::vector<uint8_t> test_sysex(size_t length, uint8_t seed, bool terminated = true) {
+	std::vector<uint8_t> rval(length);
+	for (size_t i = 1; i < length; i++) { rval[i] = (uint8_t)((seed + i) & 0x7F); }
+	rval[0] = 0xF0;
+	if (terminated) { rval.back() = 0xF7; }
+	return rval;
+}
+
+std::vector<uint8_t> joined(std::vector<fake_application::message> const& messages) {
+	std::vector<uint8_t> rval;
+	for (auto& m : messages) { rval.insert(rval.end(), m.data.begin(), m.data.end()); }
+	return rval;
+}
+
+// A prepared application buffer
+struct app_buffer {
+	std::vector<char> data;
+	MIDIHDR hdr{};
+
+	explicit app_buffer(size_t size) : data(size) {
+		hdr.lpData = data.data();
+		hdr.dwBufferLength = (DWORD)size;
+		hdr.dwFlags = MHDR_PREPARED;
+	}
+};
+
+input_pool_config small_input_pool() {
+	input_pool_config cfg;
+	cfg.buffers = 4;
+	cfg.buffer_size = 16;
+	cfg.arena_size = 1024;
+	cfg.max_pending = 8;
+	return cfg;
+}
+
+void test_input_pool_reassembly() {
+	auto cfg = small_input_pool();
+	input_buffer_pool pool(fake_handle<HMIDIIN>(1), g_app_callback, cfg);
+	CHECK(pool.start() == MMSYSERR_NOERROR);
+	CHECK(g_fake.in_prepared == 4 && driver_queued() == 4);
+
+	// Three driver buffers, one application buffer queued after the message is complete
+	auto msg = test_sysex(40, 1);
+	CHECK(driver_receives(pool, msg, cfg.buffer_size, 1000));
+	CHECK(wait_for([] { return driver_queued() == 4; }));
+	CHECK(g_app.count() == 0);
+	app_buffer whole(64);
+	CHECK(pool.add_app_buffer(&whole.hdr) == MMSYSERR_NOERROR);
+	CHECK(wait_for([] { return g_app.count() == 1; }));
+	auto got = g_app.take();
+	CHECK(got[0].msg == MIM_LONGDATA && got[0].hdr == &whole.hdr && got[0].data == msg);
+	CHECK(got[0].timestamp == 1000);		// Of the first buffer
+	CHECK((whole.hdr.dwFlags & MHDR_DONE) && !(whole.hdr.dwFlags & MHDR_INQUEUE));
+	CHECK(!pool.has_app_buffers());
+
+	// Split over smaller application buffers, in the order they were queued
+	uint64_t split = g_input_pool_split.load();
+	app_buffer parts[3] = { app_buffer(16), app_buffer(16), app_buffer(16) };
+	for (auto& part : parts) { CHECK(pool.add_app_buffer(&part.hdr) == MMSYSERR_NOERROR); }
+	CHECK(driver_receives(pool, msg, cfg.buffer_size, 2000));
+	CHECK(wait_for([] { return g_app.count() == 3; }));
+	got = g_app.take();
+	CHECK(joined(got) == msg);
+	for (size_t i = 0; i < 3; i++) {
+		CHECK(got[i].msg == MIM_LONGDATA && got[i].hdr == &parts[i].hdr && got[i].timestamp == 2000);
+	}
+	CHECK(got[2].data.size() == 8);
+	CHECK(g_input_pool_split.load() == split + 1);
+
+	// Messages from the wrapper itself take the same way
+	auto injected = test_sysex(6, 2);
+	app_buffer last(64);
+	pool.inject(injected.data(), injected.size(), 3000);
+	CHECK(pool.add_app_buffer(&last.hdr) == MMSYSERR_NOERROR);
+	CHECK(wait_for([] { return g_app.count() == 1; }));
+	got = g_app.take();
+	CHECK(got[0].data == injected && got[0].timestamp == 3000);
+
+	close_pool(pool);
+}
+
+void test_input_pool_errors() {
+	auto cfg = small_input_pool();
+	input_buffer_pool pool(fake_handle<HMIDIIN>(1), g_app_callback, cfg);
+	CHECK(pool.start() == MMSYSERR_NOERROR);
+
+	app_buffer unprepared(16);
+	unprepared.hdr.dwFlags = 0;
+	CHECK(pool.add_app_buffer(&unprepared.hdr) == MIDIERR_UNPREPARED);
+	CHECK(pool.add_app_buffer(nullptr) == MIDIERR_UNPREPARED);
+
+	// A message that ends in an error buffer is MIM_LONGERROR in every application buffer
+	uint64_t errors = g_input_pool_errors.load();
+	app_buffer parts[2] = { app_buffer(16), app_buffer(16) };
+	for (auto& part : parts) { CHECK(pool.add_app_buffer(&part.hdr) == MMSYSERR_NOERROR); }
+	CHECK(pool.add_app_buffer(&parts[0].hdr) == MIDIERR_STILLPLAYING);
+	auto msg = test_sysex(20, 3, false);
+	CHECK(driver_returns(pool, { msg.begin(), msg.begin() + 16 }, 100));
+	CHECK(driver_returns(pool, { msg.begin() + 16, msg.end() }, 101, true));
+	CHECK(wait_for([] { return g_app.count() == 2; }));
+	auto got = g_app.take();
+	CHECK(got[0].msg == MIM_LONGERROR && got[1].msg == MIM_LONGERROR);
+	CHECK(joined(got) == msg && got[1].timestamp == 100);
+	CHECK(g_input_pool_errors.load() == errors + 1);
+
+	// An empty error buffer ends the message in progress; without one, it is nothing
+	app_buffer whole(64);
+	CHECK(pool.add_app_buffer(&whole.hdr) == MMSYSERR_NOERROR);
+	CHECK(driver_returns(pool, {}, 150, true));
+	msg = test_sysex(16, 4, false);
+	CHECK(driver_returns(pool, msg, 200));
+	CHECK(driver_returns(pool, {}, 201, true));
+	CHECK(wait_for([] { return g_app.count() == 1; }));
+	got = g_app.take();
+	CHECK(got[0].msg == MIM_LONGERROR && got[0].data == msg && got[0].timestamp == 200);
+	CHECK(g_input_pool_errors.load() == errors + 2);
+
+	close_pool(pool);
+}
+
+void test_input_pool_overflow() {
+	auto cfg = small_input_pool();
+	cfg.arena_size = 64;
+	cfg.max_pending = 3;
+	input_buffer_pool pool(fake_handle<HMIDIIN>(1), g_app_callback, cfg);
+	CHECK(pool.start() == MMSYSERR_NOERROR);
+	uint64_t too_long = g_input_pool_dropped_too_long.load();
+	uint64_t overflow = g_input_pool_dropped_overflow.load();
+
+	// Larger than the arena: dropped whole, and the next message is unaffected
+	CHECK(driver_receives(pool, test_sysex(80, 5), cfg.buffer_size, 0));
+	CHECK(g_input_pool_dropped_too_long.load() == too_long + 1);
+
+	// The arena is a ring: a message that doesn't fit at the end goes to the start, if the
+	// oldest message has been delivered from there
+	auto a = test_sysex(24, 6), b = test_sysex(24, 7), c = test_sysex(20, 8);
+	pool.inject(a.data(), a.size(), 1);
+	pool.inject(b.data(), b.size(), 2);
+	pool.inject(c.data(), c.size(), 3);		// 16 bytes left at the end, none at the start
+	CHECK(g_input_pool_dropped_overflow.load() == overflow + 1);
+	app_buffer first(64);
+	CHECK(pool.add_app_buffer(&first.hdr) == MMSYSERR_NOERROR);
+	CHECK(wait_for([] { return g_app.count() == 1; }));
+	pool.inject(c.data(), c.size(), 3);		// Wraps around
+	auto d = test_sysex(8, 9);
+	pool.inject(d.data(), d.size(), 4);		// Would run into b
+	CHECK(g_input_pool_dropped_overflow.load() == overflow + 2);
+
+	// Then the pending queue is what runs out
+	app_buffer next[2] = { app_buffer(64), app_buffer(64) };
+	for (auto& buffer : next) { CHECK(pool.add_app_buffer(&buffer.hdr) == MMSYSERR_NOERROR); }
+	CHECK(wait_for([] { return g_app.count() == 3; }));
+	for (int i = 0; i < 4; i++) { pool.inject(d.data(), d.size(), 5 + i); }
+	CHECK(g_input_pool_dropped_overflow.load() == overflow + 3);
+	app_buffer rest[3] = { app_buffer(64), app_buffer(64), app_buffer(64) };
+	for (auto& buffer : rest) { CHECK(pool.add_app_buffer(&buffer.hdr) == MMSYSERR_NOERROR); }
+	CHECK(wait_for([] { return g_app.count() == 6; }));
+	auto got = g_app.take();
+	CHECK(got[0].data == a && got[1].data == b && got[2].data == c);
+	CHECK(got[3].data == d && got[4].data == d && got[5].data == d);
+	CHECK(got[3].timestamp == 5 && got[5].timestamp == 7);
+
+	close_pool(pool);
+}
+
+void test_input_pool_reset() {
+	auto cfg = small_input_pool();
+	input_buffer_pool pool(fake_handle<HMIDIIN>(1), g_app_callback, cfg);
+	CHECK(pool.start() == MMSYSERR_NOERROR);
+
+	// A message waiting for an application buffer and one half received are both dropped,
+	// as is the rest of it arriving during the reset
+	auto waiting = test_sysex(10, 10);
+	pool.inject(waiting.data(), waiting.size(), 1);
+	auto cut = test_sysex(24, 11);
+	CHECK(driver_returns(pool, { cut.begin(), cut.begin() + 16 }, 2));
+	pool.begin_reset();
+	CHECK(driver_returns(pool, { cut.begin() + 16, cut.end() }, 3));
+	pool.end_reset();
+	app_buffer queued(64);
+	CHECK(pool.add_app_buffer(&queued.hdr) == MMSYSERR_NOERROR);
+	CHECK(!wait_for([] { return g_app.count() > 0; }, 50));
+
+	// Queued application buffers come back empty
+	pool.begin_reset();
+	pool.end_reset();
+	auto got = g_app.take();
+	CHECK(got.size() == 1 && got[0].msg == MIM_LONGDATA && got[0].hdr == &queued.hdr && got[0].data.empty());
+	CHECK((queued.hdr.dwFlags & MHDR_DONE) && !(queued.hdr.dwFlags & MHDR_INQUEUE));
+	CHECK(!pool.has_app_buffers());
+
+	auto msg = test_sysex(30, 12);
+	CHECK(pool.add_app_buffer(&queued.hdr) == MMSYSERR_NOERROR);
+	CHECK(driver_receives(pool, msg, cfg.buffer_size, 4));
+	CHECK(wait_for([] { return g_app.count() == 1; }));
+	CHECK(g_app.take()[0].data == msg);
+
+	close_pool(pool);
+}
+
+// Input dispatcher
+
+// The application's side: records what the dispatcher delivers, and can be held in its
+// callback, as a slow application is
+struct slow_application {
+	HANDLE gate = CreateEventW(NULL, TRUE, TRUE, NULL);		// Open: callbacks return at once
+	std::atomic<size_t> entered{ 0 };
+	SRWLOCK lock = SRWLOCK_INIT;
+	std::vector<std::pair<UINT, DWORD_PTR>> got;			// Message and its first parameter
+	std::vector<uint64_t> latency_ticks;					// Pushed with the QPC as second parameter
+
+	~slow_application() { CloseHandle(gate); }
+
+	size_t count() {
+		AcquireSRWLockShared(&lock);
+		size_t rval = got.size();
+		ReleaseSRWLockShared(&lock);
+		return rval;
+	}
+};
+
+slow_application* g_slow_app = nullptr;
+
+void CALLBACK slow_app_callback(HDRVR hdrvr, UINT msg, DWORD_PTR instance, DWORD_PTR param1, DWORD_PTR param2) {
+	auto& app = *g_slow_app;
+	app.entered++;
+	WaitForSingleObject(app.gate, INFINITE);
+	uint64_t now = qpc_now();
+	AcquireSRWLockExclusive(&app.lock);
+	app.got.push_back({ msg, param1 });
+	app.latency_ticks.push_back(now - param2);
+	ReleaseSRWLockExclusive(&app.lock);
+}
+
+const app_callback g_slow_app_callback = { (DWORD_PTR)slow_app_callback, 0, CALLBACK_FUNCTION };
+
+// The driver's delivery thread: pushes a burst of short messages numbered from first, then
+// optionally one message that carries a buffer
+struct fake_input_burst {
+	input_dispatcher* dispatcher;
+	DWORD_PTR first;
+	size_t count;
+	bool long_data = false;
+	std::atomic<size_t> pushed{ 0 };
+	HANDLE thread = NULL;
+
+	void start() { thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL); }
+
+	bool done(DWORD timeout_ms) {
+		if (!thread) { return true; }
+		if (WaitForSingleObject(thread, timeout_ms) != WAIT_OBJECT_0) { return false; }
+		CloseHandle(thread);
+		thread = NULL;
+		return true;
+	}
+
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		auto burst = (fake_input_burst*)param;
+		for (size_t i = 0; i < burst->count; i++, burst->pushed++) {
+			burst->dispatcher->push(fake_handle<HMIDIIN>(1), MIM_DATA, burst->first + i, qpc_now());
+		}
+		if (burst->long_data) {
+			burst->dispatcher->push(fake_handle<HMIDIIN>(1), MIM_LONGDATA, 0, qpc_now());
+			burst->pushed++;
+		}
+		return 0;
+	}
+};
+
+// Holds the application in its callback for message 0, then sends a burst of 100 into a ring
+// of 16. Returns the messages delivered once the application is let go.
+std::vector<DWORD_PTR> burst_into_full_ring(input_overflow overflow, bool long_data) {
+	slow_application app;
+	g_slow_app = &app;
+	input_dispatch_config cfg;
+	cfg.capacity = 16;
+	cfg.overflow = overflow;
+	input_dispatcher dispatcher(g_slow_app_callback, cfg);
+	dispatcher.start(cfg.priority);
+	ResetEvent(app.gate);
+	fake_input_burst held{ &dispatcher, 0, 1 };
+	held.start();
+	CHECK(held.done(1000));
+	CHECK(wait_for([&] { return app.entered == 1; }));
+
+	fake_input_burst burst{ &dispatcher, 1, 99, long_data };
+	burst.start();
+	bool blocked = !burst.done(20);
+	// Short messages never hold up the driver unless the policy says so; buffers always wait
+	CHECK(blocked == (overflow == input_overflow::Block || long_data));
+	SetEvent(app.gate);
+	CHECK(burst.done(1000));
+	CHECK(dispatcher.stop());
+	std::vector<DWORD_PTR> rval;
+	bool long_last = true;
+	for (size_t i = 0; i < app.got.size(); i++) {
+		if (app.got[i].first == MIM_DATA) { rval.push_back(app.got[i].second); }
+		else { long_last &= i + 1 == app.got.size(); }
+	}
+	CHECK(long_last && app.got.size() == rval.size() + (long_data ? 1 : 0));
+	g_slow_app = nullptr;
+	return rval;
+}
+
+std::vector<DWORD_PTR> numbered(DWORD_PTR first, DWORD_PTR last) {
+	std::vector<DWORD_PTR> rval;
+	for (DWORD_PTR n = first; n <= last; n++) { rval.push_back(n); }
+	return rval;
+}
+
+void test_input_dispatch_overflow() {
+	uint64_t dropped = g_input_dispatch_dropped, blocked = g_input_dispatch_blocked;
+
+	// Block: nothing lost, the driver waits
+	CHECK(burst_into_full_ring(input_overflow::Block, false) == numbered(0, 99));
+	CHECK(g_input_dispatch_dropped == dropped && g_input_dispatch_blocked > blocked);
+	blocked = g_input_dispatch_blocked;
+
+	// Drop newest: the 16 that fit are kept
+	CHECK(burst_into_full_ring(input_overflow::DropNewest, false) == numbered(0, 16));
+	CHECK(g_input_dispatch_dropped == dropped + 83 && g_input_dispatch_blocked == blocked);
+
+	// Drop oldest: the last 16 are kept
+	auto expected = numbered(84, 99);
+	expected.insert(expected.begin(), 0);
+	CHECK(burst_into_full_ring(input_overflow::DropOldest, false) == expected);
+	CHECK(g_input_dispatch_dropped == dropped + 166 && g_input_dispatch_blocked == blocked);
+
+	// A buffer isn't dropped, and it isn't delivered ahead of the messages before it
+	CHECK(burst_into_full_ring(input_overflow::DropNewest, true) == numbered(0, 16));
+	CHECK(g_input_dispatch_dropped == dropped + 249 && g_input_dispatch_blocked == blocked + 1);
+}
+
+void test_input_dispatch_latency() {
+	slow_application app;
+	g_slow_app = &app;
+	uint64_t delivered = g_input_dispatch_delivered;
+	uint64_t slow = 0;
+	for (size_t i = g_stats_histogram_buckets; i-- > histogram_bucket(10000000); ) { slow += g_input_dispatch_latency_histogram[i]; }
+	input_dispatch_config cfg;
+	input_dispatcher dispatcher(g_slow_app_callback, cfg);
+	dispatcher.start(cfg.priority);
+
+	// A burst of 1000 while the application is held for 20 ms: the depth and the wait show
+	// in the stats
+	ResetEvent(app.gate);
+	fake_input_burst burst{ &dispatcher, 0, 1000 };
+	burst.start();
+	CHECK(burst.done(1000));
+	Sleep(20);
+	SetEvent(app.gate);
+	CHECK(wait_for([&] { return app.count() == 1000; }));
+	bool in_order = true;
+	for (size_t i = 0; i < app.got.size(); i++) { in_order &= app.got[i].first == MIM_DATA && app.got[i].second == i; }
+	CHECK(in_order);
+	CHECK(g_input_dispatch_max_depth >= 998);
+	uint64_t slow_now = 0;
+	for (size_t i = g_stats_histogram_buckets; i-- > histogram_bucket(10000000); ) { slow_now += g_input_dispatch_latency_histogram[i]; }
+	CHECK(slow_now >= slow + 999);		// All but message 0, taken right away and held in the callback
+	CHECK(std::all_of(app.latency_ticks.begin(), app.latency_ticks.end(), [](uint64_t ticks) { return ticks_to_ns(ticks) >= 10e6; }));
+
+	// stop() delivers what is still queued before it returns
+	ResetEvent(app.gate);
+	fake_input_burst more{ &dispatcher, 1000, 50 };
+	more.start();
+	CHECK(more.done(1000));
+	SetEvent(app.gate);
+	CHECK(dispatcher.stop());
+	CHECK(app.count() == 1050 && g_input_dispatch_delivered == delivered + 1050);
+	g_slow_app = nullptr;
+}
+
+// Clock engine
+
+// RMS distance of the intervals between times (QPC) from period_ms, after the first skip
+// intervals, while the loop locks
+double rms_jitter_ms(std::vector<uint64_t> const& times, double period_ms, size_t skip) {
+	double sum = 0;
+	size_t n = 0;
+	for (size_t i = skip + 1; i < times.size(); i++, n++) {
+		double error = ticks_to_ns(times[i] - times[i - 1]) / 1000000 - period_ms;
+		sum += error * error;
+	}
+	return n ? std::sqrt(sum / n) : 0.0;
+}
+
+struct clock_run {
+	size_t taken = 0;				// Clocks the engine sent itself
+	std::vector<uint64_t> app;		// When the application sent each clock, QPC
+	std::vector<uint64_t> sent;		// When the driver got each clock
+};
+
+// An application sending clocks from a thread that isn't real-time: clock k is due at
+// k * period_ms, early or late by up to jitter_ms. Clocks the engine doesn't take go straight
+// to the driver, as in midiOutShortMsg. Ends with a Stop, which sends the clocks still owed.
+clock_run send_clocks(clock_engine& engine, HMIDIOUT hmo, size_t count, double period_ms, double jitter_ms) {
+	clock_run rval;
+	uint32_t seed = 4242;
+	double ticks_per_ms = g_qpc_frequency.QuadPart / 1000.0;
+	g_fake.clear();
+	uint64_t start = qpc_now();
+	for (size_t k = 0; k < count; k++) {
+		seed = seed * 1664525 + 1013904223;
+		double offset = ((seed >> 8) % 2001 / 1000.0 - 1) * jitter_ms;
+		uint64_t due = start + (uint64_t)((k * period_ms + jitter_ms + offset) * ticks_per_ms);
+		while (qpc_now() + 2 * ticks_per_ms < due) { Sleep(1); }
+		while (qpc_now() < due) { Sleep(0); }
+		rval.app.push_back(qpc_now());
+		if (engine.on_message(0xF8)) { rval.taken++; }
+		else { fake_midiOutShortMsg(hmo, 0xF8); }
+	}
+	Sleep((DWORD)(2 * period_ms));
+	CHECK(!engine.on_message(0xFC));
+	fake_midiOutShortMsg(hmo, 0xFC);
+	AcquireSRWLockShared(&g_fake.lock);
+	for (size_t i = 0; i < g_fake.short_msgs.size(); i++) {
+		if (g_fake.short_msgs[i].second == 0xF8) { rval.sent.push_back(g_fake.short_msg_times[i]); }
+	}
+	CHECK(!g_fake.short_msgs.empty() && g_fake.short_msgs.back().second == 0xFC);
+	ReleaseSRWLockShared(&g_fake.lock);
+	return rval;
+}
+
+void test_clock_engine_counts() {
+	auto saved = g_clock_engine_config;
+	HMIDIOUT hmo = fake_handle<HMIDIOUT>(1);
+	clock_engine engine(hmo);
+	uint64_t passed_through = g_clock_passed_through.load(), relocks = g_clock_relocks.load();
+	uint64_t in_clocks = g_clock_in_jitter.clocks.load();
+
+	// Every application clock results in exactly one clock sent, and the first two go as they come
+	auto run = send_clocks(engine, hmo, 50, 10, 2);
+	CHECK(run.taken == 48 && run.sent.size() == 50);
+	CHECK(g_clock_passed_through.load() == passed_through + 2);
+	CHECK(g_clock_in_jitter.clocks.load() == in_clocks + 48);
+	// Never ahead of the application's clock
+	for (size_t i = 0; i < run.sent.size(); i++) { CHECK(run.sent[i] >= run.app[i]); }
+
+	// The Stop started the loop over, as does a gap of more than four periods
+	g_fake.clear();
+	CHECK(!engine.on_message(0xF8));
+	Sleep(10);
+	CHECK(!engine.on_message(0xF8));
+	Sleep(10);
+	CHECK(engine.on_message(0xF8));
+	CHECK(g_clock_passed_through.load() == passed_through + 4);
+	CHECK(wait_for([] { return g_fake.short_count() == 1; }));
+	Sleep(60);
+	CHECK(!engine.on_message(0xF8));
+	CHECK(g_clock_relocks.load() == relocks + 1);
+	Sleep(10);
+	CHECK(!engine.on_message(0xF8));
+	Sleep(10);
+	CHECK(engine.on_message(0xF8));
+	CHECK(wait_for([] { return g_fake.short_count() == 2; }));
+
+	// Once closed, the thread is gone and sends nothing more
+	engine.closing();
+	engine.closed(true);
+	engine.on_message(0xF8);
+	engine.on_message(0xF8);
+	Sleep(20);
+	CHECK(g_fake.short_count() == 2);
+	g_clock_engine_config = saved;
+}
+
+// Clocks 10 ms apart, sent up to 3 ms early or late: what the driver gets is steadier than
+// what the application sends once the loop has locked, even more so when the engine may
+// send a clock before the application's. The loop starts from one jittered interval, so at
+// the default bandwidth it takes longer to lock than the test runs.
+void test_clock_engine_jitter() {
+	auto saved = g_clock_engine_config;
+	g_clock_engine_config.bandwidth_hz = 2;
+	for (uint64_t max_lead : { 0, 1 }) {
+		g_clock_engine_config.max_lead = max_lead;
+		HMIDIOUT hmo = fake_handle<HMIDIOUT>(1);
+		clock_engine engine(hmo);
+		auto run = send_clocks(engine, hmo, 120, 10, 3);
+		CHECK(run.sent.size() >= run.app.size() && run.sent.size() <= run.app.size() + max_lead);
+		double app_rms = rms_jitter_ms(run.app, 10, 40);
+		double sent_rms = rms_jitter_ms(std::vector<uint64_t>(run.sent.begin(), run.sent.begin() + run.app.size()), 10, 40);
+		CHECK(app_rms > 1);
+		CHECK(sent_rms < (max_lead ? app_rms / 2 : app_rms));
+		CHECK(std::abs(g_clock_bpm.load() - 250) < 10);
+		engine.closing();
+		engine.closed(true);
+	}
+	g_clock_engine_config = saved;
+}
+
+// gzip writer
+
+// Independent DEFLATE decoder (stored, fixed and dynamic Huffman blocks), so the writer is
+// checked against the format rather than against itself
+class inflater {
+public:
+	// The data of a gzip member, or nothing if it is invalid or its trailer doesn't match
+	static std::optional<std::vector<uint8_t>> gunzip(std::vector<uint8_t> const& gz) {
+		if (gz.size() < 18 || gz[0] != 0x1F || gz[1] != 0x8B || gz[2] != 8 || (gz[3] & 0xE0)) { return std::nullopt; }
+		size_t at = 10;
+		uint8_t flags = gz[3];
+		if (flags & 4) { at += 2 + (gz[at] | (gz[at + 1] << 8)); }			// FEXTRA
+		for (uint8_t flag : { 8, 16 }) {									// FNAME, FCOMMENT
+			if (flags & flag) {
+				while (at < gz.size() && gz[at]) { at++; }
+				at++;
+			}
+		}
+		if (flags & 2) { at += 2; }											// FHCRC
+		if (at + 8 > gz.size()) { return std::nullopt; }
+		inflater i(gz.data() + at, gz.size() - 8 - at);
+		if (!i.inflate()) { return std::nullopt; }
+		auto le32 = [&](size_t offset) {
+			return (uint32_t)gz[offset] | ((uint32_t)gz[offset + 1] << 8) | ((uint32_t)gz[offset + 2] << 16) | ((uint32_t)gz[offset + 3] << 24);
+		};
+		size_t trailer = at + (i.m_bit_pos + 7) / 8;
+		if (trailer + 8 != gz.size()) { return std::nullopt; }
+		if (le32(trailer) != gzip_writer::crc32(i.m_out.data(), i.m_out.size()) || le32(trailer + 4) != (uint32_t)i.m_out.size()) { return std::nullopt; }
+		return std::move(i.m_out);
+	}
+
+private:
+	struct huffman {
+		std::array<uint16_t, 16> count{};	// Codes of each length
+		std::vector<uint16_t> symbols;		// Ordered by code
+	};
+
+	inflater(const uint8_t* data, size_t size) : m_data(data), m_size(size) {}
+
+	bool bits(size_t n, uint32_t& value) {
+		value = 0;
+		for (size_t k = 0; k < n; k++) {
+			if (m_bit_pos >= m_size * 8) { return false; }
+			value |= (uint32_t)((m_data[m_bit_pos / 8] >> (m_bit_pos % 8)) & 1) << k;
+			m_bit_pos++;
+		}
+		return true;
+	}
+
+	static bool build(huffman& h, const uint8_t* lengths, size_t n) {
+		h.count.fill(0);
+		for (size_t s = 0; s < n; s++) { h.count[lengths[s]]++; }
+		int left = 1;
+		for (size_t length = 1; length < 16; length++) {
+			left = 2 * left - h.count[length];
+			if (left < 0) { return false; }		// Over-subscribed
+		}
+		std::array<uint16_t, 16> offsets{};
+		for (size_t length = 1; length < 15; length++) { offsets[length + 1] = offsets[length] + h.count[length]; }
+		h.symbols.assign(n, 0);
+		for (size_t s = 0; s < n; s++) {
+			if (lengths[s]) { h.symbols[offsets[lengths[s]]++] = (uint16_t)s; }
+		}
+		return true;
+	}
+
+	int decode(huffman const& h) {
+		int code = 0, first = 0, index = 0;
+		for (size_t length = 1; length < 16; length++) {
+			uint32_t bit;
+			if (!bits(1, bit)) { return -1; }
+			code |= bit;
+			int count = h.count[length];
+			if (code - count < first) { return h.symbols[index + (code - first)]; }
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+		return -1;
+	}
+
+	bool codes(huffman const& lengths, huffman const& distances) {
+		static const uint16_t length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		static const uint8_t length_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		static const uint16_t distance_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+		static const uint8_t distance_extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+		while (true) {
+			int symbol = decode(lengths);
+			if (symbol < 0 || symbol > 285) { return false; }
+			if (symbol < 256) {
+				m_out.push_back((uint8_t)symbol);
+				continue;
+			}
+			if (symbol == 256) { return true; }
+			uint32_t extra;
+			symbol -= 257;
+			if (!bits(length_extra[symbol], extra)) { return false; }
+			size_t length = length_base[symbol] + extra;
+			symbol = decode(distances);
+			if (symbol < 0 || symbol > 29 || !bits(distance_extra[symbol], extra)) { return false; }
+			size_t distance = distance_base[symbol] + extra;
+			if (distance > m_out.size()) { return false; }
+			for (size_t k = 0; k < length; k++) { m_out.push_back(m_out[m_out.size() - distance]); }
+		}
+	}
+
+	bool stored() {
+		m_bit_pos = (m_bit_pos + 7) / 8 * 8;
+		size_t at = m_bit_pos / 8;
+		if (at + 4 > m_size) { return false; }
+		uint16_t length = m_data[at] | (m_data[at + 1] << 8);
+		uint16_t inverse = m_data[at + 2] | (m_data[at + 3] << 8);
+		if ((uint16_t)~length != inverse || at + 4 + length > m_size) { return false; }
+		m_out.insert(m_out.end(), m_data + at + 4, m_data + at + 4 + length);
+		m_bit_pos = (at + 4 + length) * 8;
+		return true;
+	}
+
+	bool fixed() {
+		uint8_t lengths[288 + 30];
+		std::fill(lengths, lengths + 144, 8);
+		std::fill(lengths + 144, lengths + 256, 9);
+		std::fill(lengths + 256, lengths + 280, 7);
+		std::fill(lengths + 280, lengths + 288, 8);
+		std::fill(lengths + 288, lengths + 318, 5);
+		huffman literal, distance;
+		build(literal, lengths, 288);
+		build(distance, lengths + 288, 30);
+		return codes(literal, distance);
+	}
+
+	bool dynamic() {
+		static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+		uint32_t literals, distances, code_lengths;
+		if (!bits(5, literals) || !bits(5, distances) || !bits(4, code_lengths)) { return false; }
+		literals += 257;
+		distances += 1;
+		code_lengths += 4;
+		if (literals > 286 || distances > 30) { return false; }
+		uint8_t lengths[320] = {};
+		for (size_t k = 0; k < code_lengths; k++) {
+			uint32_t length;
+			if (!bits(3, length)) { return false; }
+			lengths[order[k]] = (uint8_t)length;
+		}
+		huffman length_code;
+		if (!build(length_code, lengths, 19)) { return false; }
+		size_t n = 0;
+		while (n < literals + distances) {
+			int symbol = decode(length_code);
+			if (symbol < 0) { return false; }
+			if (symbol < 16) {
+				lengths[n++] = (uint8_t)symbol;
+				continue;
+			}
+			uint8_t repeated = 0;
+			uint32_t times;
+			if (symbol == 16) {
+				if (n == 0 || !bits(2, times)) { return false; }
+				repeated = lengths[n - 1];
+				times += 3;
+			}
+			else if (symbol == 17) {
+				if (!bits(3, times)) { return false; }
+				times += 3;
+			}
+			else {
+				if (!bits(7, times)) { return false; }
+				times += 11;
+			}
+			if (n + times > literals + distances) { return false; }
+			while (times--) { lengths[n++] = repeated; }
+		}
+		huffman literal, distance;
+		if (!lengths[256] || !build(literal, lengths, literals) || !build(distance, lengths + literals, distances)) { return false; }
+		return codes(literal, distance);
+	}
+
+	bool inflate() {
+		uint32_t last, type;
+		do {
+			if (!bits(1, last) || !bits(2, type)) { return false; }
+			bool ok = type == 0 ? stored() : type == 1 ? fixed() : type == 2 ? dynamic() : false;
+			if (!ok) { return false; }
+		} while (!last);
+		return true;
+	}
+
+	const uint8_t* m_data;
+	size_t m_size;
+	size_t m_bit_pos = 0;
+	std::vector<uint8_t> m_out;
+};
+
+void test_inflater() {
+	// From zlib: a stored block and a dynamic Huffman block
+	const std::vector<uint8_t> stored = {
+		0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x03, 0x01, 0x0C, 0x00, 0xF3, 0xFF, 0x73,
+		0x74, 0x6F, 0x72, 0x65, 0x64, 0x20, 0x62, 0x6C, 0x6F, 0x63, 0x6B, 0x94, 0xA3, 0x24, 0x3D, 0x0C,
+		0x00, 0x00, 0x00
+	};
+	const std::vector<uint8_t> dynamic = {
+		0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x05, 0xC1, 0x01, 0x0D, 0x00, 0x30,
+		0x0C, 0xC3, 0x30, 0x2A, 0x81, 0x90, 0x5D, 0x93, 0xAA, 0x03, 0x78, 0xF9, 0x43, 0xBA, 0x5D, 0xD9,
+		0x61, 0x64, 0x0F, 0x73, 0x58, 0x51, 0x52, 0x94, 0x1D, 0x1A, 0x2A, 0x79, 0xA4, 0x78, 0x71, 0x68,
+		0x3E, 0x38, 0xE5, 0xAF, 0xDA, 0x32, 0x00, 0x00, 0x00
+	};
+	auto text = [](const char* s) { return std::vector<uint8_t>(s, s + strlen(s)); };
+	CHECK(inflater::gunzip(stored) == text("stored block"));
+	CHECK(inflater::gunzip(dynamic) == text("F0 41 10 42 12 40 00 7F 00 41 F7 F0 7E 7F 09 01 F7"));
+	auto corrupt = dynamic;
+	corrupt[corrupt.size() - 8] ^= 1;
+	CHECK(!inflater::gunzip(corrupt));
+}
+
+void test_gzip_round_trip() {
+	const char* check_value = "123456789";
+	CHECK(gzip_writer::crc32((const uint8_t*)check_value, 9) == 0xCBF43926);
+
+	std::vector<std::vector<uint8_t>> inputs;
+	inputs.push_back({});
+	inputs.push_back({ 'a' });
+	inputs.push_back({ 'a', 'b', 'a', 'b', 'a' });
+	std::string log;
+	for (int i = 0; log.size() < 100000; i++) {
+		log += "midiOutGetDevCapsW(" + std::to_string(i % 7) + "): Microsoft GS Wavetable Synth -> Wavetable " + std::to_string(i) + "\r\n";
+	}
+	inputs.push_back(std::vector<uint8_t>(log.begin(), log.end()));
+	inputs.push_back(std::vector<uint8_t>(70000, 0));			// Maximum length matches
+	uint32_t seed = 1;
+	std::vector<uint8_t> noise(50000);
+	for (auto& b : noise) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		b = (uint8_t)seed;
+	}
+	inputs.push_back(noise);
+	// Repeats just inside and just outside the window
+	std::vector<uint8_t> far = noise;
+	far.resize(32768 + 1000);
+	far.insert(far.end(), noise.begin(), noise.begin() + 2000);
+	inputs.push_back(far);
+
+	for (auto const& input : inputs) {
+		auto gz = gzip_writer::compress(input.data(), input.size());
+		CHECK(inflater::gunzip(gz) == input);
+	}
+	auto gz = gzip_writer::compress((const uint8_t*)log.data(), log.size());
+	CHECK(gz.size() < log.size() / 4);
+}
+
+// Handle table
+
+void test_handle_device_table() {
+	handle_device_table table;
+	HANDLE a = fake_handle<HANDLE>(1);
+	HANDLE b = fake_handle<HANDLE>(2);
+	CHECK(!table.find(a));
+	CHECK(!table.find(NULL));
+	table.add(a, true, 3);
+	table.add(b, false, 5);
+	auto found = table.find(a);
+	CHECK(found && found->device_id == 3 && found->output && found->rule == g_handle_rule_unresolved);
+	found = table.find(b);
+	CHECK(found && found->device_id == 5 && !found->output);
+
+	table.resolve(a, *table.find(a), 7);
+	CHECK(table.find(a)->rule == 7);
+	// Reopened since the lookup: the old resolution is not recorded
+	auto stale = *table.find(b);
+	table.add(b, true, 6);
+	table.resolve(b, stale, 9);
+	found = table.find(b);
+	CHECK(found && found->device_id == 6 && found->output && found->rule == g_handle_rule_unresolved);
+	table.resolve(b, *found, g_handle_rule_none);
+	CHECK(table.find(b)->rule == g_handle_rule_none);
+	CHECK(table.stats_json()["open_handles"] == 2);
+
+	table.remove(a);
+	CHECK(!table.find(a));
+	CHECK(table.find(b).has_value());
+	table.remove(a);
+	CHECK(table.stats_json()["open_handles"] == 1);
+}
+
+void test_handle_device_table_probing() {
+	handle_device_table table;
+	const size_t n = 3000;
+	for (size_t i = 1; i <= n; i++) { table.add(fake_handle<HANDLE>(i), i & 1, (UINT)i); }
+	for (size_t i = 1; i <= n; i += 2) { table.remove(fake_handle<HANDLE>(i)); }
+	bool all_found = true;
+	for (size_t i = 1; i <= n; i++) {
+		auto found = table.find(fake_handle<HANDLE>(i));
+		all_found &= (i & 1) ? !found : (found && found->device_id == i);
+	}
+	CHECK(all_found);
+	// Slots freed by the removes are reused
+	for (size_t i = n + 1; i <= n + n / 2; i++) { table.add(fake_handle<HANDLE>(i), true, (UINT)i); }
+	CHECK(table.stats_json()["open_handles"] == n);
+	all_found = true;
+	for (size_t i = 2; i <= n + n / 2; i += (i < n ? 2 : 1)) {
+		auto found = table.find(fake_handle<HANDLE>(i));
+		all_found &= found && found->device_id == i;
+	}
+	CHECK(all_found);
+
+	// Full: handles that don't fit are not found
+	uint64_t full = g_handle_table_full.load();
+	size_t capacity = table.stats_json()["capacity"];
+	for (size_t i = 1; i <= capacity + 10; i++) { table.add(fake_handle<HANDLE>(100000 + i), true, 1); }
+	CHECK(g_handle_table_full.load() > full);
+	CHECK(table.stats_json()["open_handles"] == capacity);
+	CHECK(!table.find(fake_handle<HANDLE>(100000 + capacity + 10)));
+	for (size_t i = 2; i <= n + n / 2; i += (i < n ? 2 : 1)) { table.remove(fake_handle<HANDLE>(i)); }
+	for (size_t i = 1; i <= capacity + 10; i++) { table.remove(fake_handle<HANDLE>(100000 + i)); }
+	CHECK(table.stats_json()["open_handles"] == 0);
+	table.add(fake_handle<HANDLE>(1), true, 1);
+	CHECK(table.find(fake_handle<HANDLE>(1)).has_value());
+}
+
+// Identity responder
+
+const std::vector<uint8_t> g_identity_request = { 0xF0, 0x7E, 0x7F, 0x06, 0x01, 0xF7 };
+const std::vector<uint8_t> g_identity_reply = { 0xF0, 0x7E, 0x10, 0x06, 0x02, 0x41, 0x42, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0xF7 };
+
+identity_responder* g_hooked_responder = nullptr;
+
+void identity_reply_hook(uint8_t const* data, size_t length) {
+	if (g_hooked_responder) { g_hooked_responder->on_input(data, length); }
+}
+
+// The configured input, open with its pool, as midiInOpen leaves it for the responder
+struct identity_input {
+	HMIDIIN hmi;
+	input_buffer_pool* pool;
+
+	explicit identity_input(HMIDIIN hmi) : hmi(hmi) {
+		auto state = std::make_unique<midi_in_handle_state>();
+		state->app = g_app_callback;
+		state->identity = true;
+		state->pool = std::make_unique<input_buffer_pool>(hmi, g_app_callback, small_input_pool());
+		state->pool->set_message_hook(identity_reply_hook);
+		CHECK(state->pool->start() == MMSYSERR_NOERROR);
+		pool = state->pool.get();
+		g_midi_in_handles.add(hmi, std::move(state));
+	}
+
+	~identity_input() {
+		close_pool(*pool);
+		g_midi_in_handles.remove(hmi);
+	}
+};
+
+// The application's request, prepared
+struct identity_request {
+	std::vector<char> data{ g_identity_request.begin(), g_identity_request.end() };
+	MIDIHDR hdr{};
+
+	identity_request() {
+		hdr.lpData = data.data();
+		hdr.dwBufferLength = (DWORD)data.size();
+		hdr.dwFlags = MHDR_PREPARED;
+	}
+};
+
+void test_identity_responder() {
+	CHECK(identity_responder::is_request(g_identity_request.data(), g_identity_request.size()));
+	CHECK(!identity_responder::is_request(g_identity_reply.data(), g_identity_reply.size()));
+	CHECK(identity_responder::is_reply(g_identity_reply.data(), g_identity_reply.size()));
+	CHECK(!identity_responder::is_reply(g_identity_reply.data(), g_identity_reply.size() - 1));
+	CHECK(!identity_responder::is_reply(g_identity_request.data(), g_identity_request.size()));
+
+	const char* cache_file = "identity_responder_test.txt";
+	remove(cache_file);
+	g_identity_responder_config = {};
+	g_identity_responder_config.output_device = 2;
+	g_identity_responder_config.input_device = 3;
+	g_identity_responder_config.maybe_cache_file = cache_file;
+	static identity_responder responder;
+	responder.load(g_identity_responder_config);
+
+	HMIDIOUT hmo = fake_handle<HMIDIOUT>(1);
+	midi_out_handle_state out;
+	out.device_id = 2;
+	out.app = g_app_callback;
+	midi_out_handle_state other_out;
+	other_out.device_id = 1;
+	other_out.app = g_app_callback;
+	identity_request request;
+	uint64_t requests = g_identity_requests.load(), forwarded = g_identity_forwarded.load();
+	uint64_t answered = g_identity_answered.load(), captured = g_identity_captured.load();
+
+	// No reply known yet, and the input isn't open: the request goes to the device
+	CHECK(!responder.on_output(hmo, out, &request.hdr));
+	CHECK(g_identity_requests.load() == requests + 1 && g_identity_forwarded.load() == forwarded + 1);
+	auto input = std::make_unique<identity_input>(fake_handle<HMIDIIN>(3));
+	responder.input_opened();
+	CHECK(!responder.on_output(hmo, out, &request.hdr));
+	CHECK(g_identity_forwarded.load() == forwarded + 2);
+
+	// Other outputs and other SysEx are left alone
+	CHECK(!responder.on_output(hmo, other_out, &request.hdr));
+	identity_request not_request;
+	not_request.data[4] = 0x02;
+	CHECK(!responder.on_output(hmo, out, &not_request.hdr));
+	CHECK(g_identity_requests.load() == requests + 2);
+
+	// The device's reply is captured, and answers the next request right away
+	uint64_t device_replies = g_identity_device_replies.load();
+	responder.on_input(g_identity_request.data(), g_identity_request.size());
+	CHECK(g_identity_captured.load() == captured && g_identity_device_replies.load() == device_replies);
+	responder.on_input(g_identity_reply.data(), g_identity_reply.size());
+	CHECK(g_identity_captured.load() == captured + 1 && g_identity_device_replies.load() == device_replies + 1);
+	app_buffer reply(32);
+	CHECK(input->pool->add_app_buffer(&reply.hdr) == MMSYSERR_NOERROR);
+	g_app.clear();
+	CHECK(responder.on_output(hmo, out, &request.hdr));
+	CHECK(wait_for([] { return g_app.count() == 2; }));
+	auto got = g_app.take();
+	CHECK(got[0].handle == (HANDLE)hmo && got[0].msg == MOM_DONE && got[0].hdr == &request.hdr);
+	CHECK((request.hdr.dwFlags & MHDR_DONE) && !(request.hdr.dwFlags & MHDR_INQUEUE));
+	CHECK(got[1].msg == MIM_LONGDATA && got[1].hdr == &reply.hdr && got[1].data == g_identity_reply);
+	// Counted by the responder's thread once the pool has the reply, which may deliver it first
+	CHECK(wait_for([&] { return g_identity_answered.load() == answered + 1; }));
+
+	// A later reply from the device doesn't replace the captured one
+	auto other_reply = g_identity_reply;
+	other_reply[5] = 0x43;
+	responder.on_input(other_reply.data(), other_reply.size());
+	CHECK(g_identity_captured.load() == captured + 1);
+
+	// Once the input is closed, requests go to the device again
+	responder.input_closed();
+	input.reset();
+	CHECK(!responder.on_output(hmo, out, &request.hdr));
+
+	// The captured reply is saved, and a later run answers with it from the start
+	responder.save();
+	std::ifstream saved(cache_file);
+	std::string line;
+	CHECK(std::getline(saved, line) && line == "F0 7E 10 06 02 41 42 01 00 00 01 00 00 00 F7");
+	saved.close();
+	static identity_responder later;
+	later.load(g_identity_responder_config);
+	input = std::make_unique<identity_input>(fake_handle<HMIDIIN>(3));
+	later.input_opened();
+	CHECK(input->pool->add_app_buffer(&reply.hdr) == MMSYSERR_NOERROR);
+	CHECK(later.on_output(hmo, out, &request.hdr));
+	CHECK(wait_for([] { return g_app.count() == 2; }));
+	got = g_app.take();
+	CHECK(got.size() == 2 && got[1].msg == MIM_LONGDATA && got[1].data == g_identity_reply);
+	later.input_closed();
+	input.reset();
+
+	// A configured reply wins over the cache, and a cache that isn't a reply is ignored
+	identity_responder_config configured = g_identity_responder_config;
+	configured.reply = other_reply;
+	identity_responder from_config;
+	from_config.load(configured);
+	from_config.on_input(g_identity_reply.data(), g_identity_reply.size());
+	from_config.save();
+	saved.open(cache_file);
+	CHECK(std::getline(saved, line) && line == "F0 7E 10 06 02 41 42 01 00 00 01 00 00 00 F7");
+	saved.close();
+	FILE* f = fopen(cache_file, "w");
+	fprintf(f, "F0 7E 10 06 01 F7\n");
+	fclose(f);
+	identity_responder from_bad_cache;
+	from_bad_cache.load(g_identity_responder_config);
+	CHECK(!from_bad_cache.on_output(hmo, out, &request.hdr));
+
+	remove(cache_file);
+	responder.stop();
+	later.stop();
+	g_identity_responder_config = {};
+}
+
+// The device's reply comes in over several driver buffers. It is captured once reassembled,
+// and an input rule that rewrites it applies to the wrapper's answers too.
+void test_identity_responder_rewrite() {
+	g_identity_responder_config = {};
+	g_identity_responder_config.output_device = 2;
+	g_identity_responder_config.input_device = 3;
+	static identity_responder responder;
+	responder.load(g_identity_responder_config);
+	g_hooked_responder = &responder;
+	auto saved_rewriter = g_sysex_rewriter;
+	bool saved_rewrite_enabled = g_sysex_rewrite_enabled;
+	g_sysex_rewriter = sysex_rewriter();
+	auto rule = sysex_rule("F0 7E ?? 06 02 41 42", "?? ?? ?? ?? ?? 43 44");
+	rule.output = false;
+	g_sysex_rewriter.add(rule);
+	g_sysex_rewriter.build();
+	g_sysex_rewrite_enabled = true;
+	auto expected = g_identity_reply;
+	expected[5] = 0x43;
+	expected[6] = 0x44;
+
+	auto input = std::make_unique<identity_input>(fake_handle<HMIDIIN>(3));
+	responder.input_opened();
+	app_buffer from_device(32), from_wrapper(32);
+	CHECK(input->pool->add_app_buffer(&from_device.hdr) == MMSYSERR_NOERROR);
+	g_app.clear();
+	uint64_t captured = g_identity_captured.load();
+	CHECK(driver_receives(*input->pool, g_identity_reply, 8, 0));
+	CHECK(wait_for([] { return g_app.count() == 1; }));
+	auto got = g_app.take();
+	CHECK(got.size() == 1 && got[0].data == expected);
+	CHECK(g_identity_captured.load() == captured + 1);
+
+	HMIDIOUT hmo = fake_handle<HMIDIOUT>(1);
+	midi_out_handle_state out;
+	out.device_id = 2;
+	out.app = g_app_callback;
+	identity_request request;
+	CHECK(input->pool->add_app_buffer(&from_wrapper.hdr) == MMSYSERR_NOERROR);
+	CHECK(responder.on_output(hmo, out, &request.hdr));
+	CHECK(wait_for([] { return g_app.count() == 2; }));
+	got = g_app.take();
+	CHECK(got.size() == 2 && got[1].msg == MIM_LONGDATA && got[1].data == expected);
+
+	responder.input_closed();
+	input.reset();
+	responder.stop();
+	g_hooked_responder = nullptr;
+	g_sysex_rewriter = saved_rewriter;
+	g_sysex_rewrite_enabled = saved_rewrite_enabled;
+	g_identity_responder_config = {};
+}
+
+// Shared outputs
+
+app_callback app_instance(DWORD_PTR instance) {
+	return { (DWORD_PTR)fake_app_callback, instance, CALLBACK_FUNCTION };
+}
+
+HMIDIOUT native_of(HMIDIOUT hmo) {
+	auto state = g_midi_out_handles.find(hmo);
+	return state && state->shared ? state->shared->native : NULL;
+}
+
+MMRESULT close_shared(HMIDIOUT hmo) {
+	return g_shared_outputs.close(hmo, *g_midi_out_handles.find(hmo));
+}
+
+void test_shared_outputs() {
+	g_shared_outputs_config = shared_outputs_config();
+	g_shared_outputs_config.linger_ms = 20;
+	uint64_t reused = g_shared_outputs_lingering_reused.load();
+
+	// Two opens of a device share the native handle; each has its own callback
+	HMIDIOUT first = NULL, second = NULL;
+	CHECK(g_shared_outputs.open(&first, 3, app_instance(1), CALLBACK_FUNCTION) == MMSYSERR_NOERROR);
+	CHECK(g_shared_outputs.open(&second, 3, app_instance(2), CALLBACK_FUNCTION) == MMSYSERR_NOERROR);
+	CHECK(first && second && first != second);
+	CHECK(g_fake.open_count() == 1 && native_of(first) == fake_handle<HMIDIOUT>(1001) && native_of(second) == native_of(first));
+	CHECK(!g_shared_outputs.sole_user(*g_midi_out_handles.find(first)));
+	auto device = g_handle_devices.find(first);
+	CHECK(device.has_value() && device->device_id == 3 && device->output);
+	auto got = g_app.take();
+	CHECK(got.size() == 2 && got[0].msg == MOM_OPEN && got[0].handle == first && got[0].instance == 1);
+	CHECK(got[1].msg == MOM_OPEN && got[1].handle == second && got[1].instance == 2);
+
+	// A finished long message goes to the handle that sent it, once
+	MIDIHDR hdr = {};
+	g_midi_out_handles.find(second)->shared->sending(&hdr, second);
+	auto [driver_callback, driver_instance] = g_fake.out_opens[0];
+	auto callback = (DRVCALLBACK*)driver_callback;
+	callback((HDRVR)native_of(first), MOM_DONE, driver_instance, (DWORD_PTR)&hdr, 0);
+	callback((HDRVR)native_of(first), MOM_DONE, driver_instance, (DWORD_PTR)&hdr, 0);
+	got = g_app.take();
+	CHECK(got.size() == 1 && got[0].msg == MOM_DONE && got[0].handle == second && got[0].hdr == &hdr);
+
+	// Closing fails while a long message is in the driver, like the native close
+	auto second_state = g_midi_out_handles.find(second);
+	second_state->long_in_flight.push_back(&hdr);
+	CHECK(close_shared(second) == MIDIERR_STILLPLAYING);
+	hdr.dwFlags |= MHDR_DONE;
+
+	// The native handle stays open for the linger time after the last close, and an open
+	// meanwhile takes it over
+	CHECK(close_shared(first) == MMSYSERR_NOERROR);
+	CHECK(close_shared(second) == MMSYSERR_NOERROR);
+	got = g_app.take();
+	CHECK(got.size() == 2 && got[0].msg == MOM_CLOSE && got[0].handle == first && got[1].handle == second);
+	CHECK(g_fake.close_count() == 0);
+	CHECK(g_shared_outputs.open(&first, 3, app_instance(1), CALLBACK_FUNCTION) == MMSYSERR_NOERROR);
+	CHECK(g_fake.open_count() == 1 && g_shared_outputs_lingering_reused.load() == reused + 1);
+	CHECK(g_shared_outputs.sole_user(*g_midi_out_handles.find(first)));
+	CHECK(close_shared(first) == MMSYSERR_NOERROR);
+	CHECK(wait_for([] { return g_fake.close_count() == 1; }));
+	CHECK(g_fake.out_closes[0] == fake_handle<HMIDIOUT>(1001));
+	CHECK(g_shared_outputs.open(&first, 3, app_instance(1), CALLBACK_FUNCTION) == MMSYSERR_NOERROR);
+	CHECK(g_fake.open_count() == 2);
+
+	// Without linger time, the native handle is closed with the last logical one
+	g_shared_outputs_config.linger_ms = 0;
+	CHECK(close_shared(first) == MMSYSERR_NOERROR);
+	CHECK(g_fake.close_count() == 2);
+
+	// A failed open leaves nothing behind
+	g_fake.open_result = MMSYSERR_ALLOCATED;
+	CHECK(g_shared_outputs.open(&first, 4, app_instance(1), CALLBACK_FUNCTION) == MMSYSERR_ALLOCATED);
+	g_fake.open_result = MMSYSERR_NOERROR;
+	CHECK(g_shared_outputs.open(&first, 4, app_instance(1), CALLBACK_FUNCTION) == MMSYSERR_NOERROR);
+	CHECK(close_shared(first) == MMSYSERR_NOERROR);
+	g_app.clear();
+}
+
+// Two users of one device: a value is only redundant if the device already has it, whoever
+// sent it, and each user's running status is its own
+void test_shared_outputs_filter() {
+	g_shared_outputs_config = shared_outputs_config();
+	g_shared_outputs_config.linger_ms = 0;
+	HMIDIOUT a = NULL, b = NULL;
+	CHECK(g_shared_outputs.open(&a, 6, app_instance(1), CALLBACK_FUNCTION) == MMSYSERR_NOERROR);
+	CHECK(g_shared_outputs.open(&b, 6, app_instance(2), CALLBACK_FUNCTION) == MMSYSERR_NOERROR);
+	auto sent = [](HMIDIOUT hmo, DWORD msg) -> std::optional<DWORD> {
+		uint64_t flush_at = 0;
+		DWORD flush_msg = 0;
+		auto verdict = filter_output_msg(*g_midi_out_handles.find(hmo), msg, qpc_now(), 0, flush_at, flush_msg);
+		if (verdict != output_filter_state::Verdict::Send) { return std::nullopt; }
+		return msg;
+	};
+
+	CHECK(sent(a, 0x6407B0) == 0x6407B0u);		// Volume 100
+	CHECK(sent(b, 0x3207B0) == 0x3207B0u);		// 50
+	CHECK(sent(a, 0x6407B0) == 0x6407B0u);		// The device is at 50
+	CHECK(!sent(b, 0x6407B0).has_value());
+
+	// a relies on its running status while b sends on another channel
+	CHECK(sent(a, 0x403C90) == 0x403C90u);
+	CHECK(sent(b, 0x0A07B1) == 0x0A07B1u);
+	CHECK(sent(a, 0x4040) == 0x404090u);
+	CHECK(sent(b, 0x0B07) == 0x0B07B1u);
+	CHECK(sent(a, 0x4343) == 0x434390u);
+	CHECK(sent(a, 0x00F8) == 0x00F8u);
+	CHECK(sent(a, 0x4444) == 0x444490u);
+
+	CHECK(close_shared(a) == MMSYSERR_NOERROR);
+	CHECK(close_shared(b) == MMSYSERR_NOERROR);
+}
+
+// A close while the driver's thread is calling back with the handle's last MOM_DONE: the
+// state outlives the close, and MOM_CLOSE comes after the MOM_DONE
+void test_shared_outputs_close_in_callback() {
+	g_shared_outputs_config = shared_outputs_config();
+	g_shared_outputs_config.linger_ms = 0;
+	slow_application app;
+	g_slow_app = &app;
+	static HMIDIOUT hmo;
+	static MIDIHDR hdr;
+	static DRVCALLBACK* callback;
+	static DWORD_PTR instance;
+	static MMRESULT closed;
+	hmo = NULL;
+	hdr = {};
+	closed = MMSYSERR_ERROR;
+	CHECK(g_shared_outputs.open(&hmo, 7, g_slow_app_callback, CALLBACK_FUNCTION) == MMSYSERR_NOERROR);
+	ResetEvent(app.gate);
+	hdr.dwFlags = MHDR_DONE;
+	g_midi_out_handles.find(hmo)->shared->sending(&hdr, hmo);
+	callback = (DRVCALLBACK*)g_fake.out_opens.back().first;
+	instance = g_fake.out_opens.back().second;
+	HANDLE driver = CreateThread(NULL, 0, [](LPVOID) -> DWORD {
+		callback((HDRVR)native_of(hmo), MOM_DONE, instance, (DWORD_PTR)&hdr, 0);
+		return 0;
+	}, NULL, 0, NULL);
+	CHECK(wait_for([&] { return app.entered == 2; }));
+	std::weak_ptr<midi_out_handle_state> weak = g_midi_out_handles.find(hmo);
+	HANDLE closing = CreateThread(NULL, 0, [](LPVOID) -> DWORD {
+		closed = close_shared(hmo);
+		return 0;
+	}, NULL, 0, NULL);
+	CHECK(WaitForSingleObject(closing, 20) == WAIT_TIMEOUT && app.entered == 2);
+	CHECK(!g_midi_out_handles.find(hmo) && !weak.expired());
+
+	SetEvent(app.gate);
+	CHECK(WaitForSingleObject(driver, 1000) == WAIT_OBJECT_0);
+	CHECK(WaitForSingleObject(closing, 1000) == WAIT_OBJECT_0);
+	CHECK(closed == MMSYSERR_NOERROR);
+	CloseHandle(driver);
+	CloseHandle(closing);
+	CHECK(weak.expired());
+	CHECK(app.got.size() == 3 && app.got[0].first == MOM_OPEN && app.got[1].first == MOM_DONE && app.got[2].first == MOM_CLOSE);
+	CHECK(g_fake.close_count() >= 1);
+	g_slow_app = nullptr;
+}
+
+// Opens of the same device from several threads while the native open takes a while
+void test_shared_outputs_concurrent() {
+	g_shared_outputs_config = shared_outputs_config();
+	g_shared_outputs_config.linger_ms = 0;
+	g_fake.open_delay_ms = 20;
+	constexpr size_t n = 8;
+	HMIDIOUT handles[n] = {};
+	HANDLE threads[n];
+	for (size_t i = 0; i < n; i++) {
+		threads[i] = CreateThread(NULL, 0, [](LPVOID param) -> DWORD {
+			return g_shared_outputs.open((LPHMIDIOUT)param, 5, app_instance(0), CALLBACK_FUNCTION);
+		}, &handles[i], 0, NULL);
+	}
+	WaitForMultipleObjects(n, threads, TRUE, INFINITE);
+	for (HANDLE thread : threads) { CloseHandle(thread); }
+	CHECK(g_fake.open_count() == 1);
+	for (HMIDIOUT hmo : handles) { CHECK(hmo && native_of(hmo) == native_of(handles[0])); }
+	for (HMIDIOUT hmo : handles) { CHECK(close_shared(hmo) == MMSYSERR_NOERROR); }
+	CHECK(g_fake.close_count() == 1);
+	g_app.clear();
+}
+
+// Latency probe
+
+void test_latency_probe() {
+	latency_probe probe;
+	g_latency_probe_config = latency_probe_config();
+	g_latency_probe_config.interval_ms = 5;
+	HMIDIOUT out = fake_handle<HMIDIOUT>(1);
+	probe.input_opened();
+	CHECK(probe.started());
+
+	// Nothing to send on before the application opens the output
+	CHECK(wait_for([&] { return probe.stats_json()["skipped_output_closed"] >= 2; }));
+	CHECK(g_fake.short_count() == 0);
+
+	// The probes change the device's running status behind the output filter's back
+	bool filter_enabled = g_output_filter_enabled;
+	g_output_filter_enabled = true;
+	auto state = std::make_shared<midi_out_handle_state>();
+	state->filter.device_running_status = 0x90;
+	g_midi_out_handles.add(out, state);
+	probe.output_opened(out);
+	CHECK(wait_for([] { return g_fake.short_count() >= 4; }));
+	probe.output_closed(out);
+	CHECK(state->filter.device_running_status == 0);
+	g_midi_out_handles.take(out);
+	g_output_filter_enabled = filter_enabled;
+	AcquireSRWLockShared(&g_fake.lock);
+	auto sent = g_fake.short_msgs;
+	ReleaseSRWLockShared(&g_fake.lock);
+	for (size_t i = 0; i < sent.size(); i++) {
+		CHECK(sent[i].first == out && sent[i].second == (0x77BF | (DWORD)i << 16));
+	}
+
+	// A loopback with a delay of 10 ms
+	Sleep(10);
+	for (auto& [hmo, msg] : sent) { CHECK(probe.on_input(msg)); }
+	auto stats = probe.stats_json();
+	CHECK(stats["sent"] == sent.size() && stats["received"] == sent.size() && stats["lost"] == 0);
+	CHECK(stats["min_us"] >= 10000.0 && stats["max_us"] >= stats["mean_us"] && stats["mean_us"] >= stats["min_us"]);
+	uint64_t in_histogram = 0;
+	for (auto& bucket : stats["round_trip_histogram_ns_log2"]) { in_histogram += bucket.get<uint64_t>(); }
+	CHECK(in_histogram == sent.size());
+
+	// A probe that comes back twice is still taken out of the input
+	CHECK(probe.on_input(sent[0].second));
+	CHECK(probe.stats_json()["unexpected"] == 1);
+
+	// The application's messages pass, even on the probe's channel or controller
+	CHECK(!probe.on_input(0x4077BE));
+	CHECK(!probe.on_input(0x4076BF));
+	CHECK(!probe.on_input(0x40779F));
+	CHECK(probe.stats_json()["received"] == sent.size());
+
+	probe.input_closed();
+	probe.stop();
+}
+
+// Stream engine
+
+// A buffer of MIDIEVENTs, as midiStreamOut takes it
+struct stream_buffer {
+	std::vector<DWORD> words;
+	MIDIHDR hdr{};
+
+	void event(DWORD delta, DWORD event) {
+		words.insert(words.end(), { delta, 0, event });
+	}
+
+	void long_event(DWORD delta, std::vector<uint8_t> const& data) {
+		event(delta, MEVT_F_LONG | ((DWORD)MEVT_LONGMSG << 24) | (DWORD)data.size());
+		size_t at = words.size();
+		words.resize(at + (data.size() + 3) / 4);
+		memcpy(&words[at], data.data(), data.size());
+	}
+
+	LPMIDIHDR prepared() {
+		hdr = {};
+		hdr.lpData = (LPSTR)words.data();
+		hdr.dwBufferLength = hdr.dwBytesRecorded = (DWORD)(words.size() * sizeof(DWORD));
+		hdr.dwFlags = MHDR_PREPARED;
+		return &hdr;
+	}
+};
+
+DWORD stream_position(midi_stream& stream, UINT type) {
+	MMTIME mmt = {};
+	mmt.wType = type;
+	stream.position(&mmt, sizeof(mmt));
+	return type == TIME_MS ? mmt.u.ms : mmt.u.ticks;
+}
+
+void test_stream_engine_playback() {
+	midi_stream stream(g_app_callback);
+	HMIDIOUT out = fake_handle<HMIDIOUT>(1);
+	g_fake.long_msg_done = true;
+	stream.start(out);
+
+	// 96 ticks per quarter note and 9.6 ms per quarter note: 100 us per tick
+	MIDIPROPTIMEDIV timediv = { sizeof(timediv) };
+	CHECK(stream.property((LPBYTE)&timediv, MIDIPROP_GET | MIDIPROP_TIMEDIV) == MMSYSERR_NOERROR && timediv.dwTimeDiv == 96);
+	MIDIPROPTEMPO tempo = { sizeof(tempo), 9600 };
+	CHECK(stream.property((LPBYTE)&tempo, MIDIPROP_SET | MIDIPROP_TEMPO) == MMSYSERR_NOERROR);
+	CHECK(stream.property((LPBYTE)&tempo, MIDIPROP_GET | MIDIPROP_SET | MIDIPROP_TEMPO) == MMSYSERR_INVALPARAM);
+	MIDIPROPTEMPO no_tempo = { sizeof(no_tempo), 0 };
+	CHECK(stream.property((LPBYTE)&no_tempo, MIDIPROP_SET | MIDIPROP_TEMPO) == MMSYSERR_INVALPARAM);
+
+	stream_buffer song;
+	song.event(0, 0x403C90);								// Tick 0
+	song.event(50, ((DWORD)MEVT_TEMPO << 24) | 19200);		// Tick 50, at 5 ms; then 200 us per tick
+	song.event(0, 0x403E90);								// 5 ms
+	song.event(10, MEVT_F_CALLBACK | 0x003C80);				// Tick 60, 7 ms
+	song.long_event(0, { 0xF0, 0x7E, 0x7F, 0x09, 0x01, 0xF7 });
+	song.event(20, 0x003E80);								// Tick 80, 11 ms
+	LPMIDIHDR hdr = song.prepared();
+	CHECK(stream.out(hdr, sizeof(*hdr)) == MMSYSERR_NOERROR);
+	CHECK(stream.out(hdr, sizeof(*hdr)) == MIDIERR_STILLPLAYING);
+	CHECK((hdr->dwFlags & MHDR_ISSTRM) && (hdr->dwFlags & MHDR_INQUEUE));
+
+	// Streams start paused
+	Sleep(10);
+	CHECK(g_fake.short_count() == 0);
+	uint64_t start = qpc_now();
+	stream.restart();
+	CHECK(wait_for([] { return g_app.count() == 2; }));
+	auto got = g_app.take();
+	CHECK(got[0].msg == MOM_POSITIONCB && got[0].hdr == hdr && got[0].offset == 3 * 3 * sizeof(DWORD));
+	CHECK(got[1].msg == MOM_DONE && got[1].hdr == hdr);
+	CHECK((hdr->dwFlags & MHDR_DONE) && !(hdr->dwFlags & MHDR_INQUEUE));
+
+	AcquireSRWLockShared(&g_fake.lock);
+	auto sent = g_fake.short_msgs;
+	auto times = g_fake.short_msg_times;
+	auto long_msgs = g_fake.long_msgs;
+	ReleaseSRWLockShared(&g_fake.lock);
+	std::vector<std::pair<HMIDIOUT, DWORD>> expected = { { out, 0x403C90 }, { out, 0x403E90 }, { out, 0x003C80 }, { out, 0x003E80 } };
+	CHECK(sent == expected);
+	const double expected_ms[] = { 0, 5, 7, 11 };
+	for (size_t i = 0; i < times.size() && i < 4; i++) {
+		double ms = ticks_to_ns(times[i] - start) / 1e6;
+		CHECK(ms >= expected_ms[i] - 0.01 && ms < expected_ms[i] + 3);
+	}
+	CHECK(long_msgs.size() == 1 && long_msgs[0].first == out);
+	if (long_msgs.size() == 1) {
+		LPMIDIHDR sysex = long_msgs[0].second;
+		CHECK(std::vector<uint8_t>(sysex->lpData, sysex->lpData + sysex->dwBytesRecorded) == std::vector<uint8_t>({ 0xF0, 0x7E, 0x7F, 0x09, 0x01, 0xF7 }));
+		CHECK(!(sysex->dwFlags & MHDR_PREPARED));
+	}
+
+	// The position keeps running while playing, and stands still while paused
+	CHECK(stream_position(stream, TIME_TICKS) >= 80 && stream_position(stream, TIME_MS) >= 11);
+	CHECK(stream.property((LPBYTE)&timediv, MIDIPROP_SET | MIDIPROP_TIMEDIV) == MIDIERR_STILLPLAYING);
+	stream.pause();
+	DWORD paused_at = stream_position(stream, TIME_MS);
+	Sleep(5);
+	CHECK(stream_position(stream, TIME_MS) == paused_at);
+	stream.restart();
+	Sleep(5);
+	CHECK(stream_position(stream, TIME_MS) > paused_at);
+
+	// Stop returns the queued buffers, silences the notes still sounding and rewinds
+	stream_buffer held;
+	held.event(0, 0x404090);
+	held.event(10000, 0x004080);							// 2 s later
+	hdr = held.prepared();
+	CHECK(stream.out(hdr, sizeof(*hdr)) == MMSYSERR_NOERROR);
+	CHECK(wait_for([] { return g_fake.short_count() == 5; }));
+	stream.stop();
+	got = g_app.take();
+	CHECK(got.size() == 1 && got[0].msg == MOM_DONE && got[0].hdr == hdr);
+	AcquireSRWLockShared(&g_fake.lock);
+	CHECK(g_fake.short_msgs.size() == 6 && g_fake.short_msgs.back().second == 0x004080);
+	ReleaseSRWLockShared(&g_fake.lock);
+	CHECK(stream_position(stream, TIME_TICKS) == 0);
+	CHECK(stream.close());
+}
+
+// A stream closed from its own callback, as midiStreamClose does it: the engine thread
+// deletes the stream once the callback has returned
+midi_stream* g_closing_stream = nullptr;
+std::atomic<bool> g_closing_stream_joined{ true };
+std::atomic<bool> g_closing_stream_deleted{ false };
+
+void CALLBACK closing_stream_callback(HDRVR hdrvr, UINT msg, DWORD_PTR instance, DWORD_PTR param1, DWORD_PTR param2) {
+	if (msg != MOM_DONE) { return; }
+	g_closing_stream_joined = g_closing_stream->close();
+	g_closing_stream->delete_on_exit([](void* p) {
+		delete (midi_stream*)p;
+		g_closing_stream_deleted = true;
+	}, g_closing_stream);
+}
+
+void test_stream_engine_close_in_callback() {
+	g_closing_stream_deleted = false;
+	g_closing_stream = new midi_stream({ (DWORD_PTR)closing_stream_callback, 0, CALLBACK_FUNCTION });
+	g_closing_stream->start(fake_handle<HMIDIOUT>(1));
+	stream_buffer song;
+	song.event(0, 0x403C90);
+	LPMIDIHDR hdr = song.prepared();
+	CHECK(g_closing_stream->out(hdr, sizeof(*hdr)) == MMSYSERR_NOERROR);
+	g_closing_stream->restart();
+	CHECK(wait_for([] { return g_closing_stream_deleted.load(); }));
+	CHECK(!g_closing_stream_joined);
+	CHECK(g_fake.short_count() == 1);
+	g_closing_stream = nullptr;
+}
+
+// Wave output
+
+// Defined with the driver callback in the DLL; the same here
+void complete_wave_out_buffer(wave_out_handle_state& state, HWAVEOUT hwo, LPWAVEHDR hdr) {
+	if (g_wave_stats_enabled) { state.on_done(); }
+	state.app.invoke(hwo, WOM_DONE, (DWORD_PTR)hdr, 0);
+}
+
+// The DLL's driver callback for instrumented or re-chunked outputs
+void CALLBACK wave_out_trampoline(HWAVEOUT hwo, UINT wMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2) {
+	auto state = (wave_out_handle_state*)dwInstance;
+	if (wMsg == WOM_DONE) {
+		if (state->rechunk && state->rechunk->owns((LPWAVEHDR)dwParam1)) {
+			state->rechunk->on_native_done((LPWAVEHDR)dwParam1);
+			return;
+		}
+		complete_wave_out_buffer(*state, hwo, (LPWAVEHDR)dwParam1);
+		return;
+	}
+	state->app.invoke(hwo, wMsg, dwParam1, dwParam2);
+}
+
+// 48 kHz 16-bit stereo: 192 bytes per ms
+const WAVEFORMATEX g_wave_format = { WAVE_FORMAT_PCM, 2, 48000, 192000, 4, 16, 0 };
+constexpr DWORD g_wave_bytes_per_ms = 192;
+
+// An output opened on the fake device the way the DLL opens it while instrumentation or
+// re-chunking is enabled. write, reset and close do what the DLL's overrides do.
+struct wave_output {
+	HWAVEOUT hwo = fake_handle<HWAVEOUT>(1);
+	wave_out_handle_state state;
+
+	wave_output() {
+		state.app = g_app_callback;
+		g_wave_device.open(hwo, wave_out_trampoline, (DWORD_PTR)&state, g_wave_bytes_per_ms);
+		if (g_wave_stats_enabled) {
+			state.slot = g_wave_stats.claim_slot(hwo);
+			g_wave_stats.block().opens.fetch_add(1, std::memory_order_relaxed);
+		}
+		if (g_wave_rechunk_enabled) {
+			state.rechunk = std::make_unique<wave_rechunker>(hwo, state, g_wave_format, g_wave_rechunk_config);
+			state.rechunk->start();
+		}
+	}
+
+	MMRESULT write(LPWAVEHDR hdr) {
+		if (g_wave_stats_enabled) { state.on_write(hdr); }
+		MMRESULT rval = state.rechunk ? state.rechunk->write(hdr) : MMwaveOutWrite(hwo, hdr, sizeof(*hdr));
+		if (g_wave_stats_enabled && rval != MMSYSERR_NOERROR) { state.undo_write(); }
+		return rval;
+	}
+
+	MMRESULT reset() {
+		state.resetting = true;
+		MMRESULT rval = state.rechunk ? state.rechunk->reset() : MMwaveOutReset(hwo);
+		state.on_reset();
+		state.resetting = false;
+		return rval;
+	}
+
+	void close() {
+		if (state.rechunk) { state.rechunk->stop(); }
+		g_wave_device.close();
+		g_wave_stats.release_slot(state.slot);
+	}
+};
+
+// An application's prepared buffers, filled with a byte pattern that runs on across them
+struct wave_buffers {
+	std::vector<std::vector<char>> data;
+	std::vector<WAVEHDR> hdrs;
+
+	wave_buffers(size_t count, DWORD bytes) : data(count), hdrs(count) {
+		for (size_t i = 0; i < count; i++) {
+			data[i].resize(bytes);
+			for (DWORD j = 0; j < bytes; j++) { data[i][j] = (char)((i * bytes + j) % 251); }
+			hdrs[i] = {};
+			hdrs[i].lpData = data[i].data();
+			hdrs[i].dwBufferLength = bytes;
+			hdrs[i].dwFlags = WHDR_PREPARED;
+		}
+	}
+
+	std::vector<char> joined() const {
+		std::vector<char> rval;
+		for (auto const& d : data) { rval.insert(rval.end(), d.begin(), d.end()); }
+		return rval;
+	}
+};
+
+// Buffers completed so far, in order
+std::vector<LPWAVEHDR> wave_done() {
+	std::vector<LPWAVEHDR> rval;
+	for (auto const& m : g_app.take()) {
+		if (m.msg == WOM_DONE) { rval.push_back((LPWAVEHDR)m.hdr); }
+	}
+	return rval;
+}
+
+uint64_t histogram_from(std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> const& histogram, uint64_t ns) {
+	uint64_t rval = 0;
+	for (size_t i = histogram_bucket(ns); i < histogram.size(); i++) { rval += histogram[i].load(); }
+	return rval;
+}
+
+void test_wave_stats_counters() {
+	auto& b = g_wave_stats.block();
+	uint64_t writes = b.writes, bytes = b.bytes_written, done = b.buffers_done, underruns = b.underruns;
+	uint64_t depth[3] = { b.queue_depth_histogram[0], b.queue_depth_histogram[1], b.queue_depth_histogram[2] };
+	uint64_t gaps = histogram_from(b.refill_gap_histogram, 0), long_gaps = histogram_from(b.refill_gap_histogram, 2000000);
+	uint64_t dry = histogram_from(b.underrun_histogram, 4000000);
+	HWAVEOUT hwo = fake_handle<HWAVEOUT>(1);
+	wave_out_handle_state state;
+	state.slot = g_wave_stats.claim_slot(hwo);
+	CHECK(state.slot && state.slot->handle == (uint64_t)hwo);
+	wave_buffers app(3, 1000);
+
+	// Three buffers queued, at depths 0, 1 and 2
+	for (auto& hdr : app.hdrs) { state.on_write(&hdr); }
+	CHECK(state.slot->queued == 3 && state.slot->max_queued == 3 && state.slot->writes == 3);
+	CHECK(b.queue_depth_histogram[0] == depth[0] + 1 && b.queue_depth_histogram[1] == depth[1] + 1 && b.queue_depth_histogram[2] == depth[2] + 1);
+	CHECK(b.writes == writes + 3 && b.bytes_written == bytes + 3000);
+
+	// Two done and a late refill: a gap, but the queue never ran dry
+	state.on_done();
+	state.on_done();
+	CHECK(state.slot->queued == 1 && b.buffers_done == done + 2);
+	Sleep(3);
+	state.on_write(&app.hdrs[0]);
+	CHECK(histogram_from(b.refill_gap_histogram, 0) == gaps + 1 && histogram_from(b.refill_gap_histogram, 2000000) == long_gaps + 1);
+	CHECK(b.underruns == underruns);
+
+	// The queue runs dry: an underrun once the next write comes, with the time it was dry
+	state.on_done();
+	state.on_done();
+	CHECK(state.slot->queued == 0 && b.underruns == underruns);
+	Sleep(5);
+	state.on_write(&app.hdrs[1]);
+	CHECK(b.underruns == underruns + 1 && state.slot->underruns == 1);
+	CHECK(histogram_from(b.underrun_histogram, 4000000) == dry + 1);
+
+	// Buffers returned by a reset are not
+	state.resetting = true;
+	state.on_done();
+	state.resetting = false;
+	state.on_reset();
+	state.on_write(&app.hdrs[2]);
+	CHECK(b.underruns == underruns + 1);
+
+	// A failed native write is taken back
+	state.on_write(&app.hdrs[0]);
+	state.undo_write();
+	CHECK(state.slot->queued == 1 && state.queued == 1);
+
+	// A completion with nothing counted as queued doesn't wrap
+	state.on_reset();
+	state.on_done();
+	CHECK(state.queued == 0 && state.slot->queued == 0);
+
+	// Once all slots are taken, handles are only counted in the totals
+	std::vector<wave_stats_block::handle_slot*> slots;
+	while (auto slot = g_wave_stats.claim_slot(fake_handle<HWAVEOUT>(100 + slots.size()))) { slots.push_back(slot); }
+	CHECK(slots.size() == g_wave_stats_handle_slots - 1);
+	g_wave_stats.release_slot(state.slot);
+	CHECK(state.slot->handle == 0);
+	for (auto slot : slots) { g_wave_stats.release_slot(slot); }
+	CHECK(g_wave_stats.stats_json()["writes"] == b.writes.load());
+}
+
+void test_wave_stats_playback() {
+	g_wave_stats_enabled = true;
+	auto& b = g_wave_stats.block();
+	uint64_t writes = b.writes, underruns = b.underruns, depth0 = b.queue_depth_histogram[0], dry = histogram_from(b.underrun_histogram, 4000000);
+	wave_output out;
+	CHECK(out.state.slot != NULL);
+	wave_buffers app(3, 10 * g_wave_bytes_per_ms);
+
+	// Three 10 ms buffers, each written again as soon as it is done: no underrun
+	for (auto& hdr : app.hdrs) { CHECK(out.write(&hdr) == MMSYSERR_NOERROR); }
+	size_t written = 3, returned = 0;
+	while (returned < written && wait_for([] { return g_app.count() > 0; })) {
+		for (LPWAVEHDR hdr : wave_done()) {
+			returned++;
+			if (written < 30) {
+				CHECK(out.write(hdr) == MMSYSERR_NOERROR);
+				written++;
+			}
+		}
+	}
+	CHECK(returned == 30);
+	CHECK(b.writes == writes + 30 && b.underruns == underruns && g_wave_device.underruns == 0);
+	CHECK(out.state.slot->writes == 30 && out.state.slot->max_queued == 3 && out.state.slot->queued == 0);
+	CHECK(b.queue_depth_histogram[0] == depth0 + 1);
+
+	// One buffer, written again 5 ms after it is done: the wrapper sees the same underruns as
+	// the device, the first one from the end of the loop above
+	for (int round = 0; round < 5; round++) {
+		Sleep(5);
+		CHECK(out.write(&app.hdrs[0]) == MMSYSERR_NOERROR);
+		CHECK(wait_for([] { return g_app.count() == 1; }));
+		g_app.clear();
+	}
+	CHECK(g_wave_device.underruns == 5 && b.underruns == underruns + 5 && out.state.slot->underruns == 5);
+	CHECK(histogram_from(b.underrun_histogram, 4000000) == dry + 5);
+
+	// A reset returns what is queued, and the next write isn't an underrun
+	for (auto& hdr : app.hdrs) { CHECK(out.write(&hdr) == MMSYSERR_NOERROR); }
+	CHECK(g_wave_device.underruns == 6 && b.underruns == underruns + 6);
+	CHECK(out.reset() == MMSYSERR_NOERROR);
+	CHECK(wave_done().size() == 3 && out.state.slot->queued == 0);
+	CHECK(out.write(&app.hdrs[0]) == MMSYSERR_NOERROR);
+	CHECK(wait_for([] { return g_app.count() == 1; }));
+	CHECK(g_wave_device.underruns == 6 && b.underruns == underruns + 6);
+
+	// A write the driver refuses isn't counted as queued
+	WAVEHDR unprepared = app.hdrs[1];
+	unprepared.dwFlags = 0;
+	CHECK(out.write(&unprepared) == WAVERR_UNPREPARED);
+	CHECK(out.state.slot->queued == 0 && out.state.queued == 0);
+	out.close();
+	g_wave_stats_enabled = false;
+}
+
+// 10 ms slices, 4 in the driver at most: 40 ms of latency whatever the application's buffers
+void set_rechunk_config() {
+	g_wave_rechunk_enabled = true;
+	g_wave_rechunk_config = wave_rechunk_config();
+}
+
+const DWORD g_chunk_bytes = 10 * g_wave_bytes_per_ms;
+
+// How much the device had played when each buffer came back
+std::vector<size_t> g_played_at_done;
+
+void CALLBACK played_at_done_callback(HDRVR hdrvr, UINT msg, DWORD_PTR instance, DWORD_PTR param1, DWORD_PTR param2) {
+	AcquireSRWLockShared(&g_wave_device.lock);
+	g_played_at_done.push_back(g_wave_device.played.size());
+	ReleaseSRWLockShared(&g_wave_device.lock);
+	fake_app_callback(hdrvr, msg, instance, param1, param2);
+}
+
+void test_wave_rechunk_large_buffers() {
+	set_rechunk_config();
+	uint64_t copied = g_wave_rechunk_copied_slices;
+	wave_output out;
+	g_played_at_done.clear();
+	out.state.app = { (DWORD_PTR)played_at_done_callback, 0, CALLBACK_FUNCTION };
+	CHECK(out.state.rechunk->chunk_bytes() == g_chunk_bytes);
+
+	// Loops are refused, and the header is left as it was
+	wave_buffers loop(1, 10 * g_wave_bytes_per_ms);
+	loop.hdrs[0].dwFlags |= WHDR_BEGINLOOP | WHDR_ENDLOOP;
+	loop.hdrs[0].dwLoops = 2;
+	CHECK(out.write(&loop.hdrs[0]) == MMSYSERR_NOTSUPPORTED);
+	CHECK(loop.hdrs[0].dwFlags == (WHDR_PREPARED | WHDR_BEGINLOOP | WHDR_ENDLOOP));
+
+	wave_buffers app(2, 200 * g_wave_bytes_per_ms);
+	for (auto& hdr : app.hdrs) { CHECK(out.write(&hdr) == MMSYSERR_NOERROR); }
+	CHECK(app.hdrs[0].dwFlags & WHDR_INQUEUE);
+
+	// Returned in order, each once all its slices are played
+	CHECK(wait_for([] { return g_app.count() == 2; }));
+	auto done = wave_done();
+	CHECK(done.size() == 2 && done[0] == &app.hdrs[0] && done[1] == &app.hdrs[1]);
+	std::vector<size_t> expected_played = { app.data[0].size(), 2 * app.data[0].size() };
+	CHECK(g_played_at_done == expected_played);
+	CHECK((app.hdrs[0].dwFlags & (WHDR_DONE | WHDR_INQUEUE)) == WHDR_DONE);
+	out.close();
+
+	// Played as written, in full-size slices pointing into the application's buffers, with
+	// never more than the pool queued and no underrun
+	CHECK(g_wave_device.played == app.joined());
+	CHECK(g_wave_device.writes == 40 && g_wave_rechunk_copied_slices == copied);
+	CHECK(g_wave_device.max_queued_bytes <= 4 * g_chunk_bytes);
+	CHECK(g_wave_device.underruns == 0 && g_wave_device.prepared == 0);
+	g_wave_rechunk_enabled = false;
+}
+
+void test_wave_rechunk_small_buffers() {
+	set_rechunk_config();
+	uint64_t copied = g_wave_rechunk_copied_slices, copied_bytes = g_wave_rechunk_copied_bytes;
+	wave_output out;
+	g_played_at_done.clear();
+	out.state.app = { (DWORD_PTR)played_at_done_callback, 0, CALLBACK_FUNCTION };
+	// 40 ms that fill the pool, so all the rest is written while the pool is busy: 40 buffers
+	// of 1 ms, then 2500 and 1340 bytes, whose tail is combined with the next buffer
+	std::vector<DWORD> sizes = { 4 * g_chunk_bytes };
+	sizes.insert(sizes.end(), 40, g_wave_bytes_per_ms);
+	sizes.push_back(2500);
+	sizes.push_back(1340);
+	wave_buffers app(sizes.size(), 0);
+	size_t offset = 0;
+	for (size_t i = 0; i < sizes.size(); i++) {
+		app.data[i].resize(sizes[i]);
+		for (DWORD j = 0; j < sizes[i]; j++) { app.data[i][j] = (char)((offset + j) % 251); }
+		offset += sizes[i];
+		app.hdrs[i].lpData = app.data[i].data();
+		app.hdrs[i].dwBufferLength = sizes[i];
+	}
+	for (auto& hdr : app.hdrs) { CHECK(out.write(&hdr) == MMSYSERR_NOERROR); }
+
+	size_t returned = 0;
+	bool in_order = true;
+	while (returned < sizes.size() && wait_for([] { return g_app.count() > 0; })) {
+		for (LPWAVEHDR hdr : wave_done()) { in_order &= hdr == &app.hdrs[returned++]; }
+	}
+	CHECK(returned == sizes.size() && in_order);
+	bool played_first = g_played_at_done.size() == sizes.size();
+	for (size_t i = 0, end = 0; i < g_played_at_done.size(); i++) {
+		end += sizes[i];
+		played_first &= g_played_at_done[i] >= end;
+	}
+	CHECK(played_first);
+	out.close();
+	CHECK(g_wave_device.played == app.joined());
+	// 4 full slices, 4 of 10 small buffers copied together, then 1920 bytes of the 2500 in
+	// place and the 580 left copied with the 1340
+	CHECK(g_wave_device.writes == 10);
+	CHECK(g_wave_rechunk_copied_slices == copied + 5 && g_wave_rechunk_copied_bytes == copied_bytes + 5 * g_chunk_bytes);
+	CHECK(g_wave_device.underruns == 0 && g_wave_device.prepared == 0);
+	g_wave_rechunk_enabled = false;
+}
+
+void test_wave_rechunk_reset() {
+	set_rechunk_config();
+	wave_output out;
+	wave_buffers app(2, 200 * g_wave_bytes_per_ms);
+	for (auto& hdr : app.hdrs) { CHECK(out.write(&hdr) == MMSYSERR_NOERROR); }
+	CHECK(out.write(&app.hdrs[0]) == WAVERR_STILLPLAYING);
+	WAVEHDR unprepared = {};
+	CHECK(out.write(&unprepared) == WAVERR_UNPREPARED);
+	Sleep(30);
+
+	// The slices come back from the driver, then every buffer, played or not
+	CHECK(out.reset() == MMSYSERR_NOERROR);
+	auto done = wave_done();
+	CHECK(done.size() == 2 && done[0] == &app.hdrs[0] && done[1] == &app.hdrs[1]);
+	CHECK((app.hdrs[1].dwFlags & (WHDR_DONE | WHDR_INQUEUE)) == WHDR_DONE);
+	CHECK(g_wave_device.queued() == 0 && !out.state.rechunk->has_app_buffers());
+
+	// And playback goes on from the next write
+	size_t played = g_wave_device.played.size();
+	CHECK(out.write(&app.hdrs[0]) == MMSYSERR_NOERROR);
+	CHECK(wait_for([] { return g_app.count() == 1; }));
+	out.close();
+	CHECK(g_wave_device.played.size() == played + app.hdrs[0].dwBufferLength);
+	CHECK(std::equal(app.data[0].begin(), app.data[0].end(), g_wave_device.played.begin() + played));
+	CHECK(g_wave_device.prepared == 0);
+	g_wave_rechunk_enabled = false;
+}
+
+// Rule table
+
+MIDIOUTCAPSW out_caps(const wchar_t* name, WORD man_id, WORD prod_id) {
+	MIDIOUTCAPSW caps = {};
+	wcsncpy(caps.szPname, name, MAXPNAMELEN - 1);
+	caps.wMid = man_id;
+	caps.wPid = prod_id;
+	caps.vDriverVersion = 0x100;
+	caps.wTechnology = MOD_MIDIPORT;
+	caps.wChannelMask = 0xFFFF;
+	return caps;
+}
+
+MIDIINCAPSW in_caps(const wchar_t* name, WORD man_id, WORD prod_id) {
+	MIDIINCAPSW caps = {};
+	wcsncpy(caps.szPname, name, MAXPNAMELEN - 1);
+	caps.wMid = man_id;
+	caps.wPid = prod_id;
+	caps.vDriverVersion = 0x100;
+	return caps;
+}
+
+void test_rule_table_match() {
+	rule_table rules;
+	replace_rule by_id;						// 0
+	by_id.maybe_match_man_id = 1;
+	by_id.maybe_match_prod_id = 2;
+	by_id.maybe_replace_voices = 32;
+	rules.add(by_id);
+	replace_rule by_name;					// 1
+	by_name.maybe_match_direction = Direction::Output;
+	by_name.maybe_match_name = L"Synth [0-9]+";
+	by_name.maybe_replace_name = L"Synth";
+	by_name.maybe_replace_man_id = 7;
+	by_name.maybe_replace_interface_name = L"\\\\?\\synth";
+	rules.add(by_name);
+	replace_rule by_new_id;					// 2: sees what rule 1 replaced
+	by_new_id.maybe_match_man_id = 7;
+	by_new_id.maybe_match_driver_version = 0x100;
+	by_new_id.maybe_replace_support = MIDICAPS_VOLUME;
+	rules.add(by_new_id);
+	CHECK(rules.size() == 3);
+	CHECK(rules.fields(1) == (MatchDirection | MatchName | ReplaceName | ReplaceManId | ReplaceInterfaceName));
+
+	auto synth = to_our_dev_caps(out_caps(L"Synth 12", 1, 2));
+	CHECK(rules.is_match(0, synth) && rules.is_match(1, synth) && !rules.is_match(2, synth));
+	CHECK(!rules.is_match(1, to_our_dev_caps(out_caps(L"Synth 12 B", 1, 2))));			// The whole name
+	CHECK(!rules.is_match(1, to_our_dev_caps(in_caps(L"Synth 12", 1, 2))));
+	CHECK(!rules.is_match(0, to_our_dev_caps(out_caps(L"Synth 12", 1, 3))));
+	CHECK(rules.first_match(synth) == std::optional<size_t>(0));
+	CHECK(rules.first_match(to_our_dev_caps(out_caps(L"Synth 1", 5, 5))) == std::optional<size_t>(1));
+	CHECK(rules.first_match(to_our_dev_caps(out_caps(L"Piano", 7, 5))) == std::optional<size_t>(2));
+	CHECK(!rules.first_match(to_our_dev_caps(in_caps(L"Synth 1", 5, 5))).has_value());
+	CHECK(rules.interface_name(1) == std::optional<std::wstring>(L"\\\\?\\synth"));
+	CHECK(!rules.interface_name(0).has_value());
+
+	// In config order, each rule on the caps as the rules before it left them
+	auto caps = out_caps(L"Synth 12", 1, 2);
+	int matches = 0;
+	rules.apply_in_place_c(caps, [&] { matches++; });
+	CHECK(matches == 3);
+	CHECK(std::wstring(caps.szPname) == L"Synth" && caps.wMid == 7 && caps.wPid == 2);
+	CHECK(caps.wVoices == 32 && caps.dwSupport == MIDICAPS_VOLUME && caps.wChannelMask == 0xFFFF);
+
+	// Input caps have no output fields to replace; the rest still applies
+	auto input = in_caps(L"Synth 12", 7, 2);
+	matches = 0;
+	rules.apply_in_place_c(input, [&] { matches++; });
+	CHECK(matches == 1 && std::wstring(input.szPname) == L"Synth 12");
+}
+
+void test_rule_table_fields() {
+	rule_table rules;
+	// Values wider than the caps member are refused, not truncated
+	replace_rule wide;
+	wide.maybe_match_man_id = 0x10000;
+	wide.maybe_replace_name = L"Never";
+	CHECK(throws([&] { rules.add(wide); }));
+	wide.maybe_match_man_id.reset();
+	wide.maybe_replace_support = 0xFFFFFFFFull + 1;
+	CHECK(throws([&] { rules.add(wide); }));
+	CHECK(rules.size() == 0);
+	wide.maybe_replace_support = 0xFFFFFFFF;
+	wide.maybe_match_driver_version = 0xFFFFFFFF;
+	rules.add(wide);
+	auto caps = out_caps(L"Any", 1, 1);
+	caps.vDriverVersion = 0xFFFFFFFF;
+	rules.apply_in_place_c(caps, [] {});
+	CHECK(caps.dwSupport == 0xFFFFFFFF && std::wstring(caps.szPname) == L"Never");
+
+	// A pattern shared by rules is compiled once
+	replace_rule a, b;
+	a.maybe_match_name = b.maybe_match_name = L"Shared.*";
+	a.maybe_replace_man_id = 1;
+	b.maybe_replace_prod_id = 2;
+	rules.add(a);
+	rules.add(b);
+	CHECK(rules.name_patterns() == 1);
+
+	// Replacement names are cut to szPname
+	rule_table longer;
+	replace_rule rename;
+	rename.maybe_replace_name = std::wstring(100, L'x');
+	longer.add(rename);
+	caps = out_caps(L"Any", 1, 1);
+	longer.apply_in_place_c(caps, [] {});
+	CHECK(std::wstring(caps.szPname) == std::wstring(MAXPNAMELEN - 1, L'x'));
+	MIDIOUTCAPSA caps_a = {};
+	longer.apply_in_place_c(caps_a, [] {});
+	CHECK(std::string(caps_a.szPname) == std::string(MAXPNAMELEN - 1, 'x'));
+}
+
+// Against a plain evaluation of every rule, on random rules and devices over a few values
+void test_rule_table_random() {
+	uint32_t seed = 12345;
+	auto next = [&](uint32_t n) {
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 16) % n;
+	};
+	const wchar_t* names[] = { L"A", L"B", L"C" };
+	for (int round = 0; round < 200; round++) {
+		rule_table rules;
+		std::vector<replace_rule> plain;
+		size_t n = 1 + next(40);
+		for (size_t k = 0; k < n; k++) {
+			replace_rule r;
+			if (next(3) == 0) { r.maybe_match_direction = next(2) ? Direction::Input : Direction::Output; }
+			if (next(3) == 0) { r.maybe_match_name = names[next(3)]; }
+			if (next(2) == 0) { r.maybe_match_man_id = next(3); }
+			if (next(3) == 0) { r.maybe_match_prod_id = next(3); }
+			if (next(4) == 0) { r.maybe_match_driver_version = next(2); }
+			if (next(3) == 0) { r.maybe_replace_name = names[next(3)]; }
+			if (next(3) == 0) { r.maybe_replace_man_id = next(3); }
+			if (next(3) == 0) { r.maybe_replace_prod_id = next(3); }
+			if (next(4) == 0) { r.maybe_replace_driver_version = next(2); }
+			if (next(2) == 0) { r.maybe_replace_voices = k; }
+			rules.add(r);
+			plain.push_back(r);
+		}
+		for (int device = 0; device < 10; device++) {
+			auto caps = out_caps(names[next(3)], (WORD)next(3), (WORD)next(3));
+			caps.vDriverVersion = next(2);
+			auto expected = to_our_dev_caps(caps);
+			if (next(2)) {
+				expected.direction = Direction::Input;
+				expected.technology = expected.voices = expected.notes = expected.channel_mask = expected.support = std::nullopt;
+			}
+			bool input = expected.direction == Direction::Input;
+			for (auto& r : plain) {
+				bool match = (!r.maybe_match_direction || r.maybe_match_direction == expected.direction) &&
+					(!r.maybe_match_name || r.maybe_match_name == expected.name) &&
+					(!r.maybe_match_man_id || r.maybe_match_man_id == expected.man_id) &&
+					(!r.maybe_match_prod_id || r.maybe_match_prod_id == expected.prod_id) &&
+					(!r.maybe_match_driver_version || r.maybe_match_driver_version == expected.driver_version);
+				if (!match) { continue; }
+				if (r.maybe_replace_name) { expected.name = r.maybe_replace_name.value(); }
+				if (r.maybe_replace_man_id) { expected.man_id = r.maybe_replace_man_id.value(); }
+				if (r.maybe_replace_prod_id) { expected.prod_id = r.maybe_replace_prod_id.value(); }
+				if (r.maybe_replace_driver_version) { expected.driver_version = r.maybe_replace_driver_version.value(); }
+				if (r.maybe_replace_voices && !input) { expected.voices = r.maybe_replace_voices.value(); }
+			}
+			midi_dev_caps got;
+			if (input) {
+				auto in = in_caps(caps.szPname, caps.wMid, caps.wPid);
+				in.vDriverVersion = caps.vDriverVersion;
+				rules.apply_in_place_c(in, [] {});
+				got = to_our_dev_caps(in);
+			}
+			else {
+				rules.apply_in_place_c(caps, [] {});
+				got = to_our_dev_caps(caps);
+			}
+			CHECK(got.name == expected.name && got.man_id == expected.man_id && got.prod_id == expected.prod_id &&
+				got.driver_version == expected.driver_version && got.voices == expected.voices);
+		}
+	}
+}
+
+// The A variants check and patch the char buffer directly when they can. They must end up
+// where the W variant gets with the widened name.
+void test_rule_table_narrow() {
+	uint32_t seed = 4242;
+	auto next = [&](uint32_t n) {
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 16) % n;
+	};
+	const wchar_t* patterns[] = { L"Synth.*", L"[A-Z]+ [0-9]", L"Caf\u00e9.*", L"Piano" };
+	const char* names[] = { "Synth 1", "AB 3", "XY 12", "Piano", "Grand Piano", "Caf\xe9 Piano", "Synth \xe9" };
+	const wchar_t* replacements[] = { L"Synth", L"XY 1", L"Piano" };
+	uint64_t narrow = g_name_checks_narrow, transcoded = g_name_checks_transcoded;
+	for (int round = 0; round < 100; round++) {
+		rule_table rules;
+		size_t n = 1 + next(10);
+		for (size_t k = 0; k < n; k++) {
+			replace_rule r;
+			if (next(3)) { r.maybe_match_name = patterns[next(4)]; }
+			if (next(3) == 0) { r.maybe_match_man_id = next(2); }
+			if (next(2)) { r.maybe_replace_name = replacements[next(3)]; }
+			if (next(3) == 0) { r.maybe_replace_man_id = next(2); }
+			rules.add(r);
+		}
+		for (const char* name : names) {
+			std::wstring wide = stringToWstring(name);
+			WORD man_id = (WORD)next(2);
+			auto caps_w = out_caps(wide.c_str(), man_id, 1);
+			MIDIOUTCAPSA caps_a = {};
+			strcpy(caps_a.szPname, name);
+			caps_a.wMid = man_id;
+			caps_a.wPid = 1;
+			caps_a.vDriverVersion = caps_w.vDriverVersion;
+			int matches_w = 0, matches_a = 0;
+			rules.apply_in_place_c(caps_w, [&] { matches_w++; });
+			rules.apply_in_place_c(caps_a, [&] { matches_a++; });
+			// A name the rules left alone keeps its bytes, even where they don't widen
+			std::string expected = caps_w.szPname == wide ? std::string(name) : wstringToString(caps_w.szPname);
+			CHECK(matches_a == matches_w && std::string(caps_a.szPname) == expected && caps_a.wMid == caps_w.wMid);
+		}
+	}
+	CHECK(g_name_checks_narrow > narrow && g_name_checks_transcoded > transcoded);
+
+	// ASCII names against ASCII patterns stay narrow; anything else is widened
+	rule_table rules;
+	replace_rule r;
+	r.maybe_match_name = L"Synth.*";
+	rules.add(r);
+	r.maybe_match_name = L"Caf\u00e9";
+	rules.add(r);
+	narrow = g_name_checks_narrow;
+	transcoded = g_name_checks_transcoded;
+	MIDIINCAPSA in = {};
+	strcpy(in.szPname, "Synth 1");
+	rules.apply_in_place_c(in, [] {});
+	CHECK(g_name_checks_narrow == narrow + 1 && g_name_checks_transcoded == transcoded + 1);
+	strcpy(in.szPname, "Synth \xe9");
+	rules.apply_in_place_c(in, [] {});
+	CHECK(g_name_checks_narrow == narrow + 1 && g_name_checks_transcoded == transcoded + 3);
+}
+
+// Name patterns are compiled the first time a device gets past a rule's numeric fields
+void test_rule_table_lazy_compile() {
+	uint64_t lazily = g_name_patterns_compiled_lazily, narrow = g_name_patterns_compiled_narrow, invalid = g_name_patterns_invalid;
+	rule_table rules;
+	std::vector<replace_rule> plain(5);
+	plain[0].maybe_match_man_id = 5;
+	plain[0].maybe_match_name = L"A.*";
+	plain[1].maybe_match_man_id = 6;
+	plain[1].maybe_match_name = L"B.*";
+	plain[2].maybe_match_name = L"(unclosed";
+	plain[3].maybe_match_man_id = 7;
+	plain[3].maybe_match_name = L"A.*";					// Shares the pattern of the first rule
+	plain[4].maybe_match_man_id = 8;
+	plain[4].maybe_match_name = L"C.*";
+	for (auto& r : plain) {
+		r.maybe_replace_name = L"Renamed";
+		rules.add(r);
+	}
+	CHECK(rules.name_patterns() == 4);
+	CHECK(g_name_patterns_compiled_lazily == lazily);
+
+	// Only the pattern of the rule found is compiled; the invalid one comes after it
+	midi_dev_caps device = to_our_dev_caps(out_caps(L"Bass", 6, 1));
+	CHECK(rules.first_match(device) == std::optional<size_t>(1));
+	CHECK(g_name_patterns_compiled_lazily == lazily + 1 && g_name_patterns_invalid == invalid);
+
+	// The invalid pattern never matches, and is only compiled once
+	device = to_our_dev_caps(out_caps(L"Arp", 7, 1));
+	CHECK(rules.first_match(device) == std::optional<size_t>(3));
+	CHECK(rules.first_match(device) == std::optional<size_t>(3));
+	CHECK(g_name_patterns_compiled_lazily == lazily + 2 && g_name_patterns_invalid == invalid + 1);
+
+	// An A-variant query on an ASCII name compiles the narrow form instead
+	MIDIOUTCAPSA caps_a = {};
+	strcpy(caps_a.szPname, "Cello");
+	caps_a.wMid = 8;
+	rules.apply_in_place_c(caps_a, [] {});
+	CHECK(std::string(caps_a.szPname) == "Renamed");
+	CHECK(g_name_patterns_compiled_narrow == narrow + 1 && g_name_patterns_compiled_lazily == lazily + 2);
+}
+
+// Patterns that take a while to compile, all different
+std::vector<replace_rule> compile_heavy_rules(size_t n) {
+	std::vector<replace_rule> rval(n);
+	for (size_t k = 0; k < n; k++) {
+		rval[k].maybe_match_man_id = (DWORD)k;
+		rval[k].maybe_match_name = L"(Yamaha|Roland|Korg|Kawai) [A-Z]{2,4}-" + std::to_wstring(k) + L"( MIDI| Synth| Port [0-9]+)*";
+		rval[k].maybe_replace_name = L"Renamed " + std::to_wstring(k);
+	}
+	return rval;
+}
+
+void test_rule_table_compile_all() {
+	uint64_t eagerly = g_name_patterns_compiled_eagerly, lazily = g_name_patterns_compiled_lazily, narrow = g_name_patterns_compiled_narrow;
+	uint64_t invalid = g_name_patterns_invalid;
+	rule_table rules;
+	for (auto const& r : compile_heavy_rules(100)) { rules.add(r); }
+	replace_rule bad;
+	bad.maybe_match_name = L"[unclosed";
+	rules.add(bad);
+
+	// Every pattern once, in both forms, the invalid one reported once
+	rules.compile_all_async(4);
+	CHECK(wait_for([&] { return g_name_patterns_compiled_eagerly == eagerly + 100 && g_name_patterns_compiled_narrow == narrow + 100; }));
+	rules.stop_compiling();
+	CHECK(g_name_patterns_invalid == invalid + 1);
+	auto caps = out_caps(L"Korg MS-42 Synth", 42, 1);
+	rules.apply_in_place_c(caps, [] {});
+	CHECK(std::wstring(caps.szPname) == L"Renamed 42");
+	CHECK(g_name_patterns_compiled_lazily == lazily && g_name_patterns_compiled_eagerly == eagerly + 100);
+
+	// Stopped right after starting: the workers leave the table before it goes away, and
+	// lookups compile what they didn't get to
+	eagerly = g_name_patterns_compiled_eagerly;
+	{
+		rule_table many;
+		for (auto const& r : compile_heavy_rules(2000)) { many.add(r); }
+		many.compile_all_async(2);
+		many.stop_compiling();
+		uint64_t compiled = g_name_patterns_compiled_eagerly - eagerly;
+		Sleep(10);
+		CHECK(g_name_patterns_compiled_eagerly - eagerly == compiled);
+		auto last = out_caps(L"Kawai XY-1999", 1999, 1);
+		many.apply_in_place_c(last, [] {});
+		CHECK(std::wstring(last.szPname) == L"Renamed 1999");
+	}
+}
+
+// Profiles
+
+json test_profiles() {
+	return json::parse(R"({
+		"log": "top.log",
+		"rules": [ { "match_name": "Top", "replace_name": "Top rule" } ],
+		"profiles": [
+			{ "name": "No match keys", "rules": [ { "match_name": "A", "replace_name": "Never" } ] },
+			{ "match_exe": "Player.EXE", "log": "player.log", "rules": [ { "match_name": "B", "replace_name": "Player rule" } ] },
+			{ "name": "Studio", "match_exe": "editor.exe", "match_path": ".*\\\\Studio\\\\.*" },
+			{ "name": "Any editor", "match_exe": "editor.exe", "popup": false, "rules": [] }
+		]
+	})");
+}
+
+void test_profile_select() {
+	CHECK(hash_file_name(L"Player.exe") == hash_file_name(L"PLAYER.EXE"));
+	CHECK(hash_file_name(L"Player.exe") != hash_file_name(L"Player.ex"));
+	CHECK(file_name_of(L"C:\\Program Files\\Player.exe") == L"Player.exe");
+	CHECK(file_name_of(L"/home/user/.wine/drive_c/Player.exe") == L"Player.exe");
+	CHECK(file_name_of(L"Player.exe") == L"Player.exe");
+
+	json data = test_profiles();
+	auto& profiles = data["profiles"];
+	std::wostringstream log;
+	// By file name, case-insensitively, wherever it is
+	CHECK(select_profile(profiles, L"C:\\Apps\\player.exe", log) == &profiles[1]);
+	CHECK(select_profile(profiles, L"D:/player.exe", log) == &profiles[1]);
+	CHECK(select_profile(profiles, L"C:\\Apps\\player.exe.bak", log) == nullptr);
+	CHECK(select_profile(profiles, L"C:\\Apps\\my_player.exe", log) == nullptr);
+	// Both keys have to match; the first matching profile wins
+	CHECK(select_profile(profiles, L"C:\\Studio\\editor.exe", log) == &profiles[2]);
+	CHECK(select_profile(profiles, L"C:\\Apps\\Editor.exe", log) == &profiles[3]);
+	// A profile without match keys never matches
+	CHECK(select_profile(profiles, L"C:\\Apps\\other.exe", log) == nullptr);
+}
+
+void test_profile_apply() {
+	std::wostringstream log;
+	json data = test_profiles();
+	CHECK(apply_profile(data, L"C:\\Apps\\Player.exe", log) == std::optional<std::string>("Player.EXE"));
+	CHECK(data["log"] == "player.log");
+	CHECK(data["rules"].size() == 2);
+	CHECK(data["rules"][0]["replace_name"] == "Top rule" && data["rules"][1]["replace_name"] == "Player rule");
+	CHECK(!data.contains("match_exe") && !data.contains("name"));
+
+	data = test_profiles();
+	CHECK(apply_profile(data, L"C:\\Apps\\editor.exe", log) == std::optional<std::string>("Any editor"));
+	CHECK(data["log"] == "top.log" && data["popup"] == false && data["rules"].size() == 1);
+
+	data = test_profiles();
+	json unchanged = data;
+	CHECK(!apply_profile(data, L"C:\\Apps\\other.exe", log).has_value());
+	CHECK(data == unchanged);
+
+	// Profile rules without top-level ones
+	data = test_profiles();
+	data.erase("rules");
+	apply_profile(data, L"Player.exe", log);
+	CHECK(data["rules"].size() == 1);
+}
+
+// Timer wheel
+
+// Drives the wheel's ticks directly, without its thread or the clock
+struct timer_wheel_test {
+	static void cascade() {
+		const std::vector<uint64_t> delays = {
+			0, 1, 255, 256, 257, 1000, 16383, 16384, 16385, 70000, 1048575, 1048576, 1048577, 5000000,
+			(1ull << 26) - 1, (1ull << 26) + 1000		// Beyond the wheel: kept in its last slot until it is near
+		};
+		constexpr uint64_t never = ~0ull;
+		for (uint64_t start : { 0ull, 123456ull }) {
+			timer_wheel wheel;
+			wheel.m_tick = start;
+			std::vector<timer_wheel::timer> timers(delays.size());
+			for (size_t i = 0; i < timers.size(); i++) {
+				timers[i].id = (UINT)i;
+				timers[i].expires = start + delays[i];
+				wheel.insert(&timers[i]);
+			}
+			std::vector<uint64_t> fired_at(timers.size(), never);
+			std::vector<timer_wheel::timer*> batch;
+			bool fired_once = true;
+			while (wheel.m_tick <= start + delays.back()) {
+				uint64_t tick = wheel.m_tick;
+				wheel.take_tick(batch);
+				for (auto t : batch) {
+					fired_once &= fired_at[t->id] == never;
+					fired_at[t->id] = tick;
+				}
+				batch.clear();
+			}
+			CHECK(fired_once);
+			for (size_t i = 0; i < timers.size(); i++) { CHECK(fired_at[i] == start + delays[i]); }
+		}
+	}
+
+	static void next_busy_tick() {
+		timer_wheel wheel;
+		wheel.m_tick = 1000;
+		timer_wheel::timer t;
+		t.expires = 1010;
+		wheel.insert(&t);
+		CHECK(wheel.next_busy_tick() == 1010);
+		wheel.unlink(&t);
+		CHECK(wheel.next_busy_tick() == 1024);		// The next cascade
+		t.expires = 990;							// Overdue: the current tick
+		wheel.insert(&t);
+		CHECK(wheel.next_busy_tick() == 1000);
+	}
+};
+
+// The wheel's own thread, in real time. Each test has a wheel of its own, stopped at the end
+// like the DLL's.
+struct timer_counter {
+	std::atomic<size_t> calls{ 0 };
+	std::atomic<uint64_t> first{ 0 };	// QPC
+	DWORD sleep_ms = 0;					// Time the callback takes
+	timer_wheel* kill_self = nullptr;	// Kills its timer from the callback
+	std::atomic<MMRESULT> kill_result{ MMSYSERR_ERROR };
+};
+
+void CALLBACK count_timer(UINT id, UINT msg, DWORD_PTR user, DWORD_PTR dw1, DWORD_PTR dw2) {
+	auto counter = (timer_counter*)user;
+	uint64_t expected = 0;
+	counter->first.compare_exchange_strong(expected, qpc_now());
+	counter->calls++;
+	if (counter->sleep_ms) { Sleep(counter->sleep_ms); }
+	if (counter->kill_self) { counter->kill_result = counter->kill_self->kill(id); }
+}
+
+double ms_since(uint64_t start) {
+	return ticks_to_ns(qpc_now() - start) / 1e6;
+}
+
+void test_timer_wheel_timers() {
+	static timer_wheel wheel;
+	timer_counter periodic, once;
+	uint64_t start = qpc_now();
+	UINT periodic_id = wheel.set(5, count_timer, (DWORD_PTR)&periodic, TIME_PERIODIC | TIME_CALLBACK_FUNCTION);
+	UINT once_id = wheel.set(20, count_timer, (DWORD_PTR)&once, TIME_ONESHOT);
+	CHECK(periodic_id && once_id && periodic_id != once_id);
+
+	// A one-shot timer fires once, never early, and is gone afterwards
+	CHECK(wait_for([&] { return once.calls == 1; }));
+	CHECK(ticks_to_ns(once.first - start) >= 20e6);
+	Sleep(50);
+	CHECK(once.calls == 1);
+	CHECK(wheel.kill(once_id) == MMSYSERR_INVALPARAM);
+
+	// A periodic one every period, never ahead of time, until it is killed
+	size_t calls = periodic.calls;
+	double elapsed_ms = ms_since(start);
+	CHECK(calls <= elapsed_ms / 5 && calls + 3 >= elapsed_ms / 5);
+	CHECK(wheel.kill(periodic_id) == MMSYSERR_NOERROR);
+	calls = periodic.calls;
+	Sleep(20);
+	CHECK(periodic.calls == calls);
+	CHECK(wheel.kill(periodic_id) == MMSYSERR_INVALPARAM);
+
+	// Event variants
+	HANDLE event = CreateEventW(NULL, FALSE, FALSE, NULL);
+	CHECK(wheel.set(10, (LPTIMECALLBACK)event, 0, TIME_ONESHOT | TIME_CALLBACK_EVENT_SET) != 0);
+	CHECK(WaitForSingleObject(event, 1000) == WAIT_OBJECT_0);
+	CHECK(wheel.set(10, (LPTIMECALLBACK)event, 0, TIME_ONESHOT | TIME_CALLBACK_EVENT_SET | TIME_CALLBACK_EVENT_PULSE) == 0);
+	CloseHandle(event);
+
+	// Invalid arguments, checked against timeGetDevCaps
+	CHECK(wheel.set(5, NULL, 0, TIME_ONESHOT) == 0);
+	CHECK(wheel.set(0, count_timer, (DWORD_PTR)&once, TIME_ONESHOT) == 0);
+
+	// A periodic timer killing itself from its callback
+	timer_counter self;
+	self.kill_self = &wheel;
+	CHECK(wheel.set(2, count_timer, (DWORD_PTR)&self, TIME_PERIODIC) != 0);
+	CHECK(wait_for([&] { return self.kill_result == MMSYSERR_NOERROR; }));
+	Sleep(10);
+	CHECK(self.calls == 1);
+	wheel.stop();
+}
+
+void test_timer_wheel_slow_callback() {
+	static timer_wheel wheel;
+	uint64_t skipped = g_timer_wheel_skipped_periods;
+	timer_counter slow;
+	slow.sleep_ms = 7;
+	uint64_t start = qpc_now();
+	UINT id = wheel.set(2, count_timer, (DWORD_PTR)&slow, TIME_PERIODIC);
+	Sleep(100);
+	CHECK(wheel.kill(id) == MMSYSERR_NOERROR);
+	// The periods missed during a callback are skipped, not caught up in a burst, and kill
+	// waited for the callback still running
+	size_t calls = slow.calls;
+	CHECK(calls >= 5 && calls <= ms_since(start) / 7 + 1);
+	CHECK(g_timer_wheel_skipped_periods > skipped);
+	Sleep(20);
+	CHECK(slow.calls == calls);
+	wheel.stop();
+}
+
+struct test_case {
+	const char* name;
+	void (*run)();
+};
+
+const test_case g_tests[] = {
+	{ "output_scheduler_order", test_output_scheduler_order },
+	{ "output_scheduler_flush", test_output_scheduler_flush },
+	{ "output_filter_redundant", test_output_filter_redundant },
+	{ "output_filter_running_status", test_output_filter_running_status },
+	{ "output_filter_rate_limit", test_output_filter_rate_limit },
+	{ "note_tracker_short", test_note_tracker_short },
+	{ "note_tracker_long", test_note_tracker_long },
+	{ "sysex_pattern", test_sysex_pattern },
+	{ "sysex_rewrite", test_sysex_rewrite },
+	{ "sysex_rewrite_random", test_sysex_rewrite_random },
+	{ "sysex_roland_checksum", test_sysex_roland_checksum },
+	{ "input_pool_reassembly", test_input_pool_reassembly },
+	{ "input_pool_errors", test_input_pool_errors },
+	{ "input_pool_overflow", test_input_pool_overflow },
+	{ "input_pool_reset", test_input_pool_reset },
+	{ "input_dispatch_overflow", test_input_dispatch_overflow },
+	{ "input_dispatch_latency", test_input_dispatch_latency },
+	{ "clock_engine_counts", test_clock_engine_counts },
+	{ "clock_engine_jitter", test_clock_engine_jitter },
+	{ "inflater", test_inflater },
+	{ "gzip_round_trip", test_gzip_round_trip },
+	{ "handle_device_table", test_handle_device_table },
+	{ "handle_device_table_probing", test_handle_device_table_probing },
+	{ "identity_responder", test_identity_responder },
+	{ "identity_responder_rewrite", test_identity_responder_rewrite },
+	{ "shared_outputs", test_shared_outputs },
+	{ "shared_outputs_filter", test_shared_outputs_filter },
+	{ "shared_outputs_close_in_callback", test_shared_outputs_close_in_callback },
+	{ "shared_outputs_concurrent", test_shared_outputs_concurrent },
+	{ "latency_probe", test_latency_probe },
+	{ "stream_engine_playback", test_stream_engine_playback },
+	{ "stream_engine_close_in_callback", test_stream_engine_close_in_callback },
+	{ "wave_stats_counters", test_wave_stats_counters },
+	{ "wave_stats_playback", test_wave_stats_playback },
+	{ "wave_rechunk_large_buffers", test_wave_rechunk_large_buffers },
+	{ "wave_rechunk_small_buffers", test_wave_rechunk_small_buffers },
+	{ "wave_rechunk_reset", test_wave_rechunk_reset },
+	{ "rule_table_match", test_rule_table_match },
+	{ "rule_table_fields", test_rule_table_fields },
+	{ "rule_table_random", test_rule_table_random },
+	{ "rule_table_narrow", test_rule_table_narrow },
+	{ "rule_table_lazy_compile", test_rule_table_lazy_compile },
+	{ "rule_table_compile_all", test_rule_table_compile_all },
+	{ "profile_select", test_profile_select },
+	{ "profile_apply", test_profile_apply },
+	{ "timer_wheel_cascade", timer_wheel_test::cascade },
+	{ "timer_wheel_next_busy_tick", timer_wheel_test::next_busy_tick },
+	{ "timer_wheel_timers", test_timer_wheel_timers },
+	{ "timer_wheel_slow_callback", test_timer_wheel_slow_callback },
+};
+
+// Benchmarks: mean time per operation on the wrapper's own paths, without a driver
+
+size_t g_bench_iterations = 100000;
+
+// Mean ns per call of f, after one call to warm up. Slow operations run a fraction of the
+// iterations.
+template<typename F>
+double mean_ns(F f, size_t divisor = 1) {
+	size_t iterations = g_bench_iterations / divisor ? g_bench_iterations / divisor : 1;
+	f();
+	uint64_t start = qpc_now();
+	for (size_t n = 0; n < iterations; n++) { f(); }
+	return ticks_to_ns(qpc_now() - start) / iterations;
+}
+
+// A three-note chord on every channel, with volume and pitch bend, as a sequencer plays it
+std::vector<DWORD> bench_short_msgs() {
+	std::vector<DWORD> rval;
+	for (DWORD ch = 0; ch < 16; ch++) {
+		for (DWORD note : { 60, 64, 67 }) { rval.push_back((0x90 | ch) | (note << 8) | (0x40 << 16)); }
+		rval.push_back((0xB0 | ch) | (7 << 8) | (100 << 16));
+		rval.push_back((0xE0 | ch) | (0x10 << 16));
+	}
+	return rval;
+}
+
+json bench_note_tracker() {
+	auto msgs = bench_short_msgs();
+	note_tracker notes;
+	double pass_ns = mean_ns([&] {
+		for (DWORD msg : msgs) { notes.on_short_msg(msg); }
+	});
+	g_fake.clear();
+	uint64_t reset_messages = notes.silence(fake_handle<HMIDIOUT>(1));
+	return json{
+		{ "track_ns_per_message", pass_ns / msgs.size() },
+		{ "reset_messages", reset_messages },
+		{ "sweep_messages", g_reset_sweep_messages }
+	};
+}
+
+// A 256 KB bulk dump of Roland DT1 messages (16 data bytes each, to addresses 0 to 4095),
+// scanned with 1 to 1000 rules that each rewrite the device ID of one address and fix the
+// checksum, once with the automaton and once as it would be done rule by rule
+json bench_sysex_rewrite() {
+	std::vector<uint8_t> dump;
+	for (size_t message = 0; dump.size() < 256 * 1024; message++) {
+		size_t begin = dump.size();
+		uint16_t address = (uint16_t)(message % 4096);
+		dump.insert(dump.end(), { 0xF0, 0x41, 0x10, 0x42, 0x12, 0x40, (uint8_t)(address >> 7), (uint8_t)(address & 0x7F) });
+		for (size_t i = 0; i < 16; i++) { dump.push_back((uint8_t)((message + i) & 0x7F)); }
+		unsigned sum = 0;
+		for (size_t i = begin + 5; i < dump.size(); i++) { sum += dump[i]; }
+		dump.push_back((uint8_t)((128 - (sum & 0x7F)) & 0x7F));
+		dump.push_back(0xF7);
+	}
+	json rval = json::object();
+	rval["dump_bytes"] = dump.size();
+	for (size_t n : { 1, 10, 100, 1000 }) {
+		sysex_rewriter rewriter;
+		std::vector<sysex_rewrite_rule> rules;
+		for (size_t k = 0; k < n; k++) {
+			uint16_t address = (uint16_t)(k * 4096 / n);
+			char match[64];
+			snprintf(match, sizeof(match), "F0 41 10 42 12 40 %02X %02X", address >> 7, address & 0x7F);
+			auto rule = sysex_rule(match, "?? ?? 11 ?? ?? ?? ?? ??");
+			rule.checksum = sysex_checksum::Roland;
+			rewriter.add(rule);
+			rules.push_back(rule);
+		}
+		rewriter.build();
+		// Both rewrite a fresh copy each time, or the device IDs would no longer match
+		auto buffer = dump;
+		uint64_t matches = g_sysex_rewrite_matches.load();
+		rewriter.rewrite(buffer.data(), buffer.size(), true);
+		json result{
+			{ "states", rewriter.states() },
+			{ "matches", g_sysex_rewrite_matches.load() - matches },
+			{ "automaton_ns_per_kb", mean_ns([&] {
+				memcpy(buffer.data(), dump.data(), dump.size());
+				rewriter.rewrite(buffer.data(), buffer.size(), true);
+			}, 10000) * 1024 / dump.size() }
+		};
+		if (n <= 100) {
+			double per_rule_ns = mean_ns([&] {
+				memcpy(buffer.data(), dump.data(), dump.size());
+				for (auto const& rule : rules) {
+					for (size_t start = 0; start + rule.match.size() <= buffer.size(); start++) {
+						size_t i = 0;
+						while (i < rule.match.size() && (rule.match[i] < 0 || buffer[start + i] == rule.match[i])) { i++; }
+						if (i == rule.match.size()) { buffer[start + 2] = 0x11; }
+					}
+				}
+			}, 10000);
+			result["per_rule_ns_per_kb"] = per_rule_ns * 1024 / dump.size();
+		}
+		rval[std::to_string(n)] = result;
+	}
+	return rval;
+}
+
+// The driver thread's cost per message through the dispatcher, and the time from the push to
+// the application's callback: for back-to-back messages, and for messages 1 ms apart, where
+// the dispatcher sleeps in between
+json bench_input_dispatch() {
+	slow_application app;
+	g_slow_app = &app;
+	input_dispatch_config cfg;
+	input_dispatcher dispatcher(g_slow_app_callback, cfg);
+	dispatcher.start(cfg.priority);
+	auto latency = [&] {
+		dispatcher.flush();
+		AcquireSRWLockExclusive(&app.lock);
+		double sum_ns = 0, max_ns = 0;
+		for (uint64_t ticks : app.latency_ticks) {
+			double ns = ticks_to_ns(ticks);
+			sum_ns += ns;
+			if (ns > max_ns) { max_ns = ns; }
+		}
+		json rval = {
+			{ "messages", app.latency_ticks.size() },
+			{ "mean_latency_us", app.latency_ticks.empty() ? 0.0 : sum_ns / app.latency_ticks.size() / 1000 },
+			{ "max_latency_us", max_ns / 1000 }
+		};
+		app.got.clear();
+		app.latency_ticks.clear();
+		ReleaseSRWLockExclusive(&app.lock);
+		return rval;
+	};
+	DWORD_PTR n = 0;
+	double push_ns = mean_ns([&] { dispatcher.push(fake_handle<HMIDIIN>(1), MIM_DATA, n++, qpc_now()); });
+	json burst = latency();
+	for (int i = 0; i < 200; i++) {
+		dispatcher.push(fake_handle<HMIDIIN>(1), MIM_DATA, n++, qpc_now());
+		Sleep(1);
+	}
+	json spaced = latency();
+	dispatcher.stop();
+	g_slow_app = nullptr;
+	return json{
+		{ "push_ns", push_ns },
+		{ "back_to_back", burst },
+		{ "spaced_1ms", spaced }
+	};
+}
+
+// What the responder adds to a request it doesn't answer and to the device's reply, and the
+// time from the application's request to the wrapper's answer reaching its callback. The
+// device's own round trip, which the answer saves, is in the stats as mean_device_reply_us.
+json bench_identity_responder() {
+	g_identity_responder_config = {};
+	g_identity_responder_config.output_device = 2;
+	g_identity_responder_config.input_device = 3;
+	g_identity_responder_config.reply = g_identity_reply;
+	static identity_responder responder;
+	responder.load(g_identity_responder_config);
+	HMIDIOUT hmo = fake_handle<HMIDIOUT>(1);
+	midi_out_handle_state out;
+	out.device_id = 2;
+	out.app = g_app_callback;
+	identity_request request;
+
+	// The input isn't open yet, so requests go to the device
+	double forwarded_ns = mean_ns([&] {
+		responder.on_output(hmo, out, &request.hdr);
+		responder.on_input(g_identity_reply.data(), g_identity_reply.size());
+	});
+
+	identity_input input(fake_handle<HMIDIIN>(3));
+	responder.input_opened();
+	app_buffer reply(32);
+	size_t answers = g_bench_iterations / 100 ? g_bench_iterations / 100 : 1;
+	uint64_t ticks = 0;
+	g_app.clear();
+	for (size_t n = 0; n < answers; n++) {
+		input.pool->add_app_buffer(&reply.hdr);
+		uint64_t start = qpc_now();
+		responder.on_output(hmo, out, &request.hdr);
+		while (g_app.count() < 2) { Sleep(0); }
+		ticks += qpc_now() - start;
+		g_app.clear();
+	}
+	responder.input_closed();
+	responder.stop();
+	g_identity_responder_config = {};
+	return json{
+		{ "forwarded_ns", forwarded_ns },
+		{ "answer_us", ticks_to_ns(ticks) / answers / 1000 }
+	};
+}
+
+// 150 clocks 10 ms apart from an application that sends them up to 3 ms early or late, and
+// what the driver gets from the clock engine, once the loop has locked (after 50 clocks)
+json bench_clock_engine() {
+	auto saved = g_clock_engine_config;
+	auto jitter = [](std::vector<uint64_t> const& times) {
+		double max_ms = 0;
+		for (size_t i = 51; i < times.size(); i++) {
+			double error = std::abs(ticks_to_ns(times[i] - times[i - 1]) / 1000000 - 10);
+			if (error > max_ms) { max_ms = error; }
+		}
+		return json{ { "rms_ms", rms_jitter_ms(times, 10, 50) }, { "max_ms", max_ms } };
+	};
+	json rval = json::object();
+	struct {
+		const char* name;
+		double bandwidth_hz;
+		uint64_t max_lead;
+	} const cases[] = { { "default", 0.5, 0 }, { "bandwidth_2hz", 2, 0 }, { "bandwidth_2hz_lead_1", 2, 1 } };
+	for (auto& c : cases) {
+		g_clock_engine_config.bandwidth_hz = c.bandwidth_hz;
+		g_clock_engine_config.max_lead = c.max_lead;
+		HMIDIOUT hmo = fake_handle<HMIDIOUT>(1);
+		clock_engine engine(hmo);
+		auto run = send_clocks(engine, hmo, 150, 10, 3);
+		run.sent.resize(run.app.size());
+		engine.closing();
+		engine.closed(true);
+		rval[c.name] = json{ { "application", jitter(run.app) }, { "sent", jitter(run.sent) } };
+	}
+	g_clock_engine_config = saved;
+	return rval;
+}
+
+// An open/close cycle of an output, as applications that open the port for every song do,
+// with a native open costing 20 ms as under Wine: straight to the driver, and through the
+// shared outputs, where the native handle lingers between cycles
+json bench_shared_outputs() {
+	g_fake.clear();
+	g_fake.open_delay_ms = 20;
+	const size_t direct_cycles = 10;
+	uint64_t start = qpc_now();
+	for (size_t i = 0; i < direct_cycles; i++) {
+		HMIDIOUT hmo;
+		MMmidiOutOpen(&hmo, 7, 0, 0, CALLBACK_NULL);
+		MMmidiOutClose(hmo);
+	}
+	double direct_ns = ticks_to_ns(qpc_now() - start) / direct_cycles;
+
+	g_shared_outputs_config = shared_outputs_config();
+	app_callback app;
+	double shared_ns = mean_ns([&] {
+		HMIDIOUT hmo;
+		g_shared_outputs.open(&hmo, 7, app, CALLBACK_NULL);
+		close_shared(hmo);
+	}, 10);
+	json rval = {
+		{ "native_open_ms", g_fake.open_delay_ms },
+		{ "direct_cycle_ns", direct_ns },
+		{ "shared_cycle_ns", shared_ns },
+		{ "shared_native_opens", g_fake.open_count() - direct_cycles }
+	};
+	g_fake.clear();
+	return rval;
+}
+
+// The stream engine's own scheduling: how many events per second it dispatches when they
+// are all due, and how late it sends events 1 ms apart
+json bench_stream_engine() {
+	midi_stream stream(g_app_callback);
+	stream.start(fake_handle<HMIDIOUT>(1));
+	MIDIPROPTEMPO tempo = { sizeof(tempo), 9600 };		// 100 us per tick
+	stream.property((LPBYTE)&tempo, MIDIPROP_SET | MIDIPROP_TEMPO);
+
+	size_t burst_events = g_bench_iterations / 10 ? g_bench_iterations / 10 : 1;
+	stream_buffer burst;
+	for (size_t i = 0; i < burst_events; i++) { burst.event(0, 0x403C90); }
+	g_fake.clear();
+	g_app.clear();
+	LPMIDIHDR hdr = burst.prepared();
+	uint64_t start = qpc_now();
+	stream.out(hdr, sizeof(*hdr));
+	stream.restart();
+	wait_for([] { return g_app.count() == 1; }, 60000);
+	double burst_ns = ticks_to_ns(qpc_now() - start);
+
+	const size_t paced_events = 200;
+	stream_buffer paced;
+	for (size_t i = 0; i < paced_events; i++) { paced.event(10, 0x403C90); }
+	stream.stop();
+	g_fake.clear();
+	g_app.clear();
+	hdr = paced.prepared();
+	stream.out(hdr, sizeof(*hdr));
+	start = qpc_now();
+	stream.restart();
+	wait_for([] { return g_app.count() == 1; }, 60000);
+	AcquireSRWLockShared(&g_fake.lock);
+	auto times = g_fake.short_msg_times;
+	ReleaseSRWLockShared(&g_fake.lock);
+	double late_sum_ns = 0, late_max_ns = 0;
+	for (size_t i = 0; i < times.size(); i++) {
+		double late = ticks_to_ns(times[i] - start) - (i + 1) * 1e6;
+		late_sum_ns += late;
+		if (late > late_max_ns) { late_max_ns = late; }
+	}
+	stream.stop();
+	stream.close();
+	return json{
+		{ "burst_events", burst_events },
+		{ "burst_ns_per_event", burst_ns / burst_events },
+		{ "paced_events", times.size() },
+		{ "paced_mean_late_us", times.empty() ? 0.0 : late_sum_ns / times.size() / 1000 },
+		{ "paced_max_late_us", late_max_ns / 1000 }
+	};
+}
+
+// What the instrumentation adds to a waveOutWrite and its WOM_DONE, meant to stay on in
+// production: the counters of a write and a completion, with and without a handle slot
+json bench_wave_stats() {
+	wave_buffers app(1, 10 * g_wave_bytes_per_ms);
+	wave_out_handle_state state;
+	double unslotted_ns = mean_ns([&] {
+		state.on_write(&app.hdrs[0]);
+		state.on_done();
+	});
+	state.slot = g_wave_stats.claim_slot(fake_handle<HWAVEOUT>(1));
+	double slotted_ns = mean_ns([&] {
+		state.on_write(&app.hdrs[0]);
+		state.on_done();
+	});
+	g_wave_stats.release_slot(state.slot);
+	return json{
+		{ "write_and_done_ns", slotted_ns },
+		{ "write_and_done_unslotted_ns", unslotted_ns }
+	};
+}
+
+// Plays total_ms from count buffers of buffer_ms each on the fake device, writing every
+// buffer again as soon as it is done. The latency is the most audio queued in the driver at
+// a write.
+json wave_playback(size_t count, DWORD buffer_ms, DWORD total_ms) {
+	g_app.clear();
+	wave_output out;
+	wave_buffers app(count, buffer_ms * g_wave_bytes_per_ms);
+	size_t total = total_ms / buffer_ms, written = 0, returned = 0;
+	for (size_t i = 0; i < count && written < total; i++, written++) { out.write(&app.hdrs[i]); }
+	while (returned < written && wait_for([] { return g_app.count() > 0; })) {
+		for (LPWAVEHDR hdr : wave_done()) {
+			returned++;
+			if (written < total) {
+				out.write(hdr);
+				written++;
+			}
+		}
+	}
+	out.close();
+	return json{
+		{ "latency_ms", (double)g_wave_device.max_queued_bytes / g_wave_bytes_per_ms },
+		{ "underruns", g_wave_device.underruns },
+		{ "driver_writes", g_wave_device.writes }
+	};
+}
+
+// Half a second of audio in two 100 ms buffers and in three 2 ms ones, straight to the driver
+// and re-chunked into 10 ms slices 4 deep
+json bench_wave_rechunk() {
+	json rval;
+	for (bool rechunk : { false, true }) {
+		g_wave_rechunk_enabled = rechunk;
+		g_wave_rechunk_config = wave_rechunk_config();
+		rval[rechunk ? "rechunked" : "direct"] = {
+			{ "large_buffers", wave_playback(2, 100, 500) },
+			{ "small_buffers", wave_playback(3, 2, 500) }
+		};
+	}
+	g_wave_rechunk_enabled = false;
+	return rval;
+}
+
+// Queries against large rule tables. Every rule but the last is ruled out by its numeric
+// fields, as with rules written per device, so their name patterns are never compiled and a
+// query is mostly the scan over the numeric arrays.
+json bench_rule_table() {
+	json rval = json::array();
+	for (size_t n : { 10, 1000, 10000 }) {
+		rule_table rules;
+		for (size_t k = 0; k < n; k++) {
+			replace_rule r;
+			r.maybe_match_man_id = k + 1 == n ? 1 : 2 + k % 1000;
+			r.maybe_match_name = L"Device " + std::to_wstring(k % 100);
+			r.maybe_replace_name = L"Renamed";
+			rules.add(r);
+		}
+		auto caps_w = out_caps((L"Device " + std::to_wstring((n - 1) % 100)).c_str(), 1, 1);
+		MIDIOUTCAPSA caps_a = {};
+		strcpy(caps_a.szPname, wstringToString(caps_w.szPname).c_str());
+		caps_a.wMid = caps_a.wPid = 1;
+		auto ours = to_our_dev_caps(caps_w);
+		std::vector<uint8_t> candidates(n);
+		rval.push_back({
+			{ "rules", n },
+			{ "scan_ns_per_rule", mean_ns([&] { rules.numeric_candidates(ours, 0, candidates.data()); }, 10) / n },
+			{ "query_w_ns", mean_ns([&] { auto copy = caps_w; rules.apply_in_place_c(copy, [] {}); }, 10) },
+			{ "query_a_ns", mean_ns([&] { auto copy = caps_a; rules.apply_in_place_c(copy, [] {}); }, 10) }
+		});
+	}
+	return rval;
+}
+
+// A and W caps queries through 100 rules matched by name only, so every query checks every
+// pattern: W, A on the char buffer, A the way it was done before (widened, queried as W and
+// narrowed back), and A for a name that isn't ASCII, which still gets widened
+json bench_caps_a_vs_w() {
+	rule_table rules;
+	for (size_t k = 0; k < 100; k++) {
+		replace_rule r;
+		r.maybe_match_name = L"Device " + std::to_wstring(k) + L"( Port [0-9])?";
+		r.maybe_replace_name = L"Renamed";
+		rules.add(r);
+	}
+	auto caps_w = out_caps(L"Device 99", 1, 1);
+	MIDIOUTCAPSA caps_a = {};
+	strcpy(caps_a.szPname, "Device 99");
+	MIDIOUTCAPSA caps_8bit = caps_a;
+	strcpy(caps_8bit.szPname, "Device 99 \xe9");
+	return json{
+		{ "rules", rules.size() },
+		{ "w_ns", mean_ns([&] { auto copy = caps_w; rules.apply_in_place_c(copy, [] {}); }, 10) },
+		{ "a_ns", mean_ns([&] { auto copy = caps_a; rules.apply_in_place_c(copy, [] {}); }, 10) },
+		{ "a_transcoded_ns", mean_ns([&] {
+			auto copy = caps_a;
+			MIDIOUTCAPSW wide = {};
+			wcsncpy(wide.szPname, stringToWstring(copy.szPname).c_str(), MAXPNAMELEN - 1);
+			rules.apply_in_place_c(wide, [] {});
+			strcpy(copy.szPname, wstringToString(wide.szPname).c_str());
+		}, 10) },
+		{ "a_not_ascii_ns", mean_ns([&] { auto copy = caps_8bit; rules.apply_in_place_c(copy, [] {}); }, 10) }
+	};
+}
+
+// Startup with 500 rules, each with its own name pattern: adding them with lazy compilation,
+// adding them and compiling every pattern on this thread (as load_config used to), and
+// adding them and compiling on the worker pool until it is done, which compiles the narrow
+// form of each pattern as well. Then the first query,
+// which compiles only the pattern of the rule it gets to.
+json bench_rule_startup() {
+	auto plain = compile_heavy_rules(500);
+	const size_t runs = 3;
+	auto startup_ms = [&](auto after_add) {
+		uint64_t start = qpc_now();
+		for (size_t run = 0; run < runs; run++) {
+			rule_table rules;
+			for (auto const& r : plain) { rules.add(r); }
+			after_add(rules);
+		}
+		return ticks_to_ns(qpc_now() - start) / runs / 1e6;
+	};
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	json rval = {
+		{ "rules", plain.size() },
+		{ "lazy_ms", startup_ms([](rule_table&) {}) },
+		{ "serial_ms", startup_ms([&](rule_table&) {
+			for (auto const& r : plain) { std::wregex re(r.maybe_match_name.value()); }
+		}) },
+		{ "parallel_ms", startup_ms([&](rule_table& rules) {
+			uint64_t eagerly = g_name_patterns_compiled_eagerly, narrow = g_name_patterns_compiled_narrow;
+			rules.compile_all_async(0);
+			wait_for([&] { return g_name_patterns_compiled_eagerly - eagerly == plain.size() && g_name_patterns_compiled_narrow - narrow == plain.size(); });
+			rules.stop_compiling();
+		}) },
+		{ "parallel_threads", info.dwNumberOfProcessors }
+	};
+	rule_table rules;
+	for (auto const& r : plain) { rules.add(r); }
+	auto caps = out_caps(L"Korg MS-499 Synth", 499, 1);
+	uint64_t start = qpc_now();
+	rules.apply_in_place_c(caps, [] {});
+	rval["first_query_us"] = ticks_to_ns(qpc_now() - start) / 1000;
+	return rval;
+}
+
+// A config with 50 profiles of 20 rules each, matched by file name or by path. At startup,
+// the DLL parses it and selects the profile; only that profile's rules are read, and they are
+// compiled lazily afterwards.
+json bench_profiles() {
+	json config = { { "rules", json::array() }, { "profiles", json::array() } };
+	for (int k = 0; k < 50; k++) {
+		json profile = { { "name", "Profile " + std::to_string(k) }, { "rules", json::array() } };
+		if (k % 2) { profile["match_path"] = ".*\\\\Vendor " + std::to_string(k) + "\\\\.*"; }
+		else { profile["match_exe"] = "app" + std::to_string(k) + ".exe"; }
+		for (int r = 0; r < 20; r++) {
+			profile["rules"].push_back({ { "match_name", "Device " + std::to_string(r) + ".*" }, { "match_man_id", r }, { "replace_name", "Renamed " + std::to_string(r) } });
+		}
+		config["profiles"].push_back(profile);
+	}
+	std::string text = config.dump();
+	json data = json::parse(text);
+	std::wostringstream log;
+	auto select = [&](std::wstring const& exe) {
+		return mean_ns([&] {
+			select_profile(data["profiles"], exe, log);
+			log.str(L"");
+		}, 100);
+	};
+	json selected = data;
+	apply_profile(selected, L"C:\\Vendor 49\\app49.exe", log);
+	return json{
+		{ "config_bytes", text.size() },
+		{ "parse_ns", mean_ns([&] { json::parse(text); }, 1000) },
+		{ "select_ns", {
+			{ "unrelated", select(L"C:\\Windows\\notepad.exe") },
+			{ "first_profile", select(L"C:\\Apps\\app0.exe") },
+			{ "last_profile", select(L"C:\\Vendor 49\\app49.exe") }
+		} },
+		{ "rules_selected", selected["rules"].size() },
+		{ "rules_in_config", 50 * 20 }
+	};
+}
+
+// How far each interval of a periodic timer is from its period
+struct timer_jitter {
+	UINT period = 0;
+	uint64_t last = 0;		// QPC
+	size_t intervals = 0;
+	double sum_ns = 0;
+	double max_ns = 0;
+};
+
+void CALLBACK jitter_timer(UINT id, UINT msg, DWORD_PTR user, DWORD_PTR dw1, DWORD_PTR dw2) {
+	auto jitter = (timer_jitter*)user;
+	uint64_t now = qpc_now();
+	if (jitter->last) {
+		double ns = ticks_to_ns(now - jitter->last) - jitter->period * 1e6;
+		if (ns < 0) { ns = -ns; }
+		jitter->sum_ns += ns;
+		if (ns > jitter->max_ns) { jitter->max_ns = ns; }
+		jitter->intervals++;
+	}
+	jitter->last = now;
+}
+
+uint64_t process_cpu_ticks() {
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	auto ticks = [](FILETIME const& ft) { return (uint64_t)ft.dwHighDateTime << 32 | ft.dwLowDateTime; };
+	return ticks(kernel) + ticks(user);		// 100 ns
+}
+
+// 32 periodic timers of 1 to 8 ms for a second, as a sequencer with plugins sets them up
+template<typename Set, typename Kill>
+json run_timers(Set set, Kill kill) {
+	std::vector<timer_jitter> timers(32);
+	std::vector<UINT> ids;
+	uint64_t cpu = process_cpu_ticks();
+	for (size_t i = 0; i < timers.size(); i++) {
+		timers[i].period = 1 + i % 8;
+		ids.push_back(set(timers[i].period, jitter_timer, (DWORD_PTR)&timers[i]));
+	}
+	Sleep(1000);
+	for (UINT id : ids) { kill(id); }
+	double cpu_ms = (process_cpu_ticks() - cpu) / 1e4;
+	size_t intervals = 0;
+	double sum_ns = 0, max_ns = 0;
+	for (auto const& t : timers) {
+		intervals += t.intervals;
+		sum_ns += t.sum_ns;
+		if (t.max_ns > max_ns) { max_ns = t.max_ns; }
+	}
+	return json{
+		{ "callbacks", intervals + timers.size() },
+		{ "mean_jitter_us", intervals ? sum_ns / intervals / 1000 : 0.0 },
+		{ "max_jitter_us", max_ns / 1000 },
+		{ "process_cpu_ms", cpu_ms }
+	};
+}
+
+// The wheel against the system's own timeSetEvent (not the wrapper's, were it next to this
+// executable); "native" is null if that can't be loaded
+json bench_timer_wheel() {
+	static timer_wheel wheel;
+	json rval = { { "wheel", run_timers(
+		[](UINT delay, LPTIMECALLBACK proc, DWORD_PTR user) { return wheel.set(delay, proc, user, TIME_PERIODIC); },
+		[](UINT id) { wheel.kill(id); }) } };
+	wchar_t path[MAX_PATH];
+	GetSystemDirectoryW(path, MAX_PATH);
+	wcscat(path, L"\\winmm.dll");
+	HMODULE winmm = LoadLibraryW(path);
+	auto native_set = winmm ? (MMRESULT(WINAPI*)(UINT, UINT, LPTIMECALLBACK, DWORD_PTR, UINT))GetProcAddress(winmm, "timeSetEvent") : NULL;
+	auto native_kill = winmm ? (MMRESULT(WINAPI*)(UINT))GetProcAddress(winmm, "timeKillEvent") : NULL;
+	rval["native"] = nullptr;
+	if (native_set && native_kill) {
+		rval["native"] = run_timers(
+			[&](UINT delay, LPTIMECALLBACK proc, DWORD_PTR user) { return native_set(delay, 1, proc, user, TIME_PERIODIC); },
+			[&](UINT id) { native_kill(id); });
+	}
+	wheel.stop();
+	return rval;
+}
+
+struct bench_case {
+	const char* name;
+	json (*run)();
+};
+
+const bench_case g_benches[] = {
+	{ "note_tracker", bench_note_tracker },
+	{ "sysex_rewrite", bench_sysex_rewrite },
+	{ "input_dispatch", bench_input_dispatch },
+	{ "clock_engine", bench_clock_engine },
+	{ "identity_responder", bench_identity_responder },
+	{ "shared_outputs", bench_shared_outputs },
+	{ "stream_engine", bench_stream_engine },
+	{ "wave_stats", bench_wave_stats },
+	{ "wave_rechunk", bench_wave_rechunk },
+	{ "rule_table", bench_rule_table },
+	{ "caps_a_vs_w", bench_caps_a_vs_w },
+	{ "rule_startup", bench_rule_startup },
+	{ "profiles", bench_profiles },
+	{ "timer_wheel", bench_timer_wheel },
+};
+
+bool selected(const char* name, std::vector<std::string> const& names) {
+	if (names.empty()) { return true; }
+	return std::any_of(names.begin(), names.end(), [&](std::string const& prefix) { return std::string(name).starts_with(prefix); });
+}
+
+int usage() {
+	fwprintf(stderr, L"Usage: Tests [name]...\n"
+		L"       Tests --bench [--iterations <n>] [name]...\n");
+	return 2;
+}
+
+int wmain(int argc, wchar_t** argv) {
+	init_stats();
+	install_fakes();
+	std::vector<std::string> names;
+	bool bench = false;
+	for (int i = 1; i < argc; i++) {
+		std::wstring arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == L"--iterations" && has_value) { g_bench_iterations = wcstoull(argv[++i], nullptr, 10); }
+		else if (arg == L"--bench") { bench = true; }
+		else if (arg.starts_with(L"--")) { return usage(); }
+		else { names.push_back(wstringToString(arg)); }
+	}
+	if (g_bench_iterations == 0) { g_bench_iterations = 1; }
+
+	if (bench) {
+		json report = { { "iterations", g_bench_iterations } };
+		for (auto const& b : g_benches) {
+			if (selected(b.name, names)) { report[b.name] = b.run(); }
+		}
+		printf("%s\n", report.dump(2).c_str());
+		return 0;
+	}
+
+	size_t run = 0;
+	for (auto const& test : g_tests) {
+		if (!selected(test.name, names)) { continue; }
+		g_current_test = test.name;
+		g_fake.clear();
+		g_app.clear();
+		size_t failures = g_failures;
+		test.run();
+		fprintf(stderr, "%s %s\n", g_failures == failures ? "ok  " : "FAIL", test.name);
+		run++;
+	}
+	fprintf(stderr, "%zu tests, %zu checks, %zu failed\n", run, g_checks, g_failures);
+	return g_failures ? 1 : 0;
+}
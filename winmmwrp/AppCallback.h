@@ -0,0 +1,26 @@
+// The callback an application passed to midiInOpen / midiOutOpen, for the cases where the
+// wrapper installs its own callback with the driver and forwards messages itself.
+
+struct app_callback {
+	DWORD_PTR callback = 0;
+	DWORD_PTR instance = 0;
+	DWORD flags = CALLBACK_NULL;
+
+	// Delivers a message the way the native WinMM DriverCallback would.
+	void invoke(HANDLE h, UINT msg, DWORD_PTR p1, DWORD_PTR p2) const {
+		switch (flags & CALLBACK_TYPEMASK) {
+		case CALLBACK_FUNCTION:
+			if (callback) { ((DRVCALLBACK*)callback)((HDRVR)h, msg, instance, p1, p2); }
+			break;
+		case CALLBACK_WINDOW:
+			PostMessageW((HWND)callback, msg, (WPARAM)h, (LPARAM)p1);
+			break;
+		case CALLBACK_THREAD:
+			PostThreadMessageW((DWORD)callback, msg, (WPARAM)h, (LPARAM)p1);
+			break;
+		case CALLBACK_EVENT:
+			SetEvent((HANDLE)callback);
+			break;
+		}
+	}
+};
@@ -0,0 +1,233 @@
+// MIDI clock smoothing for one output. The application's timing clocks (F8) are not sent
+// as they come: they drive a delay-locked loop (second order, as a PLL), which estimates the
+// clock period and the time of the next clock, and a high-priority thread sends the clocks at
+// the times the loop predicts. Every application clock still results in exactly one clock
+// sent, so positions stay in step; by default a clock is only sent once the application's has
+// arrived, and max_lead lets the thread send that many ahead. Start (FA), Continue (FB), Stop
+// (FC) and Song Position Pointer (F2) first send the clocks still owed, so they keep their
+// place in the stream, and start the loop over, as does a gap of several periods; the first
+// clocks after that are sent as they come.
+
+#include <cmath>
+
+struct clock_engine_config {
+	UINT output_device = 0;
+	double bandwidth_hz = 0.5;		// Loop bandwidth: lower is smoother, higher follows tempo changes faster
+	uint64_t max_lead = 0;
+	uint64_t spin_us = 1500;
+	int priority = THREAD_PRIORITY_TIME_CRITICAL;
+};
+
+bool g_clock_engine_enabled = false;
+clock_engine_config g_clock_engine_config;
+
+// Jitter is the difference between a clock interval and the loop's period estimate
+struct clock_jitter_stats {
+	std::atomic<uint64_t> clocks{ 0 };
+	std::atomic<uint64_t> max_ticks{ 0 };
+	std::atomic<double> sum_squares_ns{ 0 };
+	std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> histogram{};		// log2 ns
+
+	void record(uint64_t ticks) {
+		clocks.fetch_add(1, std::memory_order_relaxed);
+		double ns = ticks_to_ns(ticks);
+		histogram[histogram_bucket((uint64_t)ns)].fetch_add(1, std::memory_order_relaxed);
+		double prev_sum = sum_squares_ns.load(std::memory_order_relaxed);
+		while (!sum_squares_ns.compare_exchange_weak(prev_sum, prev_sum + ns * ns, std::memory_order_relaxed)) {}
+		uint64_t prev_max = max_ticks.load(std::memory_order_relaxed);
+		while (ticks > prev_max && !max_ticks.compare_exchange_weak(prev_max, ticks, std::memory_order_relaxed)) {}
+	}
+
+	json to_json() const {
+		json buckets = json::array();
+		for (auto& bucket : histogram) { buckets.push_back(bucket.load()); }
+		uint64_t n = clocks.load();
+		return json{
+			{ "clocks", n },
+			{ "rms_jitter_ns", n ? std::sqrt(sum_squares_ns.load() / n) : 0.0 },
+			{ "max_jitter_ns", ticks_to_ns(max_ticks.load()) },
+			{ "jitter_histogram_log2_ns", buckets }
+		};
+	}
+};
+
+clock_jitter_stats g_clock_in_jitter;		// The application's clocks
+clock_jitter_stats g_clock_out_jitter;		// The clocks sent by the engine
+std::atomic<uint64_t> g_clock_passed_through{ 0 };
+std::atomic<uint64_t> g_clock_relocks{ 0 };
+std::atomic<uint64_t> g_clock_catch_ups{ 0 };		// Sent late, with a later application clock already in
+std::atomic<uint64_t> g_clock_flushed{ 0 };			// Sent early, before a transport message
+std::atomic<double> g_clock_bpm{ 0 };
+
+class clock_engine {
+public:
+	explicit clock_engine(HMIDIOUT native) : m_native(native) {
+		InitializeCriticalSection(&m_lock);
+		m_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+	}
+
+	~clock_engine() {
+		DeleteCriticalSection(&m_lock);
+		if (m_wake) { CloseHandle(m_wake); }
+	}
+
+	// A system real-time or common message from the application. Returns true if the engine
+	// sends it itself.
+	bool on_message(DWORD msg) {
+		uint8_t status = msg & 0xFF;
+		if (status == 0xFA || status == 0xFB || status == 0xFC || status == 0xF2) {
+			EnterCriticalSection(&m_lock);
+			while (m_emitted < m_received) {
+				MMmidiOutShortMsg(m_native, 0xF8);
+				m_emitted++;
+				g_clock_flushed.fetch_add(1, std::memory_order_relaxed);
+			}
+			restart();
+			LeaveCriticalSection(&m_lock);
+			return false;
+		}
+		if (status != 0xF8) { return false; }
+		uint64_t now = qpc_now();
+		EnterCriticalSection(&m_lock);
+		if (m_received >= 2 && now - m_last_in > 4 * m_period) {
+			restart();
+			g_clock_relocks.fetch_add(1, std::memory_order_relaxed);
+		}
+		m_received++;
+		bool pass_through = m_received <= 2;
+		if (m_received == 2) {
+			// Locks with the first interval as the period
+			m_period = (double)(now - m_last_in);
+			m_next = now + m_period;
+		}
+		else if (m_received > 2) {
+			g_clock_in_jitter.record((uint64_t)std::abs((double)(now - m_last_in) - m_period));
+			double omega = 2 * 3.14159265358979 * g_clock_engine_config.bandwidth_hz * m_period / g_qpc_frequency.QuadPart;
+			double e = (double)now - m_next;
+			m_next += std::sqrt(2.0) * omega * e + m_period;
+			m_period += omega * omega * e;
+			g_clock_bpm.store(60.0 * g_qpc_frequency.QuadPart / (24 * m_period), std::memory_order_relaxed);
+		}
+		m_last_in = now;
+		if (pass_through) {
+			m_emitted++;
+			m_last_out = now;
+			g_clock_passed_through.fetch_add(1, std::memory_order_relaxed);
+		}
+		else { ensure_thread(); }
+		LeaveCriticalSection(&m_lock);
+		if (!pass_through) { SetEvent(m_wake); }
+		return !pass_through;
+	}
+
+	// midiOutClose: the thread doesn't send while the handle is being closed, and the engine
+	// stops only if the close succeeded. Otherwise it carries on as before.
+	void closing() { EnterCriticalSection(&m_lock); }
+
+	void closed(bool success) {
+		if (success) { m_exit = true; }
+		LeaveCriticalSection(&m_lock);
+		if (success) { stop(); }
+	}
+
+	// After the handle is closed, or at process detach. The thread can't exit while DllMain
+	// holds the loader lock, so this returns once it has left the engine.
+	void stop() {
+		m_exit = true;
+		if (m_wake) { SetEvent(m_wake); }
+		if (m_thread) {
+			while (m_running && WaitForSingleObject(m_thread, 1) == WAIT_TIMEOUT) {}
+			CloseHandle(m_thread);
+			m_thread = NULL;
+		}
+	}
+
+private:
+	// Called with m_lock held. Clocks already sent ahead of the application are not taken back.
+	void restart() {
+		m_received = m_emitted = 0;
+		m_generation++;
+	}
+
+	void ensure_thread() {
+		if (m_thread || m_exit) { return; }
+		m_running = true;
+		m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+		if (m_thread) { SetThreadPriority(m_thread, g_clock_engine_config.priority); }
+		else { m_running = false; }
+	}
+
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		auto engine = (clock_engine*)param;
+		engine->run();
+		engine->m_running = false;	// Last access to the engine
+		return 0;
+	}
+
+	void run() {
+		g_timer_periods.begin(NULL, L"clock engine", 1);
+		uint64_t spin_ticks = g_clock_engine_config.spin_us * g_qpc_frequency.QuadPart / 1000000;
+		while (!m_exit) {
+			EnterCriticalSection(&m_lock);
+			if (m_received < 2 || m_emitted >= m_received + g_clock_engine_config.max_lead) {
+				LeaveCriticalSection(&m_lock);
+				WaitForSingleObject(m_wake, INFINITE);
+				continue;
+			}
+			uint64_t generation = m_generation;
+			// Predicted time of the next clock to send
+			double due_at = m_next + ((double)m_emitted - (double)m_received) * m_period;
+			uint64_t due = due_at > 0 ? (uint64_t)due_at : 0;
+			bool behind = m_received > m_emitted + 1;
+			LeaveCriticalSection(&m_lock);
+
+			uint64_t now = qpc_now();
+			if (!behind && due > now + spin_ticks) {
+				WaitForSingleObject(m_wake, (DWORD)((due - now - spin_ticks) * 1000 / g_qpc_frequency.QuadPart));
+				continue;
+			}
+			while (!behind && qpc_now() < due && !m_exit && m_generation == generation) { YieldProcessor(); }
+
+			EnterCriticalSection(&m_lock);
+			if (m_generation != generation || m_exit) {
+				LeaveCriticalSection(&m_lock);
+				continue;
+			}
+			now = qpc_now();
+			MMmidiOutShortMsg(m_native, 0xF8);
+			g_clock_out_jitter.record((uint64_t)std::abs((double)(now - m_last_out) - m_period));
+			if (behind) { g_clock_catch_ups.fetch_add(1, std::memory_order_relaxed); }
+			m_last_out = now;
+			m_emitted++;
+			LeaveCriticalSection(&m_lock);
+		}
+		g_timer_periods.end(NULL, L"clock engine", 1);
+	}
+
+	HMIDIOUT m_native;
+	CRITICAL_SECTION m_lock;		// Protects the loop state
+	HANDLE m_wake = NULL;
+	HANDLE m_thread = NULL;
+	std::atomic<bool> m_exit{ false };
+	std::atomic<bool> m_running{ false };	// The thread still uses the engine
+	std::atomic<uint64_t> m_generation{ 0 };	// Bumped on restart, so a pending send is dropped
+
+	uint64_t m_received = 0;		// Application clocks since the last restart
+	uint64_t m_emitted = 0;			// Clocks sent since the last restart
+	uint64_t m_last_in = 0;			// QPC
+	uint64_t m_last_out = 0;
+	double m_period = 0;			// QPC ticks
+	double m_next = 0;				// Predicted QPC time of application clock m_received + 1
+};
+
+json clock_engine_stats_json() {
+	return json{
+		{ "bpm", g_clock_bpm.load() },
+		{ "passed_through", g_clock_passed_through.load() },
+		{ "relocks", g_clock_relocks.load() },
+		{ "catch_ups", g_clock_catch_ups.load() },
+		{ "flushed", g_clock_flushed.load() },
+		{ "application", g_clock_in_jitter.to_json() },
+		{ "sent", g_clock_out_jitter.to_json() }
+	};
+}
@@ -0,0 +1,211 @@
+// Answers Universal Identity Requests (F0 7E <device> 06 01 F7) sent on one output with an
+// identity reply on one input, right away, instead of waiting for the device's own reply.
+// The reply comes from the config or from a cache file. Without either, requests go to the
+// device, and its first reply is captured and saved to the cache file at exit, so later
+// requests (and later runs) are answered by the wrapper.
+// Replies are queued through the input buffer pool of the configured input, which is created
+// for it even if the pool isn't enabled. The reply is kept as the device sends it; input SysEx
+// rewrite rules apply to the wrapper's answers as they do to the device's own replies.
+
+struct identity_responder_config {
+	UINT output_device = 0;
+	UINT input_device = 0;
+	std::vector<uint8_t> reply;							// Empty: not configured
+	std::optional<std::string> maybe_cache_file;
+};
+
+bool g_identity_responder_enabled = false;
+identity_responder_config g_identity_responder_config;
+
+std::atomic<uint64_t> g_identity_requests{ 0 };
+std::atomic<uint64_t> g_identity_answered{ 0 };
+std::atomic<uint64_t> g_identity_forwarded{ 0 };		// No reply known yet, or the input wasn't open
+std::atomic<uint64_t> g_identity_captured{ 0 };
+std::atomic<uint64_t> g_identity_answer_ticks{ 0 };		// Request to reply queued for the application
+std::atomic<uint64_t> g_identity_device_reply_ticks{ 0 };	// Request to the device's own reply
+std::atomic<uint64_t> g_identity_device_replies{ 0 };
+
+class identity_responder {
+public:
+	static bool is_request(uint8_t const* data, size_t length) {
+		return length == 6 && data[0] == 0xF0 && data[1] == 0x7E && data[3] == 0x06 && data[4] == 0x01 && data[5] == 0xF7;
+	}
+
+	static bool is_reply(uint8_t const* data, size_t length) {
+		return length >= 6 && data[0] == 0xF0 && data[1] == 0x7E && data[3] == 0x06 && data[4] == 0x02 && data[length - 1] == 0xF7;
+	}
+
+	// Called once the config is loaded
+	void load(identity_responder_config const& cfg) {
+		m_reply = cfg.reply;
+		if (m_reply.empty() && cfg.maybe_cache_file.has_value()) {
+			std::ifstream in(cfg.maybe_cache_file.value());
+			std::string text;
+			if (in && std::getline(in, text)) {
+				try {
+					auto bytes = parse_sysex_pattern(text);
+					std::vector<uint8_t> reply(bytes.begin(), bytes.end());
+					if (std::find(bytes.begin(), bytes.end(), -1) == bytes.end() && is_reply(reply.data(), reply.size())) { m_reply = reply; }
+				}
+				catch (std::runtime_error&) {}		// Captured again
+			}
+		}
+	}
+
+	// midiOutLongMsg on the configured output. Returns true if the request is answered by
+	// the wrapper, in which case it never reaches the device.
+	bool on_output(HMIDIOUT hmo, midi_out_handle_state const& state, LPMIDIHDR pmh) {
+		if (state.device_id != g_identity_responder_config.output_device ||
+			!is_request((uint8_t const*)pmh->lpData, pmh->dwBufferLength)) {
+			return false;
+		}
+		g_identity_requests.fetch_add(1, std::memory_order_relaxed);
+		uint64_t now = qpc_now();
+		AcquireSRWLockExclusive(&m_lock);
+		bool known = !m_reply.empty() && m_input_open;
+		if (known) {
+			pmh->dwFlags = (pmh->dwFlags | MHDR_INQUEUE) & ~MHDR_DONE;
+			m_answers.push_back({ hmo, pmh, state.app, now });
+		}
+		else {
+			m_requested_at = now;
+			g_identity_forwarded.fetch_add(1, std::memory_order_relaxed);
+		}
+		bool start = known && !m_thread && !m_exit;
+		if (start) {
+			m_running = true;
+			m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+			if (!m_thread) { m_running = false; }
+		}
+		ReleaseSRWLockExclusive(&m_lock);
+		if (!known) { return false; }
+		if (start && m_thread) { SetThreadPriority(m_thread, THREAD_PRIORITY_ABOVE_NORMAL); }
+		WakeConditionVariable(&m_wake);
+		return true;
+	}
+
+	// A complete SysEx message from the device on the configured input, before rewriting
+	void on_input(uint8_t const* data, size_t length) {
+		if (!is_reply(data, length)) { return; }
+		AcquireSRWLockExclusive(&m_lock);
+		if (m_requested_at) {
+			g_identity_device_reply_ticks.fetch_add(qpc_now() - m_requested_at, std::memory_order_relaxed);
+			g_identity_device_replies.fetch_add(1, std::memory_order_relaxed);
+			m_requested_at = 0;
+		}
+		if (m_reply.empty()) {
+			m_reply.assign(data, data + length);
+			m_captured = true;
+			g_identity_captured.fetch_add(1, std::memory_order_relaxed);
+		}
+		ReleaseSRWLockExclusive(&m_lock);
+	}
+
+	void input_opened() { set_input_open(true); }
+	void input_closed() { set_input_open(false); }
+
+	// Writes a captured reply to the cache file
+	void save() {
+		if (!m_captured || !g_identity_responder_config.maybe_cache_file.has_value()) { return; }
+		FILE* f = fopen(g_identity_responder_config.maybe_cache_file.value().c_str(), "w");
+		if (!f) { return; }
+		for (size_t i = 0; i < m_reply.size(); i++) { fprintf(f, i ? " %02X" : "%02X", m_reply[i]); }
+		fprintf(f, "\n");
+		fclose(f);
+	}
+
+	// Process detach. Answers still queued are dropped. The thread can't exit under the loader
+	// lock, so this waits for it to leave the responder rather than for its handle alone.
+	void stop() {
+		AcquireSRWLockExclusive(&m_lock);
+		m_exit = true;
+		HANDLE thread = m_thread;
+		ReleaseSRWLockExclusive(&m_lock);
+		WakeConditionVariable(&m_wake);
+		if (thread) {
+			while (m_running && WaitForSingleObject(thread, 1) == WAIT_TIMEOUT) {}
+		}
+	}
+
+private:
+	struct answer {
+		HMIDIOUT hmo;
+		LPMIDIHDR pmh;
+		app_callback app;
+		uint64_t requested_at;		// QPC
+	};
+
+	void set_input_open(bool open) {
+		AcquireSRWLockExclusive(&m_lock);
+		m_input_open = open;
+		ReleaseSRWLockExclusive(&m_lock);
+	}
+
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		auto responder = (identity_responder*)param;
+		responder->run();
+		responder->m_running = false;	// Last access to the responder
+		return 0;
+	}
+
+	// Completes the request the way the driver would, then queues the reply on the input
+	void run() {
+		std::vector<answer> answers;
+		std::vector<uint8_t> reply;
+		AcquireSRWLockExclusive(&m_lock);
+		while (!m_exit) {
+			if (m_answers.empty()) {
+				SleepConditionVariableSRW(&m_wake, &m_lock, INFINITE, 0);
+				continue;
+			}
+			answers.swap(m_answers);
+			reply = m_reply;
+			ReleaseSRWLockExclusive(&m_lock);
+			for (auto& a : answers) {
+				a.pmh->dwFlags = (a.pmh->dwFlags | MHDR_DONE) & ~MHDR_INQUEUE;
+				a.app.invoke(a.hmo, MOM_DONE, (DWORD_PTR)a.pmh, 0);
+				bool queued = false;
+				g_midi_in_handles.for_each([&](HMIDIIN, midi_in_handle_state& state) {
+					if (queued || !state.identity || !state.pool) { return; }
+					DWORD timestamp = state.started_at ? MMtimeGetTime() - state.started_at : 0;
+					state.pool->inject(reply.data(), reply.size(), timestamp);
+					queued = true;
+				});
+				if (queued) {
+					g_identity_answered.fetch_add(1, std::memory_order_relaxed);
+					g_identity_answer_ticks.fetch_add(qpc_now() - a.requested_at, std::memory_order_relaxed);
+				}
+			}
+			answers.clear();
+			AcquireSRWLockExclusive(&m_lock);
+		}
+		ReleaseSRWLockExclusive(&m_lock);
+	}
+
+	SRWLOCK m_lock = SRWLOCK_INIT;					// Protects everything below
+	CONDITION_VARIABLE m_wake = CONDITION_VARIABLE_INIT;
+	std::vector<uint8_t> m_reply;
+	bool m_captured = false;
+	bool m_input_open = false;
+	uint64_t m_requested_at = 0;					// Last request sent to the device, QPC
+	std::vector<answer> m_answers;
+	HANDLE m_thread = NULL;
+	bool m_exit = false;
+	std::atomic<bool> m_running{ false };			// The thread still uses the responder; not under m_lock
+};
+
+identity_responder g_identity_responder;
+
+json identity_responder_stats_json() {
+	uint64_t answered = g_identity_answered.load();
+	uint64_t device_replies = g_identity_device_replies.load();
+	return json{
+		{ "requests", g_identity_requests.load() },
+		{ "answered", answered },
+		{ "forwarded", g_identity_forwarded.load() },
+		{ "captured", g_identity_captured.load() },
+		{ "mean_answer_us", answered ? ticks_to_ns(g_identity_answer_ticks.load()) / answered / 1000 : 0.0 },
+		{ "device_replies", device_replies },
+		{ "mean_device_reply_us", device_replies ? ticks_to_ns(g_identity_device_reply_ticks.load()) / device_replies / 1000 : 0.0 }
+	};
+}
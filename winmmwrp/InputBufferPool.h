@@ -0,0 +1,325 @@
+// Wrapper-managed SysEx input buffers. A configurable number of buffers is kept queued with
+// the native driver at all times. Incoming SysEx, which may span several of those buffers,
+// is reassembled into a contiguous message in a ring arena, and copied into the application's
+// own buffers (queued through midiInAddBuffer) as soon as they are available.
+// Returned native buffers are recycled by a worker thread, because the driver callback must
+// not call back into WinMM.
+// A message that ended in a buffer returned with MIM_LONGERROR is delivered as MIM_LONGERROR,
+// in every application buffer it takes up.
+
+struct input_pool_config {
+	size_t buffers = 16;
+	size_t buffer_size = 4096;
+	size_t arena_size = 1 << 20;	// Also the largest SysEx that can be reassembled
+	size_t max_pending = 256;		// Completed messages waiting for application buffers
+};
+
+bool g_input_pool_enabled = false;
+input_pool_config g_input_pool_config;
+
+std::atomic<uint64_t> g_input_pool_messages{ 0 };
+std::atomic<uint64_t> g_input_pool_dropped_overflow{ 0 };	// Arena or pending queue full
+std::atomic<uint64_t> g_input_pool_dropped_too_long{ 0 };	// Larger than the arena
+std::atomic<uint64_t> g_input_pool_split{ 0 };				// Needed more than one application buffer
+std::atomic<uint64_t> g_input_pool_errors{ 0 };				// Ended in an MIM_LONGERROR buffer
+
+class input_buffer_pool {
+public:
+	input_buffer_pool(HMIDIIN hmi, app_callback const& app, input_pool_config const& cfg) :
+		m_hmi(hmi),
+		m_app(app),
+		m_cfg(cfg),
+		m_native_data(cfg.buffers * cfg.buffer_size),
+		m_native_hdrs(cfg.buffers),
+		m_arena(cfg.arena_size),
+		m_pending(cfg.max_pending) {
+		InitializeCriticalSection(&m_lock);
+		m_reassembly.reserve(cfg.arena_size);
+		m_recycle.reserve(cfg.buffers);
+		m_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+	}
+
+	~input_buffer_pool() {
+		DeleteCriticalSection(&m_lock);
+		if (m_wake) { CloseHandle(m_wake); }
+	}
+
+	// Prepares the native buffers, queues them with the driver and starts the worker.
+	MMRESULT start() {
+		for (size_t i = 0; i < m_cfg.buffers; i++) {
+			auto& hdr = m_native_hdrs[i];
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.lpData = (LPSTR)&m_native_data[i * m_cfg.buffer_size];
+			hdr.dwBufferLength = (DWORD)m_cfg.buffer_size;
+			MMRESULT rval = MMmidiInPrepareHeader(m_hmi, &hdr, sizeof(hdr));
+			if (rval == MMSYSERR_NOERROR) { rval = MMmidiInAddBuffer(m_hmi, &hdr, sizeof(hdr)); }
+			if (rval != MMSYSERR_NOERROR) { return rval; }
+		}
+		m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+		if (m_thread) { SetThreadPriority(m_thread, THREAD_PRIORITY_ABOVE_NORMAL); }
+		return MMSYSERR_NOERROR;
+	}
+
+	// Stops recycling. Buffers the driver returns from now on stay with the wrapper.
+	void stop() {
+		m_stop = true;
+		SetEvent(m_wake);
+		if (m_thread) {
+			WaitForSingleObject(m_thread, INFINITE);
+			CloseHandle(m_thread);
+			m_thread = NULL;
+		}
+	}
+
+	// Unprepares the native buffers. The driver must have returned them already, i.e. call
+	// after stop() and the native midiInReset.
+	void release() {
+		for (auto& hdr : m_native_hdrs) {
+			MMmidiInUnprepareHeader(m_hmi, &hdr, sizeof(hdr));
+		}
+	}
+
+	bool owns(LPMIDIHDR hdr) const {
+		return hdr >= m_native_hdrs.data() && hdr < m_native_hdrs.data() + m_native_hdrs.size();
+	}
+
+	// Driver callback for one of our native buffers (MIM_LONGDATA / MIM_LONGERROR).
+	void on_native_buffer(LPMIDIHDR hdr, DWORD_PTR timestamp, bool error) {
+		EnterCriticalSection(&m_lock);
+		if (hdr->dwBytesRecorded > 0 && !m_resetting) {
+			if (m_reassembly.empty()) { m_reassembly_timestamp = timestamp; }
+			size_t room = m_reassembly.capacity() - m_reassembly.size();
+			if (hdr->dwBytesRecorded <= room) {
+				m_reassembly.insert(m_reassembly.end(), hdr->lpData, hdr->lpData + hdr->dwBytesRecorded);
+			}
+			else {
+				m_reassembly_too_long = true;
+			}
+			bool complete = error || (uint8_t)hdr->lpData[hdr->dwBytesRecorded - 1] == 0xF7;
+			if (complete) { finish_message(error); }
+		}
+		else if (error && !m_resetting && (!m_reassembly.empty() || m_reassembly_too_long)) {
+			// An empty error buffer still ends the message in progress
+			finish_message(true);
+		}
+		if (!m_stop) { m_recycle.push_back(hdr); }
+		LeaveCriticalSection(&m_lock);
+		SetEvent(m_wake);
+	}
+
+	// A complete message from the wrapper itself, delivered like one from the driver, input
+	// SysEx rewriting included
+	void inject(uint8_t const* data, size_t length, DWORD_PTR timestamp) {
+		std::vector<uint8_t> message(data, data + length);
+		if (g_sysex_rewrite_enabled) { g_sysex_rewriter.rewrite(message.data(), message.size(), false); }
+		EnterCriticalSection(&m_lock);
+		if (!m_resetting && !m_stop) { queue_message(message.data(), message.size(), timestamp, false); }
+		LeaveCriticalSection(&m_lock);
+		SetEvent(m_wake);
+	}
+
+	// Called with every complete message from the driver, as the driver sent it, before
+	// SysEx rewriting. Set before start().
+	void set_message_hook(void (*hook)(uint8_t const* data, size_t length)) { m_message_hook = hook; }
+
+	// Application's midiInAddBuffer. The header is queued with the wrapper, not the driver.
+	MMRESULT add_app_buffer(LPMIDIHDR hdr) {
+		if (!hdr || !(hdr->dwFlags & MHDR_PREPARED)) { return MIDIERR_UNPREPARED; }
+		if (hdr->dwFlags & MHDR_INQUEUE) { return MIDIERR_STILLPLAYING; }
+		EnterCriticalSection(&m_lock);
+		hdr->dwFlags = (hdr->dwFlags | MHDR_INQUEUE) & ~MHDR_DONE;
+		hdr->dwBytesRecorded = 0;
+		hdr->lpNext = NULL;
+		if (m_app_tail) { m_app_tail->lpNext = hdr; }
+		else { m_app_head = hdr; }
+		m_app_tail = hdr;
+		bool have_pending = m_pending_count > 0;
+		LeaveCriticalSection(&m_lock);
+		if (have_pending) { SetEvent(m_wake); }
+		return MMSYSERR_NOERROR;
+	}
+
+	bool has_app_buffers() {
+		EnterCriticalSection(&m_lock);
+		bool rval = m_app_head != NULL;
+		LeaveCriticalSection(&m_lock);
+		return rval;
+	}
+
+	// Application's midiInReset: drop everything not yet delivered and return all
+	// application buffers as done.
+	void begin_reset() {
+		EnterCriticalSection(&m_lock);
+		m_resetting = true;
+		LeaveCriticalSection(&m_lock);
+	}
+
+	void end_reset() {
+		EnterCriticalSection(&m_lock);
+		m_resetting = false;
+		m_reassembly.clear();
+		m_reassembly_too_long = false;
+		m_pending_count = 0;
+		LPMIDIHDR hdr = m_app_head;
+		m_app_head = m_app_tail = NULL;
+		LeaveCriticalSection(&m_lock);
+		while (hdr) {
+			LPMIDIHDR next = hdr->lpNext;
+			hdr->dwFlags = (hdr->dwFlags | MHDR_DONE) & ~MHDR_INQUEUE;
+			m_app.invoke(m_hmi, MIM_LONGDATA, (DWORD_PTR)hdr, 0);
+			hdr = next;
+		}
+	}
+
+private:
+	struct pending_msg {
+		size_t offset;
+		size_t length;
+		size_t delivered;
+		DWORD_PTR timestamp;
+		bool error;
+	};
+
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		((input_buffer_pool*)param)->run();
+		return 0;
+	}
+
+	void run() {
+		std::vector<LPMIDIHDR> recycle;
+		recycle.reserve(m_cfg.buffers);
+		while (!m_stop) {
+			WaitForSingleObject(m_wake, INFINITE);
+			EnterCriticalSection(&m_lock);
+			recycle.swap(m_recycle);
+			LeaveCriticalSection(&m_lock);
+			for (auto hdr : recycle) {
+				hdr->dwBytesRecorded = 0;
+				hdr->dwFlags &= ~MHDR_DONE;
+				if (!m_stop) { MMmidiInAddBuffer(m_hmi, hdr, sizeof(*hdr)); }
+			}
+			recycle.clear();
+			deliver();
+		}
+	}
+
+	// Called with m_lock held
+	void finish_message(bool error) {
+		if (error) { g_input_pool_errors.fetch_add(1, std::memory_order_relaxed); }
+		if (m_reassembly_too_long) {
+			g_input_pool_dropped_too_long.fetch_add(1, std::memory_order_relaxed);
+		}
+		else {
+			if (m_message_hook && !error) { m_message_hook(m_reassembly.data(), m_reassembly.size()); }
+			if (g_sysex_rewrite_enabled) { g_sysex_rewriter.rewrite(m_reassembly.data(), m_reassembly.size(), false); }
+			queue_message(m_reassembly.data(), m_reassembly.size(), m_reassembly_timestamp, error);
+		}
+		m_reassembly.clear();
+		m_reassembly_too_long = false;
+	}
+
+	// Called with m_lock held
+	void queue_message(uint8_t const* data, size_t length, DWORD_PTR timestamp, bool error) {
+		if (m_pending_count == m_pending.size()) {
+			g_input_pool_dropped_overflow.fetch_add(1, std::memory_order_relaxed);
+		}
+		else if (auto offset = arena_alloc(length)) {
+			memcpy(&m_arena[offset.value()], data, length);
+			m_pending[(m_pending_first + m_pending_count) % m_pending.size()] = { offset.value(), length, 0, timestamp, error };
+			m_pending_count++;
+			g_input_pool_messages.fetch_add(1, std::memory_order_relaxed);
+		}
+		else {
+			g_input_pool_dropped_overflow.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	// Messages are consumed in order, so free space is everything from the end of the newest
+	// message up to the start of the oldest one (wrapping around). Called with m_lock held.
+	std::optional<size_t> arena_alloc(size_t length) {
+		if (m_pending_count == 0) { m_arena_head = 0; }
+		size_t tail = m_pending_count ? m_pending[m_pending_first].offset : m_arena_head;
+		size_t rval = m_arena_head;
+		if (m_arena_head >= tail) {
+			if (m_arena.size() - m_arena_head < length) {
+				if (length >= tail) { return std::nullopt; }
+				rval = 0;
+			}
+		}
+		else if (tail - m_arena_head <= length) {
+			return std::nullopt;
+		}
+		m_arena_head = rval + length;
+		return rval;
+	}
+
+	// Copies completed messages into application buffers, splitting them if needed.
+	void deliver() {
+		while (true) {
+			EnterCriticalSection(&m_lock);
+			if (m_pending_count == 0 || !m_app_head) {
+				LeaveCriticalSection(&m_lock);
+				return;
+			}
+			auto& msg = m_pending[m_pending_first];
+			LPMIDIHDR hdr = m_app_head;
+			m_app_head = hdr->lpNext;
+			if (!m_app_head) { m_app_tail = NULL; }
+			size_t n = msg.length - msg.delivered;
+			if (n > hdr->dwBufferLength) {
+				n = hdr->dwBufferLength;
+				if (msg.delivered == 0) { g_input_pool_split.fetch_add(1, std::memory_order_relaxed); }
+			}
+			memcpy(hdr->lpData, &m_arena[msg.offset + msg.delivered], n);
+			msg.delivered += n;
+			DWORD_PTR timestamp = msg.timestamp;
+			UINT wMsg = msg.error ? MIM_LONGERROR : MIM_LONGDATA;
+			if (msg.delivered == msg.length) {
+				m_pending_first = (m_pending_first + 1) % m_pending.size();
+				m_pending_count--;
+			}
+			hdr->dwBytesRecorded = (DWORD)n;
+			hdr->dwFlags = (hdr->dwFlags | MHDR_DONE) & ~MHDR_INQUEUE;
+			LeaveCriticalSection(&m_lock);
+			m_app.invoke(m_hmi, wMsg, (DWORD_PTR)hdr, timestamp);
+		}
+	}
+
+	HMIDIIN m_hmi;
+	app_callback m_app;
+	input_pool_config m_cfg;
+
+	CRITICAL_SECTION m_lock;	// Protects everything below, except the native buffers themselves
+	HANDLE m_wake = NULL;
+	HANDLE m_thread = NULL;
+	std::atomic<bool> m_stop{ false };
+	bool m_resetting = false;
+	void (*m_message_hook)(uint8_t const* data, size_t length) = nullptr;
+
+	std::vector<char> m_native_data;
+	std::vector<MIDIHDR> m_native_hdrs;
+	std::vector<LPMIDIHDR> m_recycle;
+
+	std::vector<uint8_t> m_reassembly;
+	DWORD_PTR m_reassembly_timestamp = 0;
+	bool m_reassembly_too_long = false;
+
+	std::vector<uint8_t> m_arena;
+	size_t m_arena_head = 0;
+	std::vector<pending_msg> m_pending;		// Ring of completed messages
+	size_t m_pending_first = 0;
+	size_t m_pending_count = 0;
+
+	LPMIDIHDR m_app_head = NULL;			// Application buffers, chained through lpNext
+	LPMIDIHDR m_app_tail = NULL;
+};
+
+json input_pool_stats_json() {
+	return json{
+		{ "messages", g_input_pool_messages.load() },
+		{ "dropped_overflow", g_input_pool_dropped_overflow.load() },
+		{ "dropped_too_long", g_input_pool_dropped_too_long.load() },
+		{ "split_over_app_buffers", g_input_pool_split.load() },
+		{ "errors", g_input_pool_errors.load() }
+	};
+}
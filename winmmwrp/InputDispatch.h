@@ -0,0 +1,230 @@
+// Decoupled input callbacks. The driver callback only puts each message in a lock-free ring,
+// and a dispatcher thread per handle calls the application, so a slow callback no longer
+// holds up the driver's delivery thread (and the timestamps it takes). When the ring is full,
+// short messages are dropped according to the overflow policy; messages that carry a buffer
+// or open/close the handle are never dropped, the driver thread waits for room instead.
+
+enum class input_overflow { Block, DropNewest, DropOldest };
+
+struct input_dispatch_config {
+	size_t capacity = 4096;		// Power of two
+	input_overflow overflow = input_overflow::Block;
+	int priority = THREAD_PRIORITY_ABOVE_NORMAL;
+};
+
+bool g_input_dispatch_enabled = false;
+input_dispatch_config g_input_dispatch_config;
+
+std::atomic<uint64_t> g_input_dispatch_queued{ 0 };
+std::atomic<uint64_t> g_input_dispatch_delivered{ 0 };
+std::atomic<uint64_t> g_input_dispatch_dropped{ 0 };
+std::atomic<uint64_t> g_input_dispatch_blocked{ 0 };		// Pushes that had to wait for room
+std::atomic<uint64_t> g_input_dispatch_max_depth{ 0 };
+std::atomic<uint64_t> g_input_dispatch_max_latency_ticks{ 0 };
+std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> g_input_dispatch_depth_histogram{};		// log2 of the messages already queued
+std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> g_input_dispatch_latency_histogram{};	// log2 ns from the driver callback to the application's
+
+class input_dispatcher {
+public:
+	input_dispatcher(app_callback const& app, input_dispatch_config const& cfg) :
+		m_app(app),
+		m_overflow(cfg.overflow),
+		m_ring(cfg.capacity),
+		m_mask(cfg.capacity - 1) {
+		m_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+		m_drained = CreateEventW(NULL, FALSE, FALSE, NULL);
+		m_room = CreateEventW(NULL, FALSE, FALSE, NULL);
+	}
+
+	~input_dispatcher() {
+		if (m_wake) { CloseHandle(m_wake); }
+		if (m_drained) { CloseHandle(m_drained); }
+		if (m_room) { CloseHandle(m_room); }
+		if (m_thread) { CloseHandle(m_thread); }
+	}
+
+	bool start(int priority) {
+		m_thread = CreateThread(NULL, 0, thread_proc, this, 0, &m_thread_id);
+		if (m_thread) { SetThreadPriority(m_thread, priority); }
+		return m_thread != NULL;
+	}
+
+	// Delivers what is queued and ends the thread. Returns false if called from the
+	// application's callback, in which case the thread ends on its own and the dispatcher
+	// must be left alive, until on_exit (see delete_on_exit).
+	bool stop() {
+		flush();
+		m_exit = true;
+		SetEvent(m_wake);
+		if (GetCurrentThreadId() == m_thread_id) { return false; }
+		if (m_thread) {
+			WaitForSingleObject(m_thread, INFINITE);
+			CloseHandle(m_thread);
+			m_thread = NULL;
+		}
+		return true;
+	}
+
+	// After stop() returned false: the thread calls on_exit(context) once the callback has
+	// returned, as the last thing it does. on_exit may delete the dispatcher.
+	void delete_on_exit(void (*on_exit)(void*), void* context) {
+		m_on_exit = on_exit;
+		m_on_exit_context = context;
+	}
+
+	// Driver callback. Messages come from one driver thread at a time.
+	void push(HMIDIIN hmi, UINT msg, DWORD_PTR p1, DWORD_PTR p2) {
+		entry e{ hmi, msg, p1, p2, qpc_now() };
+		bool waited = false;
+		while (true) {
+			uint64_t head = m_head.load(std::memory_order_relaxed);
+			uint64_t tail = m_tail.load(std::memory_order_acquire);
+			if (head - tail <= m_mask) {
+				m_ring[head & m_mask] = e;
+				m_head.store(head + 1, std::memory_order_seq_cst);
+				record_depth(head - tail);
+				g_input_dispatch_queued.fetch_add(1, std::memory_order_relaxed);
+				if (m_sleeping.load(std::memory_order_seq_cst)) { SetEvent(m_wake); }
+				return;
+			}
+			if (m_overflow == input_overflow::DropNewest && droppable(msg)) {
+				g_input_dispatch_dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			if (m_overflow == input_overflow::DropOldest && droppable(m_ring[tail & m_mask].msg)) {
+				// Races with the dispatcher taking the same entry; whoever moves the tail has it
+				if (m_tail.compare_exchange_strong(tail, tail + 1, std::memory_order_acq_rel)) {
+					g_input_dispatch_dropped.fetch_add(1, std::memory_order_relaxed);
+				}
+				continue;
+			}
+			if (!waited) {
+				waited = true;
+				g_input_dispatch_blocked.fetch_add(1, std::memory_order_relaxed);
+			}
+			// Sleeps until the dispatcher takes an entry. The flag is set before looking at
+			// the ring again, so either the dispatcher sees it or this sees the room.
+			m_waiting_for_room.store(true, std::memory_order_seq_cst);
+			if (head - m_tail.load(std::memory_order_seq_cst) > m_mask) { WaitForSingleObject(m_room, INFINITE); }
+			m_waiting_for_room.store(false, std::memory_order_relaxed);
+		}
+	}
+
+	// Waits until everything queued so far has been delivered, e.g. so that buffers returned
+	// by midiInReset have reached the application when the call returns. Does nothing from
+	// the application's callback.
+	void flush() {
+		if (GetCurrentThreadId() == m_thread_id || !m_thread) { return; }
+		uint64_t target = m_head.load(std::memory_order_acquire);
+		while (m_completed.load(std::memory_order_acquire) < target && !m_thread_done) {
+			SetEvent(m_wake);
+			WaitForSingleObject(m_drained, 1);
+		}
+	}
+
+private:
+	struct entry {
+		HMIDIIN hmi;
+		UINT msg;
+		DWORD_PTR p1;
+		DWORD_PTR p2;
+		uint64_t queued_at;		// QPC
+	};
+
+	// Short messages and errors; the rest carries a buffer or changes the handle's state
+	static bool droppable(UINT msg) {
+		return msg == MIM_DATA || msg == MIM_MOREDATA || msg == MIM_ERROR;
+	}
+
+	static void record_depth(uint64_t depth) {
+		g_input_dispatch_depth_histogram[histogram_bucket(depth)].fetch_add(1, std::memory_order_relaxed);
+		uint64_t prev_max = g_input_dispatch_max_depth.load(std::memory_order_relaxed);
+		while (depth > prev_max && !g_input_dispatch_max_depth.compare_exchange_weak(prev_max, depth, std::memory_order_relaxed)) {}
+	}
+
+	static void record_latency(uint64_t ticks) {
+		g_input_dispatch_latency_histogram[histogram_bucket((uint64_t)ticks_to_ns(ticks))].fetch_add(1, std::memory_order_relaxed);
+		uint64_t prev_max = g_input_dispatch_max_latency_ticks.load(std::memory_order_relaxed);
+		while (ticks > prev_max && !g_input_dispatch_max_latency_ticks.compare_exchange_weak(prev_max, ticks, std::memory_order_relaxed)) {}
+	}
+
+	// Takes the oldest entry, unless the driver thread dropped it first
+	bool pop(entry& out) {
+		while (true) {
+			uint64_t tail = m_tail.load(std::memory_order_acquire);
+			if (tail == m_head.load(std::memory_order_acquire)) { return false; }
+			entry e = m_ring[tail & m_mask];
+			if (m_tail.compare_exchange_strong(tail, tail + 1, std::memory_order_seq_cst)) {
+				out = e;
+				if (m_waiting_for_room.load(std::memory_order_seq_cst)) { SetEvent(m_room); }
+				return true;
+			}
+		}
+	}
+
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		auto dispatcher = (input_dispatcher*)param;
+		dispatcher->run();
+		if (dispatcher->m_on_exit) { dispatcher->m_on_exit(dispatcher->m_on_exit_context); }
+		return 0;
+	}
+
+	void run() {
+		entry e;
+		while (true) {
+			while (pop(e)) {
+				record_latency(qpc_now() - e.queued_at);
+				m_app.invoke(e.hmi, e.msg, e.p1, e.p2);
+				g_input_dispatch_delivered.fetch_add(1, std::memory_order_relaxed);
+				m_completed.store(m_tail.load(std::memory_order_acquire), std::memory_order_release);
+			}
+			m_completed.store(m_tail.load(std::memory_order_acquire), std::memory_order_release);
+			SetEvent(m_drained);
+			if (m_exit) { break; }
+			m_sleeping.store(true, std::memory_order_seq_cst);
+			if (m_tail.load(std::memory_order_seq_cst) == m_head.load(std::memory_order_seq_cst)) {
+				WaitForSingleObject(m_wake, INFINITE);
+			}
+			m_sleeping.store(false, std::memory_order_relaxed);
+		}
+		m_thread_done = true;
+		SetEvent(m_drained);
+	}
+
+	app_callback m_app;
+	input_overflow m_overflow;
+	std::vector<entry> m_ring;
+	uint64_t m_mask;
+	std::atomic<uint64_t> m_head{ 0 };		// Next entry to write; only the driver thread moves it
+	std::atomic<uint64_t> m_tail{ 0 };		// Next entry to deliver; moved by the dispatcher, or the driver thread dropping
+	std::atomic<uint64_t> m_completed{ 0 };	// Entries before this one are delivered or dropped
+	std::atomic<bool> m_sleeping{ false };
+	std::atomic<bool> m_waiting_for_room{ false };	// The driver thread waits for m_room
+	std::atomic<bool> m_exit{ false };
+	std::atomic<bool> m_thread_done{ false };
+	HANDLE m_wake = NULL;
+	HANDLE m_drained = NULL;
+	HANDLE m_room = NULL;					// Set after an entry is taken while the driver thread waits
+	HANDLE m_thread = NULL;
+	DWORD m_thread_id = 0;
+	void (*m_on_exit)(void*) = nullptr;		// Only set and used on the thread itself
+	void* m_on_exit_context = nullptr;
+};
+
+json input_dispatch_stats_json() {
+	auto histogram = [](auto const& buckets) {
+		json rval = json::array();
+		for (auto& bucket : buckets) { rval.push_back(bucket.load()); }
+		return rval;
+	};
+	return json{
+		{ "queued", g_input_dispatch_queued.load() },
+		{ "delivered", g_input_dispatch_delivered.load() },
+		{ "dropped", g_input_dispatch_dropped.load() },
+		{ "blocked", g_input_dispatch_blocked.load() },
+		{ "max_depth", g_input_dispatch_max_depth.load() },
+		{ "depth_histogram_log2", histogram(g_input_dispatch_depth_histogram) },
+		{ "max_latency_ns", ticks_to_ns(g_input_dispatch_max_latency_ticks.load()) },
+		{ "latency_histogram_log2_ns", histogram(g_input_dispatch_latency_histogram) }
+	};
+}
@@ -0,0 +1,157 @@
+// The device interface queries (midiOutMessage / midiInMessage with DRV_QUERYDEVICEINTERFACESIZE
+// and DRV_QUERYDEVICEINTERFACE). The name comes from the first rule matching the device's
+// caps, or else from the driver. Like the rule code, this logs through the includer's
+// wrapper_log; the includer also defines should_log_query, which decides whether a query is
+// logged.
+
+// Queries the device's caps natively, for the first rule matching them
+std::optional<size_t> first_matching_rule(Direction devDirection, UINT_PTR deviceId, bool log) {
+	if (devDirection == Direction::Input) {
+		MIDIINCAPSW pmoc;
+		MMmidiInGetDevCapsW(deviceId, &pmoc, sizeof(pmoc));
+		auto ours = to_our_dev_caps(pmoc);
+		if (log) {
+			wrapper_log(nullptr, L"--> Transparently queried the device #%u properties for interface query. Found device:\n%ls", (unsigned)deviceId, stringify_caps(pmoc).c_str());
+		}
+		return g_replace_rules.first_match(ours);
+	} else {
+		MIDIOUTCAPSW pmoc;
+		MMmidiOutGetDevCapsW(deviceId, &pmoc, sizeof(pmoc));
+		auto ours = to_our_dev_caps(pmoc);
+		if (log) {
+			wrapper_log(nullptr, L"--> Transparently queried the device #%u properties for interface query. Found device:\n%ls", (unsigned)deviceId, stringify_caps(pmoc).c_str());
+		}
+		return g_replace_rules.first_match(ours);
+	}
+}
+
+// hm is either an open handle or a device ID. For a handle, the rule is only looked up by
+// the first query.
+std::optional<std::wstring> get_maybe_interface_name_override(Direction devDirection, UINT_PTR hm, bool log) {
+	std::optional<size_t> rule;
+	if (auto entry = g_handle_devices.find((HANDLE)hm); entry && entry->output == (devDirection == Direction::Output)) {
+		if (entry->rule == g_handle_rule_unresolved) {
+			rule = first_matching_rule(devDirection, entry->device_id, log);
+			g_handle_devices.resolve((HANDLE)hm, entry.value(), rule.has_value() ? (uint32_t)rule.value() : g_handle_rule_none);
+		}
+		else {
+			if (entry->rule != g_handle_rule_none) { rule = entry->rule; }
+			if (log) { wrapper_log(nullptr, L"--> Handle of device #%u, matching rules were looked up by an earlier query\n", entry->device_id); }
+		}
+	}
+	else {
+		rule = first_matching_rule(devDirection, hm, log);
+	}
+	if (!rule.has_value()) { return std::nullopt; }
+	return g_replace_rules.interface_name(rule.value());
+}
+
+template<typename HM>
+MMRESULT handle_QUERYDEVICEINTERFACESIZE(stats_timer &timer, Direction devDirection, HM hm, DWORD_PTR dw1, DWORD_PTR dw2) {
+	ULONG sz;
+	MMRESULT rval;
+	rval = timer.native([&] {
+		return devDirection == Direction::Input ?
+			MMmidiInMessage((HMIDIIN)hm, DRV_QUERYDEVICEINTERFACESIZE, reinterpret_cast<DWORD_PTR>(&sz), 0) :
+			MMmidiOutMessage(native_midi_out((HMIDIOUT)hm), DRV_QUERYDEVICEINTERFACESIZE, reinterpret_cast<DWORD_PTR>(&sz), 0);
+	});
+	bool log = should_log_query(devDirection == Direction::Input ? StatsEntry::midiInMessage_QUERYDEVICEINTERFACESIZE : StatsEntry::midiOutMessage_QUERYDEVICEINTERFACESIZE,
+		log_dedup::key_builder().add(hm).add(rval).add(rval == MMSYSERR_NOERROR ? sz : 0));
+	if (log) {
+		wrapper_log(nullptr, L"Handle query for device interface size for %s. Return code: %u (is error: %u). Native reported size: %d\n",
+		                      (devDirection == Direction::Input ? L"input" : L"output"),
+							  (unsigned) rval,
+							  (rval == MMSYSERR_NOERROR ? 0 : 1),
+							  sz);
+	}
+	std::optional<std::wstring> maybe_substitute = get_maybe_interface_name_override(devDirection, (UINT_PTR)hm, log);
+	auto &out_size = *reinterpret_cast<ULONG*>(dw1);
+	if (maybe_substitute.has_value()) {
+		int new_sz = sizeof(wchar_t) * (maybe_substitute.value().size() + 1);
+		if (log) { wrapper_log(nullptr, L"--> Matched a replace rule. Returning MMSYSERR_NOERROR with size %d of: %ls\n\n", new_sz, maybe_substitute.value().c_str()); }
+		auto *ptr = reinterpret_cast<ULONG*>(dw1);
+		out_size = new_sz;
+		rval = MMSYSERR_NOERROR;
+	} else {
+		if (log) { wrapper_log(nullptr, L"--> No match, returning native result.\n\n"); }
+		auto *ptr = reinterpret_cast<ULONG*>(dw1);
+		out_size = sz;
+	}
+	return rval;
+}
+
+template<typename HM>
+MMRESULT handle_QUERYDEVICEINTERFACE(stats_timer &timer, Direction devDirection, HM hm, DWORD_PTR dw1, DWORD_PTR dw2) {
+	MMRESULT rval;
+	rval = timer.native([&] {
+		return devDirection == Direction::Input ?
+			MMmidiInMessage((HMIDIIN)hm, DRV_QUERYDEVICEINTERFACE, dw1, dw2) :
+			MMmidiOutMessage(native_midi_out((HMIDIOUT)hm), DRV_QUERYDEVICEINTERFACE, dw1, dw2);
+	});
+	log_dedup::key_builder key;
+	key.add(hm).add(rval);
+	if (rval == MMSYSERR_NOERROR) {
+		key.add((const void*)dw1, wcsnlen(reinterpret_cast<wchar_t*>(dw1), dw2 / sizeof(wchar_t)) * sizeof(wchar_t));
+	}
+	bool log = should_log_query(devDirection == Direction::Input ? StatsEntry::midiInMessage_QUERYDEVICEINTERFACE : StatsEntry::midiOutMessage_QUERYDEVICEINTERFACE, key);
+	if (log) {
+		wrapper_log(nullptr, L"Handle query for device interface name for %s. Return code: %u (is error: %u). Native result: %ls\n",
+			                  (devDirection == Direction::Input ? L"input" : L"output"),
+		                      (unsigned) rval,
+							  (rval == MMSYSERR_NOERROR ? 0 : 1),
+							  reinterpret_cast<wchar_t*>(dw1));
+	}
+	std::optional<std::wstring> maybe_substitute = get_maybe_interface_name_override(devDirection, (UINT_PTR)hm, log);
+	auto &out_size = *reinterpret_cast<ULONG*>(dw1);
+	if (maybe_substitute.has_value()) {
+		if (log) { wrapper_log(nullptr, L"--> Matched a replace rule. Returning MMSYSERR_NOERROR with: %ls\n\n", maybe_substitute.value().c_str()); }
+		wcsncpy(reinterpret_cast<wchar_t*>(dw1), maybe_substitute.value().c_str(), dw2 / sizeof(wchar_t));
+		reinterpret_cast<wchar_t*>(dw1)[dw2 / sizeof(wchar_t) - 1] = L'\0';
+		rval = MMSYSERR_NOERROR;
+	}
+	else if (log) {
+		wrapper_log(nullptr, L"--> No match, returning native result.\n\n");
+	}
+	return rval;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutMessage(
+	_In_opt_ HMIDIOUT hmo,
+	_In_ UINT uMsg,
+	_In_opt_ DWORD_PTR dw1,
+	_In_opt_ DWORD_PTR dw2
+) {
+	// The queries translate shared output handles themselves, after looking up the device
+	switch (uMsg) {
+		case DRV_QUERYDEVICEINTERFACESIZE: {
+			stats_timer timer(StatsEntry::midiOutMessage_QUERYDEVICEINTERFACESIZE);
+			return handle_QUERYDEVICEINTERFACESIZE(timer, Direction::Output, hmo, dw1, dw2);
+		}
+		case DRV_QUERYDEVICEINTERFACE: {
+			stats_timer timer(StatsEntry::midiOutMessage_QUERYDEVICEINTERFACE);
+			return handle_QUERYDEVICEINTERFACE(timer, Direction::Output, hmo, dw1, dw2);
+		}
+		default:
+			return MMmidiOutMessage(native_midi_out(hmo), uMsg, dw1, dw2);
+	};
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiInMessage(
+	_In_opt_ HMIDIIN hmi,
+	_In_ UINT uMsg,
+	_In_opt_ DWORD_PTR dw1,
+	_In_opt_ DWORD_PTR dw2
+) {
+	switch (uMsg) {
+		case DRV_QUERYDEVICEINTERFACESIZE: {
+			stats_timer timer(StatsEntry::midiInMessage_QUERYDEVICEINTERFACESIZE);
+			return handle_QUERYDEVICEINTERFACESIZE(timer, Direction::Input, hmi, dw1, dw2);
+		}
+		case DRV_QUERYDEVICEINTERFACE: {
+			stats_timer timer(StatsEntry::midiInMessage_QUERYDEVICEINTERFACE);
+			return handle_QUERYDEVICEINTERFACE(timer, Direction::Input, hmi, dw1, dw2);
+		}
+		default:
+			return MMmidiInMessage(hmi, uMsg, dw1, dw2);
+	};
+}
@@ -0,0 +1,157 @@
+// Round-trip latency probe. While the application has both the configured input and the
+// configured output open, a probe thread periodically sends a controller message carrying a
+// sequence number to the output, on the application's own (native) handle: opening a second
+// handle would take the port from the application on drivers that allow only one. When the
+// message comes back on the input (through a loopback cable or a virtual port), it is
+// removed from the application's input and the QPC round-trip time is recorded.
+
+struct latency_probe_config {
+	UINT output_device = 0;
+	UINT input_device = 0;
+	uint64_t interval_ms = 500;
+	uint8_t channel = 15;			// 0-based
+	uint8_t controller = 119;		// An undefined controller, so devices ignore it
+};
+
+bool g_latency_probe_enabled = false;
+latency_probe_config g_latency_probe_config;
+
+class latency_probe {
+public:
+	// Called when the application opens / closes the configured input.
+	void input_opened() {
+		if (m_listeners.fetch_add(1) == 0 && !m_thread) {
+			m_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+			m_running = true;
+			m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+			if (m_thread) { SetThreadPriority(m_thread, THREAD_PRIORITY_HIGHEST); }
+			else { m_running = false; }
+		}
+	}
+
+	void input_closed() {
+		m_listeners.fetch_sub(1);
+	}
+
+	// Called when the application opens / closes the configured output, with the handle the
+	// driver knows. A handle is removed before it is closed, so it is never used afterwards.
+	void output_opened(HMIDIOUT native) {
+		AcquireSRWLockExclusive(&m_outputs_lock);
+		m_outputs.push_back(native);
+		ReleaseSRWLockExclusive(&m_outputs_lock);
+	}
+
+	void output_closed(HMIDIOUT native) {
+		AcquireSRWLockExclusive(&m_outputs_lock);
+		if (auto it = std::find(m_outputs.begin(), m_outputs.end(), native); it != m_outputs.end()) { m_outputs.erase(it); }
+		ReleaseSRWLockExclusive(&m_outputs_lock);
+	}
+
+	// Called from the input callback of the configured input. Returns whether the message
+	// was a probe, in which case it must not be passed on to the application.
+	bool on_input(DWORD msg) {
+		auto const& cfg = g_latency_probe_config;
+		if ((msg & 0xFF) != (0xB0u | cfg.channel) || ((msg >> 8) & 0x7F) != cfg.controller) { return false; }
+		uint64_t now = qpc_now();
+		uint8_t seq = (msg >> 16) & 0x7F;
+		uint64_t sent = m_sent_at[seq].exchange(0, std::memory_order_acq_rel);
+		if (!sent) {
+			m_unexpected.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+		uint64_t ns = (uint64_t)ticks_to_ns(now - sent);
+		m_received.fetch_add(1, std::memory_order_relaxed);
+		m_total_ns.fetch_add(ns, std::memory_order_relaxed);
+		uint64_t prev = m_min_ns.load(std::memory_order_relaxed);
+		while (ns < prev && !m_min_ns.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+		prev = m_max_ns.load(std::memory_order_relaxed);
+		while (ns > prev && !m_max_ns.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+		m_histogram[histogram_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Process detach: returns once the thread no longer sends probes nor uses the probe. It
+	// can't exit under the loader lock, so its handle alone can't tell.
+	void stop() {
+		m_stop = true;
+		if (m_wake) { SetEvent(m_wake); }
+		if (m_thread) {
+			while (m_running && WaitForSingleObject(m_thread, 1) == WAIT_TIMEOUT) {}
+		}
+	}
+
+	bool started() const { return m_thread != NULL; }
+
+	json stats_json() {
+		uint64_t received = m_received.load();
+		uint64_t sent = m_sent.load();
+		json histogram = json::array();
+		for (auto& b : m_histogram) { histogram.push_back(b.load()); }
+		json rval = {
+			{ "output_device", g_latency_probe_config.output_device },
+			{ "input_device", g_latency_probe_config.input_device },
+			{ "sent", sent },
+			{ "received", received },
+			{ "lost", sent - received },
+			{ "unexpected", m_unexpected.load() },
+			{ "skipped_output_closed", m_skipped.load() },
+			{ "min_us", received ? m_min_ns.load() / 1000.0 : 0.0 },
+			{ "mean_us", received ? m_total_ns.load() / 1000.0 / received : 0.0 },
+			{ "max_us", m_max_ns.load() / 1000.0 },
+			{ "round_trip_histogram_ns_log2", histogram }
+		};
+		return rval;
+	}
+
+private:
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		auto probe = (latency_probe*)param;
+		probe->run();
+		probe->m_running = false;	// Last access to the probe
+		return 0;
+	}
+
+	void run() {
+		auto const& cfg = g_latency_probe_config;
+		uint8_t seq = 0;
+		while (!m_stop) {
+			if (m_listeners.load() > 0) {
+				// The output stays open while a probe is sent on it
+				AcquireSRWLockShared(&m_outputs_lock);
+				if (!m_outputs.empty()) {
+					// A probe that is still outstanding after 128 intervals counts as lost
+					m_sent_at[seq].store(qpc_now(), std::memory_order_release);
+					m_sent.fetch_add(1, std::memory_order_relaxed);
+					MMmidiOutShortMsg(m_outputs.front(), (0xB0u | cfg.channel) | ((DWORD)cfg.controller << 8) | ((DWORD)seq << 16));
+					forget_device_running_status(m_outputs.front());
+					seq = (seq + 1) & 0x7F;
+				}
+				else {
+					m_skipped.fetch_add(1, std::memory_order_relaxed);
+				}
+				ReleaseSRWLockShared(&m_outputs_lock);
+			}
+			WaitForSingleObject(m_wake, (DWORD)cfg.interval_ms);
+		}
+	}
+
+	std::atomic<int> m_listeners{ 0 };
+	std::atomic<bool> m_stop{ false };
+	std::atomic<bool> m_running{ false };	// The thread still uses the probe
+	HANDLE m_wake = NULL;
+	HANDLE m_thread = NULL;
+	SRWLOCK m_outputs_lock = SRWLOCK_INIT;
+	std::vector<HMIDIOUT> m_outputs;		// The application's handles on the output
+
+	std::array<std::atomic<uint64_t>, 128> m_sent_at{};	// By sequence number; 0 = not outstanding
+	std::atomic<uint64_t> m_sent{ 0 };
+	std::atomic<uint64_t> m_received{ 0 };
+	std::atomic<uint64_t> m_unexpected{ 0 };
+	std::atomic<uint64_t> m_skipped{ 0 };			// Intervals with the input open but not the output
+	std::atomic<uint64_t> m_total_ns{ 0 };
+	std::atomic<uint64_t> m_min_ns{ UINT64_MAX };
+	std::atomic<uint64_t> m_max_ns{ 0 };
+	std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> m_histogram{};
+};
+
+latency_probe g_latency_probe;
@@ -0,0 +1,107 @@
+// Suppression of repeated log entries for polled queries (GetDevCaps, device interface).
+// Each event is identified by a hash of the entry point, the device and the raw native
+// result, computed before anything is formatted. Within the summary interval a repeat is
+// only counted; the next time it is logged, the count is logged with it. The table is a
+// fixed-size open-addressing hash table with atomic slots, so threads never block on it.
+
+struct log_dedup_config {
+	uint64_t interval_ms = 10000;	// Log a repeated event at most once per interval
+	size_t table_size = 1024;		// Distinct events tracked; rounded up to a power of two
+	size_t max_probes = 8;			// Slots looked at per event before giving up (and logging)
+};
+
+bool g_log_dedup_enabled = false;
+log_dedup_config g_log_dedup_config;
+
+std::atomic<uint64_t> g_log_dedup_suppressed{ 0 };
+std::atomic<uint64_t> g_log_dedup_untracked{ 0 };	// Table full, logged without suppression
+
+class log_dedup {
+public:
+	// Incremental FNV-1a over the parts of an event
+	struct key_builder {
+		uint64_t h = 14695981039346656037ull;
+
+		key_builder& add(const void* data, size_t size) {
+			auto p = (const uint8_t*)data;
+			for (size_t i = 0; i < size; i++) { h = (h ^ p[i]) * 1099511628211ull; }
+			return *this;
+		}
+
+		template<typename T>
+		key_builder& add(T const& v) { return add(&v, sizeof(v)); }
+
+		uint64_t key() const { return h ? h : 1; }	// 0 marks an empty slot
+	};
+
+	void init(log_dedup_config const& cfg) {
+		size_t size = 1;
+		while (size < cfg.table_size) { size <<= 1; }
+		m_slots = std::make_unique<slot[]>(size);
+		m_mask = size - 1;
+		m_max_probes = cfg.max_probes < size ? cfg.max_probes : size;
+		m_interval_ticks = cfg.interval_ms * g_qpc_frequency.QuadPart / 1000;
+	}
+
+	// Returns whether the event should be logged now. If so, out_repeats is the number of
+	// times it was suppressed since it was last logged.
+	bool should_log(uint64_t key, uint64_t& out_repeats) {
+		out_repeats = 0;
+		if (!m_slots) { return true; }
+		uint64_t now = qpc_now();
+		for (size_t probe = 0; probe < m_max_probes; probe++) {
+			slot& s = m_slots[(key + probe) & m_mask];
+			uint64_t k = s.key.load(std::memory_order_acquire);
+			if (k == 0) {
+				if (!s.key.compare_exchange_strong(k, key, std::memory_order_acq_rel) && k != key) { continue; }
+				if (k == 0) {
+					s.last_logged.store(now, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (k != key) {
+				continue;
+			}
+			uint64_t last = s.last_logged.load(std::memory_order_acquire);
+			if (now - last < m_interval_ticks || !s.last_logged.compare_exchange_strong(last, now, std::memory_order_acq_rel)) {
+				// Within the interval, or another thread is logging it right now
+				s.repeats.fetch_add(1, std::memory_order_relaxed);
+				g_log_dedup_suppressed.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			out_repeats = s.repeats.exchange(0, std::memory_order_relaxed);
+			return true;
+		}
+		g_log_dedup_untracked.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Total repeats that were never followed by a logged occurrence, e.g. at exit.
+	uint64_t take_unreported() {
+		uint64_t rval = 0;
+		if (!m_slots) { return rval; }
+		for (size_t i = 0; i <= m_mask; i++) { rval += m_slots[i].repeats.exchange(0, std::memory_order_relaxed); }
+		return rval;
+	}
+
+private:
+	struct slot {
+		std::atomic<uint64_t> key{ 0 };
+		std::atomic<uint64_t> last_logged{ 0 };
+		std::atomic<uint64_t> repeats{ 0 };
+	};
+
+	std::unique_ptr<slot[]> m_slots;
+	size_t m_mask = 0;
+	size_t m_max_probes = 0;
+	uint64_t m_interval_ticks = 0;
+};
+
+log_dedup g_log_dedup;
+
+json log_dedup_stats_json() {
+	return json{
+		{ "suppressed", g_log_dedup_suppressed.load() },
+		{ "untracked", g_log_dedup_untracked.load() }
+	};
+}
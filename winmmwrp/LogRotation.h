@@ -0,0 +1,353 @@
+// Size-bounded log with rotation. When the log reaches its size limit, the writing thread
+// only closes it, renames it out of the way and reopens it. Numbering and compressing the
+// rotated segments (gzip) happens on a low-priority background thread.
+//
+// File names, for log file X:
+//   X, X.1.gz, X.2.gz, ...				current session (X.1.gz newest segment)
+//   X.s1, X.s1.1.gz, ...				previous session
+//   X.s2, ...							the one before
+//   X.rotating.<n>						segments waiting for the background thread
+
+struct log_rotation_config {
+	uint64_t max_size = 10 << 20;	// Bytes per segment
+	size_t max_files = 5;			// Rotated segments kept per session
+	bool compress = true;
+	size_t keep_sessions = 1;		// Previous sessions kept at startup
+};
+
+bool g_log_rotation_enabled = false;
+log_rotation_config g_log_rotation_config;
+
+// Minimal gzip writer: LZ77 with hash chains, encoded as a single DEFLATE block with the
+// fixed Huffman codes. Log text compresses well enough with that, and it needs no tables
+// to be transmitted or built.
+class gzip_writer {
+public:
+	static std::vector<uint8_t> compress(const uint8_t* data, size_t size) {
+		gzip_writer w;
+		static const uint8_t header[] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+		w.m_out.assign(std::begin(header), std::end(header));
+		w.deflate(data, size);
+		w.put_le32(crc32(data, size));
+		w.put_le32((uint32_t)size);
+		return std::move(w.m_out);
+	}
+
+	static uint32_t crc32(const uint8_t* data, size_t size) {
+		static const auto table = [] {
+			std::array<uint32_t, 256> t;
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++) { c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1; }
+				t[i] = c;
+			}
+			return t;
+		}();
+		uint32_t c = 0xFFFFFFFF;
+		for (size_t i = 0; i < size; i++) { c = table[(c ^ data[i]) & 0xFF] ^ (c >> 8); }
+		return c ^ 0xFFFFFFFF;
+	}
+
+private:
+	static constexpr size_t window = 32768;
+	static constexpr size_t hash_bits = 15;
+	static constexpr size_t max_chain = 32;
+	static constexpr size_t min_match = 3;
+	static constexpr size_t max_match = 258;
+
+	void deflate(const uint8_t* data, size_t size) {
+		put_bits(1, 1);		// BFINAL
+		put_bits(1, 2);		// BTYPE = fixed Huffman
+		std::vector<int32_t> head(1 << hash_bits, -1);
+		std::vector<int32_t> prev(window, -1);
+		auto hash = [&](size_t i) {
+			return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & ((1 << hash_bits) - 1);
+		};
+		auto insert = [&](size_t i) {
+			if (i + min_match > size) { return; }
+			auto h = hash(i);
+			prev[i % window] = head[h];
+			head[h] = (int32_t)i;
+		};
+
+		size_t i = 0;
+		while (i < size) {
+			size_t best_len = 0, best_dist = 0;
+			if (i + min_match <= size) {
+				size_t limit = size - i < max_match ? size - i : max_match;
+				int32_t candidate = head[hash(i)];
+				for (size_t chain = 0; candidate >= 0 && i - candidate <= window && chain < max_chain; chain++) {
+					size_t len = 0;
+					while (len < limit && data[candidate + len] == data[i + len]) { len++; }
+					if (len > best_len) {
+						best_len = len;
+						best_dist = i - candidate;
+						if (len == limit) { break; }
+					}
+					int32_t next = prev[candidate % window];
+					if (next >= candidate) { break; }
+					candidate = next;
+				}
+			}
+			if (best_len >= min_match) {
+				put_length(best_len);
+				put_distance(best_dist);
+				for (size_t k = 0; k < best_len; k++) { insert(i + k); }
+				i += best_len;
+			}
+			else {
+				put_literal(data[i]);
+				insert(i);
+				i++;
+			}
+		}
+		put_literal(256);	// End of block
+		if (m_nbits) { m_out.push_back((uint8_t)m_bitbuf); }
+	}
+
+	void put_bits(uint32_t value, int n) {
+		m_bitbuf |= value << m_nbits;
+		m_nbits += n;
+		while (m_nbits >= 8) {
+			m_out.push_back((uint8_t)m_bitbuf);
+			m_bitbuf >>= 8;
+			m_nbits -= 8;
+		}
+	}
+
+	// Huffman codes are packed starting with their most significant bit
+	void put_code(uint32_t code, int n) {
+		uint32_t reversed = 0;
+		for (int k = 0; k < n; k++) { reversed |= ((code >> k) & 1) << (n - 1 - k); }
+		put_bits(reversed, n);
+	}
+
+	void put_literal(uint32_t sym) {
+		if (sym < 144) { put_code(0x30 + sym, 8); }
+		else if (sym < 256) { put_code(0x190 + sym - 144, 9); }
+		else if (sym < 280) { put_code(sym - 256, 7); }
+		else { put_code(0xC0 + sym - 280, 8); }
+	}
+
+	void put_length(size_t len) {
+		static const uint16_t base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+			35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		static const uint8_t extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+			3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		size_t code = 28;
+		while (base[code] > len) { code--; }
+		put_literal(257 + (uint32_t)code);
+		put_bits((uint32_t)(len - base[code]), extra[code]);
+	}
+
+	void put_distance(size_t dist) {
+		static const uint16_t base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+			257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+		static const uint8_t extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+			7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+		size_t code = 29;
+		while (base[code] > dist) { code--; }
+		put_code((uint32_t)code, 5);
+		put_bits((uint32_t)(dist - base[code]), extra[code]);
+	}
+
+	void put_le32(uint32_t v) {
+		for (int k = 0; k < 4; k++) { m_out.push_back((uint8_t)(v >> (8 * k))); }
+	}
+
+	std::vector<uint8_t> m_out;
+	uint32_t m_bitbuf = 0;
+	int m_nbits = 0;
+};
+
+inline bool log_file_exists(std::string const& name) {
+	return GetFileAttributesA(name.c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+// Session 0 is the current one. Segment 0 is the live log file.
+inline std::string log_segment_name(std::string const& base, size_t session, size_t segment, bool compressed) {
+	std::string rval = base;
+	if (session) { rval += ".s" + std::to_string(session); }
+	if (segment) { rval += "." + std::to_string(segment) + (compressed ? ".gz" : ""); }
+	return rval;
+}
+
+// Moves (or, with to_session == 0, deletes) all files of a session. Segments may exist
+// both compressed and uncompressed (left behind by an interrupted rotation).
+inline void move_log_session(std::string const& base, size_t from_session, size_t to_session) {
+	for (size_t segment = 0; ; segment++) {
+		bool found = false;
+		for (bool compressed : { true, false }) {
+			if (segment == 0 && compressed) { continue; }
+			auto from = log_segment_name(base, from_session, segment, compressed);
+			if (!log_file_exists(from)) { continue; }
+			found = true;
+			if (to_session) { MoveFileExA(from.c_str(), log_segment_name(base, to_session, segment, compressed).c_str(), MOVEFILE_REPLACE_EXISTING); }
+			else { DeleteFileA(from.c_str()); }
+		}
+		if (!found && segment > 0) { break; }
+	}
+}
+
+// Called once before the log is opened. Segments an earlier process did not get to
+// compress are added to its session, then sessions are shifted by one.
+inline void prepare_log_sessions(std::string const& base, log_rotation_config const& cfg) {
+	size_t next_segment = 1;
+	while (log_file_exists(log_segment_name(base, 0, next_segment, true)) ||
+		log_file_exists(log_segment_name(base, 0, next_segment, false))) {
+		next_segment++;
+	}
+	WIN32_FIND_DATAA found;
+	HANDLE find = FindFirstFileA((base + ".rotating.*").c_str(), &found);
+	if (find != INVALID_HANDLE_VALUE) {
+		auto dir_end = base.find_last_of("\\/");
+		std::string dir = dir_end == std::string::npos ? std::string() : base.substr(0, dir_end + 1);
+		do {
+			MoveFileExA((dir + found.cFileName).c_str(), log_segment_name(base, 0, next_segment++, false).c_str(), MOVEFILE_REPLACE_EXISTING);
+		} while (FindNextFileA(find, &found));
+		FindClose(find);
+	}
+
+	move_log_session(base, cfg.keep_sessions, 0);
+	for (size_t session = cfg.keep_sessions; session > 0; session--) {
+		move_log_session(base, session - 1, session);
+	}
+}
+
+class log_rotator {
+public:
+	log_rotator() {
+		InitializeCriticalSection(&m_lock);
+	}
+
+	void start(std::string const& base, log_rotation_config const& cfg) {
+		m_base = base;
+		m_cfg = cfg;
+		m_written = 0;
+	}
+
+	// Accounts for text written to the live file. Returns whether it should be rotated.
+	bool written(uint64_t n) {
+		m_written += n;
+		return m_written >= m_cfg.max_size;
+	}
+
+	// Called with the log lock held. Replaces f with a fresh file.
+	void rotate(FILE*& f) {
+		fclose(f);
+		auto pending = m_base + ".rotating." + std::to_string(++m_sequence);
+		bool moved = MoveFileExA(m_base.c_str(), pending.c_str(), MOVEFILE_REPLACE_EXISTING);
+		f = fopen(m_base.c_str(), moved ? "w" : "a");
+		m_written = 0;
+		if (!moved) { return; }
+		if (f) { fprintf(f, "Log continued, previous segment: %s.1%s\n", m_base.c_str(), m_cfg.compress ? ".gz" : ""); }
+
+		EnterCriticalSection(&m_lock);
+		m_pending.push_back(pending);
+		LeaveCriticalSection(&m_lock);
+		if (!m_thread) {
+			m_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+			m_running = true;
+			m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+			if (!m_thread) { m_running = false; }
+		}
+		SetEvent(m_wake);
+	}
+
+	// Process detach, with the log lock held. The thread finishes the segment it is storing;
+	// the others stay X.rotating.<n> and are kept with this run's log on the next start. As
+	// the thread can't exit under the loader lock, this waits until it has left the rotator.
+	void stop() {
+		m_stop = true;
+		if (m_wake) { SetEvent(m_wake); }
+		if (m_thread) {
+			while (m_running && WaitForSingleObject(m_thread, 1) == WAIT_TIMEOUT) {}
+		}
+	}
+
+	uint64_t rotations() const { return m_sequence; }
+
+private:
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		// Background mode also lowers the I/O priority where supported
+		if (!SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN)) {
+			SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+		}
+		auto rotator = (log_rotator*)param;
+		rotator->run();
+		rotator->m_running = false;		// Last access to the rotator
+		return 0;
+	}
+
+	void run() {
+		while (!m_stop) {
+			WaitForSingleObject(m_wake, INFINITE);
+			while (!m_stop) {
+				EnterCriticalSection(&m_lock);
+				if (m_pending.empty()) {
+					LeaveCriticalSection(&m_lock);
+					break;
+				}
+				auto pending = m_pending.front();
+				m_pending.erase(m_pending.begin());
+				LeaveCriticalSection(&m_lock);
+				store_segment(pending);
+			}
+		}
+	}
+
+	void store_segment(std::string const& pending) {
+		if (m_cfg.max_files == 0) {
+			DeleteFileA(pending.c_str());
+			return;
+		}
+		for (bool compressed : { true, false }) {
+			DeleteFileA(log_segment_name(m_base, 0, m_cfg.max_files, compressed).c_str());
+			for (size_t segment = m_cfg.max_files - 1; segment > 0; segment--) {
+				auto from = log_segment_name(m_base, 0, segment, compressed);
+				if (log_file_exists(from)) {
+					MoveFileExA(from.c_str(), log_segment_name(m_base, 0, segment + 1, compressed).c_str(), MOVEFILE_REPLACE_EXISTING);
+				}
+			}
+		}
+		auto target = log_segment_name(m_base, 0, 1, m_cfg.compress);
+		if (!m_cfg.compress || !compress_file(pending, target)) {
+			MoveFileExA(pending.c_str(), log_segment_name(m_base, 0, 1, false).c_str(), MOVEFILE_REPLACE_EXISTING);
+			return;
+		}
+		DeleteFileA(pending.c_str());
+	}
+
+	static bool compress_file(std::string const& from, std::string const& to) {
+		std::string content;
+		try { content = read_file(from); }
+		catch (...) { return false; }
+		auto compressed = gzip_writer::compress((const uint8_t*)content.data(), content.size());
+		FILE* f = fopen(to.c_str(), "wb");
+		if (!f) { return false; }
+		bool ok = fwrite(compressed.data(), 1, compressed.size(), f) == compressed.size();
+		ok = fclose(f) == 0 && ok;
+		if (!ok) { DeleteFileA(to.c_str()); }
+		return ok;
+	}
+
+	static std::string read_file(std::string const& name) {
+		std::ifstream in(name, std::ios::binary);
+		if (!in) { throw std::runtime_error("Unable to open " + name); }
+		return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+
+	std::string m_base;
+	log_rotation_config m_cfg;
+	uint64_t m_written = 0;		// Protected by the log lock, like the file itself
+	uint64_t m_sequence = 0;
+
+	CRITICAL_SECTION m_lock;	// Protects m_pending
+	std::vector<std::string> m_pending;
+	HANDLE m_wake = NULL;
+	HANDLE m_thread = NULL;
+	std::atomic<bool> m_stop{ false };
+	std::atomic<bool> m_running{ false };	// The thread still uses the rotator
+};
+
+log_rotator g_log_rotator;
@@ -0,0 +1,244 @@
+// Wrapper-side state for each open MIDI handle, created in midiOutOpen / midiInOpen and
+// destroyed in midiOutClose / midiInClose.
+
+struct shared_output;
+
+struct midi_out_handle_state {
+	UINT device_id;
+	SRWLOCK lock = SRWLOCK_INIT;		// Serializes the per-handle tables below
+	output_filter_state filter;
+	note_tracker notes;
+	std::vector<LPMIDIHDR> long_in_flight;	// Sent through midiOutLongMsg and not yet done or unprepared, once each
+	// For logical handles of a shared output: the native handle, and the application's
+	// callback, which the wrapper calls itself
+	shared_output* shared = nullptr;
+	app_callback app;
+	running_status app_running_status;		// Shared outputs filter with the device's tables, which don't know it
+	std::unique_ptr<clock_engine> clock;	// Created on the first message, on the clock engine's output
+	// Callbacks of a shared output being delivered to this handle; its close waits for them,
+	// so MOM_CLOSE is the last callback the application gets
+	std::atomic<int> delivering{ 0 };
+	std::atomic<bool> closed{ false };
+};
+
+// Only exists for inputs the wrapper needs to see the input of (input buffer pool, latency
+// probe, callback dispatcher, identity responder). The wrapper then installs its own driver callback, with this
+// state as the instance data.
+struct midi_in_handle_state {
+	app_callback app;
+	std::unique_ptr<input_buffer_pool> pool;
+	std::unique_ptr<input_dispatcher> dispatch;
+	bool probe = false;		// Probe messages are filtered out of this input
+	bool identity = false;	// Input of the identity responder
+	std::atomic<DWORD> started_at{ 0 };	// MMtimeGetTime() of midiInStart, the base of MIM_xxx timestamps
+};
+
+// The states are reference counted: a driver callback that found a state keeps it alive
+// while the handle is being closed on another thread.
+template<typename Handle, typename State>
+class midi_handle_table {
+public:
+	void add(Handle h, std::shared_ptr<State> state) {
+		AcquireSRWLockExclusive(&m_lock);
+		m_handles[h] = std::move(state);
+		ReleaseSRWLockExclusive(&m_lock);
+	}
+
+	void remove(Handle h) {
+		AcquireSRWLockExclusive(&m_lock);
+		m_handles.erase(h);
+		ReleaseSRWLockExclusive(&m_lock);
+	}
+
+	// Removes the handle, leaving the state to the caller.
+	std::shared_ptr<State> take(Handle h) {
+		AcquireSRWLockExclusive(&m_lock);
+		std::shared_ptr<State> rval;
+		if (auto it = m_handles.find(h); it != m_handles.end()) {
+			rval = std::move(it->second);
+			m_handles.erase(it);
+		}
+		ReleaseSRWLockExclusive(&m_lock);
+		return rval;
+	}
+
+	// Returns NULL for handles the wrapper did not see being opened (e.g. stream handles).
+	// The state stays valid while the returned pointer is held, even if the handle is closed.
+	std::shared_ptr<State> find(Handle h) {
+		AcquireSRWLockShared(&m_lock);
+		auto it = m_handles.find(h);
+		auto rval = it == m_handles.end() ? nullptr : it->second;
+		ReleaseSRWLockShared(&m_lock);
+		return rval;
+	}
+
+	template<typename F>
+	void for_each(F f) {
+		AcquireSRWLockShared(&m_lock);
+		for (auto& [h, state] : m_handles) { f(h, *state); }
+		ReleaseSRWLockShared(&m_lock);
+	}
+
+private:
+	SRWLOCK m_lock = SRWLOCK_INIT;
+	std::unordered_map<Handle, std::shared_ptr<State>> m_handles;
+};
+
+midi_handle_table<HMIDIOUT, midi_out_handle_state> g_midi_out_handles;
+midi_handle_table<HMIDIIN, midi_in_handle_state> g_midi_in_handles;
+
+// Device of every open MIDI handle, for queries that take a handle, with the first replace
+// rule matching the device once a query has looked it up. Lookups are lock-free, so queries
+// never wait for opens and closes; those are serialized among themselves. Open addressing
+// with linear probing over a fixed array: if it fills up, handles that don't fit are
+// treated as device IDs, like before.
+
+constexpr uint32_t g_handle_rule_unresolved = 0x7FFFFFFF;
+constexpr uint32_t g_handle_rule_none = 0x7FFFFFFE;
+
+std::atomic<uint64_t> g_handle_table_hits{ 0 };
+std::atomic<uint64_t> g_handle_table_misses{ 0 };
+std::atomic<uint64_t> g_handle_table_rules_resolved{ 0 };
+std::atomic<uint64_t> g_handle_table_full{ 0 };
+
+class handle_device_table {
+public:
+	struct entry {
+		UINT device_id;
+		bool output;
+		uint32_t rule;		// Index of the first matching rule, g_handle_rule_none or g_handle_rule_unresolved
+	};
+
+	handle_device_table() : m_slots(g_capacity) {}
+
+	void add(HANDLE h, bool output, UINT device_id) {
+		AcquireSRWLockExclusive(&m_write_lock);
+		slot* free_slot = nullptr;
+		size_t i = hash(h);
+		for (size_t n = 0; n < g_capacity; n++, i = (i + 1) & g_mask) {
+			uintptr_t key = m_slots[i].key.load(std::memory_order_relaxed);
+			if (key == (uintptr_t)h) {
+				// Reused without a close we saw
+				free_slot = &m_slots[i];
+				break;
+			}
+			if (key == g_tombstone && !free_slot) { free_slot = &m_slots[i]; }
+			if (key == 0) {
+				if (!free_slot) { free_slot = &m_slots[i]; }
+				break;
+			}
+		}
+		if (free_slot) {
+			if (free_slot->key.load(std::memory_order_relaxed) != (uintptr_t)h) { m_count++; }
+			free_slot->value.store(pack({ device_id, output, g_handle_rule_unresolved }), std::memory_order_release);
+			free_slot->key.store((uintptr_t)h, std::memory_order_release);
+		}
+		else {
+			g_handle_table_full.fetch_add(1, std::memory_order_relaxed);
+		}
+		ReleaseSRWLockExclusive(&m_write_lock);
+	}
+
+	void remove(HANDLE h) {
+		AcquireSRWLockExclusive(&m_write_lock);
+		if (auto i = index_of(h)) {
+			m_count--;
+			// A slot followed by an empty one ends every probe sequence through it, so it (and
+			// tombstones right before it) can be emptied instead of left as a tombstone
+			size_t at = i.value();
+			if (m_slots[(at + 1) & g_mask].key.load(std::memory_order_relaxed) == 0) {
+				m_slots[at].key.store(0, std::memory_order_release);
+				for (at = (at - 1) & g_mask; m_slots[at].key.load(std::memory_order_relaxed) == g_tombstone; at = (at - 1) & g_mask) {
+					m_slots[at].key.store(0, std::memory_order_release);
+				}
+			}
+			else {
+				m_slots[at].key.store(g_tombstone, std::memory_order_release);
+			}
+		}
+		ReleaseSRWLockExclusive(&m_write_lock);
+	}
+
+	std::optional<entry> find(HANDLE h) const {
+		if (!h) { return std::nullopt; }
+		while (true) {
+			auto i = index_of(h);
+			if (!i) {
+				g_handle_table_misses.fetch_add(1, std::memory_order_relaxed);
+				return std::nullopt;
+			}
+			auto& s = m_slots[i.value()];
+			uint64_t value = s.value.load(std::memory_order_acquire);
+			// Otherwise the slot was reused while reading it; look again
+			if (s.key.load(std::memory_order_acquire) == (uintptr_t)h) {
+				g_handle_table_hits.fetch_add(1, std::memory_order_relaxed);
+				return unpack(value);
+			}
+		}
+	}
+
+	// Records the first matching rule of a handle's device, unless the handle has been
+	// closed or reopened since e was found
+	void resolve(HANDLE h, entry const& e, uint32_t rule) {
+		if (auto i = index_of(h)) {
+			uint64_t expected = pack(e);
+			entry resolved = e;
+			resolved.rule = rule;
+			if (m_slots[i.value()].value.compare_exchange_strong(expected, pack(resolved), std::memory_order_acq_rel)) {
+				g_handle_table_rules_resolved.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	json stats_json() {
+		AcquireSRWLockShared(&m_write_lock);
+		size_t count = m_count;
+		ReleaseSRWLockShared(&m_write_lock);
+		return json{
+			{ "open_handles", count },
+			{ "capacity", g_capacity },
+			{ "hits", g_handle_table_hits.load() },
+			{ "misses", g_handle_table_misses.load() },
+			{ "rules_resolved", g_handle_table_rules_resolved.load() },
+			{ "full", g_handle_table_full.load() }
+		};
+	}
+
+private:
+	static constexpr size_t g_capacity = 4096;		// Power of two
+	static constexpr size_t g_mask = g_capacity - 1;
+	static constexpr uintptr_t g_tombstone = ~(uintptr_t)0;
+
+	struct slot {
+		std::atomic<uintptr_t> key{ 0 };		// Handle, 0 if empty, or g_tombstone
+		std::atomic<uint64_t> value{ 0 };
+	};
+
+	static size_t hash(HANDLE h) {
+		return (size_t)(((uint64_t)(uintptr_t)h * 0x9E3779B97F4A7C15ull) >> (64 - std::bit_width(g_mask))) & g_mask;
+	}
+
+	static uint64_t pack(entry const& e) {
+		return (uint64_t)e.device_id | ((uint64_t)e.output << 32) | ((uint64_t)e.rule << 33);
+	}
+
+	static entry unpack(uint64_t v) {
+		return entry{ (UINT)v, ((v >> 32) & 1) != 0, (uint32_t)(v >> 33) };
+	}
+
+	std::optional<size_t> index_of(HANDLE h) const {
+		size_t i = hash(h);
+		for (size_t n = 0; n < g_capacity; n++, i = (i + 1) & g_mask) {
+			uintptr_t key = m_slots[i].key.load(std::memory_order_acquire);
+			if (key == (uintptr_t)h) { return i; }
+			if (key == 0) { break; }
+		}
+		return std::nullopt;
+	}
+
+	std::vector<slot> m_slots;
+	SRWLOCK m_write_lock = SRWLOCK_INIT;
+	size_t m_count = 0;
+};
+
+handle_device_table g_handle_devices;
@@ -0,0 +1,196 @@
+// The path of midiOutShortMsg and midiOutLongMsg to the driver, through the features that
+// see outgoing messages (clock engine, output filter, note tracker, shared outputs, SysEx
+// rewriter, identity responder and scheduler), with the scheduler hooks that send the
+// messages it delayed the same way.
+
+// Scheduler hook for rate-limited controllers: picks up the latest held-back value.
+bool resolve_rate_limited_controller(HMIDIOUT hmo, DWORD& msg) {
+	auto state = g_midi_out_handles.find(hmo);
+	if (!state) { return false; }
+	auto [lock, filter] = output_filter_of(*state);
+	AcquireSRWLockExclusive(lock);
+	auto pending = filter->take_pending(msg & 0x0F, (msg >> 8) & 0x7F, qpc_now());
+	ReleaseSRWLockExclusive(lock);
+	if (!pending.has_value()) { return false; }
+	msg = pending.value();
+	return true;
+}
+
+void reset_output_filter(HMIDIOUT hmo) {
+	auto state = g_midi_out_handles.find(hmo);
+	if (!state) { return; }
+	auto [lock, filter] = output_filter_of(*state);
+	AcquireSRWLockExclusive(lock);
+	filter->reset();
+	ReleaseSRWLockExclusive(lock);
+}
+
+// Returns whether a short message should be forwarded to the device; the message may get
+// its running status byte back.
+bool apply_output_filter(HMIDIOUT hmo, midi_out_handle_state* state, DWORD& dwMsg) {
+	uint64_t now = qpc_now();
+	uint64_t rate_limit_ticks = g_output_filter_config.rate_limit_interval_us * g_qpc_frequency.QuadPart / 1000000;
+	uint64_t flush_at = 0;
+	DWORD flush_msg = 0;
+	auto verdict = filter_output_msg(*state, dwMsg, now, rate_limit_ticks, flush_at, flush_msg);
+	switch (verdict) {
+	case output_filter_state::Verdict::DropRedundant:
+		g_output_filter_dropped_redundant.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	case output_filter_state::Verdict::HoldBack:
+		g_output_filter_dropped_rate_limited.fetch_add(1, std::memory_order_relaxed);
+		if (flush_at) {
+			g_output_scheduler.schedule({ .due = flush_at, .hmo = hmo, .native_hmo = native_midi_out(hmo), .short_msg = flush_msg, .resolve = resolve_rate_limited_controller });
+		}
+		return false;
+	default:
+		return true;
+	}
+}
+
+// Queues a long message in the scheduler. Like the driver, marks it queued, so it can't be
+// sent again or unprepared until it is done.
+MMRESULT schedule_long_msg(HMIDIOUT hmo, HMIDIOUT native, LPMIDIHDR pmh, UINT cbmh, uint64_t due) {
+	if (!pmh || !(pmh->dwFlags & MHDR_PREPARED)) { return MIDIERR_UNPREPARED; }
+	if (pmh->dwFlags & MHDR_INQUEUE) { return MIDIERR_STILLPLAYING; }
+	pmh->dwFlags = (pmh->dwFlags | MHDR_INQUEUE) & ~MHDR_DONE;
+	g_output_scheduler.schedule({ .due = due, .hmo = hmo, .native_hmo = native, .long_hdr = pmh, .long_hdr_size = cbmh });
+	return MMSYSERR_NOERROR;
+}
+
+void complete_unsent_long_msg(HMIDIOUT hmo, LPMIDIHDR pmh) {
+	pmh->dwFlags = (pmh->dwFlags | MHDR_DONE) & ~MHDR_INQUEUE;
+	if (auto state = g_midi_out_handles.find(hmo)) {
+		if (state->shared) { state->shared->sender(pmh, true); }
+		state->app.invoke(hmo, MOM_DONE, (DWORD_PTR)pmh, 0);
+	}
+}
+
+// Remembers a long message sent on a handle, once per header, until it is done or the
+// header is unprepared. On shared outputs, MOM_DONE is routed back to this handle.
+// Called once the header is known to be accepted.
+void track_long_msg(midi_out_handle_state& state, HMIDIOUT hmo, LPMIDIHDR pmh) {
+	AcquireSRWLockExclusive(&state.lock);
+	std::erase_if(state.long_in_flight, [pmh](LPMIDIHDR other) { return other != pmh && (other->dwFlags & MHDR_DONE); });
+	if (std::find(state.long_in_flight.begin(), state.long_in_flight.end(), pmh) == state.long_in_flight.end()) {
+		state.long_in_flight.push_back(pmh);
+	}
+	ReleaseSRWLockExclusive(&state.lock);
+	if (state.shared) { state.shared->sending(pmh, hmo); }
+}
+
+// Notes are tracked with the note tracker, and on shared outputs for resets of a single
+// logical handle. Messages going through the scheduler are tracked once they are sent, so a
+// reset dropping them leaves the tracker right.
+bool tracks_notes(midi_out_handle_state const& state) {
+	return g_note_tracker_enabled || state.shared;
+}
+
+void track_notes(midi_out_handle_state& state, DWORD short_msg, LPMIDIHDR long_hdr) {
+	AcquireSRWLockExclusive(&state.lock);
+	if (!long_hdr) { state.notes.on_short_msg(short_msg); }
+	else if (long_hdr->lpData) { state.notes.on_long_msg((uint8_t const*)long_hdr->lpData, long_hdr->dwBufferLength); }
+	ReleaseSRWLockExclusive(&state.lock);
+}
+
+void scheduled_msg_sending(HMIDIOUT hmo, DWORD short_msg, LPMIDIHDR long_hdr) {
+	if (!g_note_tracker_enabled && !g_shared_outputs_enabled) { return; }
+	if (auto state = g_midi_out_handles.find(hmo); state && tracks_notes(*state)) { track_notes(*state, short_msg, long_hdr); }
+}
+
+// The clock engine of a handle on the clock engine's output, or NULL
+clock_engine* clock_engine_of(HMIDIOUT hmo, midi_out_handle_state& state) {
+	if (state.device_id != g_clock_engine_config.output_device) { return nullptr; }
+	AcquireSRWLockExclusive(&state.lock);
+	if (!state.clock) { state.clock = std::make_unique<clock_engine>(state.shared ? state.shared->native : hmo); }
+	clock_engine* rval = state.clock.get();
+	ReleaseSRWLockExclusive(&state.lock);
+	return rval;
+}
+
+// The clock engine and the output filter, for a short message about to reach the driver.
+// Returns false if the message is not to be sent, or the clock engine sends it itself.
+bool pass_short_msg(HMIDIOUT hmo, midi_out_handle_state& state, DWORD& msg) {
+	if (g_clock_engine_enabled && (msg & 0xF0) == 0xF0) {
+		if (auto clock = clock_engine_of(hmo, state); clock && clock->on_message(msg)) { return false; }
+	}
+	return !g_output_filter_enabled || apply_output_filter(hmo, &state, msg);
+}
+
+// Scheduler hook: scheduled short messages (the configured delay and midiOutShortMsgAt) go
+// through the clock engine and the filter when they are sent, so that the filter's tables
+// follow what the device gets, in the order it gets it.
+bool resolve_scheduled_short_msg(HMIDIOUT hmo, DWORD& msg) {
+	auto state = g_midi_out_handles.find(hmo);
+	return !state || pass_short_msg(hmo, *state, msg);
+}
+
+// Only needed, and only looked up, if one of them is enabled
+decltype(&resolve_scheduled_short_msg) short_msg_resolver() {
+	return g_output_filter_enabled || g_clock_engine_enabled ? resolve_scheduled_short_msg : nullptr;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutShortMsg(
+	_In_ HMIDIOUT hmo,
+	_In_ DWORD dwMsg
+) {
+	stats_timer timer(StatsEntry::midiOutShortMsg);
+	HMIDIOUT native = hmo;
+	bool scheduled = g_scheduler_enabled && g_scheduler_config.delay_us > 0;
+	if (g_output_filter_enabled || g_note_tracker_enabled || g_shared_outputs_enabled || g_clock_engine_enabled) {
+		if (auto state = g_midi_out_handles.find(hmo)) {
+			if (!scheduled) {
+				if (!pass_short_msg(hmo, *state, dwMsg)) { return MMSYSERR_NOERROR; }
+				if (tracks_notes(*state)) { track_notes(*state, dwMsg, NULL); }
+			}
+			if (state->shared) { native = state->shared->native; }
+		}
+	}
+	if (scheduled) {
+		g_output_scheduler.schedule({ .due = qpc_now() + g_scheduler_config.delay_us * g_qpc_frequency.QuadPart / 1000000, .hmo = hmo, .native_hmo = native,
+			.short_msg = dwMsg, .resolve = short_msg_resolver() });
+		return MMSYSERR_NOERROR;
+	}
+	return timer.native([&] { return MMmidiOutShortMsg(native, dwMsg); });
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutLongMsg(
+	_In_ HMIDIOUT hmo,
+	_In_reads_bytes_(cbmh) LPMIDIHDR pmh,
+	_In_ UINT cbmh
+) {
+	stats_timer timer(StatsEntry::midiOutLongMsg);
+	// Before anything touches the buffer, which the driver may still be sending
+	if (pmh && !(pmh->dwFlags & MHDR_PREPARED)) { return MIDIERR_UNPREPARED; }
+	if (pmh && (pmh->dwFlags & MHDR_INQUEUE)) { return MIDIERR_STILLPLAYING; }
+	if (g_output_filter_enabled) {
+		// SysEx may change any part of the device state (e.g. a GM reset)
+		reset_output_filter(hmo);
+	}
+	if (g_sysex_rewrite_enabled && pmh && pmh->lpData) {
+		g_sysex_rewriter.rewrite((uint8_t*)pmh->lpData, pmh->dwBufferLength, true);
+	}
+	if (g_identity_responder_enabled && pmh && pmh->lpData) {
+		if (auto state = g_midi_out_handles.find(hmo); state && g_identity_responder.on_output(hmo, *state, pmh)) {
+			return MMSYSERR_NOERROR;
+		}
+	}
+	HMIDIOUT native = hmo;
+	shared_output* shared = nullptr;
+	bool scheduled = g_scheduler_enabled && g_scheduler_config.delay_us > 0;
+	if ((g_note_tracker_enabled || g_shared_outputs_enabled) && pmh) {
+		// Shared outputs also need this to route MOM_DONE to the sending handle
+		if (auto state = g_midi_out_handles.find(hmo); state && tracks_notes(*state)) {
+			track_long_msg(*state, hmo, pmh);
+			if (!scheduled) { track_notes(*state, 0, pmh); }
+			shared = state->shared;
+			if (shared) { native = shared->native; }
+		}
+	}
+	if (scheduled) {
+		return schedule_long_msg(hmo, native, pmh, cbmh, qpc_now() + g_scheduler_config.delay_us * g_qpc_frequency.QuadPart / 1000000);
+	}
+	MMRESULT rval = timer.native([&] { return MMmidiOutLongMsg(native, pmh, cbmh); });
+	if (rval != MMSYSERR_NOERROR && shared) { shared->sender(pmh, true); }
+	return rval;
+}
@@ -0,0 +1,323 @@
+// Cache of mixer queries. Topology (dev caps, line and control info) is kept until the handle
+// it was queried through is closed or the line changes; control details are kept for a short
+// time to live. A hidden window receives the MM_MIXM_* notifications of every mixer that was
+// queried, so changes made elsewhere (another application, the system volume) drop the
+// affected entries right away. Only queries on a mixer ID or HMIXER are cached.
+
+#include <map>
+
+struct mixer_cache_config {
+	uint64_t details_ttl_ms = 100;
+	bool notifications = true;
+};
+
+bool g_mixer_cache_enabled = false;
+mixer_cache_config g_mixer_cache_config;
+
+// A and W variants are cached apart, as their results differ
+enum class mixer_query : uint8_t { DevCapsA, DevCapsW, LineInfoA, LineInfoW, LineControlsA, LineControlsW, ControlDetailsA, ControlDetailsW };
+constexpr size_t g_mixer_query_groups = 4;
+constexpr DWORD g_mixer_object_mask = 0xF0000000;	// MIXER_OBJECTF_* bits of the query flags
+
+std::array<std::atomic<uint64_t>, g_mixer_query_groups> g_mixer_cache_hits{};
+std::array<std::atomic<uint64_t>, g_mixer_query_groups> g_mixer_cache_misses{};
+std::atomic<uint64_t> g_mixer_cache_uncached{ 0 };		// Queries passed through: other objects, custom controls...
+std::atomic<uint64_t> g_mixer_cache_expired{ 0 };
+std::atomic<uint64_t> g_mixer_cache_invalidated{ 0 };	// Entries dropped by sets, notifications and closes
+std::atomic<uint64_t> g_mixer_cache_notifications{ 0 };
+
+struct mixer_cache_key {
+	mixer_query query;
+	DWORD object_type;
+	UINT_PTR object;
+	DWORD flags;					// The query type (MIXER_GET*F_*)
+	std::array<DWORD, 5> params;	// The input fields of the query
+
+	auto operator<=>(mixer_cache_key const&) const = default;
+};
+
+struct mixer_cache_entry {
+	mixer_query query;
+	DWORD object_type;
+	UINT_PTR object;
+	UINT device;
+	DWORD control_id;			// Control details only
+	std::vector<char> data;		// The caller's output
+	DWORD line_id;				// Returned by MIXER_GETLINECONTROLSF_ONEBYID
+	uint64_t expires;			// QPC; 0 = until invalidated (topology)
+};
+
+class mixer_cache {
+public:
+	mixer_cache() {
+		InitializeCriticalSection(&m_watch_lock);
+	}
+
+	template <typename F>
+	MMRESULT dev_caps(mixer_query query, UINT_PTR id, void* caps, UINT size, F&& fetch) {
+		if (!caps || !size) { return uncached(fetch); }
+		mixer_cache_key key{ query, MIXER_OBJECTF_MIXER, id, 0, { size } };
+		// Caps never change with notifications; the ID may also be a handle
+		return lookup(key, caps, size, 0, nullptr, false, fetch);
+	}
+
+	template <typename Line, typename F>
+	MMRESULT line_info(mixer_query query, HMIXEROBJ obj, Line* line, DWORD flags, F&& fetch) {
+		if (!line || line->cbStruct != sizeof(Line) || !cacheable(flags)) { return uncached(fetch); }
+		mixer_cache_key key{ query, flags & g_mixer_object_mask, (UINT_PTR)obj, flags & MIXER_GETLINEINFOF_QUERYMASK };
+		switch (key.flags) {
+		case MIXER_GETLINEINFOF_DESTINATION: key.params = { line->cbStruct, line->dwDestination }; break;
+		case MIXER_GETLINEINFOF_SOURCE: key.params = { line->cbStruct, line->dwDestination, line->dwSource }; break;
+		case MIXER_GETLINEINFOF_LINEID: key.params = { line->cbStruct, line->dwLineID }; break;
+		case MIXER_GETLINEINFOF_COMPONENTTYPE: key.params = { line->cbStruct, line->dwComponentType }; break;
+		default: return uncached(fetch);	// Target type queries match on the whole target
+		}
+		return lookup(key, line, line->cbStruct, 0, nullptr, true, fetch);
+	}
+
+	template <typename Controls, typename F>
+	MMRESULT line_controls(mixer_query query, HMIXEROBJ obj, Controls* plc, DWORD flags, F&& fetch) {
+		if (!plc || !plc->pamxctrl || !plc->cbmxctrl || !cacheable(flags)) { return uncached(fetch); }
+		mixer_cache_key key{ query, flags & g_mixer_object_mask, (UINT_PTR)obj, flags & MIXER_GETLINECONTROLSF_QUERYMASK };
+		size_t size = plc->cbmxctrl;
+		DWORD* line_id = nullptr;
+		switch (key.flags) {
+		case MIXER_GETLINECONTROLSF_ALL:
+			key.params = { plc->cbStruct, plc->dwLineID, plc->cControls, plc->cbmxctrl };
+			size = (size_t)plc->cControls * plc->cbmxctrl;
+			break;
+		case MIXER_GETLINECONTROLSF_ONEBYID:
+			key.params = { plc->cbStruct, plc->dwControlID, plc->cbmxctrl };
+			line_id = &plc->dwLineID;
+			break;
+		case MIXER_GETLINECONTROLSF_ONEBYTYPE:
+			key.params = { plc->cbStruct, plc->dwLineID, plc->dwControlType, plc->cbmxctrl };
+			break;
+		default:
+			return uncached(fetch);
+		}
+		if (!size) { return uncached(fetch); }
+		return lookup(key, plc->pamxctrl, size, 0, line_id, true, fetch);
+	}
+
+	template <typename F>
+	MMRESULT control_details(mixer_query query, HMIXEROBJ obj, LPMIXERCONTROLDETAILS pmcd, DWORD flags, F&& fetch) {
+		DWORD type = flags & MIXER_GETCONTROLDETAILSF_QUERYMASK;
+		// Custom controls (no channels) have an owner window instead of an item count
+		if (!pmcd || !pmcd->paDetails || !pmcd->cChannels || !pmcd->cbDetails || !cacheable(flags) ||
+			(type != MIXER_GETCONTROLDETAILSF_VALUE && type != MIXER_GETCONTROLDETAILSF_LISTTEXT)) {
+			return uncached(fetch);
+		}
+		mixer_cache_key key{ query, flags & g_mixer_object_mask, (UINT_PTR)obj, type,
+			{ pmcd->cbStruct, pmcd->dwControlID, pmcd->cChannels, pmcd->cMultipleItems, pmcd->cbDetails } };
+		size_t size = (size_t)pmcd->cChannels * (pmcd->cMultipleItems ? pmcd->cMultipleItems : 1) * pmcd->cbDetails;
+		return lookup(key, pmcd->paDetails, size, pmcd->dwControlID, nullptr, true, fetch);
+	}
+
+	// After mixerSetControlDetails. Control IDs are per mixer, so the control is dropped on all
+	// of them rather than resolving the object.
+	void control_set(DWORD control_id) {
+		invalidate([&](mixer_cache_entry const& e) { return is_details(e.query) && e.control_id == control_id; });
+	}
+
+	// After mixerClose
+	void forget(HMIXER hmx) {
+		invalidate([&](mixer_cache_entry const& e) {
+			return e.object == (UINT_PTR)hmx && (e.object_type == MIXER_OBJECTF_HMIXER || e.query == mixer_query::DevCapsA || e.query == mixer_query::DevCapsW);
+		});
+	}
+
+	// Process detach. The window thread closes the watched mixers, its window and its class.
+	// It can't exit while DllMain holds the loader lock, so this waits until it has left the
+	// cache, or for its handle when the process is exiting and it is gone already.
+	void stop() {
+		EnterCriticalSection(&m_watch_lock);
+		HANDLE thread = m_thread;
+		LeaveCriticalSection(&m_watch_lock);
+		if (!thread) { return; }
+		PostThreadMessageW(m_thread_id, WM_QUIT, 0, 0);
+		while (m_thread_running && WaitForSingleObject(thread, 1) == WAIT_TIMEOUT) {}
+	}
+
+	json stats_json() {
+		static char const* const names[g_mixer_query_groups] = { "dev_caps", "line_info", "line_controls", "control_details" };
+		json rval = {
+			{ "uncached", g_mixer_cache_uncached.load() },
+			{ "expired", g_mixer_cache_expired.load() },
+			{ "invalidated", g_mixer_cache_invalidated.load() },
+			{ "notifications", g_mixer_cache_notifications.load() }
+		};
+		for (size_t i = 0; i < g_mixer_query_groups; i++) {
+			uint64_t hits = g_mixer_cache_hits[i].load();
+			uint64_t misses = g_mixer_cache_misses[i].load();
+			rval[names[i]] = { { "hits", hits }, { "misses", misses }, { "hit_rate", hits + misses ? (double)hits / (hits + misses) : 0.0 } };
+		}
+		AcquireSRWLockShared(&m_lock);
+		rval["entries"] = m_entries.size();
+		ReleaseSRWLockShared(&m_lock);
+		return rval;
+	}
+
+private:
+	static bool cacheable(DWORD flags) {
+		DWORD object_type = flags & g_mixer_object_mask;
+		return object_type == MIXER_OBJECTF_MIXER || object_type == MIXER_OBJECTF_HMIXER;
+	}
+
+	static bool is_details(mixer_query query) {
+		return query == mixer_query::ControlDetailsA || query == mixer_query::ControlDetailsW;
+	}
+
+	template <typename F>
+	MMRESULT uncached(F&& fetch) {
+		g_mixer_cache_uncached.fetch_add(1, std::memory_order_relaxed);
+		return fetch();
+	}
+
+	// Copies a cached result to the caller's buffer, or runs the native query and caches it
+	template <typename F>
+	MMRESULT lookup(mixer_cache_key const& key, void* out, size_t size, DWORD control_id, DWORD* line_id, bool watch_device, F&& fetch) {
+		size_t group = (size_t)key.query / 2;
+		uint64_t now = qpc_now();
+		AcquireSRWLockShared(&m_lock);
+		auto it = m_entries.find(key);
+		if (it != m_entries.end() && it->second.data.size() == size && (!it->second.expires || it->second.expires > now)) {
+			memcpy(out, it->second.data.data(), size);
+			if (line_id) { *line_id = it->second.line_id; }
+			ReleaseSRWLockShared(&m_lock);
+			g_mixer_cache_hits[group].fetch_add(1, std::memory_order_relaxed);
+			return MMSYSERR_NOERROR;
+		}
+		bool expired = it != m_entries.end();
+		uint64_t generation = m_generation;
+		ReleaseSRWLockShared(&m_lock);
+		if (expired) { g_mixer_cache_expired.fetch_add(1, std::memory_order_relaxed); }
+		g_mixer_cache_misses[group].fetch_add(1, std::memory_order_relaxed);
+
+		MMRESULT rval = fetch();
+		if (rval != MMSYSERR_NOERROR) { return rval; }
+		UINT device = watch_device ? resolve(key) : (UINT)-1;
+		if (watch_device && device == (UINT)-1) { return rval; }
+		if (watch_device && g_mixer_cache_config.notifications) { watch(device); }
+		mixer_cache_entry entry{ key.query, key.object_type, key.object, device, control_id,
+			std::vector<char>((char*)out, (char*)out + size), line_id ? *line_id : 0, 0 };
+		if (is_details(key.query)) { entry.expires = qpc_now() + g_mixer_cache_config.details_ttl_ms * g_qpc_frequency.QuadPart / 1000; }
+		AcquireSRWLockExclusive(&m_lock);
+		// Not cached if something was invalidated meanwhile, as the result may predate it
+		if (m_generation == generation) { m_entries[key] = std::move(entry); }
+		ReleaseSRWLockExclusive(&m_lock);
+		return rval;
+	}
+
+	static UINT resolve(mixer_cache_key const& key) {
+		if (key.object_type == MIXER_OBJECTF_MIXER) { return (UINT)key.object; }
+		UINT id;
+		return MMmixerGetID((HMIXEROBJ)key.object, &id, key.object_type) == MMSYSERR_NOERROR ? id : (UINT)-1;
+	}
+
+	template <typename Pred>
+	void invalidate(Pred&& pred) {
+		AcquireSRWLockExclusive(&m_lock);
+		size_t dropped = std::erase_if(m_entries, [&](auto const& kv) { return pred(kv.second); });
+		m_generation++;
+		ReleaseSRWLockExclusive(&m_lock);
+		g_mixer_cache_invalidated.fetch_add(dropped, std::memory_order_relaxed);
+	}
+
+	// Opens the mixer for notifications to the hidden window, once per device
+	void watch(UINT device) {
+		EnterCriticalSection(&m_watch_lock);
+		if (std::none_of(m_watched.begin(), m_watched.end(), [&](auto const& w) { return w.first == device; })) {
+			HMIXER hmx = NULL;
+			if (!ensure_window() || MMmixerOpen(&hmx, device, (DWORD_PTR)m_hwnd, 0, CALLBACK_WINDOW | MIXER_OBJECTF_MIXER) != MMSYSERR_NOERROR) {
+				hmx = NULL;
+			}
+			m_watched.push_back({ device, hmx });
+		}
+		LeaveCriticalSection(&m_watch_lock);
+	}
+
+	// Called with m_watch_lock held
+	bool ensure_window() {
+		if (m_thread) { return m_hwnd != NULL; }
+		HANDLE ready = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (!ready) { return false; }
+		m_thread_running = true;
+		m_thread = CreateThread(NULL, 0, thread_proc, ready, 0, &m_thread_id);
+		if (m_thread) { WaitForSingleObject(ready, INFINITE); }
+		else { m_thread_running = false; }
+		CloseHandle(ready);
+		return m_hwnd != NULL;
+	}
+
+	static DWORD WINAPI thread_proc(LPVOID param);
+	static LRESULT CALLBACK window_proc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam);
+
+	void on_notification(UINT msg, HMIXER hmx, DWORD id) {
+		g_mixer_cache_notifications.fetch_add(1, std::memory_order_relaxed);
+		UINT device = (UINT)-1;
+		EnterCriticalSection(&m_watch_lock);
+		for (auto const& w : m_watched) {
+			if (w.second == hmx) { device = w.first; }
+		}
+		LeaveCriticalSection(&m_watch_lock);
+		if (device == (UINT)-1) { return; }
+		if (msg == MM_MIXM_CONTROL_CHANGE) {
+			invalidate([&](mixer_cache_entry const& e) { return is_details(e.query) && e.device == device && e.control_id == id; });
+		}
+		else {
+			// A line's state (e.g. active) changed
+			invalidate([&](mixer_cache_entry const& e) { return (e.query == mixer_query::LineInfoA || e.query == mixer_query::LineInfoW) && e.device == device; });
+		}
+	}
+
+	SRWLOCK m_lock = SRWLOCK_INIT;	// Protects m_entries and m_generation
+	std::map<mixer_cache_key, mixer_cache_entry> m_entries;
+	uint64_t m_generation = 0;		// Bumped by every invalidation
+
+	CRITICAL_SECTION m_watch_lock;	// Protects m_watched and the window creation
+	std::vector<std::pair<UINT, HMIXER>> m_watched;	// Device, notification handle (NULL if it failed to open)
+	HANDLE m_thread = NULL;
+	DWORD m_thread_id = 0;
+	std::atomic<bool> m_thread_running{ false };	// The window thread still uses the cache
+	HWND m_hwnd = NULL;
+};
+
+mixer_cache g_mixer_cache;
+
+DWORD WINAPI mixer_cache::thread_proc(LPVOID param) {
+	auto& cache = g_mixer_cache;
+	WNDCLASSW wc = {};
+	wc.lpfnWndProc = window_proc;
+	// The class belongs to the wrapper, which may be unloaded before the process exits
+	GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCWSTR)window_proc, &wc.hInstance);
+	wc.lpszClassName = L"midi_replace_mixer_cache";
+	RegisterClassW(&wc);
+	cache.m_hwnd = CreateWindowExW(0, wc.lpszClassName, L"", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, wc.hInstance, NULL);
+	SetEvent((HANDLE)param);
+	if (cache.m_hwnd) {
+		MSG msg;
+		while (GetMessageW(&msg, NULL, 0, 0) > 0) { DispatchMessageW(&msg); }
+
+		// Stopped: no more notifications to the window once the mixers are closed
+		EnterCriticalSection(&cache.m_watch_lock);
+		for (auto const& w : cache.m_watched) {
+			if (w.second) { MMmixerClose(w.second); }
+		}
+		cache.m_watched.clear();
+		DestroyWindow(cache.m_hwnd);
+		cache.m_hwnd = NULL;
+		LeaveCriticalSection(&cache.m_watch_lock);
+	}
+	UnregisterClassW(wc.lpszClassName, wc.hInstance);
+	cache.m_thread_running = false;		// Last access to the cache
+	return 0;
+}
+
+LRESULT CALLBACK mixer_cache::window_proc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+	if (msg == MM_MIXM_CONTROL_CHANGE || msg == MM_MIXM_LINE_CHANGE) {
+		g_mixer_cache.on_notification(msg, (HMIXER)wParam, (DWORD)lParam);
+		return 0;
+	}
+	return DefWindowProcW(hwnd, msg, wParam, lParam);
+}
@@ -0,0 +1,129 @@
+// Tracks which notes are sounding on each output handle, as a 16x128 bitset updated from
+// the short messages (and channel messages within long messages) that reach the driver. On
+// reset, close and process exit, note-offs are sent for exactly those notes instead of
+// relying on a sweep over all 2048 channel/note pairs.
+
+struct note_tracker_config {
+	bool replace_reset_sweep = true;	// Answer midiOutReset with targeted note-offs where possible
+	bool notes_off_on_close = true;
+	bool notes_off_on_exit = true;
+};
+
+bool g_note_tracker_enabled = false;
+note_tracker_config g_note_tracker_config;
+
+std::atomic<uint64_t> g_note_tracker_resets{ 0 };
+std::atomic<uint64_t> g_note_tracker_note_offs_sent{ 0 };
+std::atomic<uint64_t> g_note_tracker_native_resets_skipped{ 0 };
+
+// Messages a full sweep sends: a note-off for every note on every channel.
+constexpr uint64_t g_reset_sweep_messages = 16 * 128;
+
+struct note_tracker {
+	uint8_t running_status = 0;
+	uint64_t sounding[16][2] = {};
+	uint16_t sustained_channels = 0;
+
+	void on_short_msg(DWORD msg) {
+		uint8_t status = msg & 0xFF;
+		uint8_t d1 = (msg >> 8) & 0x7F;
+		uint8_t d2 = (msg >> 16) & 0x7F;
+		if (status < 0x80) {
+			d2 = d1;
+			d1 = status;
+			status = running_status;
+		}
+		else if (status < 0xF0) {
+			running_status = status;
+		}
+		else if (status < 0xF8) {
+			running_status = 0;
+		}
+		uint8_t ch = status & 0x0F;
+		uint64_t bit = 1ull << (d1 & 63);
+		uint64_t& word = sounding[ch][d1 >> 6];
+
+		switch (status & 0xF0) {
+		case 0x90:
+			// Note-on with velocity 0 is a note-off
+			word = d2 ? (word | bit) : (word & ~bit);
+			break;
+		case 0x80:
+			word &= ~bit;
+			break;
+		case 0xB0:
+			if (d1 == 64) {
+				sustained_channels = d2 >= 64 ? (sustained_channels | (1 << ch)) : (sustained_channels & ~(1 << ch));
+			}
+			else if (d1 == 120 || d1 == 123) {
+				// All sound off / all notes off
+				sounding[ch][0] = sounding[ch][1] = 0;
+			}
+			break;
+		}
+	}
+
+	// The bytes of a long message: channel messages among them are tracked like short
+	// messages, SysEx and other system messages are skipped.
+	void on_long_msg(uint8_t const* data, size_t length) {
+		size_t i = 0;
+		while (i < length) {
+			uint8_t b = data[i];
+			if (b == 0xF0) {
+				auto end = (uint8_t const*)memchr(data + i, 0xF7, length - i);
+				i = end ? end - data + 1 : length;
+				running_status = 0;
+				continue;
+			}
+			if (b >= 0xF0 || (b < 0x80 && !running_status)) {
+				// Real-time and system common messages, with the data bytes that follow the latter
+				if (b >= 0xF0 && b < 0xF8) { running_status = 0; }
+				i++;
+				continue;
+			}
+			uint8_t status = b >= 0x80 ? b : running_status;
+			if (b >= 0x80) { i++; }
+			size_t data_bytes = (status & 0xE0) == 0xC0 ? 1 : 2;
+			if (i + data_bytes > length) { break; }
+			DWORD msg = status | ((DWORD)data[i] << 8);
+			if (data_bytes == 2) { msg |= (DWORD)data[i + 1] << 16; }
+			on_short_msg(msg);
+			i += data_bytes;
+		}
+	}
+
+	// Sends a note-off for every sounding note and releases held sustain pedals.
+	// Returns the number of messages sent.
+	uint64_t silence(HMIDIOUT hmo) {
+		uint64_t sent = 0;
+		for (uint8_t ch = 0; ch < 16; ch++) {
+			for (uint8_t half = 0; half < 2; half++) {
+				uint64_t word = sounding[ch][half];
+				while (word) {
+					uint8_t note = (uint8_t)(half * 64 + std::countr_zero(word));
+					word &= word - 1;
+					MMmidiOutShortMsg(hmo, (DWORD)(0x80 | ch) | ((DWORD)note << 8));
+					sent++;
+				}
+				sounding[ch][half] = 0;
+			}
+			if (sustained_channels & (1 << ch)) {
+				MMmidiOutShortMsg(hmo, (DWORD)(0xB0 | ch) | (64 << 8));
+				sent++;
+			}
+		}
+		sustained_channels = 0;
+		running_status = 0;
+		return sent;
+	}
+};
+
+json note_tracker_stats_json() {
+	uint64_t skipped = g_note_tracker_native_resets_skipped.load();
+	return json{
+		{ "resets", g_note_tracker_resets.load() },
+		{ "note_offs_sent", g_note_tracker_note_offs_sent.load() },
+		{ "native_resets_skipped", skipped },
+		{ "sweep_messages_avoided", skipped * g_reset_sweep_messages }
+	};
+}
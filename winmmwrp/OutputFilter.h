@@ -0,0 +1,211 @@
+// Redundant-message suppression for midiOutShortMsg. Per output handle, the last value
+// sent for every controller, pitch bend, channel pressure and program is remembered, and
+// messages that would not change the device's state are dropped. Optionally, selected
+// controllers are rate-limited: values arriving faster than the configured interval are
+// held back and only the latest one is sent once the interval has passed.
+
+constexpr uint8_t g_unknown_7bit = 0xFF;
+constexpr uint16_t g_unknown_14bit = 0xFFFF;
+
+struct output_filter_config {
+	bool controllers = true;
+	bool pitch_bend = true;
+	bool channel_pressure = true;
+	bool program = true;
+	uint64_t rate_limit_interval_us = 0;
+	std::array<bool, 128> rate_limited_controllers{};
+};
+
+bool g_output_filter_enabled = false;
+output_filter_config g_output_filter_config;
+
+// Controllers which must never be suppressed, because their meaning depends on other
+// state (data entry for RPN/NRPN) or because they are commands rather than values.
+constexpr std::array<bool, 128> make_unfilterable_controllers() {
+	std::array<bool, 128> rval{};
+	rval[6] = rval[38] = true;					// Data entry MSB / LSB
+	rval[96] = rval[97] = true;					// Data increment / decrement
+	for (size_t c = 120; c < 128; c++) { rval[c] = true; }	// Channel mode messages
+	return rval;
+}
+constexpr std::array<bool, 128> g_unfilterable_controllers = make_unfilterable_controllers();
+
+// A message that relied on running status (data bytes only), with its status byte
+DWORD with_status_byte(uint8_t status, DWORD msg) {
+	uint8_t d1 = msg & 0x7F;
+	uint8_t d2 = (msg >> 8) & 0x7F;
+	DWORD rval = status | ((DWORD)d1 << 8);
+	if ((status & 0xE0) != 0xC0) { rval |= (DWORD)d2 << 16; }
+	return rval;
+}
+
+// Running status as one sender uses it, for messages that go through a filter shared with
+// other senders
+struct running_status {
+	uint8_t status = 0;
+
+	// Returns msg with the status byte it relied on, if any
+	DWORD complete(DWORD msg) {
+		uint8_t first = msg & 0xFF;
+		if (first >= 0xF8) { return msg; }
+		if (first >= 0xF0) {
+			status = 0;
+			return msg;
+		}
+		if (first >= 0x80) {
+			status = first;
+			return msg;
+		}
+		return status ? with_status_byte(status, msg) : msg;
+	}
+};
+
+std::atomic<uint64_t> g_output_filter_dropped_redundant{ 0 };
+std::atomic<uint64_t> g_output_filter_dropped_rate_limited{ 0 };
+
+struct output_filter_state {
+	uint8_t running_status = 0;			// As sent by the application
+	uint8_t device_running_status = 0;	// As last received by the device
+	uint8_t controllers[16][128];
+	uint16_t pitch_bend[16];
+	uint8_t channel_pressure[16];
+	uint8_t program[16];
+
+	// Rate limiting
+	uint64_t controller_sent_at[16][128];		// QPC ticks
+	uint8_t controller_pending[16][128];		// Held-back value, or g_unknown_7bit
+	bool controller_flush_scheduled[16][128];
+
+	output_filter_state() {
+		reset();
+	}
+
+	void reset() {
+		memset(controllers, g_unknown_7bit, sizeof(controllers));
+		memset(channel_pressure, g_unknown_7bit, sizeof(channel_pressure));
+		memset(program, g_unknown_7bit, sizeof(program));
+		std::fill(std::begin(pitch_bend), std::end(pitch_bend), g_unknown_14bit);
+		memset(controller_sent_at, 0, sizeof(controller_sent_at));
+		memset(controller_pending, g_unknown_7bit, sizeof(controller_pending));
+		memset(controller_flush_scheduled, 0, sizeof(controller_flush_scheduled));
+		device_running_status = 0;		// Also called on SysEx, which cancels running status
+	}
+
+	void reset_channel(uint8_t ch) {
+		memset(controllers[ch], g_unknown_7bit, sizeof(controllers[ch]));
+		pitch_bend[ch] = g_unknown_14bit;
+		channel_pressure[ch] = g_unknown_7bit;
+	}
+
+	enum class Verdict {
+		Send,
+		DropRedundant,
+		HoldBack		// Rate limited, caller should make sure the pending value gets flushed
+	};
+
+	// Updates the state tables for msg and decides whether it needs to go to the device.
+	// When a controller gets held back for the first time in its interval, out_flush_at and
+	// out_flush_msg are set to when and for which controller the caller should schedule a flush.
+	// After a drop or a flush, the device's running status may differ from the application's:
+	// a message to send that relies on running status then gets its status byte back in msg.
+	Verdict filter(DWORD& msg, output_filter_config const& cfg, uint64_t now, uint64_t rate_limit_ticks,
+	               uint64_t &out_flush_at, DWORD &out_flush_msg) {
+		bool data_only = (msg & 0xFF) < 0x80;
+		Verdict verdict = decide(msg, cfg, now, rate_limit_ticks, out_flush_at, out_flush_msg);
+		if (verdict != Verdict::Send) { return verdict; }
+		uint8_t status = data_only ? running_status : msg & 0xFF;
+		if (status >= 0xF8) { return verdict; }	// Real-time messages leave running status alone
+		if (status >= 0xF0) {
+			device_running_status = 0;
+			return verdict;
+		}
+		if (data_only && status && device_running_status != status) { msg = with_status_byte(status, msg); }
+		if (status) { device_running_status = status; }
+		return verdict;
+	}
+
+	// Called when a held-back controller's interval has passed. Returns the message to send,
+	// or nothing if the latest value turned out to be redundant.
+	std::optional<DWORD> take_pending(uint8_t ch, uint8_t controller, uint64_t now) {
+		controller_flush_scheduled[ch][controller] = false;
+		uint8_t value = controller_pending[ch][controller];
+		controller_pending[ch][controller] = g_unknown_7bit;
+		if (value == g_unknown_7bit || controllers[ch][controller] == value) { return std::nullopt; }
+		controllers[ch][controller] = value;
+		controller_sent_at[ch][controller] = now;
+		device_running_status = 0xB0 | ch;
+		return (DWORD)(0xB0 | ch) | ((DWORD)controller << 8) | ((DWORD)value << 16);
+	}
+
+private:
+	Verdict decide(DWORD msg, output_filter_config const& cfg, uint64_t now, uint64_t rate_limit_ticks,
+	               uint64_t &out_flush_at, DWORD &out_flush_msg) {
+		uint8_t status = msg & 0xFF;
+		uint8_t d1 = (msg >> 8) & 0x7F;
+		uint8_t d2 = (msg >> 16) & 0x7F;
+		if (status < 0x80) {
+			// Running status: the first byte was already data
+			d2 = d1;
+			d1 = status;
+			status = running_status;
+		}
+		else if (status < 0xF0) {
+			running_status = status;
+		}
+		else if (status < 0xF8) {
+			running_status = 0;
+		}
+		else if (status == 0xFF) {
+			reset();
+			return Verdict::Send;
+		}
+		uint8_t ch = status & 0x0F;
+
+		switch (status & 0xF0) {
+		case 0xB0: {
+			if (d1 == 0 || d1 == 32) { program[ch] = g_unknown_7bit; }		// Next program change must go out
+			if (d1 == 121) { reset_channel(ch); }
+			if (!cfg.controllers || g_unfilterable_controllers[d1]) { return Verdict::Send; }
+			if (rate_limit_ticks && cfg.rate_limited_controllers[d1] && now - controller_sent_at[ch][d1] < rate_limit_ticks) {
+				controller_pending[ch][d1] = d2;
+				if (!controller_flush_scheduled[ch][d1]) {
+					controller_flush_scheduled[ch][d1] = true;
+					out_flush_at = controller_sent_at[ch][d1] + rate_limit_ticks;
+					out_flush_msg = (DWORD)(0xB0 | ch) | ((DWORD)d1 << 8);
+				}
+				return Verdict::HoldBack;
+			}
+			controller_pending[ch][d1] = g_unknown_7bit;
+			if (controllers[ch][d1] == d2) { return Verdict::DropRedundant; }
+			controllers[ch][d1] = d2;
+			controller_sent_at[ch][d1] = now;
+			return Verdict::Send;
+		}
+		case 0xC0: {
+			bool same = program[ch] == d1;
+			program[ch] = d1;
+			return (cfg.program && same) ? Verdict::DropRedundant : Verdict::Send;
+		}
+		case 0xD0: {
+			bool same = channel_pressure[ch] == d1;
+			channel_pressure[ch] = d1;
+			return (cfg.channel_pressure && same) ? Verdict::DropRedundant : Verdict::Send;
+		}
+		case 0xE0: {
+			uint16_t value = d1 | ((uint16_t)d2 << 7);
+			bool same = pitch_bend[ch] == value;
+			pitch_bend[ch] = value;
+			return (cfg.pitch_bend && same) ? Verdict::DropRedundant : Verdict::Send;
+		}
+		default:
+			return Verdict::Send;
+		}
+	}
+};
+
+json output_filter_stats_json() {
+	return json{
+		{ "dropped_redundant", g_output_filter_dropped_redundant.load() },
+		{ "dropped_rate_limited", g_output_filter_dropped_rate_limited.load() }
+	};
+}
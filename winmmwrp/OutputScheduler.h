@@ -0,0 +1,230 @@
+// Timestamped MIDI output. Messages are kept in a min-heap ordered by their QPC target
+// time and dispatched to the native midiOutShortMsg / midiOutLongMsg by a dedicated
+// high-priority thread, which sleeps until shortly before the target and spins for the rest.
+
+#include <queue>
+
+struct scheduled_midi_msg {
+	uint64_t due;			// QPC ticks
+	uint64_t seq;			// Keeps submission order for equal due times
+	HMIDIOUT hmo;
+	HMIDIOUT native_hmo;	// Handle passed to the driver, if not hmo (shared outputs)
+	DWORD short_msg;		// Used if long_hdr is NULL
+	LPMIDIHDR long_hdr;
+	UINT long_hdr_size;
+	// Optional, for short messages: called right before sending to fill in the final message.
+	// Returning false skips the message.
+	bool (*resolve)(HMIDIOUT hmo, DWORD& msg);
+
+	HMIDIOUT target() const { return native_hmo ? native_hmo : hmo; }
+
+	bool operator>(scheduled_midi_msg const& other) const {
+		return due != other.due ? due > other.due : seq > other.seq;
+	}
+};
+
+struct scheduler_config {
+	uint64_t delay_us = 0;		// Config-driven mode: latency added to every outgoing message
+	uint64_t spin_us = 1500;	// Busy-wait this long before the target instead of sleeping
+	int priority = THREAD_PRIORITY_TIME_CRITICAL;
+};
+
+bool g_scheduler_enabled = false;
+scheduler_config g_scheduler_config;
+
+// Defined with the overrides: returns a long message the driver refused to the application,
+// and tracks the notes of a message about to reach the driver
+void complete_unsent_long_msg(HMIDIOUT hmo, LPMIDIHDR pmh);
+void scheduled_msg_sending(HMIDIOUT hmo, DWORD short_msg, LPMIDIHDR long_hdr);
+
+class output_scheduler {
+public:
+	// Long messages must be marked MHDR_INQUEUE by the caller, as they would be by the driver.
+	// If the thread can't be started, messages are sent right away instead.
+	void schedule(scheduled_midi_msg msg) {
+		EnterCriticalSection(&m_lock);
+		if (!ensure_thread()) {
+			LeaveCriticalSection(&m_lock);
+			m_unscheduled.fetch_add(1, std::memory_order_relaxed);
+			send(msg);
+			return;
+		}
+		msg.seq = m_next_seq++;
+		bool earliest = m_queue.empty() || msg.due < m_queue.top().due;
+		m_queue.push(msg);
+		LeaveCriticalSection(&m_lock);
+		if (earliest) { SetEvent(m_wake); }
+	}
+
+	// Called before the native midiOutReset / midiOutClose. Pending short messages for the
+	// handle are dropped. Pending long messages are handed to the driver right away, so that
+	// the native reset returns them to the application with MOM_DONE as usual.
+	void flush_handle(HMIDIOUT hmo) {
+		std::vector<scheduled_midi_msg> keep, flush;
+		EnterCriticalSection(&m_dispatch_lock);
+		EnterCriticalSection(&m_lock);
+		while (!m_queue.empty()) {
+			auto msg = m_queue.top();
+			m_queue.pop();
+			(msg.hmo == hmo ? flush : keep).push_back(msg);
+		}
+		for (auto& msg : keep) { m_queue.push(msg); }
+		LeaveCriticalSection(&m_lock);
+		for (auto& msg : flush) {
+			if (msg.long_hdr) { send(msg); }
+			else { m_dropped++; }
+		}
+		LeaveCriticalSection(&m_dispatch_lock);
+	}
+
+	bool started() const {
+		return m_thread != NULL;
+	}
+
+	// Started, or had to send without a thread
+	bool used() const {
+		return m_thread != NULL || m_no_thread;
+	}
+
+	// Process detach. Messages still queued are not sent. The thread can't exit while DllMain
+	// holds the loader lock, so this waits until it has left the scheduler instead, or for its
+	// handle if the process is exiting and it is gone already.
+	void stop() {
+		EnterCriticalSection(&m_lock);
+		HANDLE thread = m_thread;
+		m_stop = true;
+		if (m_wake) { SetEvent(m_wake); }
+		LeaveCriticalSection(&m_lock);
+		if (thread) {
+			while (m_running && WaitForSingleObject(thread, 1) == WAIT_TIMEOUT) {}
+		}
+	}
+
+	output_scheduler() {
+		InitializeCriticalSection(&m_lock);
+		InitializeCriticalSection(&m_dispatch_lock);
+	}
+
+	json stats_json() {
+		json histogram = json::array();
+		for (auto& bucket : m_jitter_histogram) { histogram.push_back(bucket.load()); }
+		return json{
+			{ "dispatched", m_dispatched.load() },
+			{ "dropped_on_reset", m_dropped.load() },
+			{ "sent_unscheduled", m_unscheduled.load() },
+			{ "max_jitter_ns", ticks_to_ns(m_max_jitter_ticks.load()) },
+			{ "jitter_histogram_log2_ns", histogram }
+		};
+	}
+
+private:
+	// Called with m_lock held. A failure is not retried on every message.
+	bool ensure_thread() {
+		if (m_thread) { return true; }
+		if (m_no_thread) { return false; }
+		m_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+		m_running = true;
+		if (m_wake) { m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL); }
+		if (!m_thread) {
+			m_running = false;
+			m_no_thread = true;
+			return false;
+		}
+		SetThreadPriority(m_thread, g_scheduler_config.priority);
+		return true;
+	}
+
+	// Hands a message to the driver. The driver only accepts a long message that is not
+	// marked queued; if it refuses it anyway, the message is returned as done.
+	static void send(scheduled_midi_msg& msg) {
+		if (msg.long_hdr) {
+			scheduled_msg_sending(msg.hmo, 0, msg.long_hdr);
+			msg.long_hdr->dwFlags &= ~MHDR_INQUEUE;
+			if (MMmidiOutLongMsg(msg.target(), msg.long_hdr, msg.long_hdr_size) != MMSYSERR_NOERROR) {
+				complete_unsent_long_msg(msg.hmo, msg.long_hdr);
+			}
+		}
+		else if (!msg.resolve || msg.resolve(msg.hmo, msg.short_msg)) {
+			scheduled_msg_sending(msg.hmo, msg.short_msg, NULL);
+			MMmidiOutShortMsg(msg.target(), msg.short_msg);
+		}
+	}
+
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		auto scheduler = (output_scheduler*)param;
+		scheduler->run();
+		scheduler->m_running = false;	// Last access to the scheduler
+		return 0;
+	}
+
+	void run() {
+		// Without this, sleeps on Windows have a granularity of ~15ms
+		g_timer_periods.begin(NULL, L"output scheduler", 1);
+		uint64_t spin_ticks = g_scheduler_config.spin_us * g_qpc_frequency.QuadPart / 1000000;
+		while (!m_stop) {
+			EnterCriticalSection(&m_lock);
+			if (m_queue.empty()) {
+				LeaveCriticalSection(&m_lock);
+				WaitForSingleObject(m_wake, INFINITE);
+				continue;
+			}
+			uint64_t due = m_queue.top().due;
+			uint64_t now = qpc_now();
+			if (due > now + spin_ticks) {
+				LeaveCriticalSection(&m_lock);
+				DWORD sleep_ms = (DWORD)((due - now - spin_ticks) * 1000 / g_qpc_frequency.QuadPart);
+				WaitForSingleObject(m_wake, sleep_ms);
+				continue;
+			}
+			if (due > now) {
+				LeaveCriticalSection(&m_lock);
+				while (qpc_now() < due && !m_stop) { YieldProcessor(); }
+				continue;
+			}
+			LeaveCriticalSection(&m_lock);
+
+			// The native call happens outside the queue lock, so that the application threads
+			// can keep scheduling while a slow driver call is in progress.
+			EnterCriticalSection(&m_dispatch_lock);
+			EnterCriticalSection(&m_lock);
+			bool still_due = !m_queue.empty() && m_queue.top().due <= now;
+			scheduled_midi_msg msg;
+			if (still_due) {
+				msg = m_queue.top();
+				m_queue.pop();
+			}
+			LeaveCriticalSection(&m_lock);
+			if (still_due) {
+				record_jitter(qpc_now() - msg.due);
+				send(msg);
+			}
+			LeaveCriticalSection(&m_dispatch_lock);
+		}
+		g_timer_periods.end(NULL, L"output scheduler", 1);
+	}
+
+	void record_jitter(uint64_t late_ticks) {
+		m_dispatched.fetch_add(1, std::memory_order_relaxed);
+		uint64_t prev_max = m_max_jitter_ticks.load(std::memory_order_relaxed);
+		while (late_ticks > prev_max && !m_max_jitter_ticks.compare_exchange_weak(prev_max, late_ticks, std::memory_order_relaxed)) {}
+		m_jitter_histogram[histogram_bucket((uint64_t)ticks_to_ns(late_ticks))].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	CRITICAL_SECTION m_lock;			// Protects m_queue
+	CRITICAL_SECTION m_dispatch_lock;	// Held while handing a message to the driver
+	std::priority_queue<scheduled_midi_msg, std::vector<scheduled_midi_msg>, std::greater<scheduled_midi_msg>> m_queue;
+	uint64_t m_next_seq = 0;
+	HANDLE m_thread = NULL;
+	HANDLE m_wake = NULL;
+	bool m_no_thread = false;			// The thread could not be started
+	std::atomic<bool> m_stop{ false };
+	std::atomic<bool> m_running{ false };	// The thread still uses the scheduler
+
+	std::atomic<uint64_t> m_dispatched{ 0 };
+	std::atomic<uint64_t> m_dropped{ 0 };
+	std::atomic<uint64_t> m_unscheduled{ 0 };
+	std::atomic<uint64_t> m_max_jitter_ticks{ 0 };
+	std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> m_jitter_histogram{};
+};
+
+output_scheduler g_output_scheduler;
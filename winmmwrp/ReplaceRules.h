@@ -0,0 +1,701 @@
+// Device caps replace rules: the form written in the config, the compiled rule table that
+// the GetDevCaps and interface query overrides match against, and the parsing of rules and
+// profiles. Shared by the DLL and the offline rule evaluation tool (RuleEval), so both see
+// the same rules the same way. Expects json, stringToWstring / wstringToString, qpc_now and
+// wrapper_log to be declared before it is included.
+
+enum class Direction {
+	Input,
+	Output
+};
+
+template<typename dev_caps_struct>
+consteval Direction CapsDirection() {
+	return (std::is_same<dev_caps_struct, MIDIINCAPSW>::value || std::is_same<dev_caps_struct, MIDIINCAPSA>::value) ?
+		Direction::Input : Direction::Output;
+}
+
+struct midi_dev_caps {
+	Direction direction;                                // MIDIINCAPS or MIDIOUTCAPS
+
+	// Common
+	size_t man_id;										// wMid
+	size_t prod_id;										// wPid
+	size_t driver_version;								// vDriverVersion
+	std::wstring name;									// szPname
+
+	// MIDIOUTCAPS only
+	std::optional<size_t> technology;					// wTechnology
+	std::optional<size_t> voices;						// wVoices
+	std::optional<size_t> notes;						// wNotes
+	std::optional<size_t> channel_mask;					// wChannelMask
+	std::optional<size_t> support; 					    // dwSupport
+};
+
+template<typename dev_caps_struct>
+using dev_caps_char_type = typename std::remove_all_extents<decltype(dev_caps_struct::szPname)>::type;
+
+template<typename char_t>
+std::wstring chars_to_str(char_t* c) {
+	if (std::is_same<char_t, WCHAR>::value) {
+		return std::wstring((WCHAR*)c);
+	}
+	return stringToWstring(std::string((CHAR*)c));
+}
+
+// Everything but the name, which A-variant queries can match without widening it
+template<typename dev_caps_struct>
+midi_dev_caps to_our_numeric_dev_caps(dev_caps_struct const& v) {
+	auto constexpr direction = CapsDirection<dev_caps_struct>();
+	auto rval = midi_dev_caps{
+		.direction = direction,
+		.man_id = v.wMid,
+		.prod_id = v.wPid,
+		.driver_version = v.vDriverVersion
+	};
+
+	if constexpr (direction == Direction::Output) {
+		rval.technology = v.wTechnology;
+		rval.voices = v.wVoices;
+		rval.notes = v.wNotes;
+		rval.channel_mask = v.wChannelMask;
+		rval.support = v.dwSupport;
+	}
+
+	return rval;
+}
+
+template<typename dev_caps_struct>
+midi_dev_caps to_our_dev_caps(dev_caps_struct v) {
+	auto rval = to_our_numeric_dev_caps(v);
+	rval.name = chars_to_str(v.szPname);
+	return rval;
+}
+
+// A rule as written in the config. Only used while loading; matching is done on the
+// compiled form in rule_table.
+struct replace_rule {
+	// Matching only on common properties
+	std::optional<Direction> maybe_match_direction;
+	std::optional<std::wstring> maybe_match_name;
+	std::optional<size_t> maybe_match_man_id;
+	std::optional<size_t> maybe_match_prod_id;
+	std::optional<size_t> maybe_match_driver_version;
+
+	// Replacing common properties
+	std::optional <std::wstring> maybe_replace_name;
+	std::optional <size_t> maybe_replace_man_id;
+	std::optional <size_t> maybe_replace_prod_id;
+	std::optional <size_t> maybe_replace_driver_version;
+
+	// Replacing output device properties
+	std::optional<size_t> maybe_replace_technology;
+	std::optional<size_t> maybe_replace_voices;
+	std::optional<size_t> maybe_replace_notes;
+	std::optional<size_t> maybe_replace_channel_mask;
+	std::optional<size_t> maybe_replace_support;
+
+	// Replacing device interface name
+	std::optional<std::wstring>  maybe_replace_interface_name;
+};
+
+// Which fields a compiled rule has, one bit each.
+enum RuleField : uint32_t {
+	MatchDirection = 1 << 0,
+	MatchName = 1 << 1,
+	MatchManId = 1 << 2,
+	MatchProdId = 1 << 3,
+	MatchDriverVersion = 1 << 4,
+	ReplaceName = 1 << 5,
+	ReplaceManId = 1 << 6,
+	ReplaceProdId = 1 << 7,
+	ReplaceDriverVersion = 1 << 8,
+	ReplaceTechnology = 1 << 9,
+	ReplaceVoices = 1 << 10,
+	ReplaceNotes = 1 << 11,
+	ReplaceChannelMask = 1 << 12,
+	ReplaceSupport = 1 << 13,
+	ReplaceInterfaceName = 1 << 14,
+};
+
+struct regex_compilation_config {
+	bool eager = false;		// Compile all name patterns on worker threads after attach
+	size_t threads = 0;		// 0: one per processor
+};
+
+regex_compilation_config g_regex_compilation_config;
+
+std::atomic<uint64_t> g_name_patterns_compiled_lazily{ 0 };
+std::atomic<uint64_t> g_name_patterns_compiled_eagerly{ 0 };
+std::atomic<uint64_t> g_name_patterns_invalid{ 0 };
+std::atomic<uint64_t> g_name_pattern_compile_ticks{ 0 };
+std::atomic<uint64_t> g_name_patterns_compiled_narrow{ 0 };
+std::atomic<uint64_t> g_name_checks_narrow{ 0 };		// A-variant name checks done on the char buffer
+std::atomic<uint64_t> g_name_checks_transcoded{ 0 };	// A-variant name checks that had to widen the name
+
+// All rules, compiled into one array per field (structure of arrays) with a presence
+// bitmask per rule. Numeric fields have the width of the MIDIxxxCAPS member they refer to,
+// and strings live in a single pool, so matching a device against all rules scans a few
+// small contiguous arrays. Rules are applied in config order, like before.
+// Name patterns are only compiled the first time a device passes a rule's direction and
+// numeric fields (or by compile_all_async), since most rules never see a matching device.
+// ASCII patterns and all replacement names also get a narrow (ANSI) form, so A-variant
+// queries on ASCII device names match and patch the char buffer without transcoding.
+class rule_table {
+public:
+	~rule_table() {
+		for (auto& slot : m_name_regexes) {
+			delete slot->compiled.load();
+			delete slot->compiled_a.load();
+		}
+	}
+
+	void add(replace_rule const& r) {
+		uint32_t present = 0;
+		auto set = [&](auto const& maybe, RuleField field, auto& column) {
+			using T = typename std::remove_reference_t<decltype(column)>::value_type;
+			T value = 0;
+			if (maybe.has_value()) {
+				if (maybe.value() > (std::numeric_limits<T>::max)()) {
+					throw std::runtime_error("Value out of range: " + std::to_string(maybe.value()));
+				}
+				value = (T)maybe.value();
+				present |= field;
+			}
+			return value;
+		};
+		WORD match_man_id = set(r.maybe_match_man_id, MatchManId, m_match_man_id);
+		WORD match_prod_id = set(r.maybe_match_prod_id, MatchProdId, m_match_prod_id);
+		DWORD match_driver_version = set(r.maybe_match_driver_version, MatchDriverVersion, m_match_driver_version);
+		WORD replace_man_id = set(r.maybe_replace_man_id, ReplaceManId, m_replace_man_id);
+		WORD replace_prod_id = set(r.maybe_replace_prod_id, ReplaceProdId, m_replace_prod_id);
+		DWORD replace_driver_version = set(r.maybe_replace_driver_version, ReplaceDriverVersion, m_replace_driver_version);
+		WORD technology = set(r.maybe_replace_technology, ReplaceTechnology, m_replace_technology);
+		WORD voices = set(r.maybe_replace_voices, ReplaceVoices, m_replace_voices);
+		WORD notes = set(r.maybe_replace_notes, ReplaceNotes, m_replace_notes);
+		WORD channel_mask = set(r.maybe_replace_channel_mask, ReplaceChannelMask, m_replace_channel_mask);
+		DWORD support = set(r.maybe_replace_support, ReplaceSupport, m_replace_support);
+
+		uint32_t name_regex = 0;
+		if (r.maybe_match_name.has_value()) {
+			// Rules with the same pattern share its compiled regex
+			auto it = m_name_regex_index.find(r.maybe_match_name.value());
+			if (it == m_name_regex_index.end()) {
+				auto slot = std::make_unique<lazy_regex>();
+				slot->pattern = intern(r.maybe_match_name.value());
+				slot->ascii = is_ascii(r.maybe_match_name.value().c_str());
+				if (slot->ascii) { slot->pattern_a = intern_a(wstringToString(r.maybe_match_name.value())); }
+				m_name_regexes.push_back(std::move(slot));
+				it = m_name_regex_index.emplace(r.maybe_match_name.value(), (uint32_t)(m_name_regexes.size() - 1)).first;
+			}
+			name_regex = it->second;
+			present |= MatchName;
+		}
+		if (r.maybe_match_direction.has_value()) { present |= MatchDirection; }
+		if (r.maybe_replace_name.has_value()) { present |= ReplaceName; }
+		if (r.maybe_replace_interface_name.has_value()) { present |= ReplaceInterfaceName; }
+
+		m_present.push_back(present);
+		m_direction.push_back((uint8_t)r.maybe_match_direction.value_or(Direction::Input));
+		m_match_man_id.push_back(match_man_id);
+		m_match_prod_id.push_back(match_prod_id);
+		m_match_driver_version.push_back(match_driver_version);
+		m_name_regex.push_back(name_regex);
+		m_replace_man_id.push_back(replace_man_id);
+		m_replace_prod_id.push_back(replace_prod_id);
+		m_replace_driver_version.push_back(replace_driver_version);
+		m_replace_technology.push_back(technology);
+		m_replace_voices.push_back(voices);
+		m_replace_notes.push_back(notes);
+		m_replace_channel_mask.push_back(channel_mask);
+		m_replace_support.push_back(support);
+		m_replace_name.push_back(r.maybe_replace_name.has_value() ? intern(r.maybe_replace_name.value()) : 0);
+		m_replace_name_a.push_back(r.maybe_replace_name.has_value() ? intern_a(wstringToString(r.maybe_replace_name.value())) : 0);
+		m_replace_interface_name.push_back(r.maybe_replace_interface_name.has_value() ? intern(r.maybe_replace_interface_name.value()) : 0);
+	}
+
+	size_t size() const { return m_present.size(); }
+	uint32_t fields(size_t i) const { return m_present[i]; }
+
+	// Sets out[i - first] for every rule from first on whose direction and numeric match
+	// fields agree with m. Branch-free, so the compiler can vectorize it across rules.
+	void numeric_candidates(midi_dev_caps const& m, size_t first, uint8_t* out) const {
+		uint8_t direction = (uint8_t)m.direction;
+		WORD man_id = (WORD)m.man_id;
+		WORD prod_id = (WORD)m.prod_id;
+		DWORD driver_version = (DWORD)m.driver_version;
+		for (size_t i = first; i < m_present.size(); i++) {
+			out[i - first] = numeric_match(i, direction, man_id, prod_id, driver_version);
+		}
+	}
+
+	// An invalid pattern never matches
+	bool name_matches(size_t i, std::wstring const& name) const {
+		if (!(m_present[i] & MatchName)) { return true; }
+		auto& slot = *m_name_regexes[m_name_regex[i]];
+		std::wregex const* re = slot.compiled.load(std::memory_order_acquire);
+		if (!re && !slot.invalid.load(std::memory_order_relaxed)) { re = compile<std::wregex>(slot, false); }
+		std::wsmatch rmatch;
+		return re && std::regex_match(name, rmatch, *re);
+	}
+
+	// A-variant name, widened only when a rule can't be checked on the char buffer
+	struct narrow_name {
+		const CHAR* str;
+		std::optional<bool> ascii;
+		std::optional<std::wstring> wide;
+	};
+
+	// An ASCII pattern matches an ASCII name the same in both regex forms. Anything else
+	// (e.g. a name in a DBCS code page) goes through the wide regex like before.
+	bool name_matches_a(size_t i, narrow_name& name) const {
+		if (!(m_present[i] & MatchName)) { return true; }
+		auto& slot = *m_name_regexes[m_name_regex[i]];
+		if (!name.ascii.has_value()) { name.ascii = is_ascii(name.str); }
+		if (name.ascii.value() && slot.ascii) {
+			g_name_checks_narrow.fetch_add(1, std::memory_order_relaxed);
+			std::regex const* re = slot.compiled_a.load(std::memory_order_acquire);
+			if (!re && !slot.invalid.load(std::memory_order_relaxed)) { re = compile<std::regex>(slot, false); }
+			return re && std::regex_match(name.str, *re);
+		}
+		g_name_checks_transcoded.fetch_add(1, std::memory_order_relaxed);
+		if (!name.wide.has_value()) { name.wide = stringToWstring(name.str); }
+		return name_matches(i, name.wide.value());
+	}
+
+	size_t name_patterns() const { return m_name_regexes.size(); }
+
+	// Compiles all name patterns on a pool of worker threads. Returns right away: this runs
+	// in DllMain, where the threads only start once attach is done. Lookups meanwhile compile
+	// the patterns they need themselves.
+	void compile_all_async(size_t threads) {
+		if (threads == 0) {
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			threads = info.dwNumberOfProcessors;
+		}
+		if (threads > m_name_regexes.size()) { threads = m_name_regexes.size(); }
+		if (threads > MAXIMUM_WAIT_OBJECTS) { threads = MAXIMUM_WAIT_OBJECTS; }
+		for (size_t i = 0; i < threads; i++) {
+			m_compiling.fetch_add(1);
+			HANDLE thread = CreateThread(NULL, 0, compile_thread_proc, this, 0, NULL);
+			if (!thread) {
+				m_compiling.fetch_sub(1);
+				break;
+			}
+			SetThreadPriority(thread, THREAD_PRIORITY_BELOW_NORMAL);
+			m_compile_threads.push_back(thread);
+		}
+	}
+
+	// Process detach, before the table goes away. The workers stop after the pattern they are
+	// compiling. They can't exit while DllMain holds the loader lock, so this waits until
+	// they have left the table, or for their handles when the process is exiting and they
+	// are gone already.
+	void stop_compiling() {
+		if (m_compile_threads.empty()) { return; }
+		m_stop_compiling = true;
+		while (m_compiling.load() > 0 &&
+			WaitForMultipleObjects((DWORD)m_compile_threads.size(), m_compile_threads.data(), TRUE, 1) == WAIT_TIMEOUT) {}
+		for (HANDLE thread : m_compile_threads) { CloseHandle(thread); }
+		m_compile_threads.clear();
+	}
+
+	bool is_match(size_t i, midi_dev_caps const& m) const {
+		return numeric_match(i, (uint8_t)m.direction, (WORD)m.man_id, (WORD)m.prod_id, (DWORD)m.driver_version) &&
+			name_matches(i, m.name);
+	}
+
+	void apply(size_t i, midi_dev_caps& m) const {
+		if (m_present[i] & ReplaceName) { m.name = string_at(m_replace_name[i]); }
+		apply_numeric(i, m);
+	}
+
+	void apply_numeric(size_t i, midi_dev_caps& m) const {
+		uint32_t p = m_present[i];
+		if (p & ReplaceManId) { m.man_id = m_replace_man_id[i]; }
+		if (p & ReplaceProdId) { m.prod_id = m_replace_prod_id[i]; }
+		if (p & ReplaceDriverVersion) { m.driver_version = m_replace_driver_version[i]; }
+		if (p & ReplaceTechnology) { m.technology = m_replace_technology[i]; }
+		if (p & ReplaceVoices) { m.voices = m_replace_voices[i]; }
+		if (p & ReplaceNotes) { m.notes = m_replace_notes[i]; }
+		if (p & ReplaceChannelMask) { m.channel_mask = m_replace_channel_mask[i]; }
+		if (p & ReplaceSupport) { m.support = m_replace_support[i]; }
+	}
+
+	std::optional<std::wstring> interface_name(size_t i) const {
+		if (!(m_present[i] & ReplaceInterfaceName)) { return std::nullopt; }
+		return std::wstring(string_at(m_replace_interface_name[i]));
+	}
+
+	// Index of the first rule matching m, if any.
+	std::optional<size_t> first_match(midi_dev_caps const& m) const {
+		auto& candidates = scratch();
+		numeric_candidates(m, 0, candidates.data());
+		for (size_t i = 0; i < size(); i++) {
+			if (candidates[i] && name_matches(i, m.name)) { return i; }
+		}
+		return std::nullopt;
+	}
+
+	// Applies every matching rule in order to a MIDIxxxCAPS struct. Like before, a rule
+	// sees the caps as modified by the rules before it. on_match is called after each match.
+	template<typename dev_caps_struct, typename F>
+	void apply_in_place_c(dev_caps_struct& s, F on_match) const {
+		if (m_present.empty()) { return; }
+		if constexpr (std::is_same<dev_caps_char_type<dev_caps_struct>, CHAR>::value) {
+			apply_in_place_a(s, on_match);
+			return;
+		}
+		auto ours = to_our_dev_caps(s);
+		auto& candidates = scratch();
+		numeric_candidates(ours, 0, candidates.data());
+		for (size_t i = 0; i < size(); i++) {
+			if (!candidates[i] || !name_matches(i, ours.name)) { continue; }
+			apply(i, ours);
+			write_back(ours, s);
+			on_match();
+			if (m_present[i] & (ReplaceManId | ReplaceProdId | ReplaceDriverVersion)) {
+				// Later rules now have to match the replaced values
+				numeric_candidates(ours, i + 1, candidates.data() + i + 1);
+			}
+		}
+	}
+
+	// Same as apply_in_place_c, on the szPname of a CHAR struct
+	template<typename dev_caps_struct, typename F>
+	void apply_in_place_a(dev_caps_struct& s, F on_match) const {
+		auto ours = to_our_numeric_dev_caps(s);
+		narrow_name name{ s.szPname };
+		auto& candidates = scratch();
+		numeric_candidates(ours, 0, candidates.data());
+		for (size_t i = 0; i < size(); i++) {
+			if (!candidates[i] || !name_matches_a(i, name)) { continue; }
+			apply_numeric(i, ours);
+			write_back_numeric(ours, s);
+			if (m_present[i] & ReplaceName) {
+				constexpr size_t n = sizeof(s.szPname);
+				strncpy(s.szPname, string_a_at(m_replace_name_a[i]), n - 1);
+				s.szPname[n - 1] = 0;
+				name = narrow_name{ s.szPname };
+			}
+			on_match();
+			if (m_present[i] & (ReplaceManId | ReplaceProdId | ReplaceDriverVersion)) {
+				numeric_candidates(ours, i + 1, candidates.data() + i + 1);
+			}
+		}
+	}
+
+private:
+	struct lazy_regex {
+		uint32_t pattern = 0;								// Offset into m_strings
+		uint32_t pattern_a = 0;								// Offset into m_strings_a, if ascii
+		bool ascii = false;
+		std::atomic<std::wregex*> compiled{ nullptr };
+		std::atomic<std::regex*> compiled_a{ nullptr };
+		std::atomic<bool> invalid{ false };
+	};
+
+	template<typename char_t>
+	static bool is_ascii(const char_t* str) {
+		for (; *str; str++) {
+			if ((std::make_unsigned_t<char_t>)*str > 0x7f) { return false; }
+		}
+		return true;
+	}
+
+	// Compiles the wide (std::wregex) or narrow (std::regex) form of a pattern; concurrent
+	// compiles of the same one keep the first result
+	template<typename regex_t>
+	regex_t const* compile(lazy_regex& slot, bool eager) const {
+		constexpr bool narrow = std::is_same<regex_t, std::regex>::value;
+		std::atomic<regex_t*>* compiled;
+		if constexpr (narrow) { compiled = &slot.compiled_a; }
+		else { compiled = &slot.compiled; }
+		uint64_t start = qpc_now();
+		regex_t* re = nullptr;
+		try {
+			if constexpr (narrow) { re = new std::regex(string_a_at(slot.pattern_a)); }
+			else { re = new std::wregex(string_at(slot.pattern)); }
+		}
+		catch (std::regex_error& e) {
+			if (!slot.invalid.exchange(true)) {
+				g_name_patterns_invalid.fetch_add(1, std::memory_order_relaxed);
+				wrapper_log(nullptr, L"Invalid match_name pattern, its rules never match: %ls (%ls)\n", string_at(slot.pattern), stringToWstring(e.what()).c_str());
+			}
+			return nullptr;
+		}
+		g_name_pattern_compile_ticks.fetch_add(qpc_now() - start, std::memory_order_relaxed);
+		regex_t* expected = nullptr;
+		if (!compiled->compare_exchange_strong(expected, re, std::memory_order_acq_rel)) {
+			delete re;
+			return expected;
+		}
+		if constexpr (narrow) { g_name_patterns_compiled_narrow.fetch_add(1, std::memory_order_relaxed); }
+		else { (eager ? g_name_patterns_compiled_eagerly : g_name_patterns_compiled_lazily).fetch_add(1, std::memory_order_relaxed); }
+		return re;
+	}
+
+	static DWORD WINAPI compile_thread_proc(LPVOID param) {
+		auto table = (rule_table*)param;
+		size_t i;
+		while (!table->m_stop_compiling && (i = table->m_next_eager.fetch_add(1)) < table->m_name_regexes.size()) {
+			auto& slot = *table->m_name_regexes[i];
+			if (!slot.compiled.load(std::memory_order_acquire) && !slot.invalid.load(std::memory_order_relaxed)) { table->compile<std::wregex>(slot, true); }
+			if (slot.ascii && !slot.compiled_a.load(std::memory_order_acquire) && !slot.invalid.load(std::memory_order_relaxed)) { table->compile<std::regex>(slot, true); }
+		}
+		table->m_compiling.fetch_sub(1);	// Last access to the table
+		return 0;
+	}
+
+	uint8_t numeric_match(size_t i, uint8_t direction, WORD man_id, WORD prod_id, DWORD driver_version) const {
+		uint32_t p = m_present[i];
+		return (uint8_t)(
+			(!(p & MatchDirection) | (m_direction[i] == direction)) &
+			(!(p & MatchManId) | (m_match_man_id[i] == man_id)) &
+			(!(p & MatchProdId) | (m_match_prod_id[i] == prod_id)) &
+			(!(p & MatchDriverVersion) | (m_match_driver_version[i] == driver_version)));
+	}
+
+	std::vector<uint8_t>& scratch() const {
+		thread_local std::vector<uint8_t> candidates;
+		if (candidates.size() < size()) { candidates.resize(size()); }
+		return candidates;
+	}
+
+	template<typename dev_caps_struct>
+	static void write_back(midi_dev_caps const& ours, dev_caps_struct& s) {
+		constexpr size_t n = sizeof(s.szPname) / sizeof(s.szPname[0]);
+		if constexpr (std::is_same<dev_caps_char_type<dev_caps_struct>, WCHAR>::value) {
+			wcsncpy((WCHAR*)s.szPname, ours.name.c_str(), n - 1);
+		} else {
+			strncpy((CHAR*)s.szPname, wstringToString(ours.name).c_str(), n - 1);
+		}
+		s.szPname[n - 1] = 0;
+		write_back_numeric(ours, s);
+	}
+
+	template<typename dev_caps_struct>
+	static void write_back_numeric(midi_dev_caps const& ours, dev_caps_struct& s) {
+		s.wMid = (WORD)ours.man_id;
+		s.wPid = (WORD)ours.prod_id;
+		s.vDriverVersion = (MMVERSION)ours.driver_version;
+
+		if constexpr (CapsDirection<dev_caps_struct>() == Direction::Output) {
+			s.wTechnology = (WORD)ours.technology.value();
+			s.wVoices = (WORD)ours.voices.value();
+			s.wNotes = (WORD)ours.notes.value();
+			s.wChannelMask = (WORD)ours.channel_mask.value();
+			s.dwSupport = (DWORD)ours.support.value();
+		}
+	}
+
+	// Strings are stored NUL-terminated in one pool; identical strings are stored once.
+	uint32_t intern(std::wstring const& str) {
+		auto it = m_interned.find(str);
+		if (it != m_interned.end()) { return it->second; }
+		uint32_t offset = (uint32_t)m_strings.size();
+		m_strings.append(str);
+		m_strings.push_back(L'\0');
+		m_interned.emplace(str, offset);
+		return offset;
+	}
+
+	const wchar_t* string_at(uint32_t offset) const { return m_strings.c_str() + offset; }
+
+	// Narrow pool, for the ANSI forms of the strings above
+	uint32_t intern_a(std::string const& str) {
+		auto it = m_interned_a.find(str);
+		if (it != m_interned_a.end()) { return it->second; }
+		uint32_t offset = (uint32_t)m_strings_a.size();
+		m_strings_a.append(str);
+		m_strings_a.push_back('\0');
+		m_interned_a.emplace(str, offset);
+		return offset;
+	}
+
+	const char* string_a_at(uint32_t offset) const { return m_strings_a.c_str() + offset; }
+
+	std::vector<uint32_t> m_present;
+	std::vector<uint8_t> m_direction;
+	std::vector<WORD> m_match_man_id;
+	std::vector<WORD> m_match_prod_id;
+	std::vector<DWORD> m_match_driver_version;
+	std::vector<uint32_t> m_name_regex;			// Index into m_name_regexes
+	std::vector<WORD> m_replace_man_id;
+	std::vector<WORD> m_replace_prod_id;
+	std::vector<DWORD> m_replace_driver_version;
+	std::vector<WORD> m_replace_technology;
+	std::vector<WORD> m_replace_voices;
+	std::vector<WORD> m_replace_notes;
+	std::vector<WORD> m_replace_channel_mask;
+	std::vector<DWORD> m_replace_support;
+	std::vector<uint32_t> m_replace_name;		// Offset into m_strings
+	std::vector<uint32_t> m_replace_name_a;		// Offset into m_strings_a
+	std::vector<uint32_t> m_replace_interface_name;
+
+	std::vector<std::unique_ptr<lazy_regex>> m_name_regexes;
+	std::unordered_map<std::wstring, uint32_t> m_name_regex_index;	// Pattern to index into m_name_regexes
+	std::atomic<size_t> m_next_eager{ 0 };							// Next pattern for the compile threads
+	std::vector<HANDLE> m_compile_threads;
+	std::atomic<size_t> m_compiling{ 0 };							// Compile threads still using the table
+	std::atomic<bool> m_stop_compiling{ false };
+	std::wstring m_strings;
+	std::unordered_map<std::wstring, uint32_t> m_interned;
+	std::string m_strings_a;
+	std::unordered_map<std::string, uint32_t> m_interned_a;
+};
+
+// To illustrate and check
+static_assert(std::is_same<WCHAR, dev_caps_char_type<MIDIINCAPSW>>::value, "error");
+static_assert(std::is_same<CHAR, dev_caps_char_type<MIDIINCAPSA>>::value, "error");
+static_assert(std::is_same<WCHAR, dev_caps_char_type<MIDIOUTCAPSW>>::value, "error");
+static_assert(std::is_same<CHAR, dev_caps_char_type<MIDIOUTCAPSA>>::value, "error");
+
+rule_table g_replace_rules;
+std::vector<std::string> g_replace_rule_sources;	// Config text of each rule, for reports
+
+template<typename dev_caps_struct>
+std::wstring stringify_common_caps(dev_caps_struct const& s) {
+	return
+		L"  name: " + chars_to_str((dev_caps_char_type<dev_caps_struct> *)s.szPname) + L"\n" +
+		L"  man id: " + std::to_wstring(s.wMid) + L"\n" +
+		L"  prod id: " + std::to_wstring(s.wPid) + L"\n" +
+		L"  driver version: " + std::to_wstring(s.vDriverVersion) + L"\n";
+}
+
+template<typename out_dev_caps_struct>
+std::wstring stringify_output_caps(out_dev_caps_struct const& s) {
+	return stringify_common_caps(s) +
+	       L"  technology: " + std::to_wstring(s.wTechnology) + L"\n" +
+		   L"  voices: " + std::to_wstring(s.wVoices) + L"\n" +
+	       L"  notes: " + std::to_wstring(s.wNotes) + L"\n" +
+	       L"  channel mask: " + std::to_wstring(s.wChannelMask) + L"\n" +
+	       L"  support: " + std::to_wstring(s.dwSupport) + L"\n";
+}
+
+template<typename in_dev_caps_struct>
+std::wstring stringify_input_caps(in_dev_caps_struct const& s) {
+	return stringify_common_caps(s);
+}
+
+template<typename dev_caps_struct>
+std::wstring stringify_caps(dev_caps_struct const& s) {
+	constexpr bool is_out = CapsDirection<dev_caps_struct>() == Direction::Output;
+	if constexpr (is_out) {
+		return stringify_output_caps(s);
+	} else {
+		return stringify_input_caps(s);
+	}
+}
+
+// Case-insensitive FNV-1a, used to compare executable names without building strings.
+uint64_t hash_file_name(std::wstring_view name) {
+	uint64_t h = 14695981039346656037ull;
+	for (wchar_t c : name) {
+		h = (h ^ (uint64_t)towlower(c)) * 1099511628211ull;
+	}
+	return h;
+}
+
+std::wstring_view file_name_of(std::wstring_view path) {
+	auto pos = path.find_last_of(L"\\/");
+	return pos == std::wstring_view::npos ? path : path.substr(pos + 1);
+}
+
+// Finds the first profile matching the executable at path, either by file name
+// ("match_exe", case-insensitive) or by a regex on the full path ("match_path").
+// Other profiles are only looked at as far as needed to reject them: their rules
+// are never parsed or compiled.
+json* select_profile(json& profiles, std::wstring const& path, std::wostream& log) {
+	std::wstring_view exe = file_name_of(path);
+	uint64_t exe_hash = hash_file_name(exe);
+	log << L"Selecting profile for " << path << L"\n";
+
+	for (auto& profile : profiles) {
+		if (profile.contains("match_exe")) {
+			auto name = stringToWstring(profile["match_exe"].template get<std::string>());
+			if (hash_file_name(name) != exe_hash || _wcsicmp(name.c_str(), std::wstring(exe).c_str()) != 0) { continue; }
+		}
+		if (profile.contains("match_path")) {
+			std::wregex re(stringToWstring(profile["match_path"].template get<std::string>()), std::regex::icase);
+			if (!std::regex_match(path, re)) { continue; }
+		}
+		if (!profile.contains("match_exe") && !profile.contains("match_path")) { continue; }
+		return &profile;
+	}
+	return nullptr;
+}
+
+// Merges the profile matching the executable at path into the config: its rules are added
+// after the top-level rules, which apply to every executable, and its other settings
+// replace the top-level ones. Returns the name of the profile, if one matched.
+std::optional<std::string> apply_profile(json& data, std::wstring const& path, std::wostream& log) {
+	json* profile = select_profile(data["profiles"], path, log);
+	if (!profile) {
+		log << L"No profile matches this executable.\n";
+		return std::nullopt;
+	}
+	std::string name = profile->contains("name") ? (*profile)["name"].template get<std::string>() :
+		profile->contains("match_exe") ? (*profile)["match_exe"].template get<std::string>() : (*profile)["match_path"].template get<std::string>();
+	log << L"Using profile: " << stringToWstring(name) << L"\n";
+	json profile_rules = profile->contains("rules") ? (*profile)["rules"] : json::array();
+	for (auto& [key, value] : profile->items()) {
+		if (key != "name" && key != "match_exe" && key != "match_path" && key != "rules") { data[key] = value; }
+	}
+	if (!data.contains("rules")) { data["rules"] = json::array(); }
+	for (auto& rule : profile_rules) { data["rules"].push_back(rule); }
+	return name;
+}
+
+void parse_rules(json& rules, std::wostream& log) {
+	for (auto& rule : rules) {
+		try {
+			replace_rule rval;
+			if (rule.contains("match_name")) { rval.maybe_match_name = stringToWstring(rule["match_name"].template get<std::string>()); }
+			if (rule.contains("match_man_id")) { rval.maybe_match_man_id = rule["match_man_id"].template get<size_t>(); }
+			if (rule.contains("match_prod_id")) { rval.maybe_match_prod_id = rule["match_prod_id"].template get<size_t>(); }
+			if (rule.contains("match_driver_version")) { rval.maybe_match_driver_version = rule["match_driver_version"].template get<size_t>(); }
+			if (rule.contains("match_direction")) {
+				auto text = stringToWstring(rule["match_direction"].template get<std::string>());
+				if (text == L"in") { rval.maybe_match_direction = Direction::Input; }
+				else if (text == L"out") { rval.maybe_match_direction = Direction::Output; }
+				else {
+					throw std::runtime_error("Invalid value for match_direction (should be in or out): " + wstringToString(text));
+				}
+			}
+			if (rule.contains("replace_name")) { rval.maybe_replace_name = stringToWstring(rule["replace_name"].template get<std::string>()); }
+			if (rule.contains("replace_man_id")) { rval.maybe_replace_man_id = rule["replace_man_id"].template get<size_t>(); }
+			if (rule.contains("replace_prod_id")) { rval.maybe_replace_prod_id = rule["replace_prod_id"].template get<size_t>(); }
+			if (rule.contains("replace_driver_version")) { rval.maybe_replace_driver_version = rule["replace_driver_version"].template get<size_t>(); }
+			if (rule.contains("replace_technology")) { rval.maybe_replace_technology = rule["replace_technology"].template get<size_t>(); }
+			if (rule.contains("replace_voices")) { rval.maybe_replace_voices = rule["replace_voices"].template get<size_t>(); }
+			if (rule.contains("replace_notes")) { rval.maybe_replace_notes = rule["replace_notes"].template get<size_t>(); }
+			if (rule.contains("replace_channel_mask")) { rval.maybe_replace_channel_mask = rule["replace_channel_mask"].template get<size_t>(); }
+			if (rule.contains("replace_support")) { rval.maybe_replace_support = rule["replace_support"].template get<size_t>(); }
+			if (rule.contains("replace_interface_name")) { rval.maybe_replace_interface_name = stringToWstring(rule["replace_interface_name"].template get<std::string>()); }
+
+			if (!rval.maybe_replace_name.has_value() &&
+				!rval.maybe_replace_driver_version.has_value() &&
+				!rval.maybe_replace_man_id.has_value() &&
+				!rval.maybe_replace_prod_id.has_value() &&
+				!rval.maybe_replace_technology.has_value() &&
+				!rval.maybe_replace_voices.has_value() &&
+				!rval.maybe_replace_notes.has_value() &&
+				!rval.maybe_replace_channel_mask.has_value() &&
+				!rval.maybe_replace_support.has_value() &&
+				!rval.maybe_replace_interface_name.has_value()) {
+				throw std::runtime_error("No replace items set for rule, would not affect anything.");
+			}
+
+			g_replace_rules.add(rval);
+			g_replace_rule_sources.push_back(rule.dump());
+		}
+		catch (std::exception& e) {
+			log << L"Skipping rule:\n" << stringToWstring(std::string(e.what())) << "\n";
+		}
+		catch (...) {
+			log << L"Skipping rule (unknown exception)\n";
+		}
+	}
+}
@@ -0,0 +1,344 @@
+// Shared native output handles. Opens of the same output device within the process share
+// one native handle, opened with a wrapper callback. Every midiOutOpen still returns its own
+// logical handle (the address of its wrapper state), with its own callback, sounding notes
+// and long messages. When the last logical handle is closed, the native handle stays open
+// for the linger time, so an application reopening the device right away does not pay for
+// another native open (tens of milliseconds under Wine).
+// The native open happens outside the table lock: a device being opened has an entry marked
+// as opening, which concurrent opens of the same device wait for.
+
+struct shared_outputs_config {
+	uint64_t linger_ms = 2000;
+	std::optional<std::vector<UINT>> maybe_devices;	// Default: all devices
+};
+
+bool g_shared_outputs_enabled = false;
+shared_outputs_config g_shared_outputs_config;
+
+std::atomic<uint64_t> g_shared_outputs_opens{ 0 };
+std::atomic<uint64_t> g_shared_outputs_closes{ 0 };
+std::atomic<uint64_t> g_shared_outputs_native_opens{ 0 };
+std::atomic<uint64_t> g_shared_outputs_native_closes{ 0 };
+std::atomic<uint64_t> g_shared_outputs_lingering_reused{ 0 };
+std::atomic<uint64_t> g_shared_outputs_open_ticks{ 0 };			// Total time spent in midiOutOpen
+std::atomic<uint64_t> g_shared_outputs_close_ticks{ 0 };
+std::atomic<uint64_t> g_shared_outputs_native_open_ticks{ 0 };
+
+struct shared_output {
+	UINT device_id;
+	HMIDIOUT native = NULL;
+	bool opening = true;			// The native open is in progress
+	std::vector<HMIDIOUT> users;	// Logical handles
+	uint64_t linger_until = 0;		// QPC; only meaningful without users
+
+	// The output filter's tables describe the device, so all users share them
+	SRWLOCK filter_lock = SRWLOCK_INIT;
+	output_filter_state filter;
+
+	// Long messages in the driver, to route MOM_DONE to the logical handle that sent them
+	SRWLOCK senders_lock = SRWLOCK_INIT;
+	std::unordered_map<LPMIDIHDR, HMIDIOUT> senders;
+
+	void sending(LPMIDIHDR pmh, HMIDIOUT hmo) {
+		AcquireSRWLockExclusive(&senders_lock);
+		senders[pmh] = hmo;
+		ReleaseSRWLockExclusive(&senders_lock);
+	}
+
+	// The sender of a long message, forgotten if done
+	HMIDIOUT sender(LPMIDIHDR pmh, bool done) {
+		HMIDIOUT rval = NULL;
+		AcquireSRWLockExclusive(&senders_lock);
+		if (auto it = senders.find(pmh); it != senders.end()) {
+			rval = it->second;
+			if (done) { senders.erase(it); }
+		}
+		ReleaseSRWLockExclusive(&senders_lock);
+		return rval;
+	}
+};
+
+class shared_output_table {
+public:
+	shared_output_table() {
+		InitializeCriticalSection(&m_lock);
+	}
+
+	bool shares(UINT device_id) const {
+		auto const& devices = g_shared_outputs_config.maybe_devices;
+		return !devices.has_value() || std::find(devices->begin(), devices->end(), device_id) != devices->end();
+	}
+
+	MMRESULT open(LPHMIDIOUT phmo, UINT device_id, app_callback const& app, DWORD fdwOpen) {
+		uint64_t start = qpc_now();
+		EnterCriticalSection(&m_lock);
+		shared_output* out = find_device(device_id);
+		while (out && out->opening) {
+			// Opened by another thread; if that fails, this one tries again
+			SleepConditionVariableCS(&m_opened, &m_lock, INFINITE);
+			out = find_device(device_id);
+		}
+		if (!out) {
+			auto owned = std::make_unique<shared_output>();
+			owned->device_id = device_id;
+			out = owned.get();
+			m_outputs.push_back(std::move(owned));
+			LeaveCriticalSection(&m_lock);
+			HMIDIOUT native = NULL;
+			MMRESULT rval = MMmidiOutOpen(&native, device_id, (DWORD_PTR)trampoline, (DWORD_PTR)out,
+				(fdwOpen & ~CALLBACK_TYPEMASK) | CALLBACK_FUNCTION);
+			EnterCriticalSection(&m_lock);
+			WakeAllConditionVariable(&m_opened);
+			if (rval != MMSYSERR_NOERROR) {
+				std::erase_if(m_outputs, [out](auto const& o) { return o.get() == out; });
+				LeaveCriticalSection(&m_lock);
+				return rval;
+			}
+			out->native = native;
+			out->opening = false;
+			g_shared_outputs_native_opens.fetch_add(1, std::memory_order_relaxed);
+			g_shared_outputs_native_open_ticks.fetch_add(qpc_now() - start, std::memory_order_relaxed);
+		}
+		else if (out->users.empty()) {
+			g_shared_outputs_lingering_reused.fetch_add(1, std::memory_order_relaxed);
+		}
+		auto state = std::make_unique<midi_out_handle_state>();
+		state->device_id = device_id;
+		state->shared = out;
+		state->app = app;
+		HMIDIOUT hmo = (HMIDIOUT)state.get();
+		out->users.push_back(hmo);
+		g_midi_out_handles.add(hmo, std::move(state));
+		g_handle_devices.add(hmo, true, device_id);
+		LeaveCriticalSection(&m_lock);
+
+		*phmo = hmo;
+		app.invoke(hmo, MOM_OPEN, 0, 0);
+		g_shared_outputs_opens.fetch_add(1, std::memory_order_relaxed);
+		g_shared_outputs_open_ticks.fetch_add(qpc_now() - start, std::memory_order_relaxed);
+		return MMSYSERR_NOERROR;
+	}
+
+	// Closes a logical handle; the state is destroyed. Like the native close, this fails
+	// while long messages of the handle are still queued in the driver.
+	MMRESULT close(HMIDIOUT hmo, midi_out_handle_state& state) {
+		uint64_t start = qpc_now();
+		AcquireSRWLockShared(&state.lock);
+		bool long_pending = std::any_of(state.long_in_flight.begin(), state.long_in_flight.end(),
+			[](LPMIDIHDR pmh) { return !(pmh->dwFlags & MHDR_DONE); });
+		ReleaseSRWLockShared(&state.lock);
+		if (long_pending) { return MIDIERR_STILLPLAYING; }
+
+		app_callback app = state.app;
+		std::unique_ptr<shared_output> close_now;
+		EnterCriticalSection(&m_lock);
+		shared_output* out = state.shared;
+		std::erase(out->users, hmo);
+		g_midi_out_handles.remove(hmo);
+		g_handle_devices.remove(hmo);
+		if (out->users.empty()) {
+			if (g_shared_outputs_config.linger_ms == 0) {
+				close_now = take_output(out);
+			}
+			else {
+				out->linger_until = start + g_shared_outputs_config.linger_ms * g_qpc_frequency.QuadPart / 1000;
+				ensure_thread();
+			}
+		}
+		LeaveCriticalSection(&m_lock);
+
+		// A MOM_DONE of the handle may still be delivered by the driver's thread, which marks
+		// the header done before calling back; the caller keeps the state alive meanwhile
+		state.closed = true;
+		while (state.delivering) { SwitchToThread(); }
+		app.invoke(hmo, MOM_CLOSE, 0, 0);
+		if (close_now) {
+			// Destroyed after the native close, once the driver no longer calls back with it
+			MMmidiOutClose(close_now->native);
+			g_shared_outputs_native_closes.fetch_add(1, std::memory_order_relaxed);
+		}
+		g_shared_outputs_closes.fetch_add(1, std::memory_order_relaxed);
+		g_shared_outputs_close_ticks.fetch_add(qpc_now() - start, std::memory_order_relaxed);
+		return MMSYSERR_NOERROR;
+	}
+
+	bool sole_user(midi_out_handle_state const& state) {
+		EnterCriticalSection(&m_lock);
+		bool rval = state.shared->users.size() == 1;
+		LeaveCriticalSection(&m_lock);
+		return rval;
+	}
+
+	// Lingering handles are left to the process exit. Waits for the linger thread to leave the
+	// table, polling its handle too as it can't exit under the loader lock.
+	void stop() {
+		EnterCriticalSection(&m_lock);
+		HANDLE thread = m_thread;
+		m_stop = true;
+		if (m_wake) { SetEvent(m_wake); }
+		LeaveCriticalSection(&m_lock);
+		if (thread) {
+			while (m_running && WaitForSingleObject(thread, 1) == WAIT_TIMEOUT) {}
+		}
+	}
+
+private:
+	// Driver callback of the native handles. Opens and closes are reported per logical handle
+	// by open() / close(); finished long messages go to the handle that sent them.
+	static void CALLBACK trampoline(HMIDIOUT native, UINT wMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2);
+
+	void deliver(shared_output* out, UINT wMsg, LPMIDIHDR pmh, DWORD_PTR dwParam2) {
+		HMIDIOUT target = out->sender(pmh, wMsg == MOM_DONE);
+		if (!target) { return; }
+		auto state = g_midi_out_handles.find(target);
+		if (!state) { return; }
+		// Counted before checking for a close, which sets the flag before waiting for the count
+		state->delivering.fetch_add(1);
+		if (!state->closed) { state->app.invoke(target, wMsg, (DWORD_PTR)pmh, dwParam2); }
+		state->delivering.fetch_sub(1);
+	}
+
+	// Called with m_lock held
+	shared_output* find_device(UINT device_id) {
+		for (auto& out : m_outputs) {
+			if (out->device_id == device_id) { return out.get(); }
+		}
+		return nullptr;
+	}
+
+	// Called with m_lock held
+	std::unique_ptr<shared_output> take_output(shared_output* out) {
+		auto it = std::find_if(m_outputs.begin(), m_outputs.end(), [out](auto const& o) { return o.get() == out; });
+		auto rval = std::move(*it);
+		m_outputs.erase(it);
+		return rval;
+	}
+
+	// Called with m_lock held
+	void ensure_thread() {
+		if (m_thread) {
+			SetEvent(m_wake);
+			return;
+		}
+		m_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+		m_running = true;
+		m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+		if (!m_thread) { m_running = false; }
+	}
+
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		auto table = (shared_output_table*)param;
+		table->run();
+		table->m_running = false;	// Last access to the table
+		return 0;
+	}
+
+	// Closes native handles whose linger time is over
+	void run() {
+		std::vector<std::unique_ptr<shared_output>> expired;
+		while (!m_stop) {
+			DWORD wait_ms = INFINITE;
+			EnterCriticalSection(&m_lock);
+			uint64_t now = qpc_now();
+			for (auto it = m_outputs.begin(); it != m_outputs.end();) {
+				auto& out = **it;
+				if (!out.users.empty() || out.opening) {
+					++it;
+				}
+				else if (out.linger_until <= now) {
+					expired.push_back(std::move(*it));
+					it = m_outputs.erase(it);
+				}
+				else {
+					DWORD ms = (DWORD)((out.linger_until - now) * 1000 / g_qpc_frequency.QuadPart) + 1;
+					if (ms < wait_ms) { wait_ms = ms; }
+					++it;
+				}
+			}
+			LeaveCriticalSection(&m_lock);
+			for (auto& out : expired) {
+				MMmidiOutClose(out->native);
+				g_shared_outputs_native_closes.fetch_add(1, std::memory_order_relaxed);
+			}
+			expired.clear();
+			WaitForSingleObject(m_wake, wait_ms);
+		}
+	}
+
+	CRITICAL_SECTION m_lock;	// Protects m_outputs, the user lists and the opening flags
+	CONDITION_VARIABLE m_opened = CONDITION_VARIABLE_INIT;	// A native open finished
+	std::vector<std::unique_ptr<shared_output>> m_outputs;
+	HANDLE m_thread = NULL;
+	HANDLE m_wake = NULL;
+	std::atomic<bool> m_stop{ false };
+	std::atomic<bool> m_running{ false };	// The linger thread still uses the table
+};
+
+shared_output_table g_shared_outputs;
+
+void CALLBACK shared_output_table::trampoline(HMIDIOUT native, UINT wMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2) {
+	// The instance data is not used for MOM_CLOSE, which arrives once the handle is gone
+	if (wMsg == MOM_DONE || wMsg == MOM_POSITIONCB) {
+		g_shared_outputs.deliver((shared_output*)dwInstance, wMsg, (LPMIDIHDR)dwParam1, dwParam2);
+	}
+}
+
+// The native handle behind a handle from the application: logical handles of shared outputs
+// are translated, anything else (native handles, device IDs) is returned as-is.
+HMIDIOUT native_midi_out(HMIDIOUT hmo) {
+	if (!g_shared_outputs_enabled) { return hmo; }
+	auto state = g_midi_out_handles.find(hmo);
+	return state && state->shared ? state->shared->native : hmo;
+}
+
+// The output filter state of a handle and its lock: the shared output's for logical handles
+std::pair<SRWLOCK*, output_filter_state*> output_filter_of(midi_out_handle_state& state) {
+	if (state.shared) { return { &state.shared->filter_lock, &state.shared->filter }; }
+	return { &state.lock, &state.filter };
+}
+
+// Runs a short message through the handle's output filter. A logical handle's message gets
+// back the status byte of its own running status first, as the shared tables only know the
+// running status of all users together.
+output_filter_state::Verdict filter_output_msg(midi_out_handle_state& state, DWORD& msg, uint64_t now, uint64_t rate_limit_ticks,
+                                               uint64_t& out_flush_at, DWORD& out_flush_msg) {
+	if (state.shared) {
+		AcquireSRWLockExclusive(&state.lock);
+		msg = state.app_running_status.complete(msg);
+		ReleaseSRWLockExclusive(&state.lock);
+	}
+	auto [lock, filter] = output_filter_of(state);
+	AcquireSRWLockExclusive(lock);
+	auto verdict = filter->filter(msg, g_output_filter_config, now, rate_limit_ticks, out_flush_at, out_flush_msg);
+	ReleaseSRWLockExclusive(lock);
+	return verdict;
+}
+
+// After a message sent on a native handle past the output filter: the device's running
+// status is no longer the one the filter of the handles on it knows.
+void forget_device_running_status(HMIDIOUT native) {
+	if (!g_output_filter_enabled) { return; }
+	g_midi_out_handles.for_each([native](HMIDIOUT hmo, midi_out_handle_state& state) {
+		if ((state.shared ? state.shared->native : hmo) != native) { return; }
+		auto [lock, filter] = output_filter_of(state);
+		AcquireSRWLockExclusive(lock);
+		filter->device_running_status = 0;
+		ReleaseSRWLockExclusive(lock);
+	});
+}
+
+json shared_outputs_stats_json() {
+	auto mean_us = [](uint64_t ticks, uint64_t count) { return count ? ticks_to_ns(ticks) / 1000.0 / count : 0.0; };
+	uint64_t opens = g_shared_outputs_opens.load();
+	uint64_t native_opens = g_shared_outputs_native_opens.load();
+	return json{
+		{ "opens", opens },
+		{ "closes", g_shared_outputs_closes.load() },
+		{ "native_opens", native_opens },
+		{ "native_closes", g_shared_outputs_native_closes.load() },
+		{ "lingering_reused", g_shared_outputs_lingering_reused.load() },
+		{ "mean_open_us", mean_us(g_shared_outputs_open_ticks.load(), opens) },
+		{ "mean_close_us", mean_us(g_shared_outputs_close_ticks.load(), g_shared_outputs_closes.load()) },
+		{ "mean_native_open_us", mean_us(g_shared_outputs_native_open_ticks.load(), native_opens) }
+	};
+}
@@ -0,0 +1,408 @@
+// midiStream emulation. The stream is backed by a plain native output handle; buffers of
+// MIDIEVENTs queued with midiStreamOut are played by a high-priority thread per stream,
+// which converts ticks to QPC time (following tempo events) and sleeps / spins until each
+// event is due, like the output scheduler. The stream handle given to the application is
+// the native output handle, so midiOutPrepareHeader, midiOutShortMsg etc. work on it as usual.
+
+struct stream_engine_config {
+	uint64_t spin_us = 1500;
+	int priority = THREAD_PRIORITY_TIME_CRITICAL;
+};
+
+bool g_stream_engine_enabled = false;
+stream_engine_config g_stream_engine_config;
+
+std::atomic<uint64_t> g_stream_events{ 0 };
+std::atomic<uint64_t> g_stream_buffers_done{ 0 };
+std::atomic<uint64_t> g_stream_max_jitter_ticks{ 0 };
+std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> g_stream_jitter_histogram{};
+
+class midi_stream {
+public:
+	midi_stream(app_callback const& app) : m_app(app) {
+		InitializeCriticalSection(&m_lock);
+		m_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+		m_long_done = CreateEventW(NULL, FALSE, FALSE, NULL);
+	}
+
+	~midi_stream() {
+		DeleteCriticalSection(&m_lock);
+		if (m_wake) { CloseHandle(m_wake); }
+		if (m_long_done) { CloseHandle(m_long_done); }
+	}
+
+	// Called once the native output is open. Streams start out paused.
+	void start(HMIDIOUT hmo) {
+		m_hmo = hmo;
+		m_internal_hdr.lpData = NULL;
+		m_thread = CreateThread(NULL, 0, thread_proc, this, 0, &m_thread_id);
+		if (m_thread) { SetThreadPriority(m_thread, g_stream_engine_config.priority); }
+	}
+
+	// Ends the thread. Queued buffers must have been returned (stop()). Returns false if
+	// called from the thread itself (i.e. from a callback), which then still uses the stream
+	// until the callback returns; see delete_on_exit.
+	bool close() {
+		m_exit = true;
+		SetEvent(m_wake);
+		bool joined = true;
+		if (m_thread) {
+			if (GetCurrentThreadId() != m_thread_id) { WaitForSingleObject(m_thread, INFINITE); }
+			else { joined = false; }
+			CloseHandle(m_thread);
+			m_thread = NULL;
+		}
+		return joined;
+	}
+
+	// After close() returned false, from the callback: on_exit(context) is called by the
+	// thread once it no longer uses the stream, to delete it.
+	void delete_on_exit(void (*on_exit)(void*), void* context) {
+		m_on_exit = on_exit;
+		m_on_exit_context = context;
+	}
+
+	void invoke(HMIDIOUT hmo, UINT msg, DWORD_PTR p1, DWORD_PTR p2) {
+		m_app.invoke(hmo, msg, p1, p2);
+	}
+
+	bool is_internal_hdr(LPMIDIHDR hdr) const { return hdr == &m_internal_hdr; }
+
+	// MOM_DONE of the internal header, from the driver callback
+	void internal_hdr_done() {
+		if (m_long_done) { SetEvent(m_long_done); }
+	}
+
+	MMRESULT out(LPMIDIHDR hdr, UINT cbmh) {
+		if (!hdr || cbmh < sizeof(MIDIHDR) || hdr->dwBytesRecorded > hdr->dwBufferLength) { return MMSYSERR_INVALPARAM; }
+		if (!(hdr->dwFlags & MHDR_PREPARED)) { return MIDIERR_UNPREPARED; }
+		if (hdr->dwFlags & MHDR_INQUEUE) { return MIDIERR_STILLPLAYING; }
+		EnterCriticalSection(&m_lock);
+		hdr->dwFlags = (hdr->dwFlags | MHDR_INQUEUE | MHDR_ISSTRM) & ~MHDR_DONE;
+		hdr->dwOffset = 0;
+		if (m_queue.empty()) { m_offset = 0; }
+		m_queue.push_back(hdr);
+		LeaveCriticalSection(&m_lock);
+		SetEvent(m_wake);
+		return MMSYSERR_NOERROR;
+	}
+
+	void restart() {
+		EnterCriticalSection(&m_lock);
+		if (!m_playing) {
+			uint64_t now = qpc_now();
+			if (m_paused) {
+				m_base_qpc += now - m_paused_at;
+			}
+			else {
+				m_base_qpc = now;
+				m_base_tick = m_tick;
+			}
+			m_play_started = now;
+			m_playing = true;
+			m_paused = false;
+			m_generation++;
+		}
+		LeaveCriticalSection(&m_lock);
+		SetEvent(m_wake);
+	}
+
+	void pause() {
+		EnterCriticalSection(&m_lock);
+		if (m_playing) {
+			m_paused_at = qpc_now();
+			m_played_ticks += m_paused_at - m_play_started;
+			m_playing = false;
+			m_paused = true;
+			m_generation++;
+		}
+		LeaveCriticalSection(&m_lock);
+		SetEvent(m_wake);
+	}
+
+	// midiStreamStop / midiOutReset: returns all queued buffers, silences sounding notes and
+	// rewinds the position to 0.
+	void stop() {
+		std::vector<LPMIDIHDR> done;
+		EnterCriticalSection(&m_lock);
+		m_playing = m_paused = false;
+		m_generation++;
+		done.swap(m_queue);
+		m_event_pending = false;
+		m_offset = 0;
+		m_tick = 0;
+		m_base_tick = 0;
+		m_played_ticks = 0;
+		m_notes.silence(m_hmo);
+		LeaveCriticalSection(&m_lock);
+		for (auto hdr : done) { complete(hdr); }
+		SetEvent(m_wake);
+	}
+
+	MMRESULT position(LPMMTIME mmt, UINT cbmmt) {
+		if (!mmt || cbmmt < sizeof(MMTIME)) { return MMSYSERR_INVALPARAM; }
+		EnterCriticalSection(&m_lock);
+		uint64_t now = position_qpc();
+		if (mmt->wType == TIME_MS) {
+			uint64_t played = m_played_ticks + (m_playing ? now - m_play_started : 0);
+			mmt->u.ms = (DWORD)(played * 1000 / g_qpc_frequency.QuadPart);
+		}
+		else {
+			mmt->wType = TIME_TICKS;
+			mmt->u.ticks = (DWORD)(m_playing || m_paused ? tick_at(now) : m_tick);
+		}
+		LeaveCriticalSection(&m_lock);
+		return MMSYSERR_NOERROR;
+	}
+
+	MMRESULT property(LPBYTE data, DWORD prop) {
+		bool get = prop & MIDIPROP_GET;
+		bool set = prop & MIDIPROP_SET;
+		if (get == set || !data) { return MMSYSERR_INVALPARAM; }
+		EnterCriticalSection(&m_lock);
+		MMRESULT rval = MMSYSERR_NOERROR;
+		if (prop & MIDIPROP_TIMEDIV) {
+			auto p = (LPMIDIPROPTIMEDIV)data;
+			if (p->cbStruct < sizeof(MIDIPROPTIMEDIV)) { rval = MMSYSERR_INVALPARAM; }
+			else if (get) { p->dwTimeDiv = m_timediv; }
+			else if (m_playing) { rval = MIDIERR_STILLPLAYING; }
+			else if ((p->dwTimeDiv & 0x7FFF) == 0) { rval = MMSYSERR_INVALPARAM; }
+			else {
+				rebase(position_qpc());
+				m_timediv = p->dwTimeDiv;
+			}
+		}
+		else if (prop & MIDIPROP_TEMPO) {
+			auto p = (LPMIDIPROPTEMPO)data;
+			if (p->cbStruct < sizeof(MIDIPROPTEMPO)) { rval = MMSYSERR_INVALPARAM; }
+			else if (get) { p->dwTempo = m_tempo; }
+			else if (p->dwTempo == 0) { rval = MMSYSERR_INVALPARAM; }
+			else {
+				rebase(position_qpc());
+				m_tempo = p->dwTempo;
+				m_generation++;
+			}
+		}
+		else {
+			rval = MMSYSERR_INVALPARAM;
+		}
+		LeaveCriticalSection(&m_lock);
+		SetEvent(m_wake);
+		return rval;
+	}
+
+	bool has_queued_buffers() {
+		EnterCriticalSection(&m_lock);
+		bool rval = !m_queue.empty();
+		LeaveCriticalSection(&m_lock);
+		return rval;
+	}
+
+private:
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		auto stream = (midi_stream*)param;
+		stream->run();
+		if (stream->m_on_exit) { stream->m_on_exit(stream->m_on_exit_context); }
+		return 0;
+	}
+
+	// QPC ticks per stream tick
+	double qpc_per_tick() const {
+		double freq = (double)g_qpc_frequency.QuadPart;
+		if (m_timediv & 0x8000) {
+			// SMPTE: frames per second (negative, in the high byte) and ticks per frame
+			int fps = -(int)(int8_t)((m_timediv >> 8) & 0xFF);
+			int tpf = m_timediv & 0xFF;
+			return freq / ((fps == 29 ? 29.97 : fps) * (tpf ? tpf : 1));
+		}
+		return freq * m_tempo / 1e6 / (m_timediv & 0x7FFF);
+	}
+
+	// The time the position refers to: now while playing, otherwise where playback stopped
+	uint64_t position_qpc() const {
+		return m_playing ? qpc_now() : (m_paused ? m_paused_at : m_base_qpc);
+	}
+
+	uint64_t qpc_of_tick(uint64_t tick) const {
+		return m_base_qpc + (uint64_t)((double)(tick - m_base_tick) * qpc_per_tick());
+	}
+
+	uint64_t tick_at(uint64_t qpc) const {
+		if (qpc <= m_base_qpc) { return m_base_tick; }
+		return m_base_tick + (uint64_t)((double)(qpc - m_base_qpc) / qpc_per_tick());
+	}
+
+	// Makes the current tick the new reference point, before tempo or time division change
+	void rebase(uint64_t qpc) {
+		uint64_t tick = tick_at(qpc);
+		if (tick < m_tick) { tick = m_tick; }
+		m_base_tick = tick;
+		m_base_qpc = qpc;
+	}
+
+	void complete(LPMIDIHDR hdr) {
+		hdr->dwFlags = (hdr->dwFlags | MHDR_DONE) & ~MHDR_INQUEUE;
+		g_stream_buffers_done.fetch_add(1, std::memory_order_relaxed);
+		m_app.invoke(m_hmo, MOM_DONE, (DWORD_PTR)hdr, 0);
+	}
+
+	void run() {
+		g_timer_periods.begin(NULL, L"stream engine", 1);
+		uint64_t spin_ticks = g_stream_engine_config.spin_us * g_qpc_frequency.QuadPart / 1000000;
+		while (!m_exit) {
+			EnterCriticalSection(&m_lock);
+			if (!m_playing || m_queue.empty()) {
+				LeaveCriticalSection(&m_lock);
+				WaitForSingleObject(m_wake, INFINITE);
+				continue;
+			}
+			LPMIDIHDR hdr = m_queue.front();
+			if (m_offset + 3 * sizeof(DWORD) > hdr->dwBytesRecorded) {
+				m_queue.erase(m_queue.begin());
+				m_offset = 0;
+				LeaveCriticalSection(&m_lock);
+				complete(hdr);
+				continue;
+			}
+			auto ev = (MIDIEVENT*)(hdr->lpData + m_offset);
+			if (!m_event_pending) {
+				m_event_tick = m_tick + ev->dwDeltaTime;
+				m_event_pending = true;
+			}
+			uint64_t due = qpc_of_tick(m_event_tick);
+			uint64_t generation = m_generation;
+			LeaveCriticalSection(&m_lock);
+
+			uint64_t now = qpc_now();
+			if (due > now + spin_ticks) {
+				WaitForSingleObject(m_wake, (DWORD)((due - now - spin_ticks) * 1000 / g_qpc_frequency.QuadPart));
+				continue;
+			}
+			while (qpc_now() < due && !m_exit && m_generation == generation) { YieldProcessor(); }
+
+			EnterCriticalSection(&m_lock);
+			if (m_generation != generation || m_queue.empty() || m_queue.front() != hdr) {
+				LeaveCriticalSection(&m_lock);
+				continue;
+			}
+			record_jitter(qpc_now() - due);
+			bool send = false;
+			bool callback = dispatch(hdr, ev, send);
+			m_tick = m_event_tick;
+			m_event_pending = false;
+			LeaveCriticalSection(&m_lock);
+			if (send) {
+				send_long();
+				// A stop or reset while the SysEx was out has already returned the buffer
+				if (callback && m_generation != generation) { callback = false; }
+			}
+			if (callback) { m_app.invoke(m_hmo, MOM_POSITIONCB, (DWORD_PTR)hdr, 0); }
+		}
+		g_timer_periods.end(NULL, L"stream engine", 1);
+	}
+
+	// Sends one event and advances the read offset past it. SysEx is only copied, and
+	// send_long set, for the caller to send once it has released m_lock. Returns whether the
+	// event asks for a MOM_POSITIONCB callback. Called with m_lock held.
+	bool dispatch(LPMIDIHDR hdr, MIDIEVENT* ev, bool& long_pending) {
+		DWORD offset = m_offset;
+		DWORD size = 3 * sizeof(DWORD);
+		BYTE type = MEVT_EVENTTYPE(ev->dwEvent) & ~(MEVT_F_CALLBACK >> 24);
+		if (ev->dwEvent & MEVT_F_LONG) {
+			DWORD length = MEVT_EVENTPARM(ev->dwEvent);
+			size += (length + 3) & ~3u;
+			if (offset + size > hdr->dwBytesRecorded) {
+				// Truncated event: skip the rest of the buffer
+				m_offset = hdr->dwBytesRecorded;
+				return false;
+			}
+			if (type == MEVT_LONGMSG && length > 0) {
+				m_long_msg.assign((char const*)ev->dwParms, (char const*)ev->dwParms + length);
+				long_pending = true;
+			}
+		}
+		else if (type == MEVT_SHORTMSG) {
+			DWORD msg = MEVT_EVENTPARM(ev->dwEvent);
+			MMmidiOutShortMsg(m_hmo, msg);
+			m_notes.on_short_msg(msg);
+		}
+		else if (type == MEVT_TEMPO) {
+			DWORD tempo = MEVT_EVENTPARM(ev->dwEvent);
+			if (tempo) {
+				m_base_qpc = qpc_of_tick(m_event_tick);
+				m_base_tick = m_event_tick;
+				m_tempo = tempo;
+			}
+		}
+		g_stream_events.fetch_add(1, std::memory_order_relaxed);
+		// On MOM_POSITIONCB the application reads the offset of the event that caused it
+		hdr->dwOffset = offset;
+		m_offset = offset + size;
+		return (ev->dwEvent & MEVT_F_CALLBACK) != 0;
+	}
+
+	// SysEx from the stream is copied into m_long_msg and sent through a wrapper-owned header,
+	// without m_lock, so stop and reset don't wait for it. The next event waits for the
+	// header's MOM_DONE (for at most a second), so events stay in order.
+	void send_long() {
+		memset(&m_internal_hdr, 0, sizeof(m_internal_hdr));
+		m_internal_hdr.lpData = m_long_msg.data();
+		m_internal_hdr.dwBufferLength = m_internal_hdr.dwBytesRecorded = (DWORD)m_long_msg.size();
+		if (MMmidiOutPrepareHeader(m_hmo, &m_internal_hdr, sizeof(m_internal_hdr)) != MMSYSERR_NOERROR) { return; }
+		ResetEvent(m_long_done);
+		if (MMmidiOutLongMsg(m_hmo, &m_internal_hdr, sizeof(m_internal_hdr)) == MMSYSERR_NOERROR &&
+			!(m_internal_hdr.dwFlags & MHDR_DONE)) {
+			WaitForSingleObject(m_long_done, 1000);
+		}
+		MMmidiOutUnprepareHeader(m_hmo, &m_internal_hdr, sizeof(m_internal_hdr));
+	}
+
+	void record_jitter(uint64_t late_ticks) {
+		uint64_t prev_max = g_stream_max_jitter_ticks.load(std::memory_order_relaxed);
+		while (late_ticks > prev_max && !g_stream_max_jitter_ticks.compare_exchange_weak(prev_max, late_ticks, std::memory_order_relaxed)) {}
+		g_stream_jitter_histogram[histogram_bucket((uint64_t)ticks_to_ns(late_ticks))].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	app_callback m_app;
+	HMIDIOUT m_hmo = NULL;
+	HANDLE m_thread = NULL;
+	DWORD m_thread_id = 0;
+	HANDLE m_wake = NULL;
+	std::atomic<bool> m_exit{ false };
+	MIDIHDR m_internal_hdr = {};				// Only used by the thread, with m_long_msg
+	std::vector<char> m_long_msg;
+	HANDLE m_long_done = NULL;
+	void (*m_on_exit)(void*) = nullptr;		// Only set and used on the thread itself
+	void* m_on_exit_context = nullptr;
+
+	CRITICAL_SECTION m_lock;				// Protects everything below
+	std::vector<LPMIDIHDR> m_queue;
+	std::atomic<uint64_t> m_generation{ 0 };	// Bumped on every state change that invalidates a wait
+	bool m_playing = false;
+	bool m_paused = false;
+	DWORD m_timediv = 96;					// Ticks per quarter note, or SMPTE format
+	DWORD m_tempo = 500000;					// Microseconds per quarter note
+	uint64_t m_base_qpc = 0;				// Time of m_base_tick
+	uint64_t m_base_tick = 0;
+	uint64_t m_tick = 0;					// Tick of the last dispatched event
+	uint64_t m_event_tick = 0;				// Tick of the next event, once its delta is applied
+	bool m_event_pending = false;
+	uint64_t m_paused_at = 0;
+	uint64_t m_play_started = 0;
+	uint64_t m_played_ticks = 0;			// QPC ticks played before the current run
+	DWORD m_offset = 0;						// Read position in the first queued buffer
+	note_tracker m_notes;
+};
+
+json stream_engine_stats_json() {
+	json histogram = json::array();
+	for (auto& bucket : g_stream_jitter_histogram) { histogram.push_back(bucket.load()); }
+	return json{
+		{ "events", g_stream_events.load() },
+		{ "buffers_done", g_stream_buffers_done.load() },
+		{ "max_jitter_ns", ticks_to_ns(g_stream_max_jitter_ticks.load()) },
+		{ "jitter_histogram_log2_ns", histogram }
+	};
+}
+
+midi_handle_table<HMIDISTRM, midi_stream> g_midi_streams;
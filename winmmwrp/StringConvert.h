@@ -0,0 +1,14 @@
+// Conversions between std::string (in the current locale's multibyte encoding) and
+// std::wstring. Shared by the DLL and RuleEval.
+
+std::wstring stringToWstring(const std::string& str) {
+    std::vector<wchar_t> buffer(str.size() + 1);
+    std::mbstowcs(buffer.data(), str.c_str(), str.size() + 1);
+    return std::wstring(buffer.data());
+}
+
+std::string wstringToString(const std::wstring& wstr) {
+    std::vector<char> buffer(wstr.size() * MB_CUR_MAX + 1);
+    std::wcstombs(buffer.data(), wstr.c_str(), buffer.size());
+    return std::string(buffer.data());
+}
@@ -0,0 +1,225 @@
+// SysEx rewriting, on midiOutLongMsg and on incoming MIM_LONGDATA. A rule replaces a byte
+// pattern, which may contain "??" wildcards, by bytes of the same length, in place. The
+// longest wildcard-free run of every pattern goes into one Aho-Corasick automaton, so a
+// buffer is scanned once whatever the number of rules, and each hit is then checked against
+// the whole pattern. The Roland checksum of a rewritten message can be recomputed.
+// Patterns are only found within one buffer: input SysEx split across application buffers
+// is only rewritten completely when it is reassembled by the input pool.
+
+enum class sysex_checksum { None, Roland };
+
+struct sysex_rewrite_rule {
+	bool output = true;
+	bool input = true;
+	std::vector<int16_t> match;				// Byte, or -1 for any
+	std::vector<int16_t> replace;			// Byte, or -1 to keep the one matched
+	sysex_checksum checksum = sysex_checksum::None;
+	size_t checksum_start = 5;				// First checksummed byte, counted from F0
+};
+
+bool g_sysex_rewrite_enabled = false;
+
+std::atomic<uint64_t> g_sysex_rewrite_buffers{ 0 };
+std::atomic<uint64_t> g_sysex_rewrite_bytes{ 0 };
+std::atomic<uint64_t> g_sysex_rewrite_scan_ticks{ 0 };
+std::atomic<uint64_t> g_sysex_rewrite_max_buffer{ 0 };
+std::atomic<uint64_t> g_sysex_rewrite_max_scan_ticks{ 0 };
+std::atomic<uint64_t> g_sysex_rewrite_matches{ 0 };
+std::atomic<uint64_t> g_sysex_rewrite_overlapping{ 0 };		// Matches skipped, overlapping an earlier one
+std::atomic<uint64_t> g_sysex_rewrite_checksums{ 0 };
+std::atomic<uint64_t> g_sysex_rewrite_checksums_incomplete{ 0 };	// Message start or end not in the buffer
+
+// "F0 41 ?? 42 12": hex bytes separated by spaces, "??" for any byte
+std::vector<int16_t> parse_sysex_pattern(std::string const& text) {
+	std::vector<int16_t> rval;
+	std::istringstream is(text);
+	std::string token;
+	while (is >> token) {
+		if (token == "??") {
+			rval.push_back(-1);
+			continue;
+		}
+		if (token.size() != 2 || !isxdigit((unsigned char)token[0]) || !isxdigit((unsigned char)token[1])) {
+			throw std::runtime_error("sysex_rewrite: invalid byte '" + token + "' in '" + text + "'");
+		}
+		rval.push_back((int16_t)std::stoi(token, nullptr, 16));
+	}
+	return rval;
+}
+
+class sysex_rewriter {
+public:
+	void add(sysex_rewrite_rule const& rule) {
+		if (rule.match.empty() || rule.match.size() != rule.replace.size()) {
+			throw std::runtime_error("sysex_rewrite: match and replace must have the same, non-zero length");
+		}
+		// Anchor on the longest run without wildcards
+		size_t best_start = 0, best_length = 0;
+		for (size_t i = 0; i < rule.match.size();) {
+			size_t j = i;
+			while (j < rule.match.size() && rule.match[j] >= 0) { j++; }
+			if (j - i > best_length) {
+				best_start = i;
+				best_length = j - i;
+			}
+			i = j + 1;
+		}
+		if (best_length == 0) { throw std::runtime_error("sysex_rewrite: a pattern needs at least one byte that is not ??"); }
+		m_rules.push_back(rule);
+		m_anchor_start.push_back(best_start);
+		m_anchor_length.push_back(best_length);
+		m_has_input |= rule.input;
+		m_has_output |= rule.output;
+	}
+
+	// Builds the automaton; call once all rules are added
+	void build() {
+		m_next.assign(256, 0);
+		m_fail.assign(1, 0);
+		m_outputs.assign(1, {});
+		for (uint32_t r = 0; r < m_rules.size(); r++) {
+			uint32_t state = 0;
+			for (size_t i = 0; i < m_anchor_length[r]; i++) {
+				uint8_t byte = (uint8_t)m_rules[r].match[m_anchor_start[r] + i];
+				if (!m_next[state * 256 + byte]) {
+					m_next[state * 256 + byte] = (uint32_t)m_fail.size();
+					m_next.resize(m_next.size() + 256, 0);
+					m_fail.push_back(0);
+					m_outputs.push_back({});
+				}
+				state = m_next[state * 256 + byte];
+			}
+			m_outputs[state].push_back(r);
+		}
+		// Breadth first, turning the trie into a full transition table. Missing edges of the
+		// root stay 0, i.e. back to the root.
+		std::vector<uint32_t> queue;
+		for (size_t byte = 0; byte < 256; byte++) {
+			if (m_next[byte]) { queue.push_back(m_next[byte]); }
+		}
+		for (size_t q = 0; q < queue.size(); q++) {
+			uint32_t state = queue[q];
+			auto const& inherited = m_outputs[m_fail[state]];
+			m_outputs[state].insert(m_outputs[state].end(), inherited.begin(), inherited.end());
+			for (size_t byte = 0; byte < 256; byte++) {
+				uint32_t& next = m_next[state * 256 + byte];
+				uint32_t via_fail = m_next[m_fail[state] * 256 + byte];
+				if (next) {
+					m_fail[next] = via_fail;
+					queue.push_back(next);
+				}
+				else {
+					next = via_fail;
+				}
+			}
+		}
+		for (auto& outputs : m_outputs) { std::sort(outputs.begin(), outputs.end()); }
+	}
+
+	bool has_input_rules() const { return m_has_input; }
+	bool has_output_rules() const { return m_has_output; }
+
+	// Rewrites a buffer in place. Matches are applied from the start of the buffer; of two
+	// overlapping matches, the one starting first (or, at the same byte, the earlier rule) wins.
+	void rewrite(uint8_t* data, size_t length, bool output) const {
+		if ((output && !m_has_output) || (!output && !m_has_input) || length == 0) { return; }
+		uint64_t start_ticks = qpc_now();
+		thread_local std::vector<std::pair<size_t, uint32_t>> hits;	// Start, rule
+		hits.clear();
+		uint32_t state = 0;
+		for (size_t i = 0; i < length; i++) {
+			state = m_next[state * 256 + data[i]];
+			for (uint32_t r : m_outputs[state]) {
+				auto const& rule = m_rules[r];
+				if (!(output ? rule.output : rule.input)) { continue; }
+				size_t before_end = m_anchor_start[r] + m_anchor_length[r];
+				if (i + 1 < before_end) { continue; }
+				size_t start = i + 1 - before_end;
+				if (start + rule.match.size() <= length && matches(rule, data + start)) { hits.push_back({ start, r }); }
+			}
+		}
+		if (!hits.empty()) {
+			std::sort(hits.begin(), hits.end());
+			size_t free_from = 0;
+			for (auto [start, r] : hits) {
+				if (start < free_from) {
+					g_sysex_rewrite_overlapping.fetch_add(1, std::memory_order_relaxed);
+					continue;
+				}
+				auto const& rule = m_rules[r];
+				for (size_t i = 0; i < rule.replace.size(); i++) {
+					if (rule.replace[i] >= 0) { data[start + i] = (uint8_t)rule.replace[i]; }
+				}
+				if (rule.checksum == sysex_checksum::Roland) { fix_roland_checksum(data, length, start, rule.checksum_start); }
+				free_from = start + rule.match.size();
+				g_sysex_rewrite_matches.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		uint64_t ticks = qpc_now() - start_ticks;
+		g_sysex_rewrite_buffers.fetch_add(1, std::memory_order_relaxed);
+		g_sysex_rewrite_bytes.fetch_add(length, std::memory_order_relaxed);
+		g_sysex_rewrite_scan_ticks.fetch_add(ticks, std::memory_order_relaxed);
+		uint64_t prev_max = g_sysex_rewrite_max_buffer.load(std::memory_order_relaxed);
+		while (length > prev_max && !g_sysex_rewrite_max_buffer.compare_exchange_weak(prev_max, length, std::memory_order_relaxed)) {}
+		prev_max = g_sysex_rewrite_max_scan_ticks.load(std::memory_order_relaxed);
+		while (ticks > prev_max && !g_sysex_rewrite_max_scan_ticks.compare_exchange_weak(prev_max, ticks, std::memory_order_relaxed)) {}
+	}
+
+	size_t size() const { return m_rules.size(); }
+	size_t states() const { return m_fail.size(); }
+
+private:
+	static bool matches(sysex_rewrite_rule const& rule, uint8_t const* data) {
+		for (size_t i = 0; i < rule.match.size(); i++) {
+			if (rule.match[i] >= 0 && data[i] != rule.match[i]) { return false; }
+		}
+		return true;
+	}
+
+	// Roland DT1: the checksum is the byte before F7, and makes the address and data bytes
+	// add up to 0 modulo 128.
+	static void fix_roland_checksum(uint8_t* data, size_t length, size_t at, size_t checksum_start) {
+		size_t begin = at + 1;
+		while (begin > 0 && data[begin - 1] != 0xF0) { begin--; }
+		size_t end = at;
+		while (end < length && data[end] != 0xF7) { end++; }
+		if (begin == 0 || end == length || end < begin + checksum_start + 1) {
+			g_sysex_rewrite_checksums_incomplete.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		begin--;	// The F0
+		unsigned sum = 0;
+		for (size_t i = begin + checksum_start; i < end - 1; i++) { sum += data[i]; }
+		data[end - 1] = (uint8_t)((128 - (sum & 0x7F)) & 0x7F);
+		g_sysex_rewrite_checksums.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::vector<sysex_rewrite_rule> m_rules;
+	std::vector<size_t> m_anchor_start;
+	std::vector<size_t> m_anchor_length;
+	bool m_has_input = false;
+	bool m_has_output = false;
+
+	std::vector<uint32_t> m_next;					// 256 transitions per state
+	std::vector<uint32_t> m_fail;
+	std::vector<std::vector<uint32_t>> m_outputs;	// Rules whose anchor ends in each state, in rule order
+};
+
+sysex_rewriter g_sysex_rewriter;
+
+json sysex_rewrite_stats_json() {
+	double bytes = (double)g_sysex_rewrite_bytes.load();
+	return json{
+		{ "rules", g_sysex_rewriter.size() },
+		{ "automaton_states", g_sysex_rewriter.states() },
+		{ "buffers", g_sysex_rewrite_buffers.load() },
+		{ "bytes", g_sysex_rewrite_bytes.load() },
+		{ "matches", g_sysex_rewrite_matches.load() },
+		{ "overlapping", g_sysex_rewrite_overlapping.load() },
+		{ "checksums", g_sysex_rewrite_checksums.load() },
+		{ "checksums_incomplete", g_sysex_rewrite_checksums_incomplete.load() },
+		{ "max_buffer_bytes", g_sysex_rewrite_max_buffer.load() },
+		{ "max_scan_ns", ticks_to_ns(g_sysex_rewrite_max_scan_ticks.load()) },
+		{ "mean_scan_ns_per_kb", bytes > 0 ? ticks_to_ns(g_sysex_rewrite_scan_ticks.load()) * 1024 / bytes : 0.0 }
+	};
+}
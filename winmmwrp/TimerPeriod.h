@@ -0,0 +1,155 @@
+// Arbitration of the system timer resolution. timeBeginPeriod / timeEndPeriod requests are
+// counted per caller (the module the call came from, or one of the wrapper's own threads)
+// and period. At most one native timeBeginPeriod is active, for the finest period anyone
+// still asks for, so repeated or unbalanced requests don't pile up in the system. Requests
+// still open at process exit are released and logged.
+
+#include <intrin.h>
+
+struct timer_period_config {
+	UINT min_period = 1;	// Finer requests are served with this period
+};
+
+bool g_timer_period_enabled = false;
+timer_period_config g_timer_period_config;
+
+class timer_period_arbiter {
+public:
+	struct request {
+		HMODULE module;				// Caller, for application requests
+		const wchar_t* internal;	// Caller, for the wrapper's own threads
+		UINT period;
+		uint64_t count;
+	};
+
+	timer_period_arbiter() {
+		InitializeCriticalSection(&m_lock);
+	}
+
+	MMRESULT begin(HMODULE module, const wchar_t* internal, UINT period) {
+		EnterCriticalSection(&m_lock);
+		if (!valid(period)) {
+			m_rejected++;
+			LeaveCriticalSection(&m_lock);
+			return TIMERR_NOCANDO;
+		}
+		m_begins++;
+		auto it = std::find_if(m_requests.begin(), m_requests.end(), [&](request const& r) {
+			return r.module == module && r.internal == internal && r.period == period;
+		});
+		if (it == m_requests.end()) { m_requests.push_back({ module, internal, period, 1 }); }
+		else { it->count++; }
+		update_native();
+		LeaveCriticalSection(&m_lock);
+		return TIMERR_NOERROR;
+	}
+
+	MMRESULT end(HMODULE module, const wchar_t* internal, UINT period) {
+		EnterCriticalSection(&m_lock);
+		auto it = std::find_if(m_requests.begin(), m_requests.end(), [&](request const& r) {
+			return r.module == module && r.internal == internal && r.period == period;
+		});
+		if (it == m_requests.end()) {
+			// Begun from another module (e.g. a helper DLL) than the one ending it
+			it = std::find_if(m_requests.begin(), m_requests.end(), [&](request const& r) {
+				return !r.internal && r.period == period;
+			});
+		}
+		if (it == m_requests.end()) {
+			m_rejected++;
+			LeaveCriticalSection(&m_lock);
+			return TIMERR_NOCANDO;
+		}
+		m_ends++;
+		if (--it->count == 0) { m_requests.erase(it); }
+		update_native();
+		LeaveCriticalSection(&m_lock);
+		return TIMERR_NOERROR;
+	}
+
+	// Drops all requests and the native period. Returns the application requests that were
+	// never ended.
+	std::vector<request> release_all() {
+		EnterCriticalSection(&m_lock);
+		std::vector<request> stray;
+		for (auto const& r : m_requests) {
+			if (!r.internal) { stray.push_back(r); }
+		}
+		m_requests.clear();
+		update_native();
+		LeaveCriticalSection(&m_lock);
+		return stray;
+	}
+
+	json stats_json() {
+		EnterCriticalSection(&m_lock);
+		json requests = json::array();
+		for (auto const& r : m_requests) {
+			requests.push_back({ { "caller", wstringToString(caller_name(r)) }, { "period_ms", r.period }, { "count", r.count } });
+		}
+		json rval = {
+			{ "effective_period_ms", m_native },
+			{ "begins", m_begins },
+			{ "ends", m_ends },
+			{ "rejected", m_rejected },
+			{ "native_changes", m_native_changes },
+			{ "requests", requests }
+		};
+		LeaveCriticalSection(&m_lock);
+		return rval;
+	}
+
+	static std::wstring caller_name(request const& r) {
+		if (r.internal) { return std::wstring(L"wrapper ") + r.internal; }
+		wchar_t path[MAX_PATH];
+		DWORD n = GetModuleFileNameW(r.module, path, MAX_PATH);
+		if (n == 0) { return L"unknown module"; }
+		std::wstring name(path, n);
+		size_t slash = name.find_last_of(L"\\/");
+		return slash == std::wstring::npos ? name : name.substr(slash + 1);
+	}
+
+	// The module containing a return address
+	static HMODULE module_of(void* address) {
+		HMODULE module = NULL;
+		GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCWSTR)address, &module);
+		return module;
+	}
+
+private:
+	// Called with m_lock held
+	bool valid(UINT period) {
+		if (!m_caps_known) {
+			m_caps_known = MMtimeGetDevCaps(&m_caps, sizeof(m_caps)) == TIMERR_NOERROR;
+			if (!m_caps_known) { return period > 0; }
+		}
+		return period >= m_caps.wPeriodMin && period <= m_caps.wPeriodMax;
+	}
+
+	// Moves the native period to the finest requested one. The new period is begun before the
+	// old one ends, so the resolution never drops in between. Called with m_lock held.
+	void update_native() {
+		UINT finest = 0;
+		for (auto const& r : m_requests) {
+			if (finest == 0 || r.period < finest) { finest = r.period; }
+		}
+		if (finest && finest < g_timer_period_config.min_period) { finest = g_timer_period_config.min_period; }
+		if (finest == m_native) { return; }
+		if (finest) { MMtimeBeginPeriod(finest); }
+		if (m_native) { MMtimeEndPeriod(m_native); }
+		m_native = finest;
+		m_native_changes++;
+	}
+
+	CRITICAL_SECTION m_lock;
+	std::vector<request> m_requests;
+	UINT m_native = 0;			// Active native period, 0 = none
+	TIMECAPS m_caps = {};
+	bool m_caps_known = false;
+	uint64_t m_begins = 0;
+	uint64_t m_ends = 0;
+	uint64_t m_rejected = 0;
+	uint64_t m_native_changes = 0;
+};
+
+timer_period_arbiter g_timer_periods;
@@ -0,0 +1,377 @@
+// timeSetEvent / timeKillEvent on a hierarchical timer wheel. All multimedia timers of the
+// process run on one high-priority thread, instead of a native timer (and, under Wine, a
+// thread) each. The wheel has a 1 ms tick: 256 slots for the next 256 ms, then three levels of
+// 64 slots, each 64 times coarser, which are cascaded down as time advances. Setting and
+// killing a timer is O(1), and the thread only wakes for ticks with timers due, or to cascade.
+
+struct timer_wheel_config {
+	int priority = THREAD_PRIORITY_TIME_CRITICAL;
+};
+
+bool g_timer_wheel_enabled = false;
+timer_wheel_config g_timer_wheel_config;
+
+constexpr size_t g_timer_wheel_near_bits = 8;	// 256 slots of 1 ms
+constexpr size_t g_timer_wheel_far_bits = 6;	// 64 slots per far level
+constexpr size_t g_timer_wheel_far_levels = 3;
+
+std::atomic<uint64_t> g_timer_wheel_sets{ 0 };
+std::atomic<uint64_t> g_timer_wheel_kills{ 0 };
+std::atomic<uint64_t> g_timer_wheel_callbacks{ 0 };
+std::atomic<uint64_t> g_timer_wheel_skipped_periods{ 0 };	// Periods of a periodic timer missed as the thread fell behind
+std::atomic<uint64_t> g_timer_wheel_wakeups{ 0 };
+std::atomic<uint64_t> g_timer_wheel_idle_ticks_skipped{ 0 };	// Jumped over when a timer was set on an empty wheel
+std::atomic<uint64_t> g_timer_wheel_callback_ticks{ 0 };	// Total time spent in callbacks
+std::atomic<uint64_t> g_timer_wheel_max_late_ticks{ 0 };
+std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> g_timer_wheel_late_histogram{};
+
+class timer_wheel {
+public:
+	timer_wheel() {
+		InitializeCriticalSection(&m_lock);
+		InitializeConditionVariable(&m_callback_done);
+	}
+
+	// Returns the timer ID, or 0 like timeSetEvent. The resolution is always the wheel's tick.
+	UINT set(UINT delay, LPTIMECALLBACK proc, DWORD_PTR user, UINT flags) {
+		UINT kind = flags & (TIME_CALLBACK_EVENT_SET | TIME_CALLBACK_EVENT_PULSE);
+		if (!proc || kind == (TIME_CALLBACK_EVENT_SET | TIME_CALLBACK_EVENT_PULSE)) { return 0; }
+		EnterCriticalSection(&m_lock);
+		if (!valid_delay(delay) || !ensure_thread()) {
+			LeaveCriticalSection(&m_lock);
+			return 0;
+		}
+		if (m_timers.empty()) {
+			// The wheel is empty, so the thread has nothing to catch up on: skip the ticks
+			// since the last timer, instead of processing them one by one
+			uint64_t now_tick = (qpc_now() - m_origin) * 1000 / g_qpc_frequency.QuadPart;
+			if (now_tick > m_tick) {
+				g_timer_wheel_idle_ticks_skipped.fetch_add(now_tick - m_tick, std::memory_order_relaxed);
+				m_tick = now_tick;
+			}
+		}
+		auto owned = std::make_unique<timer>();
+		timer* t = owned.get();
+		t->id = next_id();
+		t->delay = delay;
+		t->proc = proc;
+		t->user = user;
+		t->flags = flags;
+		// Rounded up, so a timer never fires early
+		t->expires = ((qpc_now() - m_origin) * 1000 + g_qpc_frequency.QuadPart - 1) / g_qpc_frequency.QuadPart + delay;
+		m_timers.emplace(t->id, std::move(owned));
+		insert(t);
+		if (m_timers.size() > m_peak_active) { m_peak_active = m_timers.size(); }
+		UINT id = t->id;	// A one-shot timer may be gone once the lock is released
+		LeaveCriticalSection(&m_lock);
+		SetEvent(m_wake);
+		g_timer_wheel_sets.fetch_add(1, std::memory_order_relaxed);
+		return id;
+	}
+
+	// Like WinMM, a callback of the timer still running on the wheel thread has returned when
+	// this returns, unless called from a callback.
+	MMRESULT kill(UINT id) {
+		EnterCriticalSection(&m_lock);
+		auto it = m_timers.find(id);
+		if (it == m_timers.end()) {
+			LeaveCriticalSection(&m_lock);
+			return MMSYSERR_INVALPARAM;
+		}
+		timer* t = it->second.get();
+		t->killed = true;
+		if (t->in_batch) {
+			// The wheel thread holds the timer until its current tick is done
+			m_killed.push_back(std::move(it->second));
+		}
+		else {
+			unlink(t);
+		}
+		m_timers.erase(it);
+		if (GetCurrentThreadId() != m_thread_id) {
+			while (m_running_id == id) { SleepConditionVariableCS(&m_callback_done, &m_lock, INFINITE); }
+		}
+		LeaveCriticalSection(&m_lock);
+		g_timer_wheel_kills.fetch_add(1, std::memory_order_relaxed);
+		return MMSYSERR_NOERROR;
+	}
+
+	// Process detach; a callback in progress finishes first. The thread can't exit under the
+	// loader lock, so this waits for it to leave the wheel, or for its handle if it is gone.
+	void stop() {
+		EnterCriticalSection(&m_lock);
+		HANDLE thread = m_thread;
+		m_stop = true;
+		if (m_wake) { SetEvent(m_wake); }
+		LeaveCriticalSection(&m_lock);
+		if (thread && GetCurrentThreadId() != m_thread_id) {
+			while (m_running && WaitForSingleObject(thread, 1) == WAIT_TIMEOUT) {}
+		}
+	}
+
+	json stats_json() {
+		EnterCriticalSection(&m_lock);
+		size_t active = m_timers.size();
+		size_t peak_active = m_peak_active;
+		LeaveCriticalSection(&m_lock);
+		double thread_cpu_ms = 0;
+		FILETIME creation, exit, kernel, user;
+		if (m_thread && GetThreadTimes(m_thread, &creation, &exit, &kernel, &user)) {
+			auto ms = [](FILETIME const& ft) { return ((uint64_t)ft.dwHighDateTime << 32 | ft.dwLowDateTime) / 10000.0; };
+			thread_cpu_ms = ms(kernel) + ms(user);
+		}
+		json histogram = json::array();
+		for (auto& bucket : g_timer_wheel_late_histogram) { histogram.push_back(bucket.load()); }
+		return json{
+			{ "timers_set", g_timer_wheel_sets.load() },
+			{ "timers_killed", g_timer_wheel_kills.load() },
+			{ "active", active },
+			{ "peak_active", peak_active },
+			{ "callbacks", g_timer_wheel_callbacks.load() },
+			{ "skipped_periods", g_timer_wheel_skipped_periods.load() },
+			{ "wakeups", g_timer_wheel_wakeups.load() },
+			{ "idle_ticks_skipped", g_timer_wheel_idle_ticks_skipped.load() },
+			{ "callback_ms", ticks_to_ns(g_timer_wheel_callback_ticks.load()) / 1000000.0 },
+			{ "thread_cpu_ms", thread_cpu_ms },
+			{ "max_late_ns", ticks_to_ns(g_timer_wheel_max_late_ticks.load()) },
+			{ "late_histogram_log2_ns", histogram }
+		};
+	}
+
+private:
+	struct timer {
+		UINT id = 0;
+		UINT delay = 0;
+		LPTIMECALLBACK proc = nullptr;	// Or the event handle
+		DWORD_PTR user = 0;
+		UINT flags = 0;
+		uint64_t expires = 0;			// Tick
+		bool killed = false;
+		bool in_batch = false;			// Taken off the wheel by the thread, for the current tick
+		timer** slot = nullptr;			// List head of the slot it is linked in
+		timer* prev = nullptr;
+		timer* next = nullptr;
+	};
+
+	// Called with m_lock held
+	bool valid_delay(UINT delay) {
+		if (!m_caps_known) {
+			m_caps_known = MMtimeGetDevCaps(&m_caps, sizeof(m_caps)) == TIMERR_NOERROR;
+			if (!m_caps_known) { return delay > 0; }
+		}
+		return delay >= m_caps.wPeriodMin && delay <= m_caps.wPeriodMax;
+	}
+
+	// Called with m_lock held
+	bool ensure_thread() {
+		if (m_thread) { return true; }
+		m_origin = qpc_now();
+		m_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+		m_running = true;
+		m_thread = CreateThread(NULL, 0, thread_proc, this, 0, &m_thread_id);
+		if (m_thread) { SetThreadPriority(m_thread, g_timer_wheel_config.priority); }
+		else { m_running = false; }
+		return m_thread != NULL;
+	}
+
+	// Called with m_lock held
+	UINT next_id() {
+		while (true) {
+			UINT id = m_next_id++;
+			if (id != 0 && !m_timers.contains(id)) { return id; }
+		}
+	}
+
+	uint64_t due_qpc(uint64_t tick) const {
+		return m_origin + tick * g_qpc_frequency.QuadPart / 1000;
+	}
+
+	// Links a timer into the slot for its expiry. Called with m_lock held.
+	void insert(timer* t) {
+		uint64_t expires = t->expires < m_tick ? m_tick : t->expires;
+		uint64_t ahead = expires - m_tick;
+		timer** slot;
+		if (ahead < (1ull << g_timer_wheel_near_bits)) {
+			slot = &m_near[expires & ((1 << g_timer_wheel_near_bits) - 1)];
+		}
+		else {
+			size_t level = 0;
+			while (level + 1 < g_timer_wheel_far_levels && ahead >= (1ull << (g_timer_wheel_near_bits + (level + 1) * g_timer_wheel_far_bits))) { level++; }
+			if (ahead >= (1ull << (g_timer_wheel_near_bits + g_timer_wheel_far_levels * g_timer_wheel_far_bits))) {
+				expires = m_tick + (1ull << (g_timer_wheel_near_bits + g_timer_wheel_far_levels * g_timer_wheel_far_bits)) - 1;
+			}
+			slot = &m_far[level][(expires >> (g_timer_wheel_near_bits + level * g_timer_wheel_far_bits)) & ((1 << g_timer_wheel_far_bits) - 1)];
+		}
+		t->slot = slot;
+		t->prev = nullptr;
+		t->next = *slot;
+		if (t->next) { t->next->prev = t; }
+		*slot = t;
+	}
+
+	// Called with m_lock held
+	void unlink(timer* t) {
+		if (!t->slot) { return; }
+		if (t->prev) { t->prev->next = t->next; }
+		else { *t->slot = t->next; }
+		if (t->next) { t->next->prev = t->prev; }
+		t->slot = nullptr;
+		t->prev = t->next = nullptr;
+	}
+
+	// Moves the timers of a slot of a far level to finer slots. Returns the slot index, which
+	// is 0 when the next level is due as well. Called with m_lock held.
+	size_t cascade(size_t level) {
+		size_t index = (m_tick >> (g_timer_wheel_near_bits + level * g_timer_wheel_far_bits)) & ((1 << g_timer_wheel_far_bits) - 1);
+		timer* t = m_far[level][index];
+		m_far[level][index] = nullptr;
+		while (t) {
+			timer* next = t->next;
+			t->slot = nullptr;
+			insert(t);
+			t = next;
+		}
+		return index;
+	}
+
+	// Takes the timers of the current tick off the wheel and advances it. Called with m_lock held.
+	void take_tick(std::vector<timer*>& batch) {
+		size_t index = m_tick & ((1 << g_timer_wheel_near_bits) - 1);
+		if (index == 0) {
+			for (size_t level = 0; level < g_timer_wheel_far_levels && cascade(level) == 0; level++) {}
+		}
+		for (timer* t = m_near[index]; t; t = t->next) {
+			t->in_batch = true;
+			t->slot = nullptr;
+			batch.push_back(t);
+		}
+		m_near[index] = nullptr;
+		m_tick++;
+	}
+
+	// The first tick from now with timers in the near level, or the next cascade. Called with
+	// m_lock held.
+	uint64_t next_busy_tick() const {
+		uint64_t tick = m_tick;
+		do {
+			if (m_near[tick & ((1 << g_timer_wheel_near_bits) - 1)]) { return tick; }
+			tick++;
+		} while (tick & ((1 << g_timer_wheel_near_bits) - 1));
+		return tick;
+	}
+
+	static void invoke(timer const& t) {
+		switch (t.flags & (TIME_CALLBACK_EVENT_SET | TIME_CALLBACK_EVENT_PULSE)) {
+		case TIME_CALLBACK_EVENT_SET: SetEvent((HANDLE)t.proc); break;
+		case TIME_CALLBACK_EVENT_PULSE: PulseEvent((HANDLE)t.proc); break;
+		default: t.proc(t.id, 0, t.user, 0, 0); break;
+		}
+	}
+
+	void record_late(uint64_t late_ticks) {
+		uint64_t prev_max = g_timer_wheel_max_late_ticks.load(std::memory_order_relaxed);
+		while (late_ticks > prev_max && !g_timer_wheel_max_late_ticks.compare_exchange_weak(prev_max, late_ticks, std::memory_order_relaxed)) {}
+		g_timer_wheel_late_histogram[histogram_bucket((uint64_t)ticks_to_ns(late_ticks))].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Runs the callbacks of a tick, then puts periodic timers back on the wheel. Called with
+	// m_lock held; it is released around each callback.
+	void fire(std::vector<timer*>& batch, uint64_t now_tick) {
+		for (timer* t : batch) {
+			if (t->killed) { continue; }
+			m_running_id = t->id;
+			LeaveCriticalSection(&m_lock);
+			uint64_t start = qpc_now();
+			uint64_t due = due_qpc(t->expires);
+			record_late(start > due ? start - due : 0);
+			invoke(*t);
+			g_timer_wheel_callbacks.fetch_add(1, std::memory_order_relaxed);
+			g_timer_wheel_callback_ticks.fetch_add(qpc_now() - start, std::memory_order_relaxed);
+			EnterCriticalSection(&m_lock);
+			m_running_id = 0;
+			WakeAllConditionVariable(&m_callback_done);
+		}
+		for (timer* t : batch) {
+			t->in_batch = false;
+			if (t->killed) { continue; }
+			if (t->flags & TIME_PERIODIC) {
+				// Periods already over are skipped rather than fired in a burst
+				t->expires += t->delay;
+				if (t->expires <= now_tick) {
+					uint64_t missed = (now_tick - t->expires) / t->delay + 1;
+					t->expires += missed * t->delay;
+					g_timer_wheel_skipped_periods.fetch_add(missed, std::memory_order_relaxed);
+				}
+				insert(t);
+			}
+			else {
+				m_timers.erase(t->id);
+			}
+		}
+		batch.clear();
+		m_killed.clear();
+	}
+
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		auto wheel = (timer_wheel*)param;
+		wheel->run();
+		wheel->m_running = false;	// Last access to the wheel
+		return 0;
+	}
+
+	void run() {
+		std::vector<timer*> batch;
+		bool period_held = false;
+		while (!m_stop) {
+			EnterCriticalSection(&m_lock);
+			bool idle = m_timers.empty();
+			LeaveCriticalSection(&m_lock);
+			// The fine system timer period is only held while there are timers
+			if (idle != !period_held) {
+				if (idle) { g_timer_periods.end(NULL, L"timer wheel", 1); }
+				else { g_timer_periods.begin(NULL, L"timer wheel", 1); }
+				period_held = !idle;
+			}
+			DWORD wait_ms = INFINITE;
+			if (!idle) {
+				EnterCriticalSection(&m_lock);
+				uint64_t now_tick = (qpc_now() - m_origin) * 1000 / g_qpc_frequency.QuadPart;
+				while (m_tick <= now_tick && !m_stop) {
+					take_tick(batch);
+					if (!batch.empty()) { fire(batch, now_tick); }
+				}
+				uint64_t due = due_qpc(next_busy_tick());
+				LeaveCriticalSection(&m_lock);
+				uint64_t now = qpc_now();
+				wait_ms = due > now ? (DWORD)((due - now) * 1000 / g_qpc_frequency.QuadPart) + 1 : 0;
+			}
+			WaitForSingleObject(m_wake, wait_ms);
+			g_timer_wheel_wakeups.fetch_add(1, std::memory_order_relaxed);
+		}
+		if (period_held) { g_timer_periods.end(NULL, L"timer wheel", 1); }
+	}
+
+	CRITICAL_SECTION m_lock;	// Protects everything below but the thread fields
+	CONDITION_VARIABLE m_callback_done;
+	std::unordered_map<UINT, std::unique_ptr<timer>> m_timers;
+	std::vector<std::unique_ptr<timer>> m_killed;	// Killed while the thread holds them
+	std::array<timer*, (1 << g_timer_wheel_near_bits)> m_near{};
+	std::array<std::array<timer*, (1 << g_timer_wheel_far_bits)>, g_timer_wheel_far_levels> m_far{};
+	uint64_t m_tick = 0;		// Next tick to process, in ms since m_origin
+	uint64_t m_origin = 0;		// QPC of tick 0
+	UINT m_next_id = 1;
+	UINT m_running_id = 0;		// Timer whose callback is running
+	size_t m_peak_active = 0;
+	TIMECAPS m_caps = {};
+	bool m_caps_known = false;
+
+	HANDLE m_thread = NULL;
+	DWORD m_thread_id = 0;
+	HANDLE m_wake = NULL;
+	std::atomic<bool> m_stop{ false };
+	std::atomic<bool> m_running{ false };	// The thread still uses the wheel
+
+	friend struct timer_wheel_test;
+};
+
+timer_wheel g_timer_wheel;
@@ -0,0 +1,173 @@
+// waveOut instrumentation: buffers queued per handle, the gap between a buffer completing and
+// the next write, and underruns (the queue running dry while playing). The counters live in a
+// named shared-memory block, so they can be watched live from another process while the
+// application plays; only relaxed atomic increments are done on the audio path.
+
+struct wave_stats_config {
+	std::optional<std::wstring> maybe_shared_memory_name;	// Default: Local\midi_replace_wave_stats_<pid>
+};
+
+bool g_wave_stats_enabled = false;
+wave_stats_config g_wave_stats_config;
+
+constexpr uint32_t g_wave_stats_block_version = 1;
+constexpr size_t g_wave_stats_handle_slots = 16;
+constexpr size_t g_wave_stats_depth_buckets = 32;
+
+// Layout of the shared-memory block. Readers check version and size first. Counters are
+// updated independently, so they may be momentarily inconsistent with each other.
+struct wave_stats_block {
+	uint32_t version;
+	uint32_t size;
+	uint64_t qpc_frequency;
+	std::atomic<uint64_t> opens;
+	std::atomic<uint64_t> writes;
+	std::atomic<uint64_t> bytes_written;
+	std::atomic<uint64_t> buffers_done;
+	std::atomic<uint64_t> underruns;
+	std::atomic<uint64_t> prepares;
+	std::array<std::atomic<uint64_t>, g_wave_stats_depth_buckets> queue_depth_histogram;	// Buffers already queued at a write; last bucket: that many or more
+	std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> refill_gap_histogram;		// log2 ns from a completion to the next write
+	std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> underrun_histogram;		// log2 ns from running dry to the next write
+	std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> prepare_histogram;			// log2 ns in waveOutPrepareHeader
+	struct handle_slot {
+		std::atomic<uint64_t> handle;	// 0 = free
+		std::atomic<uint64_t> queued;
+		std::atomic<uint64_t> max_queued;
+		std::atomic<uint64_t> writes;
+		std::atomic<uint64_t> underruns;
+	};
+	std::array<handle_slot, g_wave_stats_handle_slots> handles;
+};
+
+class wave_stats {
+public:
+	// Maps the shared-memory block, or falls back to a process-local one.
+	void init(wave_stats_config const& cfg) {
+		std::wstring name = cfg.maybe_shared_memory_name.has_value() ?
+			cfg.maybe_shared_memory_name.value() :
+			L"Local\\midi_replace_wave_stats_" + std::to_wstring(GetCurrentProcessId());
+		m_mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(wave_stats_block), name.c_str());
+		void* view = m_mapping ? MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(wave_stats_block)) : NULL;
+		m_block = view ? new (view) wave_stats_block{} : &m_local;
+		m_block->version = g_wave_stats_block_version;
+		m_block->size = sizeof(wave_stats_block);
+		m_block->qpc_frequency = g_qpc_frequency.QuadPart;
+		m_name = view ? name : L"";
+	}
+
+	wave_stats_block& block() { return *m_block; }
+
+	std::wstring const& shared_memory_name() const { return m_name; }
+
+	// Returns NULL if all slots are taken; the handle is then only counted in the totals.
+	wave_stats_block::handle_slot* claim_slot(HWAVEOUT hwo) {
+		for (auto& slot : m_block->handles) {
+			uint64_t expected = 0;
+			if (slot.handle.compare_exchange_strong(expected, (uint64_t)hwo, std::memory_order_acq_rel)) {
+				slot.queued = slot.max_queued = slot.writes = slot.underruns = 0;
+				return &slot;
+			}
+		}
+		return NULL;
+	}
+
+	void release_slot(wave_stats_block::handle_slot* slot) {
+		if (slot) { slot->handle.store(0, std::memory_order_release); }
+	}
+
+	json stats_json() {
+		auto& b = *m_block;
+		auto histogram = [](auto const& buckets) {
+			json rval = json::array();
+			for (auto& bucket : buckets) { rval.push_back(bucket.load()); }
+			return rval;
+		};
+		return json{
+			{ "opens", b.opens.load() },
+			{ "writes", b.writes.load() },
+			{ "bytes_written", b.bytes_written.load() },
+			{ "buffers_done", b.buffers_done.load() },
+			{ "underruns", b.underruns.load() },
+			{ "prepares", b.prepares.load() },
+			{ "queue_depth_histogram", histogram(b.queue_depth_histogram) },
+			{ "refill_gap_histogram_log2_ns", histogram(b.refill_gap_histogram) },
+			{ "underrun_histogram_log2_ns", histogram(b.underrun_histogram) },
+			{ "prepare_histogram_log2_ns", histogram(b.prepare_histogram) }
+		};
+	}
+
+private:
+	HANDLE m_mapping = NULL;
+	wave_stats_block m_local{};
+	wave_stats_block* m_block = &m_local;
+	std::wstring m_name;
+};
+
+wave_stats g_wave_stats;
+
+// Only exists for outputs opened while instrumentation or re-chunking is enabled. The wrapper
+// then installs its own driver callback, with this state as the instance data.
+struct wave_out_handle_state {
+	app_callback app;
+	std::unique_ptr<wave_rechunker> rechunk;
+	wave_stats_block::handle_slot* slot = NULL;
+	std::atomic<uint64_t> queued{ 0 };
+	std::atomic<uint64_t> last_done{ 0 };	// QPC of the last completion not yet followed by a write
+	std::atomic<uint64_t> drained_at{ 0 };	// QPC of the last underrun not yet followed by a write
+	std::atomic<bool> resetting{ false };	// Buffers returned by a reset are not underruns
+
+	void on_write(LPWAVEHDR hdr) {
+		auto& b = g_wave_stats.block();
+		uint64_t now = qpc_now();
+		if (uint64_t done = last_done.exchange(0, std::memory_order_relaxed)) {
+			b.refill_gap_histogram[histogram_bucket((uint64_t)ticks_to_ns(now - done))].fetch_add(1, std::memory_order_relaxed);
+		}
+		if (uint64_t drained = drained_at.exchange(0, std::memory_order_relaxed)) {
+			// The queue ran dry and the application kept playing
+			b.underruns.fetch_add(1, std::memory_order_relaxed);
+			b.underrun_histogram[histogram_bucket((uint64_t)ticks_to_ns(now - drained))].fetch_add(1, std::memory_order_relaxed);
+			if (slot) { slot->underruns.fetch_add(1, std::memory_order_relaxed); }
+		}
+		uint64_t depth = queued.fetch_add(1, std::memory_order_relaxed);
+		b.queue_depth_histogram[depth < g_wave_stats_depth_buckets ? depth : g_wave_stats_depth_buckets - 1].fetch_add(1, std::memory_order_relaxed);
+		b.writes.fetch_add(1, std::memory_order_relaxed);
+		b.bytes_written.fetch_add(hdr->dwBufferLength, std::memory_order_relaxed);
+		if (slot) {
+			slot->writes.fetch_add(1, std::memory_order_relaxed);
+			slot->queued.store(depth + 1, std::memory_order_relaxed);
+			if (depth + 1 > slot->max_queued.load(std::memory_order_relaxed)) { slot->max_queued.store(depth + 1, std::memory_order_relaxed); }
+		}
+	}
+
+	// The native write failed after on_write
+	void undo_write() {
+		queued.fetch_sub(1, std::memory_order_relaxed);
+		if (slot) { slot->queued.store(queued.load(std::memory_order_relaxed), std::memory_order_relaxed); }
+	}
+
+	void on_done() {
+		auto& b = g_wave_stats.block();
+		uint64_t now = qpc_now();
+		b.buffers_done.fetch_add(1, std::memory_order_relaxed);
+		uint64_t left = queued.load(std::memory_order_relaxed);
+		while (left > 0 && !queued.compare_exchange_weak(left, left - 1, std::memory_order_relaxed)) {}
+		if (left > 0) { left--; }
+		if (slot) { slot->queued.store(left, std::memory_order_relaxed); }
+		last_done.store(now, std::memory_order_relaxed);
+		if (left == 0 && !resetting.load(std::memory_order_relaxed)) {
+			// Counted as an underrun once the next write shows playback was meant to go on
+			drained_at.store(now, std::memory_order_relaxed);
+		}
+	}
+
+	// After a native reset, all buffers are back
+	void on_reset() {
+		queued.store(0, std::memory_order_relaxed);
+		last_done.store(0, std::memory_order_relaxed);
+		drained_at.store(0, std::memory_order_relaxed);
+		if (slot) { slot->queued.store(0, std::memory_order_relaxed); }
+	}
+};
+
+midi_handle_table<HWAVEOUT, wave_out_handle_state> g_wave_out_handles;
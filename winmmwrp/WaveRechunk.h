@@ -0,0 +1,299 @@
+// waveOut re-chunking. The application's buffers are not written to the driver; instead they
+// are cut into slices of a target duration, which go through a fixed pool of native headers
+// (the queue depth). Slices point into the application's buffer, except for short pieces
+// (the tail of a buffer, or small buffers), which are copied into the pool's own storage and
+// combined with the following data. An application buffer is returned once all of its
+// slices are done. A worker thread per handle refills the pool, as the driver callback must
+// not call back into WinMM.
+
+#include <deque>
+
+struct wave_rechunk_config {
+	uint64_t chunk_ms = 10;
+	size_t queue_depth = 4;
+};
+
+bool g_wave_rechunk_enabled = false;
+wave_rechunk_config g_wave_rechunk_config;
+
+std::atomic<uint64_t> g_wave_rechunk_app_buffers{ 0 };
+std::atomic<uint64_t> g_wave_rechunk_slices{ 0 };
+std::atomic<uint64_t> g_wave_rechunk_copied_slices{ 0 };
+std::atomic<uint64_t> g_wave_rechunk_copied_bytes{ 0 };
+std::atomic<uint64_t> g_wave_rechunk_write_errors{ 0 };
+std::atomic<uint64_t> g_wave_rechunk_loops_rejected{ 0 };
+
+struct wave_out_handle_state;
+// Returns a finished application buffer (defined with the driver callback)
+void complete_wave_out_buffer(wave_out_handle_state& state, HWAVEOUT hwo, LPWAVEHDR hdr);
+
+class wave_rechunker {
+public:
+	wave_rechunker(HWAVEOUT hwo, wave_out_handle_state& owner, WAVEFORMATEX const& fmt, wave_rechunk_config const& cfg) :
+		m_hwo(hwo),
+		m_owner(owner),
+		m_native(cfg.queue_depth ? cfg.queue_depth : 1),
+		m_slots(m_native.size()) {
+		DWORD align = fmt.nBlockAlign ? fmt.nBlockAlign : 1;
+		uint64_t bytes = (uint64_t)fmt.nAvgBytesPerSec * cfg.chunk_ms / 1000;
+		m_chunk = (DWORD)(bytes / align * align);
+		if (m_chunk < align) { m_chunk = align; }
+		for (auto& slot : m_slots) { slot.storage.resize(m_chunk); }
+		InitializeCriticalSection(&m_lock);
+		InitializeCriticalSection(&m_dispatch_lock);
+		m_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+	}
+
+	~wave_rechunker() {
+		DeleteCriticalSection(&m_lock);
+		DeleteCriticalSection(&m_dispatch_lock);
+		if (m_wake) { CloseHandle(m_wake); }
+	}
+
+	void start() {
+		m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+		if (m_thread) { SetThreadPriority(m_thread, THREAD_PRIORITY_HIGHEST); }
+	}
+
+	// Ends the worker and unprepares the pool. All slices must be back (reset()).
+	void stop() {
+		m_stop = true;
+		SetEvent(m_wake);
+		if (m_thread) {
+			WaitForSingleObject(m_thread, INFINITE);
+			CloseHandle(m_thread);
+			m_thread = NULL;
+		}
+		for (size_t i = 0; i < m_native.size(); i++) {
+			if (m_slots[i].state != slot_state::Free) { MMwaveOutUnprepareHeader(m_hwo, &m_native[i], sizeof(WAVEHDR)); }
+		}
+	}
+
+	bool owns(LPWAVEHDR hdr) const {
+		return hdr >= m_native.data() && hdr < m_native.data() + m_native.size();
+	}
+
+	// Application's waveOutWrite. Loops are refused: the slices of a looping run would have to
+	// be replayed dwLoops times, and handing it to the driver would play it out of order.
+	MMRESULT write(LPWAVEHDR hdr) {
+		if (!(hdr->dwFlags & WHDR_PREPARED)) { return WAVERR_UNPREPARED; }
+		if (hdr->dwFlags & WHDR_INQUEUE) { return WAVERR_STILLPLAYING; }
+		if (hdr->dwFlags & (WHDR_BEGINLOOP | WHDR_ENDLOOP)) {
+			g_wave_rechunk_loops_rejected.fetch_add(1, std::memory_order_relaxed);
+			return MMSYSERR_NOTSUPPORTED;
+		}
+		EnterCriticalSection(&m_lock);
+		hdr->dwFlags = (hdr->dwFlags | WHDR_INQUEUE) & ~WHDR_DONE;
+		m_app.push_back({ hdr, 0, 0 });
+		LeaveCriticalSection(&m_lock);
+		g_wave_rechunk_app_buffers.fetch_add(1, std::memory_order_relaxed);
+		SetEvent(m_wake);
+		return MMSYSERR_NOERROR;
+	}
+
+	bool has_app_buffers() {
+		EnterCriticalSection(&m_lock);
+		bool rval = !m_app.empty();
+		LeaveCriticalSection(&m_lock);
+		return rval;
+	}
+
+	// Driver callback (WOM_DONE) for a pool header
+	void on_native_done(LPWAVEHDR native) {
+		std::vector<LPWAVEHDR> completed;
+		EnterCriticalSection(&m_lock);
+		release_slot(native - m_native.data());
+		if (!m_resetting) { take_completed(completed); }
+		LeaveCriticalSection(&m_lock);
+		for (auto hdr : completed) { complete_wave_out_buffer(m_owner, m_hwo, hdr); }
+		SetEvent(m_wake);
+	}
+
+	// Application's waveOutReset: the driver returns the slices, then all application buffers
+	// are returned, played or not.
+	MMRESULT reset() {
+		EnterCriticalSection(&m_dispatch_lock);
+		EnterCriticalSection(&m_lock);
+		m_resetting = true;
+		LeaveCriticalSection(&m_lock);
+		MMRESULT rval = MMwaveOutReset(m_hwo);
+		std::vector<LPWAVEHDR> completed;
+		EnterCriticalSection(&m_lock);
+		m_resetting = false;
+		// A slice the driver hasn't returned yet must not reach the entries freed below
+		for (auto& s : m_slots) {
+			if (s.state != slot_state::Free) { s.contributors.clear(); }
+		}
+		for (auto& entry : m_app) {
+			entry.hdr->dwFlags = (entry.hdr->dwFlags | WHDR_DONE) & ~WHDR_INQUEUE;
+			completed.push_back(entry.hdr);
+		}
+		m_app.clear();
+		m_unsliced = 0;
+		LeaveCriticalSection(&m_lock);
+		LeaveCriticalSection(&m_dispatch_lock);
+		for (auto hdr : completed) { complete_wave_out_buffer(m_owner, m_hwo, hdr); }
+		return rval;
+	}
+
+	DWORD chunk_bytes() const { return m_chunk; }
+
+private:
+	struct app_entry {
+		LPWAVEHDR hdr;
+		DWORD sliced;		// Bytes handed to slices so far
+		size_t pending;		// Slices with data of this buffer still in the driver
+	};
+
+	enum class slot_state { Free, InFlight, Done };
+
+	struct slot {
+		slot_state state = slot_state::Free;
+		std::vector<char> storage;				// For copied slices
+		std::vector<app_entry*> contributors;	// Buffers with data in this slice
+	};
+
+	static DWORD WINAPI thread_proc(LPVOID param) {
+		((wave_rechunker*)param)->run();
+		return 0;
+	}
+
+	void run() {
+		std::vector<size_t> to_unprepare;
+		while (!m_stop) {
+			WaitForSingleObject(m_wake, INFINITE);
+			EnterCriticalSection(&m_dispatch_lock);
+			EnterCriticalSection(&m_lock);
+			for (size_t i = 0; i < m_slots.size(); i++) {
+				if (m_slots[i].state == slot_state::Done) { to_unprepare.push_back(i); }
+			}
+			LeaveCriticalSection(&m_lock);
+			for (size_t i : to_unprepare) {
+				MMwaveOutUnprepareHeader(m_hwo, &m_native[i], sizeof(WAVEHDR));
+				EnterCriticalSection(&m_lock);
+				m_slots[i].state = slot_state::Free;
+				LeaveCriticalSection(&m_lock);
+			}
+			to_unprepare.clear();
+			if (!m_stop) { fill(); }
+			LeaveCriticalSection(&m_dispatch_lock);
+		}
+	}
+
+	// Hands slices to the driver while there are free slots and unsliced data.
+	// Called with m_dispatch_lock held.
+	void fill() {
+		while (true) {
+			EnterCriticalSection(&m_lock);
+			size_t i = 0;
+			while (i < m_slots.size() && m_slots[i].state != slot_state::Free) { i++; }
+			if (i == m_slots.size() || m_unsliced == m_app.size()) {
+				LeaveCriticalSection(&m_lock);
+				return;
+			}
+			auto& slot = m_slots[i];
+			auto& native = m_native[i];
+			memset(&native, 0, sizeof(native));
+			auto& first = m_app[m_unsliced];
+			DWORD remaining = first.hdr->dwBufferLength - first.sliced;
+			if (remaining >= m_chunk / 2) {
+				// Zero-copy: the slice points into the application's buffer
+				DWORD n = remaining < m_chunk ? remaining : m_chunk;
+				native.lpData = first.hdr->lpData + first.sliced;
+				native.dwBufferLength = n;
+				take_bytes(slot, first, n);
+			}
+			else {
+				// Short piece: copy it and whatever follows into the slot, up to a full chunk
+				DWORD filled = 0;
+				while (filled < m_chunk && m_unsliced < m_app.size()) {
+					auto& entry = m_app[m_unsliced];
+					DWORD left = entry.hdr->dwBufferLength - entry.sliced;
+					DWORD n = left < m_chunk - filled ? left : m_chunk - filled;
+					memcpy(slot.storage.data() + filled, entry.hdr->lpData + entry.sliced, n);
+					filled += n;
+					take_bytes(slot, entry, n);
+				}
+				native.lpData = slot.storage.data();
+				native.dwBufferLength = filled;
+				g_wave_rechunk_copied_slices.fetch_add(1, std::memory_order_relaxed);
+				g_wave_rechunk_copied_bytes.fetch_add(filled, std::memory_order_relaxed);
+			}
+			slot.state = slot_state::InFlight;
+			LeaveCriticalSection(&m_lock);
+
+			g_wave_rechunk_slices.fetch_add(1, std::memory_order_relaxed);
+			MMRESULT rval = MMwaveOutPrepareHeader(m_hwo, &native, sizeof(native));
+			if (rval == MMSYSERR_NOERROR) {
+				rval = MMwaveOutWrite(m_hwo, &native, sizeof(native));
+				if (rval != MMSYSERR_NOERROR) { MMwaveOutUnprepareHeader(m_hwo, &native, sizeof(native)); }
+			}
+			if (rval != MMSYSERR_NOERROR) {
+				// The slice is dropped, so its buffers still complete
+				g_wave_rechunk_write_errors.fetch_add(1, std::memory_order_relaxed);
+				std::vector<LPWAVEHDR> completed;
+				EnterCriticalSection(&m_lock);
+				release_slot(i);
+				slot.state = slot_state::Free;
+				take_completed(completed);
+				LeaveCriticalSection(&m_lock);
+				for (auto hdr : completed) { complete_wave_out_buffer(m_owner, m_hwo, hdr); }
+				return;
+			}
+		}
+	}
+
+	// Called with m_lock held
+	void take_bytes(slot& s, app_entry& entry, DWORD n) {
+		entry.sliced += n;
+		entry.pending++;
+		s.contributors.push_back(&entry);
+		if (entry.sliced == entry.hdr->dwBufferLength) { m_unsliced++; }
+	}
+
+	// Called with m_lock held
+	void release_slot(size_t i) {
+		auto& s = m_slots[i];
+		s.state = slot_state::Done;
+		for (auto entry : s.contributors) { entry->pending--; }
+		s.contributors.clear();
+	}
+
+	// Pops the buffers at the front that are fully played, in the order they were written.
+	// Called with m_lock held.
+	void take_completed(std::vector<LPWAVEHDR>& out) {
+		while (m_unsliced > 0 && m_app.front().pending == 0) {
+			LPWAVEHDR hdr = m_app.front().hdr;
+			hdr->dwFlags = (hdr->dwFlags | WHDR_DONE) & ~WHDR_INQUEUE;
+			out.push_back(hdr);
+			m_app.pop_front();
+			m_unsliced--;
+		}
+	}
+
+	HWAVEOUT m_hwo;
+	wave_out_handle_state& m_owner;
+	DWORD m_chunk = 0;
+	HANDLE m_thread = NULL;
+	HANDLE m_wake = NULL;
+	std::atomic<bool> m_stop{ false };
+
+	CRITICAL_SECTION m_dispatch_lock;	// Held while talking to the driver from the worker, and during reset
+	CRITICAL_SECTION m_lock;			// Protects everything below
+	bool m_resetting = false;
+	std::vector<WAVEHDR> m_native;
+	std::vector<slot> m_slots;
+	std::deque<app_entry> m_app;		// Written and not yet returned, in order; references stay valid
+	size_t m_unsliced = 0;				// Index of the first entry not fully sliced
+};
+
+json wave_rechunk_stats_json() {
+	return json{
+		{ "app_buffers", g_wave_rechunk_app_buffers.load() },
+		{ "slices", g_wave_rechunk_slices.load() },
+		{ "copied_slices", g_wave_rechunk_copied_slices.load() },
+		{ "copied_bytes", g_wave_rechunk_copied_bytes.load() },
+		{ "write_errors", g_wave_rechunk_write_errors.load() },
+		{ "loops_rejected", g_wave_rechunk_loops_rejected.load() }
+	};
+}
@@ -14,96 +14,60 @@
 #include <cwchar>
 #include <wchar.h>
 #include <algorithm>
+#include <unordered_map>
+#include <memory>
+#include <limits>
+#include <bit>
 
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
 
+#include "StringConvert.h"
+
 // Stock WinMM funcs
 extern "C" {
 #include "WinMM.h"
 }
 
-enum class Direction {
-	Input,
-	Output
-};
-
-std::wstring stringToWstring(const std::string& str) {
-    std::vector<wchar_t> buffer(str.size() + 1);
-    std::mbstowcs(buffer.data(), str.c_str(), str.size() + 1);
-    return std::wstring(buffer.data());
-}
-
-std::string wstringToString(const std::wstring& wstr) {
-    std::vector<char> buffer(wstr.size() * MB_CUR_MAX + 1);
-    std::wcstombs(buffer.data(), wstr.c_str(), buffer.size());
-    return std::string(buffer.data());
-}
-
-template<typename dev_caps_struct>
-consteval Direction CapsDirection() {
-	return (std::is_same<dev_caps_struct, MIDIINCAPSW>::value || std::is_same<dev_caps_struct, MIDIINCAPSA>::value) ?
-		Direction::Input : Direction::Output;
-}
-
-struct midi_dev_caps {
-	Direction direction;                                // MIDIINCAPS or MIDIOUTCAPS
-
-	// Common
-	size_t man_id;										// wMid
-	size_t prod_id;										// wPid
-	size_t driver_version;								// vDriverVersion
-	std::wstring name;									// szPname
-
-	// MIDIOUTCAPS only
-	std::optional<size_t> technology;					// wTechnology
-	std::optional<size_t> voices;						// wVoices
-	std::optional<size_t> notes;						// wNotes
-	std::optional<size_t> channel_mask;					// wChannelMask
-	std::optional<size_t> support; 					    // dwSupport
-};
-
-template<typename dev_caps_struct>
-using dev_caps_char_type = typename std::remove_all_extents<decltype(dev_caps_struct::szPname)>::type;
-
-template<typename char_t>
-std::wstring chars_to_str(char_t* c) {
-	if (std::is_same<char_t, WCHAR>::value) {
-		return std::wstring((WCHAR*)c);
-	}
-	return stringToWstring(std::string((CHAR*)c));
-}
-
-template<typename dev_caps_struct>
-midi_dev_caps to_our_dev_caps(dev_caps_struct v) {
-	auto constexpr direction = CapsDirection<dev_caps_struct>();
-	auto rval = midi_dev_caps{
-		.direction = direction,
-		.man_id = v.wMid,
-		.prod_id = v.wPid,
-		.driver_version = v.vDriverVersion,
-		.name = chars_to_str(v.szPname)
-	};
-
-	if constexpr (direction == Direction::Output) {
-		rval.technology = v.wTechnology;
-		rval.voices = v.wVoices;
-		rval.notes = v.wNotes;
-		rval.channel_mask = v.wChannelMask;
-		rval.support = v.dwSupport;
-	}
-
-	return rval;
-}
+#include "WrapperStats.h"
+#include "TimerPeriod.h"
+#include "OutputScheduler.h"
+#include "OutputFilter.h"
+#include "NoteTracker.h"
+#include "AppCallback.h"
+#include "SysexRewrite.h"
+#include "InputBufferPool.h"
+#include "InputDispatch.h"
+#include "ClockEngine.h"
+#include "MidiHandles.h"
+#include "IdentityResponder.h"
+#include "SharedOutputs.h"
+#include "MidiOutPath.h"
+#include "LogRotation.h"
+#include "LogDedup.h"
+#include "LatencyProbe.h"
+#include "StreamEngine.h"
+#include "WaveRechunk.h"
+#include "WaveOutStats.h"
+#include "TimerWheel.h"
+#include "MixerCache.h"
 
 FILE* g_maybe_wrapper_log_file = NULL;
+SRWLOCK g_log_lock = SRWLOCK_INIT;	// Held while writing, so the file can be rotated under the writers
 
 template<typename ...Args>
 inline void wrapper_log(std::wostringstream* maybe_os, Args... args) {
 	std::vector<wchar_t> logbuf(1024);
 
 	if (g_maybe_wrapper_log_file) {
-		fwprintf(g_maybe_wrapper_log_file, args...);
+		AcquireSRWLockExclusive(&g_log_lock);
+		if (g_maybe_wrapper_log_file) {
+			int n = fwprintf(g_maybe_wrapper_log_file, args...);
+			if (g_log_rotation_enabled && n > 0 && g_log_rotator.written(n)) {
+				g_log_rotator.rotate(g_maybe_wrapper_log_file);
+			}
+		}
+		ReleaseSRWLockExclusive(&g_log_lock);
 	}
 	if (maybe_os) {
 		auto n_needed = swprintf(logbuf.data(), 0, args...);
@@ -113,124 +77,21 @@ inline void wrapper_log(std::wostringstream* maybe_os, Args... args) {
 	}
 }
 
-struct replace_rule {
-	// Matching only on common properties
-	std::optional<Direction> maybe_match_direction;
-	std::optional<std::wregex> maybe_match_name;
-	std::optional<size_t> maybe_match_man_id;
-	std::optional<size_t> maybe_match_prod_id;
-	std::optional<size_t> maybe_match_driver_version;
-
-	// Replacing common properties
-	std::optional <std::wstring> maybe_replace_name;
-	std::optional <size_t> maybe_replace_man_id;
-	std::optional <size_t> maybe_replace_prod_id;
-	std::optional <size_t> maybe_replace_driver_version;
-
-	// Replacing output device properties
-	std::optional<size_t> maybe_replace_technology;
-	std::optional<size_t> maybe_replace_voices;
-	std::optional<size_t> maybe_replace_notes;
-	std::optional<size_t> maybe_replace_channel_mask;
-	std::optional<size_t> maybe_replace_support;
-
-	// Replacing device interface name
-	std::optional<std::wstring>  maybe_replace_interface_name;
-
-	bool is_match(midi_dev_caps const& m) const {
-		bool rval = true;
-		std::wsmatch rmatch;
-		if (maybe_match_direction.has_value()) { rval = rval && (maybe_match_direction.value() == m.direction); }
-		if (maybe_match_name.has_value()) { rval = rval && std::regex_match(m.name, rmatch, maybe_match_name.value()); }
-		if (maybe_match_man_id.has_value()) { rval = rval && (maybe_match_man_id.value() == m.man_id); }
-		if (maybe_match_prod_id.has_value()) { rval = rval && (maybe_match_prod_id.value() == m.prod_id); }
-		if (maybe_match_driver_version.has_value()) { rval = rval && (maybe_match_driver_version.value() == m.driver_version); }
-		return rval;
-	}
-
-	bool apply_in_place(midi_dev_caps& m) const {
-		bool match = is_match(m);
-		if (match) {
-			if (maybe_replace_name.has_value()) { m.name = maybe_replace_name.value(); }
-			if (maybe_replace_man_id.has_value()) { m.man_id = maybe_replace_man_id.value(); }
-			if (maybe_replace_prod_id.has_value()) { m.prod_id = maybe_replace_prod_id.value(); }
-			if (maybe_replace_driver_version.has_value()) { m.driver_version = maybe_replace_driver_version.value(); }
-			if (maybe_replace_technology.has_value()) { m.technology = maybe_replace_technology.value(); }
-			if (maybe_replace_voices.has_value()) { m.voices = maybe_replace_voices.value(); }
-			if (maybe_replace_notes.has_value()) { m.notes = maybe_replace_notes.value(); }
-			if (maybe_replace_channel_mask.has_value()) { m.channel_mask = maybe_replace_channel_mask.value(); }
-			if (maybe_replace_support.has_value()) { m.support = maybe_replace_support.value(); }
-		}
-		return match;
-	}
-
-	template<typename dev_caps_struct>
-	bool apply_in_place_c(dev_caps_struct& s) const {
-		auto ours = to_our_dev_caps(s);
-		bool matched = apply_in_place(ours);
-		if (matched) {
-			s.wMid = ours.man_id;
-			s.wPid = ours.prod_id;
-			s.vDriverVersion = ours.driver_version;
-			if (std::is_same<dev_caps_char_type<dev_caps_struct>, WCHAR>::value) {
-				wcscpy((WCHAR*)s.szPname, ours.name.c_str());
-			} else {
-				strcpy((CHAR*)s.szPname, wstringToString(ours.name).c_str());
-			}
-
-			if constexpr (CapsDirection<dev_caps_struct>() == Direction::Output) {
-				s.wTechnology = ours.technology.value();
-				s.wVoices = ours.voices.value();
-				s.wNotes = ours.notes.value();
-				s.wChannelMask = ours.channel_mask.value();
-				s.dwSupport = ours.support.value();
-			}
-		}
-		return matched;
+// Whether a polled query should be logged. The key identifies the query and its native
+// result, so repeats can be suppressed (see LogDedup.h) before anything is formatted.
+bool should_log_query(StatsEntry api, log_dedup::key_builder key) {
+	if (!g_maybe_wrapper_log_file) { return false; }
+	if (!g_log_dedup_enabled) { return true; }
+	uint64_t repeats;
+	if (!g_log_dedup.should_log(key.add(api).key(), repeats)) { return false; }
+	if (repeats) {
+		wrapper_log(nullptr, L"\n(%hs: the entry below was repeated %llu times since it was last logged)\n", g_stats_entry_names[(size_t)api], (unsigned long long)repeats);
 	}
-};
-
-// To illustrate and check
-static_assert(std::is_same<WCHAR, dev_caps_char_type<MIDIINCAPSW>>::value, "error");
-static_assert(std::is_same<CHAR, dev_caps_char_type<MIDIINCAPSA>>::value, "error");
-static_assert(std::is_same<WCHAR, dev_caps_char_type<MIDIOUTCAPSW>>::value, "error");
-static_assert(std::is_same<CHAR, dev_caps_char_type<MIDIOUTCAPSA>>::value, "error");
-
-std::vector<replace_rule> g_replace_rules;
-
-template<typename dev_caps_struct>
-std::wstring stringify_common_caps(dev_caps_struct const& s) {
-	return
-		L"  name: " + chars_to_str((dev_caps_char_type<dev_caps_struct> *)s.szPname) + L"\n" +
-		L"  man id: " + std::to_wstring(s.wMid) + L"\n" +
-		L"  prod id: " + std::to_wstring(s.wPid) + L"\n" +
-		L"  driver version: " + std::to_wstring(s.vDriverVersion) + L"\n";
-}
-
-template<typename out_dev_caps_struct>
-std::wstring stringify_output_caps(out_dev_caps_struct const& s) {
-	return stringify_common_caps(s) +
-	       L"  technology: " + std::to_wstring(s.wTechnology) + L"\n" +
-		   L"  voices: " + std::to_wstring(s.wVoices) + L"\n" +
-	       L"  notes: " + std::to_wstring(s.wNotes) + L"\n" +
-	       L"  channel mask: " + std::to_wstring(s.wChannelMask) + L"\n" +
-	       L"  support: " + std::to_wstring(s.dwSupport) + L"\n";
-}
-
-template<typename in_dev_caps_struct>
-std::wstring stringify_input_caps(in_dev_caps_struct const& s) {
-	return stringify_common_caps(s);
+	return true;
 }
 
-template<typename dev_caps_struct>
-std::wstring stringify_caps(dev_caps_struct const& s) {
-	constexpr bool is_out = CapsDirection<dev_caps_struct>() == Direction::Output;
-	if constexpr (is_out) {
-		return stringify_output_caps(s);
-	} else {
-		return stringify_input_caps(s);
-	}
-}
+#include "ReplaceRules.h"
+#include "InterfaceQuery.h"
 
 std::string abs_path_of(FILE* file) {
 	char file_name_info[MAX_PATH + sizeof(DWORD)];
@@ -273,6 +134,19 @@ std::string read_whole_file(std::string filename, std::string* maybe_abs_path_ou
 }
 
 
+// Active per-executable profile, if the config selected one.
+std::optional<std::string> g_maybe_active_profile;
+
+std::wstring current_module_path() {
+	std::vector<wchar_t> buf(MAX_PATH);
+	while (true) {
+		DWORD n = GetModuleFileNameW(NULL, buf.data(), (DWORD)buf.size());
+		if (n == 0) { return std::wstring(); }
+		if (n < buf.size()) { return std::wstring(buf.data(), n); }
+		buf.resize(buf.size() * 2);
+	}
+}
+
 bool load_config(
 	std::string filename,
 	std::optional<std::string> &out_log_filename,
@@ -289,60 +163,214 @@ bool load_config(
 		json data = json::parse(config_content);
 		log << L"Parsed config: " << stringToWstring(data.dump()) << L"\n";
 
+		if (data.contains("profiles")) {
+			g_maybe_active_profile = apply_profile(data, current_module_path(), log);
+		}
+
 		if (data.contains("log")) { out_log_filename = data["log"].template get <std::string>(); log << L"LOG " << stringToWstring(out_log_filename.value_or("no")) << std::endl; }
 		if (data.contains("popup")) { out_debug_popup = data["popup"].template get<bool>(); }
 		if (data.contains("popup_verbose")) { out_debug_popup_verbose = data["popup_verbose"].template get <bool>(); }
-		if (data.contains("rules")) {
-			auto& rules = data["rules"];
-			for (auto& rule : rules) {
-				try {
-					replace_rule rval;
-					if (rule.contains("match_name")) { rval.maybe_match_name = stringToWstring(rule["match_name"].template get<std::string>()); }
-					if (rule.contains("match_man_id")) { rval.maybe_match_man_id = rule["match_man_id"].template get<size_t>(); }
-					if (rule.contains("match_prod_id")) { rval.maybe_match_prod_id = rule["match_prod_id"].template get<size_t>(); }
-					if (rule.contains("match_driver_version")) { rval.maybe_match_driver_version = rule["match_driver_version"].template get<size_t>(); }
-					if (rule.contains("match_direction")) {
-						auto text = stringToWstring(rule["match_direction"].template get<std::string>());
-						if (text == L"in") { rval.maybe_match_direction = Direction::Input; }
-						else if (text == L"out") { rval.maybe_match_direction = Direction::Output; }
-						else {
-							throw std::runtime_error("Invalid value for match_direction (should be in or out): " + wstringToString(text));
-						}
+		if (data.contains("log_rotation")) {
+			auto& rotation = data["log_rotation"];
+			g_log_rotation_enabled = rotation.contains("enabled") ? rotation["enabled"].template get<bool>() : true;
+			if (rotation.contains("max_size")) { g_log_rotation_config.max_size = rotation["max_size"].template get<uint64_t>(); }
+			if (rotation.contains("max_files")) { g_log_rotation_config.max_files = rotation["max_files"].template get<size_t>(); }
+			if (rotation.contains("compress")) { g_log_rotation_config.compress = rotation["compress"].template get<bool>(); }
+			if (rotation.contains("keep_sessions")) { g_log_rotation_config.keep_sessions = rotation["keep_sessions"].template get<size_t>(); }
+			if (g_log_rotation_config.max_size == 0) { throw std::runtime_error("log_rotation: max_size must be nonzero"); }
+		}
+		if (data.contains("log_dedup")) {
+			auto& dedup = data["log_dedup"];
+			g_log_dedup_enabled = dedup.contains("enabled") ? dedup["enabled"].template get<bool>() : true;
+			if (dedup.contains("interval_ms")) { g_log_dedup_config.interval_ms = dedup["interval_ms"].template get<uint64_t>(); }
+			if (dedup.contains("table_size")) { g_log_dedup_config.table_size = dedup["table_size"].template get<size_t>(); }
+			if (dedup.contains("max_probes")) { g_log_dedup_config.max_probes = dedup["max_probes"].template get<size_t>(); }
+		}
+		if (data.contains("latency_probe")) {
+			auto& probe = data["latency_probe"];
+			g_latency_probe_enabled = probe.contains("enabled") ? probe["enabled"].template get<bool>() : true;
+			if (probe.contains("output_device")) { g_latency_probe_config.output_device = probe["output_device"].template get<UINT>(); }
+			if (probe.contains("input_device")) { g_latency_probe_config.input_device = probe["input_device"].template get<UINT>(); }
+			if (probe.contains("interval_ms")) { g_latency_probe_config.interval_ms = probe["interval_ms"].template get<uint64_t>(); }
+			if (probe.contains("channel")) {
+				auto channel = probe["channel"].template get<size_t>();
+				if (channel < 1 || channel > 16) { throw std::runtime_error("latency_probe: channel must be 1-16"); }
+				g_latency_probe_config.channel = (uint8_t)(channel - 1);
+			}
+			if (probe.contains("controller")) {
+				auto controller = probe["controller"].template get<size_t>();
+				if (controller >= 120) { throw std::runtime_error("latency_probe: controller must be 0-119"); }
+				g_latency_probe_config.controller = (uint8_t)controller;
+			}
+		}
+		if (data.contains("shared_outputs")) {
+			auto& shared = data["shared_outputs"];
+			g_shared_outputs_enabled = shared.contains("enabled") ? shared["enabled"].template get<bool>() : true;
+			if (shared.contains("linger_ms")) { g_shared_outputs_config.linger_ms = shared["linger_ms"].template get<uint64_t>(); }
+			if (shared.contains("devices")) { g_shared_outputs_config.maybe_devices = shared["devices"].template get<std::vector<UINT>>(); }
+		}
+		if (data.contains("wave_stats")) {
+			auto& wave = data["wave_stats"];
+			g_wave_stats_enabled = wave.contains("enabled") ? wave["enabled"].template get<bool>() : true;
+			if (wave.contains("shared_memory_name")) { g_wave_stats_config.maybe_shared_memory_name = stringToWstring(wave["shared_memory_name"].template get<std::string>()); }
+		}
+		if (data.contains("wave_rechunk")) {
+			auto& rechunk = data["wave_rechunk"];
+			g_wave_rechunk_enabled = rechunk.contains("enabled") ? rechunk["enabled"].template get<bool>() : true;
+			if (rechunk.contains("chunk_ms")) { g_wave_rechunk_config.chunk_ms = rechunk["chunk_ms"].template get<uint64_t>(); }
+			if (rechunk.contains("queue_depth")) {
+				g_wave_rechunk_config.queue_depth = rechunk["queue_depth"].template get<size_t>();
+				if (g_wave_rechunk_config.queue_depth < 2) { throw std::runtime_error("wave_rechunk: queue_depth must be at least 2"); }
+			}
+		}
+		if (data.contains("timer_period")) {
+			auto& period = data["timer_period"];
+			g_timer_period_enabled = period.contains("enabled") ? period["enabled"].template get<bool>() : true;
+			if (period.contains("min_period_ms")) {
+				g_timer_period_config.min_period = period["min_period_ms"].template get<UINT>();
+				if (g_timer_period_config.min_period == 0) { throw std::runtime_error("timer_period: min_period_ms must be at least 1"); }
+			}
+		}
+		if (data.contains("timer_wheel")) {
+			auto& wheel = data["timer_wheel"];
+			g_timer_wheel_enabled = wheel.contains("enabled") ? wheel["enabled"].template get<bool>() : true;
+		}
+		if (data.contains("mixer_cache")) {
+			auto& mixer = data["mixer_cache"];
+			g_mixer_cache_enabled = mixer.contains("enabled") ? mixer["enabled"].template get<bool>() : true;
+			if (mixer.contains("details_ttl_ms")) { g_mixer_cache_config.details_ttl_ms = mixer["details_ttl_ms"].template get<uint64_t>(); }
+			if (mixer.contains("notifications")) { g_mixer_cache_config.notifications = mixer["notifications"].template get<bool>(); }
+		}
+		if (data.contains("input_dispatch")) {
+			auto& dispatch = data["input_dispatch"];
+			g_input_dispatch_enabled = dispatch.contains("enabled") ? dispatch["enabled"].template get<bool>() : true;
+			if (dispatch.contains("capacity")) {
+				g_input_dispatch_config.capacity = dispatch["capacity"].template get<size_t>();
+				if (!std::has_single_bit(g_input_dispatch_config.capacity)) { throw std::runtime_error("input_dispatch: capacity must be a power of two"); }
+			}
+			if (dispatch.contains("overflow")) {
+				auto overflow = dispatch["overflow"].template get<std::string>();
+				if (overflow == "block") { g_input_dispatch_config.overflow = input_overflow::Block; }
+				else if (overflow == "drop_newest") { g_input_dispatch_config.overflow = input_overflow::DropNewest; }
+				else if (overflow == "drop_oldest") { g_input_dispatch_config.overflow = input_overflow::DropOldest; }
+				else { throw std::runtime_error("input_dispatch: overflow must be block, drop_newest or drop_oldest"); }
+			}
+		}
+		if (data.contains("sysex_rewrite")) {
+			auto& rewrite = data["sysex_rewrite"];
+			g_sysex_rewrite_enabled = rewrite.contains("enabled") ? rewrite["enabled"].template get<bool>() : true;
+			if (rewrite.contains("rules")) {
+				for (auto& r : rewrite["rules"]) {
+					sysex_rewrite_rule rule;
+					rule.match = parse_sysex_pattern(r["match"].template get<std::string>());
+					rule.replace = parse_sysex_pattern(r["replace"].template get<std::string>());
+					if (r.contains("direction")) {
+						auto direction = r["direction"].template get<std::string>();
+						if (direction == "in") { rule.output = false; }
+						else if (direction == "out") { rule.input = false; }
+						else { throw std::runtime_error("sysex_rewrite: direction must be in or out"); }
 					}
-					if (rule.contains("replace_name")) { rval.maybe_replace_name = stringToWstring(rule["replace_name"].template get<std::string>()); }
-					if (rule.contains("replace_man_id")) { rval.maybe_replace_man_id = rule["replace_man_id"].template get<size_t>(); }
-					if (rule.contains("replace_prod_id")) { rval.maybe_replace_prod_id = rule["replace_prod_id"].template get<size_t>(); }
-					if (rule.contains("replace_driver_version")) { rval.maybe_replace_driver_version = rule["replace_driver_version"].template get<size_t>(); }
-					if (rule.contains("replace_technology")) { rval.maybe_replace_technology = rule["replace_technology"].template get<size_t>(); }
-					if (rule.contains("replace_voices")) { rval.maybe_replace_voices = rule["replace_voices"].template get<size_t>(); }
-					if (rule.contains("replace_notes")) { rval.maybe_replace_notes = rule["replace_notes"].template get<size_t>(); }
-					if (rule.contains("replace_channel_mask")) { rval.maybe_replace_channel_mask = rule["replace_channel_mask"].template get<size_t>(); }
-					if (rule.contains("replace_support")) { rval.maybe_replace_support = rule["replace_support"].template get<size_t>(); }
-					if (rule.contains("replace_interface_name")) { rval.maybe_replace_interface_name = stringToWstring(rule["replace_interface_name"].template get<std::string>()); }
-
-					if (!rval.maybe_replace_name.has_value() &&
-						!rval.maybe_replace_driver_version.has_value() &&
-						!rval.maybe_replace_man_id.has_value() &&
-						!rval.maybe_replace_prod_id.has_value() &&
-						!rval.maybe_replace_technology.has_value() &&
-						!rval.maybe_replace_voices.has_value() &&
-						!rval.maybe_replace_notes.has_value() &&
-						!rval.maybe_replace_channel_mask.has_value() &&
-						!rval.maybe_replace_support.has_value() &&
-						!rval.maybe_replace_interface_name.has_value()) {
-						throw std::runtime_error("No replace items set for rule, would not affect anything.");
+					if (r.contains("checksum")) {
+						auto checksum = r["checksum"].template get<std::string>();
+						if (checksum == "roland") { rule.checksum = sysex_checksum::Roland; }
+						else if (checksum != "none") { throw std::runtime_error("sysex_rewrite: checksum must be roland or none"); }
 					}
-
-					g_replace_rules.push_back(rval);
+					if (r.contains("checksum_start")) { rule.checksum_start = r["checksum_start"].template get<size_t>(); }
+					g_sysex_rewriter.add(rule);
 				}
-				catch (std::exception& e) {
-					log << L"Skipping rule:\n" << stringToWstring(std::string(e.what())) << "\n";
+			}
+			g_sysex_rewriter.build();
+		}
+		if (data.contains("identity_responder")) {
+			auto& responder = data["identity_responder"];
+			g_identity_responder_enabled = responder.contains("enabled") ? responder["enabled"].template get<bool>() : true;
+			g_identity_responder_config.output_device = responder["output_device"].template get<UINT>();
+			g_identity_responder_config.input_device = responder["input_device"].template get<UINT>();
+			if (responder.contains("reply")) {
+				auto reply = parse_sysex_pattern(responder["reply"].template get<std::string>());
+				g_identity_responder_config.reply.assign(reply.begin(), reply.end());
+				if (std::find(reply.begin(), reply.end(), -1) != reply.end() ||
+					!identity_responder::is_reply(g_identity_responder_config.reply.data(), g_identity_responder_config.reply.size())) {
+					throw std::runtime_error("identity_responder: reply must be an identity reply, F0 7E <device> 06 02 ... F7");
 				}
-				catch (...) {
-					log << L"Skipping rule (unknown exception)\n";
+			}
+			if (responder.contains("cache_file")) { g_identity_responder_config.maybe_cache_file = responder["cache_file"].template get<std::string>(); }
+			g_identity_responder.load(g_identity_responder_config);
+		}
+		if (data.contains("clock_engine")) {
+			auto& clock = data["clock_engine"];
+			g_clock_engine_enabled = clock.contains("enabled") ? clock["enabled"].template get<bool>() : true;
+			g_clock_engine_config.output_device = clock["output_device"].template get<UINT>();
+			if (clock.contains("bandwidth_hz")) {
+				g_clock_engine_config.bandwidth_hz = clock["bandwidth_hz"].template get<double>();
+				if (!(g_clock_engine_config.bandwidth_hz > 0)) { throw std::runtime_error("clock_engine: bandwidth_hz must be positive"); }
+			}
+			if (clock.contains("max_lead")) { g_clock_engine_config.max_lead = clock["max_lead"].template get<uint64_t>(); }
+			if (clock.contains("spin_us")) { g_clock_engine_config.spin_us = clock["spin_us"].template get<uint64_t>(); }
+		}
+		if (data.contains("stream_engine")) {
+			auto& engine = data["stream_engine"];
+			g_stream_engine_enabled = engine.contains("enabled") ? engine["enabled"].template get<bool>() : true;
+			if (engine.contains("spin_us")) { g_stream_engine_config.spin_us = engine["spin_us"].template get<uint64_t>(); }
+		}
+		if (data.contains("stats")) {
+			auto& stats = data["stats"];
+			g_stats_enabled = stats.contains("enabled") ? stats["enabled"].template get<bool>() : true;
+			if (stats.contains("file")) { g_stats_config.maybe_output_file = stats["file"].template get<std::string>(); }
+			if (stats.contains("baseline")) { g_stats_config.maybe_baseline_file = stats["baseline"].template get<std::string>(); }
+			if (stats.contains("regression_threshold")) { g_stats_config.regression_threshold = stats["regression_threshold"].template get<double>(); }
+		}
+		if (data.contains("scheduler")) {
+			auto& scheduler = data["scheduler"];
+			g_scheduler_enabled = scheduler.contains("enabled") ? scheduler["enabled"].template get<bool>() : true;
+			if (scheduler.contains("delay_us")) { g_scheduler_config.delay_us = scheduler["delay_us"].template get<uint64_t>(); }
+			if (scheduler.contains("spin_us")) { g_scheduler_config.spin_us = scheduler["spin_us"].template get<uint64_t>(); }
+		}
+		if (data.contains("output_filter")) {
+			auto& filter = data["output_filter"];
+			g_output_filter_enabled = filter.contains("enabled") ? filter["enabled"].template get<bool>() : true;
+			if (filter.contains("controllers")) { g_output_filter_config.controllers = filter["controllers"].template get<bool>(); }
+			if (filter.contains("pitch_bend")) { g_output_filter_config.pitch_bend = filter["pitch_bend"].template get<bool>(); }
+			if (filter.contains("channel_pressure")) { g_output_filter_config.channel_pressure = filter["channel_pressure"].template get<bool>(); }
+			if (filter.contains("program")) { g_output_filter_config.program = filter["program"].template get<bool>(); }
+			if (filter.contains("rate_limit_us")) { g_output_filter_config.rate_limit_interval_us = filter["rate_limit_us"].template get<uint64_t>(); }
+			if (filter.contains("rate_limit_controllers")) {
+				for (auto& c : filter["rate_limit_controllers"]) {
+					auto controller = c.template get<size_t>();
+					if (controller >= 128) { throw std::runtime_error("Invalid controller number in rate_limit_controllers: " + std::to_string(controller)); }
+					g_output_filter_config.rate_limited_controllers[controller] = true;
 				}
 			}
 		}
+		if (data.contains("note_tracker")) {
+			auto& tracker = data["note_tracker"];
+			g_note_tracker_enabled = tracker.contains("enabled") ? tracker["enabled"].template get<bool>() : true;
+			if (tracker.contains("replace_reset_sweep")) { g_note_tracker_config.replace_reset_sweep = tracker["replace_reset_sweep"].template get<bool>(); }
+			if (tracker.contains("notes_off_on_close")) { g_note_tracker_config.notes_off_on_close = tracker["notes_off_on_close"].template get<bool>(); }
+			if (tracker.contains("notes_off_on_exit")) { g_note_tracker_config.notes_off_on_exit = tracker["notes_off_on_exit"].template get<bool>(); }
+		}
+		if (data.contains("input_pool")) {
+			auto& pool = data["input_pool"];
+			g_input_pool_enabled = pool.contains("enabled") ? pool["enabled"].template get<bool>() : true;
+			if (pool.contains("buffers")) { g_input_pool_config.buffers = pool["buffers"].template get<size_t>(); }
+			if (pool.contains("buffer_size")) { g_input_pool_config.buffer_size = pool["buffer_size"].template get<size_t>(); }
+			if (pool.contains("arena_size")) { g_input_pool_config.arena_size = pool["arena_size"].template get<size_t>(); }
+			if (pool.contains("max_pending")) { g_input_pool_config.max_pending = pool["max_pending"].template get<size_t>(); }
+			if (g_input_pool_config.buffers == 0 || g_input_pool_config.buffer_size == 0 || g_input_pool_config.max_pending == 0) {
+				throw std::runtime_error("input_pool: buffers, buffer_size and max_pending must be nonzero");
+			}
+		}
+		if (data.contains("evaluate")) {
+			log << L"The \"evaluate\" section is only used by RuleEval.exe, see the README.\n";
+		}
+		if (data.contains("regex_compilation")) {
+			auto& compilation = data["regex_compilation"];
+			if (compilation.contains("eager")) { g_regex_compilation_config.eager = compilation["eager"].template get<bool>(); }
+			if (compilation.contains("threads")) { g_regex_compilation_config.threads = compilation["threads"].template get<size_t>(); }
+		}
+		if (data.contains("rules")) {
+			parse_rules(data["rules"], log);
+		}
 	}
 	catch (std::exception& e) {
 		log << L"Unable to load config from " << stringToWstring(filename) << L".Continuing without replace rules.Exception:\n" << e.what() << L"\n";
@@ -355,6 +383,64 @@ bool load_config(
 	return true;
 }
 
+void write_stats() {
+	if (!g_stats_enabled) { return; }
+	try {
+		json current = stats_to_json(g_replace_rules.size(), g_maybe_wrapper_log_file != NULL);
+		if (g_output_scheduler.used()) { current["scheduler"] = g_output_scheduler.stats_json(); }
+		if (g_output_filter_enabled) { current["output_filter"] = output_filter_stats_json(); }
+		if (g_note_tracker_enabled) { current["note_tracker"] = note_tracker_stats_json(); }
+		if (g_input_pool_enabled) { current["input_pool"] = input_pool_stats_json(); }
+		if (g_input_dispatch_enabled) { current["input_dispatch"] = input_dispatch_stats_json(); }
+		if (g_log_dedup_enabled) { current["log_dedup"] = log_dedup_stats_json(); }
+		if (g_latency_probe.started()) { current["latency_probe"] = g_latency_probe.stats_json(); }
+		if (g_stream_engine_enabled) { current["stream_engine"] = stream_engine_stats_json(); }
+		if (g_shared_outputs_enabled) { current["shared_outputs"] = shared_outputs_stats_json(); }
+		if (g_wave_stats_enabled) {
+			current["wave_out"] = g_wave_stats.stats_json();
+			current["wave_out"]["shared_memory"] = wstringToString(g_wave_stats.shared_memory_name());
+		}
+		if (g_wave_rechunk_enabled) { current["wave_rechunk"] = wave_rechunk_stats_json(); }
+		current["timer_period"] = g_timer_periods.stats_json();
+		current["name_patterns"] = {
+			{ "patterns", g_replace_rules.name_patterns() },
+			{ "compiled_lazily", g_name_patterns_compiled_lazily.load() },
+			{ "compiled_eagerly", g_name_patterns_compiled_eagerly.load() },
+			{ "invalid", g_name_patterns_invalid.load() },
+			{ "compiled_narrow", g_name_patterns_compiled_narrow.load() },
+			{ "compile_ms", ticks_to_ns(g_name_pattern_compile_ticks.load()) / 1000000.0 },
+			{ "narrow_name_checks", g_name_checks_narrow.load() },
+			{ "transcoded_name_checks", g_name_checks_transcoded.load() }
+		};
+		if (g_timer_wheel_enabled) { current["timer_wheel"] = g_timer_wheel.stats_json(); }
+		if (g_mixer_cache_enabled) { current["mixer_cache"] = g_mixer_cache.stats_json(); }
+		if (g_sysex_rewrite_enabled) { current["sysex_rewrite"] = sysex_rewrite_stats_json(); }
+		if (g_identity_responder_enabled) { current["identity_responder"] = identity_responder_stats_json(); }
+		if (g_clock_engine_enabled) { current["clock_engine"] = clock_engine_stats_json(); }
+		current["handle_table"] = g_handle_devices.stats_json();
+		if (g_stats_config.maybe_baseline_file.has_value()) {
+			json baseline = json::parse(read_whole_file(g_stats_config.maybe_baseline_file.value(), nullptr));
+			auto regressions = compare_stats_to_baseline(current, baseline, g_stats_config.regression_threshold);
+			current["baseline"] = g_stats_config.maybe_baseline_file.value();
+			current["regressions"] = regressions;
+			for (auto const& r : regressions) {
+				wrapper_log(nullptr, L"Stats: overhead regression against baseline: %ls\n", stringToWstring(r).c_str());
+			}
+		}
+		if (g_stats_config.maybe_output_file.has_value()) {
+			FILE* f = fopen(g_stats_config.maybe_output_file.value().c_str(), "w");
+			if (f) {
+				fputs(current.dump(2).c_str(), f);
+				fclose(f);
+			}
+		}
+		wrapper_log(nullptr, L"Stats: %ls\n", stringToWstring(current.dump()).c_str());
+	}
+	catch (std::exception& e) {
+		wrapper_log(nullptr, L"Unable to write stats: %ls\n", stringToWstring(e.what()).c_str());
+	}
+}
+
 std::wstring last_error_string()
 {
 	//Get the error message ID, if any.
@@ -394,7 +480,12 @@ void configure() {
 			try_config_file = std::string(maybe_env);
 		}
 		if (try_config_file.length() > 0) {
+			uint64_t start = qpc_now();
 			success = success && load_config(try_config_file, maybe_logfilename, maybe_configabspath, debug_popup, debug_popup_verbose, config_log);
+			config_log << L"Config loaded in " << (uint64_t)ticks_to_ns(qpc_now() - start) / 1000 << L" us\n";
+			if (g_log_dedup_enabled) { g_log_dedup.init(g_log_dedup_config); }
+			if (g_wave_stats_enabled) { g_wave_stats.init(g_wave_stats_config); }
+			if (g_regex_compilation_config.eager) { g_replace_rules.compile_all_async(g_regex_compilation_config.threads); }
 		}
 
 		// Log filename override
@@ -408,6 +499,10 @@ void configure() {
 		// Open the logfile for writing
 		if (maybe_logfilename.has_value()) {
 		    wrapper_log(&pre_popup_log, L"Opening log file: %s\n", stringToWstring(maybe_logfilename.value()).c_str());
+			if (g_log_rotation_enabled) {
+				prepare_log_sessions(maybe_logfilename.value(), g_log_rotation_config);
+				g_log_rotator.start(maybe_logfilename.value(), g_log_rotation_config);
+			}
 			g_maybe_wrapper_log_file = fopen(maybe_logfilename.value().c_str(), "w");
 			if (!g_maybe_wrapper_log_file) {
 				wrapper_log(&pre_popup_log, L"Error: Unable to open log file (%s)!\n", strerror(errno));
@@ -451,6 +546,9 @@ void configure() {
 		else {
 			msg += L"Config not found!\n";
 		}
+		if (g_maybe_active_profile.has_value()) {
+			msg += L"Profile: " + stringToWstring(g_maybe_active_profile.value()) + L"\n";
+		}
 		msg += L"# of rules loaded: " + std::to_wstring(g_replace_rules.size()) + L"\n";
 
 		if (debug_popup_verbose) {
@@ -466,11 +564,14 @@ void configure() {
 	}
 }
 
+void silence_all_outputs();
+
 BOOL DllMain(HINSTANCE hInstDLL, DWORD fdwReason, LPVOID fImpLoad) {
 	switch (fdwReason) {
 
 	case DLL_PROCESS_ATTACH:
 	{
+		init_stats();
 		configure();
 
 		if (InitializeWinMM())
@@ -481,7 +582,35 @@ BOOL DllMain(HINSTANCE hInstDLL, DWORD fdwReason, LPVOID fImpLoad) {
 
 	case DLL_PROCESS_DETACH:
 	{
+		g_output_scheduler.stop();
+		g_latency_probe.stop();
+		g_shared_outputs.stop();
+		g_timer_wheel.stop();
+		g_mixer_cache.stop();
+		g_identity_responder.stop();
+		g_replace_rules.stop_compiling();
+		g_midi_out_handles.for_each([](HMIDIOUT, midi_out_handle_state& state) {
+			if (state.clock) { state.clock->stop(); }
+		});
+		if (g_note_tracker_enabled && g_note_tracker_config.notes_off_on_exit) {
+			silence_all_outputs();
+		}
+		if (g_log_dedup_enabled) {
+			if (uint64_t repeats = g_log_dedup.take_unreported()) {
+				wrapper_log(nullptr, L"\n(%llu repeated query log entries were suppressed after they were last logged)\n", (unsigned long long)repeats);
+			}
+		}
+		write_stats();
+		g_identity_responder.save();
+		for (auto const& r : g_timer_periods.release_all()) {
+			wrapper_log(nullptr, L"Timer period: released %llu unbalanced timeBeginPeriod(%u) of %ls\n",
+				(unsigned long long)r.count, r.period, timer_period_arbiter::caller_name(r).c_str());
+		}
+		AcquireSRWLockExclusive(&g_log_lock);
+		g_log_rotator.stop();
 		if (g_maybe_wrapper_log_file) { fclose(g_maybe_wrapper_log_file); }
+		g_maybe_wrapper_log_file = NULL;
+		ReleaseSRWLockExclusive(&g_log_lock);
 
 		return TRUE;
 	}
@@ -492,158 +621,713 @@ BOOL DllMain(HINSTANCE hInstDLL, DWORD fdwReason, LPVOID fImpLoad) {
 }
 
 MMRESULT WINAPI OVERRIDE_midiOutGetDevCapsA(UINT_PTR deviceId, LPMIDIOUTCAPSA pmoc, UINT cpmoc) {
-	MMRESULT rval = MMmidiOutGetDevCapsA(deviceId, pmoc, cpmoc);
-	wrapper_log(nullptr, L"\nRequest for output device capabilities:\n  %s\n", stringify_caps(*pmoc).c_str());
-	for (auto const& rule : g_replace_rules) {
-		if (rule.apply_in_place_c(*pmoc)) {
-			wrapper_log(nullptr, L"--> Matched a replace rule. Returning: %s\n", stringify_caps(*pmoc).c_str());
-		}
-	}
+	stats_timer timer(StatsEntry::midiOutGetDevCapsA);
+	deviceId = (UINT_PTR)native_midi_out((HMIDIOUT)deviceId);
+	MMRESULT rval = timer.native([&] { return MMmidiOutGetDevCapsA(deviceId, pmoc, cpmoc); });
+	bool log = should_log_query(StatsEntry::midiOutGetDevCapsA, log_dedup::key_builder().add(deviceId).add(rval).add(*pmoc));
+	if (log) { wrapper_log(nullptr, L"\nRequest for output device capabilities:\n  %s\n", stringify_caps(*pmoc).c_str()); }
+	g_replace_rules.apply_in_place_c(*pmoc, [&] {
+		if (log) { wrapper_log(nullptr, L"--> Matched a replace rule. Returning: %s\n", stringify_caps(*pmoc).c_str()); }
+	});
 	return rval;
 }
 
 MMRESULT WINAPI OVERRIDE_midiOutGetDevCapsW(UINT_PTR deviceId, LPMIDIOUTCAPSW pmoc, UINT cpmoc) {
-	MMRESULT rval = MMmidiOutGetDevCapsW(deviceId, pmoc, cpmoc);
-	wrapper_log(nullptr, L"\nRequest for output device capabilities:\n  %s\n", stringify_caps(*pmoc).c_str());
-	for (auto const& rule : g_replace_rules) {
-		if (rule.apply_in_place_c(*pmoc)) {
-			wrapper_log(nullptr, L"--> Matched a replace rule. Returning: %s\n", stringify_caps(*pmoc).c_str());
-		}
-	}
+	stats_timer timer(StatsEntry::midiOutGetDevCapsW);
+	deviceId = (UINT_PTR)native_midi_out((HMIDIOUT)deviceId);
+	MMRESULT rval = timer.native([&] { return MMmidiOutGetDevCapsW(deviceId, pmoc, cpmoc); });
+	bool log = should_log_query(StatsEntry::midiOutGetDevCapsW, log_dedup::key_builder().add(deviceId).add(rval).add(*pmoc));
+	if (log) { wrapper_log(nullptr, L"\nRequest for output device capabilities:\n  %s\n", stringify_caps(*pmoc).c_str()); }
+	g_replace_rules.apply_in_place_c(*pmoc, [&] {
+		if (log) { wrapper_log(nullptr, L"--> Matched a replace rule. Returning: %s\n", stringify_caps(*pmoc).c_str()); }
+	});
 	return rval;
 }
 
 MMRESULT WINAPI OVERRIDE_midiInGetDevCapsA(UINT_PTR deviceId, LPMIDIINCAPSA pmoc, UINT cpmoc) {
-	MMRESULT rval = MMmidiInGetDevCapsA(deviceId, pmoc, cpmoc);
-	wrapper_log(nullptr, L"\nRequest for input device capabilities: %s\n", stringify_caps(*pmoc).c_str());
-	for (auto const& rule : g_replace_rules) {
-		if (rule.apply_in_place_c(*pmoc)) {
-			wrapper_log(nullptr, L"--> Matched a replace rule. Returning: %s\n", stringify_caps(*pmoc).c_str());
+	stats_timer timer(StatsEntry::midiInGetDevCapsA);
+	MMRESULT rval = timer.native([&] { return MMmidiInGetDevCapsA(deviceId, pmoc, cpmoc); });
+	bool log = should_log_query(StatsEntry::midiInGetDevCapsA, log_dedup::key_builder().add(deviceId).add(rval).add(*pmoc));
+	if (log) { wrapper_log(nullptr, L"\nRequest for input device capabilities: %s\n", stringify_caps(*pmoc).c_str()); }
+	g_replace_rules.apply_in_place_c(*pmoc, [&] {
+		if (log) { wrapper_log(nullptr, L"--> Matched a replace rule. Returning: %s\n", stringify_caps(*pmoc).c_str()); }
+	});
+	return rval;
+}
+
+MMRESULT WINAPI OVERRIDE_midiInGetDevCapsW(UINT_PTR deviceId, LPMIDIINCAPSW pmoc, UINT cpmoc) {
+	stats_timer timer(StatsEntry::midiInGetDevCapsW);
+	MMRESULT rval = timer.native([&] { return MMmidiInGetDevCapsW(deviceId, pmoc, cpmoc); });
+	bool log = should_log_query(StatsEntry::midiInGetDevCapsW, log_dedup::key_builder().add(deviceId).add(rval).add(*pmoc));
+	if (log) { wrapper_log(nullptr, L"\nRequest for input device capabilities: %s\n", stringify_caps(*pmoc).c_str()); }
+	g_replace_rules.apply_in_place_c(*pmoc, [&] {
+		if (log) { wrapper_log(nullptr, L"--> Matched a replace rule. Returning: %s\n", stringify_caps(*pmoc).c_str()); }
+	});
+	return rval;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutOpen(
+	_Out_ LPHMIDIOUT phmo,
+	_In_ UINT uDeviceID,
+	_In_opt_ DWORD_PTR dwCallback,
+	_In_opt_ DWORD_PTR dwInstance,
+	_In_ DWORD fdwOpen
+) {
+	MMRESULT rval;
+	if (g_shared_outputs_enabled && phmo && g_shared_outputs.shares(uDeviceID)) {
+		rval = g_shared_outputs.open(phmo, uDeviceID, { dwCallback, dwInstance, fdwOpen & CALLBACK_TYPEMASK }, fdwOpen);
+	}
+	else {
+		rval = MMmidiOutOpen(phmo, uDeviceID, dwCallback, dwInstance, fdwOpen);
+		if (rval == MMSYSERR_NOERROR && phmo) {
+			if (uDeviceID != MIDI_MAPPER) { g_handle_devices.add(*phmo, true, uDeviceID); }
+			auto state = std::make_unique<midi_out_handle_state>();
+			state->device_id = uDeviceID;
+			state->app = { dwCallback, dwInstance, fdwOpen & CALLBACK_TYPEMASK };
+			g_midi_out_handles.add(*phmo, std::move(state));
 		}
 	}
+	if (rval == MMSYSERR_NOERROR && phmo && g_latency_probe_enabled && uDeviceID == g_latency_probe_config.output_device) {
+		g_latency_probe.output_opened(native_midi_out(*phmo));
+	}
 	return rval;
 }
 
-MMRESULT WINAPI OVERRIDE_midiInGetDevCapsW(UINT_PTR deviceId, LPMIDIINCAPSW pmoc, UINT cpmoc) {
-	MMRESULT rval = MMmidiInGetDevCapsW(deviceId, pmoc, cpmoc);
-	wrapper_log(nullptr, L"\nRequest for input device capabilities: %s\n", stringify_caps(*pmoc).c_str());
-	for (auto const& rule : g_replace_rules) {
-		if (rule.apply_in_place_c(*pmoc)) {
-			wrapper_log(nullptr, L"--> Matched a replace rule. Returning: %s\n", stringify_caps(*pmoc).c_str());
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutPrepareHeader(
+	_In_ HMIDIOUT hmo,
+	_Inout_updates_bytes_(cbmh) LPMIDIHDR pmh,
+	_In_ UINT cbmh
+) {
+	return MMmidiOutPrepareHeader(native_midi_out(hmo), pmh, cbmh);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutUnprepareHeader(
+	_In_ HMIDIOUT hmo,
+	_Inout_updates_bytes_(cbmh) LPMIDIHDR pmh,
+	_In_ UINT cbmh
+) {
+	// Also covers messages still waiting in the scheduler, which the driver doesn't know of
+	if (pmh && (pmh->dwFlags & MHDR_INQUEUE)) { return MIDIERR_STILLPLAYING; }
+	MMRESULT rval = MMmidiOutUnprepareHeader(native_midi_out(hmo), pmh, cbmh);
+	if ((g_note_tracker_enabled || g_shared_outputs_enabled) && rval == MMSYSERR_NOERROR) {
+		if (auto state = g_midi_out_handles.find(hmo)) {
+			AcquireSRWLockExclusive(&state->lock);
+			std::erase(state->long_in_flight, pmh);
+			ReleaseSRWLockExclusive(&state->lock);
 		}
 	}
 	return rval;
 }
 
-std::optional<std::wstring> get_maybe_interface_name_override(Direction devDirection, UINT_PTR deviceId) {
-	std::optional<std::wstring> rval;
-	if (devDirection == Direction::Input) {
-		MIDIINCAPSW pmoc;
-		MMmidiInGetDevCapsW(deviceId, &pmoc, sizeof(pmoc));
-		auto ours = to_our_dev_caps(pmoc);
-		wrapper_log(nullptr, L"--> Transparently queried the device #%u properties for interface query. Found device:\n%ls", (unsigned)deviceId, stringify_caps(pmoc).c_str());
-		for (auto &rule : g_replace_rules) {
-			if (rule.is_match(ours)) {
-				rval = rule.maybe_replace_interface_name;
-				break;
-			}
+// Sends note-offs for the notes sounding on a handle. Returns whether the native reset can
+// be skipped, which is the case if no long message is still queued in the driver.
+bool silence_output(HMIDIOUT hmo, midi_out_handle_state& state) {
+	AcquireSRWLockExclusive(&state.lock);
+	uint64_t sent = state.notes.silence(state.shared ? state.shared->native : hmo);
+	bool long_pending = std::any_of(state.long_in_flight.begin(), state.long_in_flight.end(),
+		[](LPMIDIHDR pmh) { return !(pmh->dwFlags & MHDR_DONE); });
+	ReleaseSRWLockExclusive(&state.lock);
+	g_note_tracker_note_offs_sent.fetch_add(sent, std::memory_order_relaxed);
+	return !long_pending;
+}
+
+void silence_all_outputs() {
+	g_midi_out_handles.for_each([](HMIDIOUT hmo, midi_out_handle_state& state) {
+		silence_output(hmo, state);
+	});
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutReset(
+	_In_ HMIDIOUT hmo
+) {
+	if (auto stream = g_midi_streams.find((HMIDISTRM)hmo)) {
+		// On a stream handle, a reset also stops the stream and returns its buffers
+		stream->stop();
+		return MMmidiOutReset(hmo);
+	}
+	if (g_output_scheduler.started()) { g_output_scheduler.flush_handle(hmo); }
+	reset_output_filter(hmo);
+	auto state = g_midi_out_handles.find(hmo);
+	if (state && state->shared) {
+		if (!g_shared_outputs.sole_user(*state)) {
+			// A native reset would cut off the other users of the device too, so only the notes
+			// of this handle are silenced. Its long messages complete as usual.
+			silence_output(hmo, *state);
+			return MMSYSERR_NOERROR;
+		}
+		if (!g_note_tracker_enabled) {
+			AcquireSRWLockExclusive(&state->lock);
+			state->notes = note_tracker{};
+			ReleaseSRWLockExclusive(&state->lock);
 		}
-	} else {
-		MIDIOUTCAPSW pmoc;
-		MMmidiOutGetDevCapsW(deviceId, &pmoc, sizeof(pmoc));
-		auto ours = to_our_dev_caps(pmoc);
-		wrapper_log(nullptr, L"--> Transparently queried the device #%u properties for interface query. Found device:\n%ls", (unsigned)deviceId, stringify_caps(pmoc).c_str());
-		for (auto &rule : g_replace_rules) {
-			if (rule.is_match(ours)) {
-				rval = rule.maybe_replace_interface_name;
-				break;
+	}
+	if (g_note_tracker_enabled) {
+		if (state) {
+			g_note_tracker_resets.fetch_add(1, std::memory_order_relaxed);
+			if (!g_note_tracker_config.replace_reset_sweep) {
+				AcquireSRWLockExclusive(&state->lock);
+				state->notes = note_tracker{};
+				ReleaseSRWLockExclusive(&state->lock);
+			}
+			else if (silence_output(hmo, *state)) {
+				g_note_tracker_native_resets_skipped.fetch_add(1, std::memory_order_relaxed);
+				return MMSYSERR_NOERROR;
 			}
 		}
 	}
-	return rval;
+	return MMmidiOutReset(native_midi_out(hmo));
 }
 
-template<typename HM>
-MMRESULT handle_QUERYDEVICEINTERFACESIZE(Direction devDirection, HM hm, DWORD_PTR dw1, DWORD_PTR dw2) {
-	ULONG sz;
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutClose(
+	_In_ HMIDIOUT hmo
+) {
+	if (g_output_scheduler.started()) { g_output_scheduler.flush_handle(hmo); }
+	auto state = g_midi_out_handles.find(hmo);
+	if (g_note_tracker_enabled && g_note_tracker_config.notes_off_on_close && state) {
+		silence_output(hmo, *state);
+	}
+	// The probe stops using the handle before it is closed, and gets it back if that fails
+	HMIDIOUT probed = NULL;
+	if (g_latency_probe_enabled && state && state->device_id == g_latency_probe_config.output_device) {
+		probed = state->shared ? state->shared->native : hmo;
+		g_latency_probe.output_closed(probed);
+	}
+	// The clock engine outlives the state if the close succeeds, and is given back otherwise
+	std::unique_ptr<clock_engine> clock;
+	if (state) {
+		AcquireSRWLockExclusive(&state->lock);
+		clock = std::move(state->clock);
+		ReleaseSRWLockExclusive(&state->lock);
+	}
+	if (clock) { clock->closing(); }
 	MMRESULT rval;
-	rval = devDirection == Direction::Input ?
-		   MMmidiInMessage((HMIDIIN)hm, DRV_QUERYDEVICEINTERFACESIZE, reinterpret_cast<DWORD_PTR>(&sz), 0) :
-		   MMmidiOutMessage((HMIDIOUT)hm, DRV_QUERYDEVICEINTERFACESIZE, reinterpret_cast<DWORD_PTR>(&sz), 0);
-	wrapper_log(nullptr, L"Handle query for device interface size for %s. Return code: %u (is error: %u). Native reported size: %d\n",
-	                      (devDirection == Direction::Input ? L"input" : L"output"),
-						  (unsigned) rval,
-						  (rval == MMSYSERR_NOERROR ? 0 : 1),
-						  sz);
-	std::optional<std::wstring> maybe_substitute = get_maybe_interface_name_override(devDirection, (UINT_PTR)hm);
-	auto &out_size = *reinterpret_cast<ULONG*>(dw1);
-	if (maybe_substitute.has_value()) {
-		int new_sz = sizeof(wchar_t) * (maybe_substitute.value().size() + 1);
-		wrapper_log(nullptr, L"--> Matched a replace rule. Returning MMSYSERR_NOERROR with size %d of: %ls\n\n", new_sz, maybe_substitute.value().c_str());
-		auto *ptr = reinterpret_cast<ULONG*>(dw1);
-		out_size = new_sz;
-		rval = MMSYSERR_NOERROR;
-	} else {
-		wrapper_log(nullptr, L"--> No match, returning native result.\n\n");
-		auto *ptr = reinterpret_cast<ULONG*>(dw1);
-		out_size = sz;
+	if (state && state->shared) {
+		rval = g_shared_outputs.close(hmo, *state);
+	}
+	else {
+		rval = MMmidiOutClose(hmo);
+		if (rval == MMSYSERR_NOERROR) {
+			g_midi_out_handles.remove(hmo);
+			g_handle_devices.remove(hmo);
+		}
+	}
+	if (clock) {
+		clock->closed(rval == MMSYSERR_NOERROR);
+		if (rval != MMSYSERR_NOERROR) {
+			AcquireSRWLockExclusive(&state->lock);
+			state->clock = std::move(clock);
+			ReleaseSRWLockExclusive(&state->lock);
+		}
 	}
+	if (rval != MMSYSERR_NOERROR && probed) { g_latency_probe.output_opened(probed); }
 	return rval;
 }
 
-template<typename HM>
-MMRESULT handle_QUERYDEVICEINTERFACE(Direction devDirection, HM hm, DWORD_PTR dw1, DWORD_PTR dw2) {
-	MMRESULT rval;
-	rval = devDirection == Direction::Input ?
-		MMmidiInMessage((HMIDIIN)hm, DRV_QUERYDEVICEINTERFACE, dw1, dw2) :
-		MMmidiOutMessage((HMIDIOUT)hm, DRV_QUERYDEVICEINTERFACE, dw1, dw2);
-	wrapper_log(nullptr, L"Handle query for device interface name for %s. Return code: %u (is error: %u). Native result: %ls\n",
-		                  (devDirection == Direction::Input ? L"input" : L"output"),
-	                      (unsigned) rval,
-						  (rval == MMSYSERR_NOERROR ? 0 : 1),
-						  reinterpret_cast<wchar_t*>(dw1));
-	std::optional<std::wstring> maybe_substitute = get_maybe_interface_name_override(devDirection, (UINT_PTR)hm);
-	auto &out_size = *reinterpret_cast<ULONG*>(dw1);
-	if (maybe_substitute.has_value()) {
-		wrapper_log(nullptr, L"--> Matched a replace rule. Returning MMSYSERR_NOERROR with: %ls\n\n", maybe_substitute.value().c_str());
-		wcsncpy(reinterpret_cast<wchar_t*>(dw1), maybe_substitute.value().c_str(), dw2 / sizeof(wchar_t));
-		reinterpret_cast<wchar_t*>(dw1)[dw2 / sizeof(wchar_t) - 1] = L'\0';
-		rval = MMSYSERR_NOERROR;
+// The remaining functions taking an output handle only need logical handles of shared
+// outputs translated.
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutGetID(
+	_In_ HMIDIOUT hmo,
+	_Out_ LPUINT puDeviceID
+) {
+	if (auto entry = g_handle_devices.find(hmo); entry && entry->output && puDeviceID) {
+		*puDeviceID = entry->device_id;
+		return MMSYSERR_NOERROR;
 	}
-	else {
-		wrapper_log(nullptr, L"--> No match, returning native result.\n\n");
+	return MMmidiOutGetID(native_midi_out(hmo), puDeviceID);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutGetVolume(
+	_In_opt_ HMIDIOUT hmo,
+	_Out_ LPDWORD pdwVolume
+) {
+	return MMmidiOutGetVolume(native_midi_out(hmo), pdwVolume);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutSetVolume(
+	_In_opt_ HMIDIOUT hmo,
+	_In_ DWORD dwVolume
+) {
+	return MMmidiOutSetVolume(native_midi_out(hmo), dwVolume);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutCachePatches(
+	_In_ HMIDIOUT hmo,
+	_In_ UINT uBank,
+	_In_reads_(MIDIPATCHSIZE) LPWORD pwpa,
+	_In_ UINT fuCache
+) {
+	return MMmidiOutCachePatches(native_midi_out(hmo), uBank, pwpa, fuCache);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiOutCacheDrumPatches(
+	_In_ HMIDIOUT hmo,
+	_In_ UINT uPatch,
+	_In_reads_(MIDIPATCHSIZE) LPWORD pwkya,
+	_In_ UINT fuCache
+) {
+	return MMmidiOutCacheDrumPatches(native_midi_out(hmo), uPatch, pwkya, fuCache);
+}
+
+// The source can be an output handle too
+MMRESULT WINAPI OVERRIDE_WINMM_midiConnect(HMIDI hS, HMIDIOUT hM, LPVOID lpV) {
+	return MMmidiConnect((HMIDI)native_midi_out((HMIDIOUT)hS), native_midi_out(hM), lpV);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiDisconnect(HMIDI hS, HMIDIOUT hM, LPVOID lpV) {
+	return MMmidiDisconnect((HMIDI)native_midi_out((HMIDIOUT)hS), native_midi_out(hM), lpV);
+}
+
+// Extension: send a short message at a QPC timestamp (as returned by QueryPerformanceCounter).
+// Timestamps in the past are sent as soon as possible, in submission order.
+MMRESULT WINAPI EXTENSION_midiOutShortMsgAt(
+	_In_ HMIDIOUT hmo,
+	_In_ DWORD dwMsg,
+	_In_ LONGLONG qpcTime
+) {
+	g_output_scheduler.schedule({ .due = (uint64_t)qpcTime, .hmo = hmo, .native_hmo = native_midi_out(hmo), .short_msg = dwMsg, .resolve = short_msg_resolver() });
+	return MMSYSERR_NOERROR;
+}
+
+// Extension: send a prepared long message at a QPC timestamp. Completion is reported
+// through the usual MOM_DONE callback / MHDR_DONE flag once the driver has sent it.
+MMRESULT WINAPI EXTENSION_midiOutLongMsgAt(
+	_In_ HMIDIOUT hmo,
+	_In_reads_bytes_(cbmh) LPMIDIHDR pmh,
+	_In_ UINT cbmh,
+	_In_ LONGLONG qpcTime
+) {
+	if (!pmh || !(pmh->dwFlags & MHDR_PREPARED)) { return MIDIERR_UNPREPARED; }
+	if (pmh->dwFlags & MHDR_INQUEUE) { return MIDIERR_STILLPLAYING; }
+	if (g_sysex_rewrite_enabled) { g_sysex_rewriter.rewrite((uint8_t*)pmh->lpData, pmh->dwBufferLength, true); }
+	if (auto state = g_midi_out_handles.find(hmo); state && tracks_notes(*state)) { track_long_msg(*state, hmo, pmh); }
+	return schedule_long_msg(hmo, native_midi_out(hmo), pmh, cbmh, (uint64_t)qpcTime);
+}
+
+// Driver callback for input handles the wrapper needs to see the input of. Pool buffers are
+// consumed here; everything else goes to the application as-is, through the dispatcher
+// thread if enabled.
+void CALLBACK midi_in_trampoline(HMIDIIN hmi, UINT wMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2) {
+	auto state = (midi_in_handle_state*)dwInstance;
+	if (wMsg == MIM_DATA && state->probe && g_latency_probe.on_input((DWORD)dwParam1)) {
+		return;
+	}
+	if ((wMsg == MIM_LONGDATA || wMsg == MIM_LONGERROR) && state->pool && state->pool->owns((LPMIDIHDR)dwParam1)) {
+		state->pool->on_native_buffer((LPMIDIHDR)dwParam1, dwParam2, wMsg == MIM_LONGERROR);
+		return;
+	}
+	if (wMsg == MIM_LONGDATA) {
+		// Without the pool, i.e. if it couldn't be started. The pool reports replies itself,
+		// once reassembled.
+		auto hdr = (LPMIDIHDR)dwParam1;
+		if (state->identity) { g_identity_responder.on_input((uint8_t const*)hdr->lpData, hdr->dwBytesRecorded); }
+		if (g_sysex_rewrite_enabled) { g_sysex_rewriter.rewrite((uint8_t*)hdr->lpData, hdr->dwBytesRecorded, false); }
+	}
+	if (state->dispatch) {
+		state->dispatch->push(hmi, wMsg, dwParam1, dwParam2);
+		return;
+	}
+	state->app.invoke(hmi, wMsg, dwParam1, dwParam2);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiInOpen(
+	_Out_ LPHMIDIIN phmi,
+	_In_ UINT uDeviceID,
+	_In_opt_ DWORD_PTR dwCallback,
+	_In_opt_ DWORD_PTR dwInstance,
+	_In_ DWORD fdwOpen
+) {
+	bool probe = g_latency_probe_enabled && uDeviceID == g_latency_probe_config.input_device;
+	bool rewrite = g_sysex_rewrite_enabled && g_sysex_rewriter.has_input_rules();
+	bool identity = g_identity_responder_enabled && uDeviceID == g_identity_responder_config.input_device;
+	if ((!g_input_pool_enabled && !probe && !g_input_dispatch_enabled && !rewrite && !identity) || !phmi) {
+		MMRESULT rval = MMmidiInOpen(phmi, uDeviceID, dwCallback, dwInstance, fdwOpen);
+		if (rval == MMSYSERR_NOERROR && phmi && uDeviceID != MIDI_MAPPER) { g_handle_devices.add(*phmi, false, uDeviceID); }
+		return rval;
+	}
+	auto state = std::make_unique<midi_in_handle_state>();
+	state->app = { dwCallback, dwInstance, fdwOpen & CALLBACK_TYPEMASK };
+	state->probe = probe;
+	state->identity = identity;
+	if (g_input_dispatch_enabled) {
+		// Started before the open, so MIM_OPEN goes through it too
+		state->dispatch = std::make_unique<input_dispatcher>(state->app, g_input_dispatch_config);
+		if (!state->dispatch->start(g_input_dispatch_config.priority)) { state->dispatch.reset(); }
+	}
+	MMRESULT rval = MMmidiInOpen(phmi, uDeviceID, (DWORD_PTR)midi_in_trampoline, (DWORD_PTR)state.get(),
+		(fdwOpen & ~CALLBACK_TYPEMASK) | CALLBACK_FUNCTION);
+	if (rval != MMSYSERR_NOERROR) {
+		if (state->dispatch) { state->dispatch->stop(); }
+		return rval;
+	}
+
+	// The identity responder queues its replies through the pool
+	if (g_input_pool_enabled || identity) {
+		state->pool = std::make_unique<input_buffer_pool>(*phmi, state->app, g_input_pool_config);
+		if (identity) {
+			state->pool->set_message_hook([](uint8_t const* data, size_t length) { g_identity_responder.on_input(data, length); });
+		}
+		rval = state->pool->start();
+		if (rval != MMSYSERR_NOERROR) {
+			wrapper_log(nullptr, L"Input pool: unable to queue native buffers (%u), delivering SysEx natively\n", rval);
+			state->pool->stop();
+			MMmidiInReset(*phmi);
+			state->pool->release();
+			state->pool.reset();
+		}
+	}
+	if (probe) { g_latency_probe.input_opened(); }
+	if (identity && state->pool) { g_identity_responder.input_opened(); }
+	if (uDeviceID != MIDI_MAPPER) { g_handle_devices.add(*phmi, false, uDeviceID); }
+	g_midi_in_handles.add(*phmi, std::move(state));
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiInAddBuffer(
+	_In_ HMIDIIN hmi,
+	_Out_writes_bytes_(cbmh) LPMIDIHDR pmh,
+	_In_ UINT cbmh
+) {
+	if (auto state = g_midi_in_handles.find(hmi); state && state->pool) {
+		if (cbmh < sizeof(MIDIHDR)) { return MMSYSERR_INVALPARAM; }
+		return state->pool->add_app_buffer(pmh);
+	}
+	return MMmidiInAddBuffer(hmi, pmh, cbmh);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiInGetID(
+	_In_ HMIDIIN hmi,
+	_Out_ LPUINT puDeviceID
+) {
+	if (auto entry = g_handle_devices.find(hmi); entry && !entry->output && puDeviceID) {
+		*puDeviceID = entry->device_id;
+		return MMSYSERR_NOERROR;
+	}
+	return MMmidiInGetID(hmi, puDeviceID);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiInStart(
+	_In_ HMIDIIN hmi
+) {
+	MMRESULT rval = MMmidiInStart(hmi);
+	if (rval == MMSYSERR_NOERROR) {
+		if (auto state = g_midi_in_handles.find(hmi)) { state->started_at = MMtimeGetTime(); }
 	}
 	return rval;
 }
 
-MMRESULT WINAPI OVERRIDE_WINMM_midiOutMessage(
-	_In_opt_ HMIDIOUT hmo,
-	_In_ UINT uMsg,
-	_In_opt_ DWORD_PTR dw1,
-	_In_opt_ DWORD_PTR dw2
+MMRESULT WINAPI OVERRIDE_WINMM_midiInReset(
+	_In_ HMIDIIN hmi
 ) {
-	switch (uMsg) {
-		case DRV_QUERYDEVICEINTERFACESIZE:
-			return handle_QUERYDEVICEINTERFACESIZE(Direction::Output, hmo, dw1, dw2);
-		case DRV_QUERYDEVICEINTERFACE:
-			return handle_QUERYDEVICEINTERFACE(Direction::Output, hmo, dw1, dw2);
-		default:
-			return MMmidiOutMessage(hmo, uMsg, dw1, dw2);
-	};
-}
-
-MMRESULT WINAPI OVERRIDE_WINMM_midiInMessage(
-	_In_opt_ HMIDIIN hmi,
-	_In_ UINT uMsg,
-	_In_opt_ DWORD_PTR dw1,
-	_In_opt_ DWORD_PTR dw2
+	auto state = g_midi_in_handles.find(hmi);
+	if (!state) { return MMmidiInReset(hmi); }
+	// The driver hands back the pool buffers, which are requeued as usual. Application
+	// buffers never reached the driver, so they are returned here.
+	if (state->pool) { state->pool->begin_reset(); }
+	MMRESULT rval = MMmidiInReset(hmi);
+	if (state->pool) { state->pool->end_reset(); }
+	// Buffers the driver returned have reached the application when this returns
+	if (state->dispatch) { state->dispatch->flush(); }
+	return rval;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiInClose(
+	_In_ HMIDIIN hmi
 ) {
-	switch (uMsg) {
-		case DRV_QUERYDEVICEINTERFACESIZE:
-			return handle_QUERYDEVICEINTERFACESIZE(Direction::Input, hmi, dw1, dw2);
-		case DRV_QUERYDEVICEINTERFACE:
-			return handle_QUERYDEVICEINTERFACE(Direction::Input, hmi, dw1, dw2);
-		default:
-			return MMmidiInMessage(hmi, uMsg, dw1, dw2);
-	};
-}
\ No newline at end of file
+	auto state = g_midi_in_handles.find(hmi);
+	if (!state) {
+		MMRESULT rval = MMmidiInClose(hmi);
+		if (rval == MMSYSERR_NOERROR) { g_handle_devices.remove(hmi); }
+		return rval;
+	}
+	if (state->pool) {
+		if (state->pool->has_app_buffers()) { return MIDIERR_STILLPLAYING; }
+		state->pool->stop();
+		MMmidiInReset(hmi);
+		state->pool->release();
+	}
+	MMRESULT rval = MMmidiInClose(hmi);
+	if (rval == MMSYSERR_NOERROR) {
+		g_handle_devices.remove(hmi);
+		if (state->probe) { g_latency_probe.input_closed(); }
+		if (state->identity && state->pool) { g_identity_responder.input_closed(); }
+		if (state->dispatch && !state->dispatch->stop()) {
+			// Closed from the application's callback, on the dispatcher thread: the state
+			// has to outlive this call, and the thread deletes it once the callback returns
+			auto owned = new std::shared_ptr<midi_in_handle_state>(g_midi_in_handles.take(hmi));
+			state->dispatch->delete_on_exit([](void* p) { delete (std::shared_ptr<midi_in_handle_state>*)p; }, owned);
+		}
+		else {
+			g_midi_in_handles.remove(hmi);
+		}
+	}
+	return rval;
+}
+
+// Driver callback for outputs backing an emulated stream. The engine's own SysEx header is
+// handled by the engine; MOM_DONE for the application's buffers is sent by the engine too.
+void CALLBACK midi_stream_trampoline(HMIDIOUT hmo, UINT wMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2) {
+	auto stream = (midi_stream*)dwInstance;
+	if (wMsg == MOM_DONE && stream->is_internal_hdr((LPMIDIHDR)dwParam1)) {
+		stream->internal_hdr_done();
+		return;
+	}
+	stream->invoke(hmo, wMsg, dwParam1, dwParam2);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiStreamOpen(
+	_Out_ LPHMIDISTRM phms,
+	_Inout_updates_(cMidi) LPUINT puDeviceID,
+	_In_ DWORD cMidi,
+	_In_opt_ DWORD_PTR dwCallback,
+	_In_opt_ DWORD_PTR dwInstance,
+	_In_ DWORD fdwOpen
+) {
+	if (!g_stream_engine_enabled) {
+		return MMmidiStreamOpen(phms, puDeviceID, cMidi, dwCallback, dwInstance, fdwOpen);
+	}
+	if (!phms || !puDeviceID || cMidi != 1) { return MMSYSERR_INVALPARAM; }
+	auto stream = std::make_unique<midi_stream>(app_callback{ dwCallback, dwInstance, fdwOpen & CALLBACK_TYPEMASK });
+	HMIDIOUT hmo;
+	MMRESULT rval = MMmidiOutOpen(&hmo, *puDeviceID, (DWORD_PTR)midi_stream_trampoline, (DWORD_PTR)stream.get(),
+		(fdwOpen & ~CALLBACK_TYPEMASK) | CALLBACK_FUNCTION);
+	if (rval != MMSYSERR_NOERROR) { return rval; }
+	stream->start(hmo);
+	*phms = (HMIDISTRM)hmo;
+	g_midi_streams.add(*phms, std::move(stream));
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiStreamOut(
+	_In_ HMIDISTRM hms,
+	_Out_writes_bytes_(cbmh) LPMIDIHDR pmh,
+	_In_ UINT cbmh
+) {
+	auto stream = g_midi_streams.find(hms);
+	if (!stream) { return MMmidiStreamOut(hms, pmh, cbmh); }
+	return stream->out(pmh, cbmh);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiStreamPause(
+	_In_ HMIDISTRM hms
+) {
+	auto stream = g_midi_streams.find(hms);
+	if (!stream) { return MMmidiStreamPause(hms); }
+	stream->pause();
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiStreamRestart(
+	_In_ HMIDISTRM hms
+) {
+	auto stream = g_midi_streams.find(hms);
+	if (!stream) { return MMmidiStreamRestart(hms); }
+	stream->restart();
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiStreamStop(
+	_In_ HMIDISTRM hms
+) {
+	auto stream = g_midi_streams.find(hms);
+	if (!stream) { return MMmidiStreamStop(hms); }
+	stream->stop();
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiStreamPosition(
+	_In_ HMIDISTRM hms,
+	_Out_writes_bytes_(cbmmt) LPMMTIME lpmmt,
+	_In_ UINT cbmmt
+) {
+	auto stream = g_midi_streams.find(hms);
+	if (!stream) { return MMmidiStreamPosition(hms, lpmmt, cbmmt); }
+	return stream->position(lpmmt, cbmmt);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiStreamProperty(
+	_In_ HMIDISTRM hms,
+	_Inout_updates_bytes_(sizeof(DWORD) + sizeof(DWORD)) LPBYTE lppropdata,
+	_In_ DWORD dwProperty
+) {
+	auto stream = g_midi_streams.find(hms);
+	if (!stream) { return MMmidiStreamProperty(hms, lppropdata, dwProperty); }
+	return stream->property(lppropdata, dwProperty);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_midiStreamClose(
+	_In_ HMIDISTRM hms
+) {
+	auto stream = g_midi_streams.find(hms);
+	if (!stream) { return MMmidiStreamClose(hms); }
+	// Like the native stream, closing returns any buffers still queued
+	stream->stop();
+	bool joined = stream->close();
+	MMRESULT rval = MMmidiOutClose((HMIDIOUT)hms);
+	if (rval == MMSYSERR_NOERROR) {
+		auto owned = g_midi_streams.take(hms);
+		// Closed from a stream callback: the engine thread exits once it returns, and deletes
+		// the stream then
+		if (!joined) {
+			stream->delete_on_exit([](void* p) { delete (std::shared_ptr<midi_stream>*)p; }, new std::shared_ptr<midi_stream>(std::move(owned)));
+		}
+	}
+	return rval;
+}
+
+void complete_wave_out_buffer(wave_out_handle_state& state, HWAVEOUT hwo, LPWAVEHDR hdr) {
+	if (g_wave_stats_enabled) { state.on_done(); }
+	state.app.invoke(hwo, WOM_DONE, (DWORD_PTR)hdr, 0);
+}
+
+// Driver callback for instrumented or re-chunked wave outputs
+void CALLBACK wave_out_trampoline(HWAVEOUT hwo, UINT wMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2) {
+	auto state = (wave_out_handle_state*)dwInstance;
+	if (wMsg == WOM_DONE) {
+		if (state->rechunk && state->rechunk->owns((LPWAVEHDR)dwParam1)) {
+			state->rechunk->on_native_done((LPWAVEHDR)dwParam1);
+			return;
+		}
+		complete_wave_out_buffer(*state, hwo, (LPWAVEHDR)dwParam1);
+		return;
+	}
+	state->app.invoke(hwo, wMsg, dwParam1, dwParam2);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_waveOutOpen(LPHWAVEOUT phwo, UINT uDeviceID, LPCWAVEFORMATEX pwfx, DWORD_PTR dwCallback, DWORD_PTR dwInstance, DWORD fdwOpen) {
+	if ((!g_wave_stats_enabled && !g_wave_rechunk_enabled) || !phwo || (fdwOpen & WAVE_FORMAT_QUERY)) {
+		return MMwaveOutOpen(phwo, uDeviceID, pwfx, dwCallback, dwInstance, fdwOpen);
+	}
+	auto state = std::make_unique<wave_out_handle_state>();
+	state->app = { dwCallback, dwInstance, fdwOpen & CALLBACK_TYPEMASK };
+	MMRESULT rval = MMwaveOutOpen(phwo, uDeviceID, pwfx, (DWORD_PTR)wave_out_trampoline, (DWORD_PTR)state.get(),
+		(fdwOpen & ~CALLBACK_TYPEMASK) | CALLBACK_FUNCTION);
+	if (rval != MMSYSERR_NOERROR) { return rval; }
+	if (g_wave_stats_enabled) {
+		state->slot = g_wave_stats.claim_slot(*phwo);
+		g_wave_stats.block().opens.fetch_add(1, std::memory_order_relaxed);
+	}
+	if (g_wave_rechunk_enabled && pwfx) {
+		state->rechunk = std::make_unique<wave_rechunker>(*phwo, *state, *pwfx, g_wave_rechunk_config);
+		state->rechunk->start();
+	}
+	g_wave_out_handles.add(*phwo, std::move(state));
+	return MMSYSERR_NOERROR;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_waveOutPrepareHeader(HWAVEOUT hwo, LPWAVEHDR pwh, UINT cbwh) {
+	if (!g_wave_stats_enabled) { return MMwaveOutPrepareHeader(hwo, pwh, cbwh); }
+	uint64_t start = qpc_now();
+	MMRESULT rval = MMwaveOutPrepareHeader(hwo, pwh, cbwh);
+	auto& b = g_wave_stats.block();
+	b.prepares.fetch_add(1, std::memory_order_relaxed);
+	b.prepare_histogram[histogram_bucket((uint64_t)ticks_to_ns(qpc_now() - start))].fetch_add(1, std::memory_order_relaxed);
+	return rval;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_waveOutWrite(HWAVEOUT hwo, LPWAVEHDR pwh, UINT cbwh) {
+	auto state = g_wave_out_handles.find(hwo);
+	if (!state || !pwh) { return MMwaveOutWrite(hwo, pwh, cbwh); }
+	if (cbwh < sizeof(WAVEHDR)) { return MMSYSERR_INVALPARAM; }
+	// Counted first, as the buffer may be done before the native call returns
+	if (g_wave_stats_enabled) { state->on_write(pwh); }
+	MMRESULT rval = state->rechunk ? state->rechunk->write(pwh) : MMwaveOutWrite(hwo, pwh, cbwh);
+	if (g_wave_stats_enabled && rval != MMSYSERR_NOERROR) { state->undo_write(); }
+	return rval;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_waveOutReset(HWAVEOUT hwo) {
+	auto state = g_wave_out_handles.find(hwo);
+	if (!state) { return MMwaveOutReset(hwo); }
+	state->resetting = true;
+	MMRESULT rval = state->rechunk ? state->rechunk->reset() : MMwaveOutReset(hwo);
+	state->on_reset();
+	state->resetting = false;
+	return rval;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_waveOutClose(HWAVEOUT hwo) {
+	auto state = g_wave_out_handles.find(hwo);
+	if (state && state->rechunk) {
+		if (state->rechunk->has_app_buffers()) { return WAVERR_STILLPLAYING; }
+		state->rechunk->stop();
+	}
+	MMRESULT rval = MMwaveOutClose(hwo);
+	if (state && rval == MMSYSERR_NOERROR) {
+		g_wave_stats.release_slot(state->slot);
+		g_wave_out_handles.remove(hwo);
+	}
+	return rval;
+}
+
+// The calling module identifies the requester, so the overrides must not be inlined
+__declspec(noinline) MMRESULT WINAPI OVERRIDE_WINMM_timeBeginPeriod(UINT uPeriod) {
+	if (!g_timer_period_enabled) { return MMtimeBeginPeriod(uPeriod); }
+	return g_timer_periods.begin(timer_period_arbiter::module_of(_ReturnAddress()), NULL, uPeriod);
+}
+
+__declspec(noinline) MMRESULT WINAPI OVERRIDE_WINMM_timeEndPeriod(UINT uPeriod) {
+	if (!g_timer_period_enabled) { return MMtimeEndPeriod(uPeriod); }
+	return g_timer_periods.end(timer_period_arbiter::module_of(_ReturnAddress()), NULL, uPeriod);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_timeSetEvent(UINT uDelay, UINT uResolution, LPTIMECALLBACK lpTimeProc, DWORD_PTR dwUser, UINT fuEvent) {
+	if (!g_timer_wheel_enabled) { return MMtimeSetEvent(uDelay, uResolution, lpTimeProc, dwUser, fuEvent); }
+	return g_timer_wheel.set(uDelay, lpTimeProc, dwUser, fuEvent);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_timeKillEvent(UINT uTimerID) {
+	if (!g_timer_wheel_enabled) { return MMtimeKillEvent(uTimerID); }
+	return g_timer_wheel.kill(uTimerID);
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_mixerGetDevCapsA(UINT_PTR uMxId, LPMIXERCAPSA pmxcaps, UINT cbmxcaps) {
+	auto fetch = [&] { return MMmixerGetDevCapsA(uMxId, pmxcaps, cbmxcaps); };
+	return g_mixer_cache_enabled ? g_mixer_cache.dev_caps(mixer_query::DevCapsA, uMxId, pmxcaps, cbmxcaps, fetch) : fetch();
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_mixerGetDevCapsW(UINT_PTR uMxId, LPMIXERCAPSW pmxcaps, UINT cbmxcaps) {
+	auto fetch = [&] { return MMmixerGetDevCapsW(uMxId, pmxcaps, cbmxcaps); };
+	return g_mixer_cache_enabled ? g_mixer_cache.dev_caps(mixer_query::DevCapsW, uMxId, pmxcaps, cbmxcaps, fetch) : fetch();
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_mixerGetLineInfoA(HMIXEROBJ hmxobj, LPMIXERLINEA pmxl, DWORD fdwInfo) {
+	auto fetch = [&] { return MMmixerGetLineInfoA(hmxobj, pmxl, fdwInfo); };
+	return g_mixer_cache_enabled ? g_mixer_cache.line_info(mixer_query::LineInfoA, hmxobj, pmxl, fdwInfo, fetch) : fetch();
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_mixerGetLineInfoW(HMIXEROBJ hmxobj, LPMIXERLINEW pmxl, DWORD fdwInfo) {
+	auto fetch = [&] { return MMmixerGetLineInfoW(hmxobj, pmxl, fdwInfo); };
+	return g_mixer_cache_enabled ? g_mixer_cache.line_info(mixer_query::LineInfoW, hmxobj, pmxl, fdwInfo, fetch) : fetch();
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_mixerGetLineControlsA(HMIXEROBJ hmxobj, LPMIXERLINECONTROLSA pmxlc, DWORD fdwControls) {
+	auto fetch = [&] { return MMmixerGetLineControlsA(hmxobj, pmxlc, fdwControls); };
+	return g_mixer_cache_enabled ? g_mixer_cache.line_controls(mixer_query::LineControlsA, hmxobj, pmxlc, fdwControls, fetch) : fetch();
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_mixerGetLineControlsW(HMIXEROBJ hmxobj, LPMIXERLINECONTROLSW pmxlc, DWORD fdwControls) {
+	auto fetch = [&] { return MMmixerGetLineControlsW(hmxobj, pmxlc, fdwControls); };
+	return g_mixer_cache_enabled ? g_mixer_cache.line_controls(mixer_query::LineControlsW, hmxobj, pmxlc, fdwControls, fetch) : fetch();
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_mixerGetControlDetailsA(HMIXEROBJ hmxobj, LPMIXERCONTROLDETAILS pmxcd, DWORD fdwDetails) {
+	auto fetch = [&] { return MMmixerGetControlDetailsA(hmxobj, pmxcd, fdwDetails); };
+	return g_mixer_cache_enabled ? g_mixer_cache.control_details(mixer_query::ControlDetailsA, hmxobj, pmxcd, fdwDetails, fetch) : fetch();
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_mixerGetControlDetailsW(HMIXEROBJ hmxobj, LPMIXERCONTROLDETAILS pmxcd, DWORD fdwDetails) {
+	auto fetch = [&] { return MMmixerGetControlDetailsW(hmxobj, pmxcd, fdwDetails); };
+	return g_mixer_cache_enabled ? g_mixer_cache.control_details(mixer_query::ControlDetailsW, hmxobj, pmxcd, fdwDetails, fetch) : fetch();
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_mixerSetControlDetails(HMIXEROBJ hmxobj, LPMIXERCONTROLDETAILS pmxcd, DWORD fdwDetails) {
+	MMRESULT rval = MMmixerSetControlDetails(hmxobj, pmxcd, fdwDetails);
+	if (g_mixer_cache_enabled && pmxcd) { g_mixer_cache.control_set(pmxcd->dwControlID); }
+	return rval;
+}
+
+MMRESULT WINAPI OVERRIDE_WINMM_mixerClose(HMIXER hmx) {
+	MMRESULT rval = MMmixerClose(hmx);
+	if (g_mixer_cache_enabled && rval == MMSYSERR_NOERROR) { g_mixer_cache.forget(hmx); }
+	return rval;
+}
@@ -0,0 +1,157 @@
+// Per-entry-point call timing for the overridden WinMM functions.
+// Enabled through the "stats" section of the config. When disabled, the only cost on
+// the hot path is a single branch on g_stats_enabled.
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <string>
+
+enum class StatsEntry : size_t {
+	midiOutGetDevCapsA,
+	midiOutGetDevCapsW,
+	midiInGetDevCapsA,
+	midiInGetDevCapsW,
+	midiOutMessage_QUERYDEVICEINTERFACESIZE,
+	midiOutMessage_QUERYDEVICEINTERFACE,
+	midiInMessage_QUERYDEVICEINTERFACESIZE,
+	midiInMessage_QUERYDEVICEINTERFACE,
+	midiOutShortMsg,
+	midiOutLongMsg,
+	COUNT
+};
+
+constexpr std::array<const char*, (size_t)StatsEntry::COUNT> g_stats_entry_names = {
+	"midiOutGetDevCapsA",
+	"midiOutGetDevCapsW",
+	"midiInGetDevCapsA",
+	"midiInGetDevCapsW",
+	"midiOutMessage(DRV_QUERYDEVICEINTERFACESIZE)",
+	"midiOutMessage(DRV_QUERYDEVICEINTERFACE)",
+	"midiInMessage(DRV_QUERYDEVICEINTERFACESIZE)",
+	"midiInMessage(DRV_QUERYDEVICEINTERFACE)",
+	"midiOutShortMsg",
+	"midiOutLongMsg",
+};
+
+// Bucket i holds calls whose wrapper overhead was in [2^i, 2^(i+1)) nanoseconds.
+constexpr size_t g_stats_histogram_buckets = 32;
+
+struct entry_stats {
+	std::atomic<uint64_t> calls{ 0 };
+	std::atomic<uint64_t> total_ticks{ 0 };		// Whole call, including the native function
+	std::atomic<uint64_t> native_ticks{ 0 };	// Time spent inside the native function only
+	std::atomic<uint64_t> max_overhead_ticks{ 0 };
+	std::array<std::atomic<uint64_t>, g_stats_histogram_buckets> overhead_histogram{};
+};
+
+struct stats_config {
+	std::optional<std::string> maybe_output_file;		// Written at process detach
+	std::optional<std::string> maybe_baseline_file;		// Earlier output to compare against
+	double regression_threshold = 1.25;					// Mean overhead ratio that counts as a regression
+};
+
+bool g_stats_enabled = false;
+stats_config g_stats_config;
+std::array<entry_stats, (size_t)StatsEntry::COUNT> g_entry_stats;
+LARGE_INTEGER g_qpc_frequency;
+
+inline uint64_t qpc_now() {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (uint64_t)now.QuadPart;
+}
+
+inline double ticks_to_ns(uint64_t ticks) {
+	return (double)ticks * 1e9 / (double)g_qpc_frequency.QuadPart;
+}
+
+inline size_t histogram_bucket(uint64_t ns) {
+	size_t bucket = 0;
+	while (ns > 1 && bucket < g_stats_histogram_buckets - 1) { ns >>= 1; bucket++; }
+	return bucket;
+}
+
+// Times one call of an overridden entry point. Wrap the forwarded native call in
+// native() so that the wrapper's own overhead can be separated from the driver's.
+class stats_timer {
+public:
+	explicit stats_timer(StatsEntry entry) :
+		m_entry(entry),
+		m_start(g_stats_enabled ? qpc_now() : 0) {}
+
+	template<typename F>
+	auto native(F&& f) {
+		if (!m_start) { return f(); }
+		uint64_t before = qpc_now();
+		auto rval = f();
+		m_native += qpc_now() - before;
+		return rval;
+	}
+
+	~stats_timer() {
+		if (!m_start) { return; }
+		uint64_t total = qpc_now() - m_start;
+		uint64_t overhead = total > m_native ? total - m_native : 0;
+		auto& s = g_entry_stats[(size_t)m_entry];
+		s.calls.fetch_add(1, std::memory_order_relaxed);
+		s.total_ticks.fetch_add(total, std::memory_order_relaxed);
+		s.native_ticks.fetch_add(m_native, std::memory_order_relaxed);
+		uint64_t prev_max = s.max_overhead_ticks.load(std::memory_order_relaxed);
+		while (overhead > prev_max && !s.max_overhead_ticks.compare_exchange_weak(prev_max, overhead, std::memory_order_relaxed)) {}
+		s.overhead_histogram[histogram_bucket((uint64_t)ticks_to_ns(overhead))].fetch_add(1, std::memory_order_relaxed);
+	}
+
+private:
+	StatsEntry m_entry;
+	uint64_t m_start;
+	uint64_t m_native = 0;
+};
+
+void init_stats() {
+	QueryPerformanceFrequency(&g_qpc_frequency);
+}
+
+// Machine-readable snapshot of all counters. Rule count and logging state are recorded
+// so that runs with different configurations can be told apart when comparing.
+json stats_to_json(size_t n_rules, bool logging) {
+	json entries = json::object();
+	for (size_t i = 0; i < (size_t)StatsEntry::COUNT; i++) {
+		auto& s = g_entry_stats[i];
+		uint64_t calls = s.calls.load();
+		if (calls == 0) { continue; }
+		double total_ns = ticks_to_ns(s.total_ticks.load());
+		double native_ns = ticks_to_ns(s.native_ticks.load());
+		json histogram = json::array();
+		for (auto& bucket : s.overhead_histogram) { histogram.push_back(bucket.load()); }
+		entries[g_stats_entry_names[i]] = {
+			{ "calls", calls },
+			{ "mean_total_ns", total_ns / calls },
+			{ "mean_native_ns", native_ns / calls },
+			{ "mean_overhead_ns", (total_ns - native_ns) / calls },
+			{ "max_overhead_ns", ticks_to_ns(s.max_overhead_ticks.load()) },
+			{ "overhead_histogram_log2_ns", histogram }
+		};
+	}
+	return json{
+		{ "rules", n_rules },
+		{ "logging", logging },
+		{ "entries", entries }
+	};
+}
+
+// Compares mean overhead per entry point against a baseline produced by an earlier run.
+// Returns one line of text per entry point that got slower than the configured threshold.
+std::vector<std::string> compare_stats_to_baseline(json const& current, json const& baseline, double threshold) {
+	std::vector<std::string> regressions;
+	if (!baseline.contains("entries")) { return regressions; }
+	for (auto& [name, entry] : current["entries"].items()) {
+		if (!baseline["entries"].contains(name)) { continue; }
+		double before = baseline["entries"][name]["mean_overhead_ns"].template get<double>();
+		double after = entry["mean_overhead_ns"].template get<double>();
+		if (before > 0 && after / before > threshold) {
+			regressions.push_back(name + ": " + std::to_string(before) + " ns -> " + std::to_string(after) + " ns");
+		}
+	}
+	return regressions;
+}